@@ -63,6 +63,13 @@ LOCAL_SRC_FILES := \
     twrp.cpp \
     fixContexts.cpp \
     twrpTar.cpp \
+    twrpGzip.cpp \
+    twrpAes.cpp \
+    twrpReadAhead.cpp \
+    twrpSparseImage.cpp \
+    twrpBackupScheduler.cpp \
+    twrpScanCache.cpp \
+    twrpTarIndex.cpp \
     exclude.cpp \
     find_file.cpp \
     infomanager.cpp \
@@ -146,7 +153,7 @@ endif
 ifeq ($(shell test $(PLATFORM_SDK_VERSION) -lt 24; echo $$?),0)
     LOCAL_SHARED_LIBRARIES += libmincrypttwrp
     LOCAL_C_INCLUDES += $(LOCAL_PATH)/libmincrypt/includes
-    LOCAL_CFLAGS += -DUSE_OLD_VERIFIER
+    LOCAL_CFLAGS += -DUSE_OLD_VERIFIER -DTW_NO_AES_LIBRARY
 else
     LOCAL_SHARED_LIBRARIES += libcrypto
 endif
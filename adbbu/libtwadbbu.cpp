@@ -67,6 +67,7 @@ std::vector<std::string> twadbbu::Get_ADB_Backup_Files(std::string fname) {
 	unsigned char buf[MAX_ADB_READ];
 	struct AdbBackupControlType structcmd;
 	std::vector<std::string> adb_partitions;
+	uint64_t version = ADB_BACKUP_MIN_VERSION;
 
 	int fd = open(fname.c_str(), O_RDONLY);
 	if (fd < 0) {
@@ -102,6 +103,35 @@ std::vector<std::string> twadbbu::Get_ADB_Backup_Files(std::string fname) {
 					return std::vector<std::string>();
 				}
 			}
+			else if (cmdtype == TWSTREAMHDR) {
+				struct AdbBackupStreamHeader twhdr;
+				uint32_t crc, twhdrcrc;
+
+				memcpy(&twhdr, buf, sizeof(twhdr));
+				twhdrcrc = twhdr.crc;
+				memset(&twhdr.crc, 0, sizeof(twhdr.crc));
+				crc = crc32(0L, Z_NULL, 0);
+				crc = crc32(crc, (const unsigned char*) &twhdr, sizeof(twhdr));
+				if (crc == twhdrcrc)
+					version = twhdr.version;
+			}
+			//data blocks are no longer 512 byte aligned, skip over them by length
+			else if (cmdtype == TWDATA && version >= ADB_BACKUP_FRAMED_VERSION) {
+				struct AdbBackupDataHeader datahdr;
+				uint32_t crc, datahdrcrc;
+
+				memcpy(&datahdr, buf, sizeof(datahdr));
+				datahdrcrc = datahdr.crc;
+				memset(&datahdr.crc, 0, sizeof(datahdr.crc));
+				crc = crc32(0L, Z_NULL, 0);
+				crc = crc32(crc, (const unsigned char*) &datahdr, sizeof(datahdr));
+
+				if (crc != datahdrcrc || lseek(fd, datahdr.size, SEEK_CUR) < 0) {
+					printf("ADB TWDATA header doesn't match\n");
+					close(fd);
+					return std::vector<std::string>();
+				}
+			}
 			else if (cmdtype == TWIMG || cmdtype == TWFN) {
 				struct twfilehdr twfilehdr;
 				uint32_t crc, twfilehdrcrc;
@@ -293,11 +323,12 @@ bool twadbbu::Write_TWENDADB() {
 	return true;
 }
 
-bool twadbbu::Write_TWDATA(FILE* adbd_fp) {
-	struct AdbBackupControlType data_block;
+bool twadbbu::Write_TWDATA(FILE* adbd_fp, uint64_t data_size) {
+	struct AdbBackupDataHeader data_block;
 	memset(&data_block, 0, sizeof(data_block));
 	strncpy(data_block.start_of_header, TWRP, sizeof(data_block.start_of_header));
 	strncpy(data_block.type, TWDATA, sizeof(data_block.type));
+	data_block.size = data_size;
 	data_block.crc = crc32(0L, Z_NULL, 0);
 	data_block.crc = crc32(data_block.crc, (const unsigned char*) &data_block, sizeof(data_block));
 	if (fwrite(&data_block, 1, sizeof(data_block), adbd_fp) != sizeof(data_block))  {
@@ -45,7 +45,7 @@ public:
 	static bool Write_TWEOF();                                                                     //Write ADB End-Of-File marker to stream
 	static bool Write_TWERROR();                                                                   //Write error message occurred to stream
 	static bool Write_TWENDADB();                                                                  //Write ADB End-Of-Stream command to stream
-	static bool Write_TWDATA(FILE* adbd_fp);                                                       //Write TWDATA separator
+	static bool Write_TWDATA(FILE* adbd_fp, uint64_t data_size);                                   //Write TWDATA header for data_size bytes of data
 };
 
 #endif //__LIBTWADBBU_HPP
@@ -39,7 +39,9 @@
 #define TWMD5 "twverifymd5"				//This command is compared to the md5trailer by ORS to verify transfer
 #define TWENDADB "twendadb"				//End Protocol
 #define TWERROR "twerror"				//Send error
-#define ADB_BACKUP_VERSION 3				//Backup Version
+#define ADB_BACKUP_VERSION 4				//Backup Version
+#define ADB_BACKUP_MIN_VERSION 3			//Oldest backup version that can still be restored
+#define ADB_BACKUP_FRAMED_VERSION 4			//First version storing the data length in each TWDATA header
 #define DATA_MAX_CHUNK_SIZE 1048576			//Maximum size between each data header
 #define MAX_ADB_READ 512				//align with default tar size for amount to read fom adb stream
 
@@ -62,6 +64,20 @@ struct but not really a command
   | etc...                 |
 */
 
+/*  file data format:
+  version 3: each TWDATA header is followed by data up to DATA_MAX_CHUNK_SIZE
+  including the header, the file data is padded with 0s to a multiple of
+  DATA_MAX_CHUNK_SIZE and the reader checks every 512 bytes for the trailer
+
+  version 4: each TWDATA header stores the length of the data that follows it,
+  at most DATA_MAX_CHUNK_SIZE, and the next header starts right after the data
+  | TW Data Header (size)  |
+  | size bytes of data     |
+  | TW Data Header (size)  |
+  | size bytes of data     |
+  | File/Image MD5 Trailer |
+*/
+
 //determine whether struct is 512 bytes, if not fail compilation
 #define ADBSTRUCT_STATIC_ASSERT(structure) typedef char adb_assertion[( !!(structure) )*2-1 ]
 
@@ -99,6 +115,15 @@ struct AdbBackupFileTrailer {
 	char space[440];				//stores space to align the struct to 512 bytes
 };
 
+//header in front of each block of file data for ADB_BACKUP_FRAMED_VERSION and later
+struct AdbBackupDataHeader {
+	char start_of_header[8];			//stores the magic value #define TWRP
+	char type[16];					//stores the AdbBackupDataHeader type TWDATA
+	uint64_t size;					//stores the number of data bytes following this header
+	uint32_t crc;					//stores the zlib 32 bit crc of the AdbBackupDataHeader struct to allow for making sure we are processing metadata
+	char space[476];				//stores space to align the struct to 512 bytes
+};
+
 //info for version and number of partitions backed up
 struct AdbBackupStreamHeader {
 	char start_of_header[8];			//stores the magic value #define TWRP
@@ -138,9 +138,8 @@ void twrpback::close_restore_fds() {
 
 bool twrpback::backup(std::string command) {
 	twrpMD5 digest;
-	int bytes = 0, errctr = 0;
-	char adbReadStream[MAX_ADB_READ];
-	uint64_t totalbytes = 0, dataChunkBytes = 0, fileBytes = 0;
+	int errctr = 0;
+	uint64_t totalbytes = 0;
 	uint64_t md5fnsize = 0;
 	struct AdbBackupControlType endadb;
 
@@ -148,7 +147,6 @@ bool twrpback::backup(std::string command) {
 
 	bool writedata = true;
 	bool compressed = false;
-	bool firstDataPacket = true;
 
 	adbd_fp = fdopen(adbd_fd, "w");
 	if (adbd_fp == NULL) {
@@ -188,8 +186,8 @@ bool twrpback::backup(std::string command) {
 		return false;
 	}
 
-	memset(&adbReadStream, 0, sizeof(adbReadStream));
 	memset(&cmd, 0, sizeof(cmd));
+	dataBuffer.resize(DATA_MAX_CHUNK_SIZE);
 
 	adblogwrite("opening TW_ADB_BU_CONTROL\n");
 	adb_control_bu_fd = open(TW_ADB_BU_CONTROL, O_RDONLY | O_NONBLOCK);
@@ -206,6 +204,7 @@ bool twrpback::backup(std::string command) {
 		close_backup_fds();
 		return false;
 	}
+	setPipeSize(adb_read_fd);
 
 	//loop until TWENDADB sent
 	while (true) {
@@ -306,63 +305,13 @@ bool twrpback::backup(std::string command) {
 			We received the command that we are done with the file stream.
 			We will flush the remaining data stream.
 			Update md5 and write final results to adb stream.
-			If we need padding because the total bytes are not a multiple
-			of 512, we pad the end with 0s to we reach 512.
 			We also write the final md5 to the adb stream.
 			*/
 			else if (cmdtype == TWEOF) {
 				adblogwrite("received TWEOF\n");
-				while ((bytes = read(adb_read_fd, &adbReadStream, sizeof(adbReadStream)) != 0)) {
-					totalbytes += bytes;
-					fileBytes += bytes;
-					dataChunkBytes += bytes;
-
-					char *writeAdbReadStream = new char [bytes];
-					memcpy(writeAdbReadStream, adbReadStream, bytes);
-
-					digest.update((unsigned char *) writeAdbReadStream, bytes);
-					if (fwrite(writeAdbReadStream, 1, bytes, adbd_fp) < 0) {
-						std::string msg = "Cannot write to adbd stream: ";
-						printErrMsg(msg, errno);
-					}
-					#if defined(_DEBUG_ADB_BACKUP)
-					if (write(debug_adb_fd, writeAdbReadStream, bytes) < 1) {
-						std::string msg = "Cannot write to ADB_CONTROL_READ_FD: ";
-						printErrMsg(msg, errno);
-						close_restore_fds();
-						return false;
-					}
-					#endif
-					fflush(adbd_fp);
-					delete [] writeAdbReadStream;
-					memset(adbReadStream, 0, sizeof(adbReadStream));
-				}
-
-				if (fileBytes % DATA_MAX_CHUNK_SIZE != 0) {
-					int64_t count = fileBytes / DATA_MAX_CHUNK_SIZE + 1;
-					uint64_t ceilingBytes = count * DATA_MAX_CHUNK_SIZE;
-					char padding[ceilingBytes - fileBytes];
-					int paddingBytes = sizeof(padding);
-					memset(padding, 0, paddingBytes);
-					std::stringstream paddingStr;
-					paddingStr << paddingBytes;
-					adblogwrite("writing padding to stream: " + paddingStr.str() + " bytes\n");
-					if (fwrite(padding, 1, paddingBytes, adbd_fp) != sizeof(padding)) {
-						adblogwrite("Error writing padding to adbd\n");
-						close_backup_fds();
-						return false;
-					}
-					#if defined(_DEBUG_ADB_BACKUP)
-					if (write(debug_adb_fd, padding, paddingBytes) < 1) {
-						std::string msg = "Cannot write to ADB_CONTROL_READ_FD: ";
-						printErrMsg(msg, errno);
-						close_restore_fds();
-						return false;
-					}
-					#endif
-					totalbytes += paddingBytes;
-					digest.update((unsigned char *) padding, paddingBytes);
-					fflush(adbd_fp);
+				if (!writeDataBlocks(&digest, true, &totalbytes)) {
+					close_backup_fds();
+					return false;
 				}
 
 				AdbBackupFileTrailer md5trailer;
@@ -389,102 +338,17 @@ bool twrpback::backup(std::string command) {
 				}
 				fflush(adbd_fp);
 				writedata = false;
-				firstDataPacket = true;
-				fileBytes = 0;
 			}
 			memset(&cmd, 0, sizeof(cmd));
-			dataChunkBytes = 0;
 		}
 		//If we are to write data because of a new file stream, lets write all the data.
 		//This will allow us to not write data after a command structure has been written
 		//to the adb stream.
 		//If the stream is compressed, we need to always write the data.
 		if (writedata || compressed) {
-			while ((bytes = read(adb_read_fd, &adbReadStream, sizeof(adbReadStream))) > 0) {
-				if (firstDataPacket) {
-					if (!twadbbu::Write_TWDATA(adbd_fp)) {
-						close_backup_fds();
-						return false;
-					}
-					fileBytes += MAX_ADB_READ;
-					fflush(adbd_fp);
-					firstDataPacket = false;
-					dataChunkBytes += sizeof(adbReadStream);
-				}
-				char *writeAdbReadStream = new char [bytes];
-				memcpy(writeAdbReadStream, adbReadStream, bytes);
-
-				digest.update((unsigned char *) writeAdbReadStream, bytes);
-
-				totalbytes += bytes;
-				fileBytes += bytes;
-				dataChunkBytes += bytes;
-
-				if (fwrite(writeAdbReadStream, 1, bytes, adbd_fp) != (unsigned long long)bytes) {
-					adblogwrite("Error writing backup data to adbd\n");
-					close_backup_fds();
-					return false;
-				}
-				#ifdef _DEBUG_ADB_BACKUP
-				if (write(debug_adb_fd, writeAdbReadStream, bytes) < 1) {
-					std::string msg = "Cannot write to ADB_CONTROL_READ_FD: ";
-					printErrMsg(msg, errno);
-					close_restore_fds();
-					return false;
-				}
-				#endif
-				fflush(adbd_fp);
-				delete [] writeAdbReadStream;
-
-				memset(&adbReadStream, 0, sizeof(adbReadStream));
-
-				if (dataChunkBytes == DATA_MAX_CHUNK_SIZE) {
-					dataChunkBytes = 0;
-					firstDataPacket = true;
-				}
-				else if (dataChunkBytes > (DATA_MAX_CHUNK_SIZE - sizeof(adbReadStream))) {
-					int bytesLeft = DATA_MAX_CHUNK_SIZE - dataChunkBytes;
-					char extraData[bytesLeft];
-
-					memset(&extraData, 0, bytesLeft);
-					while ((bytes = read(adb_read_fd, &extraData, bytesLeft)) != 0) {
-						if (bytes > 0) {
-							totalbytes += bytes;
-							fileBytes += bytes;
-							dataChunkBytes += bytes;
-
-							bytesLeft -= bytes;
-							char *writeAdbReadStream = new char [bytes];
-							memcpy(writeAdbReadStream, extraData, bytes);
-
-							digest.update((unsigned char *) writeAdbReadStream, bytes);
-							if (fwrite(writeAdbReadStream, 1, bytes, adbd_fp) < 0) {
-								std::string msg = "Cannot write to adbd stream: ";
-								printErrMsg(msg, errno);
-								close_restore_fds();
-								return false;
-							}
-							#ifdef _DEBUG_ADB_BACKUP
-							if (write(debug_adb_fd, writeAdbReadStream, bytes) < 1) {
-								std::string msg = "Cannot write to ADB_CONTROL_READ_FD: ";
-								printErrMsg(msg, errno);
-								close_restore_fds();
-								return false;
-							}
-							#endif
-							fflush(adbd_fp);
-							delete [] writeAdbReadStream;
-						}
-						memset(&extraData, 0, bytesLeft);
-						if (bytesLeft == 0) {
-							break;
-						}
-					}
-
-					fflush(adbd_fp);
-					dataChunkBytes = 0;
-					firstDataPacket = true;
-				}
+			if (!writeDataBlocks(&digest, false, &totalbytes)) {
+				close_backup_fds();
+				return false;
 			}
 		}
 	}
@@ -511,6 +375,8 @@ bool twrpback::restore(void) {
 	bool read_from_adb;
 	bool md5sumdata;
 	bool compressed, tweofrcvd, extraData;
+	bool adbWriteClosed = false;
+	uint64_t streamVersion = ADB_BACKUP_MIN_VERSION;
 
 	read_from_adb = true;
 
@@ -554,6 +420,7 @@ bool twrpback::restore(void) {
 
 	memset(&readAdbStream, 0, sizeof(readAdbStream));
 	memset(&cmd, 0, sizeof(cmd));
+	dataBuffer.resize(DATA_MAX_CHUNK_SIZE);
 
 	adblogwrite("opening TW_ADB_BU_CONTROL\n");
 	adb_control_bu_fd = open(TW_ADB_BU_CONTROL, O_RDONLY | O_NONBLOCK);
@@ -660,7 +527,10 @@ bool twrpback::restore(void) {
 					crc = crc32(crc, (const unsigned char*) &cnthdr, sizeof(cnthdr));
 
 					if (crc == cnthdrcrc) {
-						adblogwrite("Restoring TWSTREAMHDR\n");
+						std::stringstream versionStr;
+						versionStr << cnthdr.version;
+						adblogwrite("Restoring TWSTREAMHDR version " + versionStr.str() + "\n");
+						streamVersion = cnthdr.version;
 						if (write(adb_control_twrp_fd, readAdbStream, sizeof(readAdbStream)) < 0) {
 							std::string msg = "Cannot write to adb_control_twrp_fd: ";
 							printErrMsg(msg, errno);
@@ -686,6 +556,7 @@ bool twrpback::restore(void) {
 
 					digest.init();
 					adblogwrite("Restoring TWIMG\n");
+					adbWriteClosed = false;
 					memset(&twimghdr, 0, sizeof(twimghdr));
 					memcpy(&twimghdr, readAdbStream, sizeof(readAdbStream));
 					md5fnsize = twimghdr.size;
@@ -719,6 +590,7 @@ bool twrpback::restore(void) {
 
 					adblogwrite("opening TW_ADB_RESTORE\n");
 					adb_write_fd = open(TW_ADB_RESTORE, O_WRONLY);
+					setPipeSize(adb_write_fd);
 				}
 				//Tell TWRP we are sending a tar stream
 				else if (cmdtype == TWFN) {
@@ -732,6 +604,7 @@ bool twrpback::restore(void) {
 
 					digest.init();
 					adblogwrite("Restoring TWFN\n");
+					adbWriteClosed = false;
 					memset(&twfilehdr, 0, sizeof(twfilehdr));
 					memcpy(&twfilehdr, readAdbStream, sizeof(readAdbStream));
 					md5fnsize = twfilehdr.size;
@@ -767,6 +640,7 @@ bool twrpback::restore(void) {
 					compressed = twfilehdr.compressed == 1 ? true: false;
 					adblogwrite("opening TW_ADB_RESTORE\n");
 					adb_write_fd = open(TW_ADB_RESTORE, O_WRONLY);
+					setPipeSize(adb_write_fd);
 				}
 				else if (cmdtype == MD5TRAILER) {
 					if (fileBytes >= md5fnsize)
@@ -784,6 +658,17 @@ bool twrpback::restore(void) {
 					}
 					continue;
 				}
+				//Send a length prefixed block of tar or partition image data to TWRP
+				else if (cmdtype == TWDATA && streamVersion >= ADB_BACKUP_FRAMED_VERSION) {
+					uint64_t dataBytes;
+
+					if (!restoreDataBlock(readAdbStream, &digest, &dataBytes, &adbWriteClosed)) {
+						close_restore_fds();
+						return false;
+					}
+					totalbytes += dataBytes;
+					fileBytes += dataBytes;
+				}
 				//Send the tar or partition image md5 to TWRP
 				else if (cmdtype == TWDATA) {
 					dataChunkBytes += sizeof(readAdbStream);
@@ -933,3 +818,114 @@ bool twrpback::checkMD5Trailer(char readAdbStream[], uint64_t md5fnsize, twrpMD5
 	}
 	return false;
 }
+
+void twrpback::setPipeSize(int fd) {
+	//Let a whole TWDATA block sit in the fifo instead of the default 64k
+	#ifdef F_SETPIPE_SZ
+	if (fd >= 0 && fcntl(fd, F_SETPIPE_SZ, DATA_MAX_CHUNK_SIZE) < 0) {
+		std::string msg = "Unable to resize fifo: ";
+		printErrMsg(msg, errno);
+	}
+	#endif
+}
+
+bool twrpback::writeDataBlocks(twrpMD5 *digest, bool drain, uint64_t *totalbytes) {
+	while (true) {
+		size_t len = 0;
+		bool eof = false;
+
+		//Fill the block as far as TWRP has data ready for us
+		while (len < DATA_MAX_CHUNK_SIZE) {
+			ssize_t bytes = read(adb_read_fd, &dataBuffer[len], DATA_MAX_CHUNK_SIZE - len);
+			if (bytes > 0) {
+				len += bytes;
+				continue;
+			}
+			if (bytes == 0) {
+				eof = true;
+				break;
+			}
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN) {
+				std::string msg = "Cannot read from TW_ADB_BACKUP: ";
+				printErrMsg(msg, errno);
+				return false;
+			}
+			if (len > 0 || !drain)
+				break;
+			usleep(1000);
+		}
+
+		if (len > 0) {
+			if (!twadbbu::Write_TWDATA(adbd_fp, len)) {
+				adblogwrite("Error writing TWDATA to adbd\n");
+				return false;
+			}
+			if (fwrite(&dataBuffer[0], 1, len, adbd_fp) != len) {
+				adblogwrite("Error writing backup data to adbd\n");
+				return false;
+			}
+			fflush(adbd_fp);
+			digest->update(&dataBuffer[0], len);
+			*totalbytes += len;
+			#ifdef _DEBUG_ADB_BACKUP
+			if (write(debug_adb_fd, &dataBuffer[0], len) < 1) {
+				std::string msg = "Cannot write to ADB_CONTROL_READ_FD: ";
+				printErrMsg(msg, errno);
+				return false;
+			}
+			#endif
+		}
+		if (eof || (!drain && len < DATA_MAX_CHUNK_SIZE))
+			return true;
+	}
+}
+
+bool twrpback::restoreDataBlock(char readAdbStream[], twrpMD5 *digest, uint64_t *dataBytes, bool *adbWriteClosed) {
+	struct AdbBackupDataHeader datahdr;
+	uint32_t crc, datahdrcrc;
+
+	//ADBSTRUCT_STATIC_ASSERT(sizeof(datahdr) == MAX_ADB_READ);
+	memcpy(&datahdr, readAdbStream, MAX_ADB_READ);
+	datahdrcrc = datahdr.crc;
+	memset(&datahdr.crc, 0, sizeof(datahdr.crc));
+	crc = crc32(0L, Z_NULL, 0);
+	crc = crc32(crc, (const unsigned char*) &datahdr, sizeof(datahdr));
+
+	if (crc != datahdrcrc || datahdr.size > DATA_MAX_CHUNK_SIZE) {
+		adblogwrite("ADB TWDATA crc header doesn't match\n");
+		return false;
+	}
+	if (fread(&dataBuffer[0], 1, datahdr.size, adbd_fp) != datahdr.size) {
+		adblogwrite("Unexpected end of adb stream in TWDATA\n");
+		return false;
+	}
+	digest->update(&dataBuffer[0], datahdr.size);
+	*dataBytes = datahdr.size;
+
+	#ifdef _DEBUG_ADB_BACKUP
+	if (write(debug_adb_fd, &dataBuffer[0], datahdr.size) < 0) {
+		std::string msg = "Cannot write to ADB_CONTROL_READ_FD: ";
+		printErrMsg(msg, errno);
+		return false;
+	}
+	#endif
+
+	//Once TWRP has stopped reading keep consuming the stream for the md5 check
+	size_t written = 0;
+	while (!*adbWriteClosed && written < datahdr.size) {
+		ssize_t bytes = write(adb_write_fd, &dataBuffer[written], datahdr.size - written);
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			std::string msg = "Cannot write to TWRP ADB FIFO: ";
+			printErrMsg(msg, errno);
+			adblogwrite("end of stream reached.\n");
+			*adbWriteClosed = true;
+			break;
+		}
+		written += bytes;
+	}
+	return true;
+}
@@ -18,6 +18,7 @@
 #define _TWRPBACK_HPP
 
 #include <fstream>
+#include <vector>
 #include "../twrpDigest/twrpMD5.hpp"
 
 class twrpback {
@@ -49,12 +50,16 @@ private:
 	char operation[512];                                                     // operation to send to ors
 	std::ofstream adblogfile;                                                // adb stream log file
 	std::string streamFn;
+	std::vector<unsigned char> dataBuffer;                                   // buffer for a single TWDATA block
 	typedef void (twrpback::*ThreadPtr)(void);
 	typedef void* (*PThreadPtr)(void *);
 	void adbloginit(void);                                                   // setup adb log stream file
 	void close_backup_fds();                                                 // close backup resources
 	void close_restore_fds();                                                // close restore resources
 	bool checkMD5Trailer(char adbReadStream[], uint64_t md5fnsize, twrpMD5* digest); // Check MD5 Trailer
+	void setPipeSize(int fd);                                                 // enlarge fifo to hold a TWDATA block
+	bool writeDataBlocks(twrpMD5 *digest, bool drain, uint64_t *totalbytes);  // Send data from TWRP to adbd as TWDATA blocks
+	bool restoreDataBlock(char readAdbStream[], twrpMD5 *digest, uint64_t *dataBytes, bool *adbWriteClosed); // Send one length prefixed TWDATA block to TWRP
 	void printErrMsg(std::string msg, int errNum);                          // print error msg to adb log
 };
 
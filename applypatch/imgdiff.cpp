@@ -153,7 +153,10 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/file.h>
@@ -251,6 +254,7 @@ static const struct option OPTIONS[] = {
   { "block-limit", required_argument, nullptr, 0 },
   { "debug-dir", required_argument, nullptr, 0 },
   { "split-info", required_argument, nullptr, 0 },
+  { "thread-count", required_argument, nullptr, 0 },
   { "verbose", no_argument, nullptr, 'v' },
   { nullptr, 0, nullptr, 0 },
 };
@@ -1095,55 +1099,116 @@ void ZipModeImage::ValidateSplitImages(const std::vector<ZipModeImage>& split_tg
   }
 }
 
+// Suffix array index of the pseudo source, shared by all the target chunks that have no matching
+// source entry. The first of them builds the index as part of its bsdiff while holding the lock;
+// the index is only read after that, so the later chunks use it concurrently.
+class SharedSuffixArrayIndex {
+ public:
+  ~SharedSuffixArrayIndex() {
+    delete index_;
+  }
+
+  bool MakePatch(const ImageChunk& tgt, const ImageChunk& src, std::vector<uint8_t>* patch_data) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (index_ == nullptr) {
+      return ImageChunk::MakePatch(tgt, src, patch_data, &index_);
+    }
+    bsdiff::SuffixArrayIndexInterface* index = index_;
+    lock.unlock();
+    return ImageChunk::MakePatch(tgt, src, patch_data, &index);
+  }
+
+ private:
+  std::mutex mutex_;
+  bsdiff::SuffixArrayIndexInterface* index_ = nullptr;
+};
+
 bool ZipModeImage::GeneratePatchesInternal(const ZipModeImage& tgt_image,
                                            const ZipModeImage& src_image,
-                                           std::vector<PatchChunk>* patch_chunks) {
-  LOG(INFO) << "Constructing patches for " << tgt_image.NumOfChunks() << " chunks...";
+                                           std::vector<PatchChunk>* patch_chunks,
+                                           size_t thread_count) {
+  size_t num_chunks = tgt_image.NumOfChunks();
+  LOG(INFO) << "Constructing patches for " << num_chunks << " chunks...";
   patch_chunks->clear();
 
-  bsdiff::SuffixArrayIndexInterface* bsdiff_cache = nullptr;
-  for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
-    const auto& tgt_chunk = tgt_image[i];
+  // Each chunk is an independent bsdiff, so they are handed out to a pool of workers. The results
+  // are collected by chunk index and assembled in order afterwards, which keeps the output
+  // identical regardless of the number of threads.
+  const ImageChunk pseudo_source = src_image.PseudoSource();
+  SharedSuffixArrayIndex pseudo_source_index;
+  std::vector<const ImageChunk*> src_chunks(num_chunks, nullptr);
+  std::vector<std::vector<uint8_t>> patches(num_chunks);
+  std::atomic<size_t> next_chunk(0);
+  std::atomic<bool> failed(false);
+
+  auto worker = [&]() {
+    size_t i;
+    while (!failed && (i = next_chunk++) < num_chunks) {
+      const auto& tgt_chunk = tgt_image[i];
+      if (PatchChunk::RawDataIsSmaller(tgt_chunk, 0)) {
+        continue;
+      }
 
-    if (PatchChunk::RawDataIsSmaller(tgt_chunk, 0)) {
-      patch_chunks->emplace_back(tgt_chunk);
-      continue;
+      const ImageChunk* src_chunk = (tgt_chunk.GetType() != CHUNK_DEFLATE)
+                                        ? nullptr
+                                        : src_image.FindChunkByName(tgt_chunk.GetEntryName());
+      bool success;
+      if (src_chunk == nullptr) {
+        src_chunks[i] = &pseudo_source;
+        success = pseudo_source_index.MakePatch(tgt_chunk, pseudo_source, &patches[i]);
+      } else {
+        src_chunks[i] = src_chunk;
+        success = ImageChunk::MakePatch(tgt_chunk, *src_chunk, &patches[i], nullptr);
+      }
+      if (!success) {
+        LOG(ERROR) << "Failed to generate patch, name: " << tgt_chunk.GetEntryName();
+        failed = true;
+      }
     }
+  };
 
-    const ImageChunk* src_chunk = (tgt_chunk.GetType() != CHUNK_DEFLATE)
-                                      ? nullptr
-                                      : src_image.FindChunkByName(tgt_chunk.GetEntryName());
+  thread_count = std::max<size_t>(1, std::min(thread_count, num_chunks));
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < thread_count; i++) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto& t : workers) {
+    t.join();
+  }
+  if (failed) {
+    return false;
+  }
 
-    const auto& src_ref = (src_chunk == nullptr) ? src_image.PseudoSource() : *src_chunk;
-    bsdiff::SuffixArrayIndexInterface** bsdiff_cache_ptr =
-        (src_chunk == nullptr) ? &bsdiff_cache : nullptr;
+  for (size_t i = 0; i < num_chunks; i++) {
+    const auto& tgt_chunk = tgt_image[i];
 
-    std::vector<uint8_t> patch_data;
-    if (!ImageChunk::MakePatch(tgt_chunk, src_ref, &patch_data, bsdiff_cache_ptr)) {
-      LOG(ERROR) << "Failed to generate patch, name: " << tgt_chunk.GetEntryName();
-      return false;
+    if (src_chunks[i] == nullptr) {
+      patch_chunks->emplace_back(tgt_chunk);
+      continue;
     }
 
-    LOG(INFO) << "patch " << i << " is " << patch_data.size() << " bytes (of "
+    LOG(INFO) << "patch " << i << " is " << patches[i].size() << " bytes (of "
               << tgt_chunk.GetRawDataLength() << ")";
 
-    if (PatchChunk::RawDataIsSmaller(tgt_chunk, patch_data.size())) {
+    if (PatchChunk::RawDataIsSmaller(tgt_chunk, patches[i].size())) {
       patch_chunks->emplace_back(tgt_chunk);
     } else {
-      patch_chunks->emplace_back(tgt_chunk, src_ref, std::move(patch_data));
+      patch_chunks->emplace_back(tgt_chunk, *src_chunks[i], std::move(patches[i]));
     }
   }
-  delete bsdiff_cache;
 
-  CHECK_EQ(patch_chunks->size(), tgt_image.NumOfChunks());
+  CHECK_EQ(patch_chunks->size(), num_chunks);
   return true;
 }
 
 bool ZipModeImage::GeneratePatches(const ZipModeImage& tgt_image, const ZipModeImage& src_image,
-                                   const std::string& patch_name) {
+                                   const std::string& patch_name, size_t thread_count) {
   std::vector<PatchChunk> patch_chunks;
 
-  ZipModeImage::GeneratePatchesInternal(tgt_image, src_image, &patch_chunks);
+  if (!ZipModeImage::GeneratePatchesInternal(tgt_image, src_image, &patch_chunks, thread_count)) {
+    return false;
+  }
 
   CHECK_EQ(tgt_image.NumOfChunks(), patch_chunks.size());
 
@@ -1162,7 +1227,7 @@ bool ZipModeImage::GeneratePatches(const std::vector<ZipModeImage>& split_tgt_im
                                    const std::vector<SortedRangeSet>& split_src_ranges,
                                    const std::string& patch_name,
                                    const std::string& split_info_file,
-                                   const std::string& debug_dir) {
+                                   const std::string& debug_dir, size_t thread_count) {
   LOG(INFO) << "Constructing patches for " << split_tgt_images.size() << " split images...";
 
   android::base::unique_fd patch_fd(
@@ -1176,7 +1241,7 @@ bool ZipModeImage::GeneratePatches(const std::vector<ZipModeImage>& split_tgt_im
   for (size_t i = 0; i < split_tgt_images.size(); i++) {
     std::vector<PatchChunk> patch_chunks;
     if (!ZipModeImage::GeneratePatchesInternal(split_tgt_images[i], split_src_images[i],
-                                               &patch_chunks)) {
+                                               &patch_chunks, thread_count)) {
       LOG(ERROR) << "Failed to generate split patch";
       return false;
     }
@@ -1478,6 +1543,7 @@ int imgdiff(int argc, const char** argv) {
   size_t blocks_limit = 0;
   std::string split_info_file;
   std::string debug_dir;
+  size_t thread_count = std::max(1U, std::thread::hardware_concurrency());
 
   int opt;
   int option_index;
@@ -1521,6 +1587,10 @@ int imgdiff(int argc, const char** argv) {
           split_info_file = optarg;
         } else if (name == "debug-dir") {
           debug_dir = optarg;
+        } else if (name == "thread-count" &&
+                   (!android::base::ParseUint(optarg, &thread_count) || thread_count == 0)) {
+          LOG(ERROR) << "Failed to parse thread count: " << optarg;
+          return 1;
         }
         break;
       }
@@ -1546,6 +1616,8 @@ int imgdiff(int argc, const char** argv) {
            "  --split-info,     Output the split information (patch_size, tgt_size, src_ranges);\n"
            "                    zip mode with block-limit only.\n"
            "  --debug-dir,      Debug directory to put the split srcs and patches, zip mode only.\n"
+           "  --thread-count,   Number of chunks to diff at the same time, zip mode only;\n"
+           "                    defaults to the number of CPUs.\n"
            "  -v, --verbose,    Enable verbose logging.";
     return 2;
   }
@@ -1580,11 +1652,13 @@ int imgdiff(int argc, const char** argv) {
                                                &split_src_images, &split_src_ranges);
 
       if (!ZipModeImage::GeneratePatches(split_tgt_images, split_src_images, split_src_ranges,
-                                         argv[optind + 2], split_info_file, debug_dir)) {
+                                         argv[optind + 2], split_info_file, debug_dir,
+                                         thread_count)) {
         return 1;
       }
 
-    } else if (!ZipModeImage::GeneratePatches(tgt_image, src_image, argv[optind + 2])) {
+    } else if (!ZipModeImage::GeneratePatches(tgt_image, src_image, argv[optind + 2],
+                                              thread_count)) {
       return 1;
     }
   } else {
@@ -50,7 +50,7 @@ static inline int32_t Read4(const void *address) {
 // This function is a wrapper of ApplyBSDiffPatch(). It has a custom sink function to deflate the
 // patched data and stream the deflated data to output.
 static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_len,
-                                            const Value& patch, size_t patch_offset,
+                                            const BlobView& patch, size_t patch_offset,
                                             const char* deflate_header, SinkFn sink, SHA_CTX* ctx) {
   size_t expected_target_length = static_cast<size_t>(Read8(deflate_header + 32));
   int level = Read4(deflate_header + 40);
@@ -134,20 +134,20 @@ static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_
 
 int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const unsigned char* patch_data,
                     size_t patch_size, SinkFn sink) {
-  Value patch(VAL_BLOB, std::string(reinterpret_cast<const char*>(patch_data), patch_size));
-  return ApplyImagePatch(old_data, old_size, patch, sink, nullptr, nullptr);
+  return ApplyImagePatch(old_data, old_size, BlobView(patch_data, patch_size), sink, nullptr,
+                         nullptr);
 }
 
-int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value& patch, SinkFn sink,
-                    SHA_CTX* ctx, const Value* bonus_data) {
-  if (patch.data.size() < 12) {
+int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const BlobView& patch,
+                    SinkFn sink, SHA_CTX* ctx, const Value* bonus_data) {
+  if (patch.size() < 12) {
     printf("patch too short to contain header\n");
     return -1;
   }
 
   // IMGDIFF2 uses CHUNK_NORMAL, CHUNK_DEFLATE, and CHUNK_RAW. (IMGDIFF1, which is no longer
   // supported, used CHUNK_NORMAL and CHUNK_GZIP.)
-  const char* const patch_header = patch.data.data();
+  const char* const patch_header = patch.data();
   if (memcmp(patch_header, "IMGDIFF2", 8) != 0) {
     printf("corrupt patch file header (magic number)\n");
     return -1;
@@ -157,7 +157,7 @@ int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value&
   size_t pos = 12;
   for (int i = 0; i < num_chunks; ++i) {
     // each chunk's header record starts with 4 bytes.
-    if (pos + 4 > patch.data.size()) {
+    if (pos + 4 > patch.size()) {
       printf("failed to read chunk %d record\n", i);
       return -1;
     }
@@ -167,7 +167,7 @@ int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value&
     if (type == CHUNK_NORMAL) {
       const char* normal_header = patch_header + pos;
       pos += 24;
-      if (pos > patch.data.size()) {
+      if (pos > patch.size()) {
         printf("failed to read chunk %d normal header data\n", i);
         return -1;
       }
@@ -187,14 +187,14 @@ int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value&
     } else if (type == CHUNK_RAW) {
       const char* raw_header = patch_header + pos;
       pos += 4;
-      if (pos > patch.data.size()) {
+      if (pos > patch.size()) {
         printf("failed to read chunk %d raw header data\n", i);
         return -1;
       }
 
       size_t data_len = static_cast<size_t>(Read4(raw_header));
 
-      if (pos + data_len > patch.data.size()) {
+      if (pos + data_len > patch.size()) {
         printf("failed to read chunk %d raw data\n", i);
         return -1;
       }
@@ -210,7 +210,7 @@ int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value&
       // deflate chunks have an additional 60 bytes in their chunk header.
       const char* deflate_header = patch_header + pos;
       pos += 60;
-      if (pos > patch.data.size()) {
+      if (pos > patch.size()) {
         printf("failed to read chunk %d deflate header data\n", i);
         return -1;
       }
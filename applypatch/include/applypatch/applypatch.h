@@ -28,6 +28,7 @@
 
 // Forward declaration to avoid including "edify/expr.h" in the header.
 struct Value;
+class BlobView;
 
 struct FileContents {
   uint8_t sha1[SHA_DIGEST_LENGTH];
@@ -64,8 +65,9 @@ void ShowBSDiffLicense();
 
 // Applies the bsdiff-patch given in 'patch' (from offset 'patch_offset' to the end) to the source
 // data given by (old_data, old_size). Writes the patched output through the given 'sink', and
-// updates the SHA-1 context with the output data. Returns 0 on success.
-int ApplyBSDiffPatch(const unsigned char* old_data, size_t old_size, const Value& patch,
+// updates the SHA-1 context with the output data. Returns 0 on success. 'patch' may be a Value or a
+// view into memory that isn't owned by a Value, such as the mapped update package.
+int ApplyBSDiffPatch(const unsigned char* old_data, size_t old_size, const BlobView& patch,
                      size_t patch_offset, SinkFn sink, SHA_CTX* ctx);
 
 // imgpatch.cpp
@@ -73,8 +75,8 @@ int ApplyBSDiffPatch(const unsigned char* old_data, size_t old_size, const Value
 // Applies the imgdiff-patch given in 'patch' to the source data given by (old_data, old_size), with
 // the optional bonus data. Writes the patched output through the given 'sink', and updates the
 // SHA-1 context with the output data. Returns 0 on success.
-int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value& patch, SinkFn sink,
-                    SHA_CTX* ctx, const Value* bonus_data);
+int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const BlobView& patch,
+                    SinkFn sink, SHA_CTX* ctx, const Value* bonus_data);
 
 // freecache.cpp
 
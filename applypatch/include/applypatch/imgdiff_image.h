@@ -232,9 +232,10 @@ class ZipModeImage : public Image {
   // src and tgt are identical.
   static bool CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage* src_image);
 
-  // Compute the patch between tgt & src images, and write the data into |patch_name|.
+  // Compute the patch between tgt & src images, and write the data into |patch_name|. Up to
+  // |thread_count| chunks are diffed at the same time.
   static bool GeneratePatches(const ZipModeImage& tgt_image, const ZipModeImage& src_image,
-                              const std::string& patch_name);
+                              const std::string& patch_name, size_t thread_count);
 
   // Compute the patch based on the lists of split src and tgt images. Generate patches for each
   // pair of split pieces and write the data to |patch_name|. If |debug_dir| is specified, write
@@ -243,7 +244,7 @@ class ZipModeImage : public Image {
                               const std::vector<ZipModeImage>& split_src_images,
                               const std::vector<SortedRangeSet>& split_src_ranges,
                               const std::string& patch_name, const std::string& split_info_file,
-                              const std::string& debug_dir);
+                              const std::string& debug_dir, size_t thread_count);
 
   // Split the tgt chunks and src chunks based on the size limit.
   static bool SplitZipModeImageWithLimit(const ZipModeImage& tgt_image,
@@ -275,9 +276,9 @@ class ZipModeImage : public Image {
                                          std::vector<ZipModeImage>* split_tgt_images,
                                          std::vector<ZipModeImage>* split_src_images);
 
-  // Function that actually iterates the tgt_chunks and makes patches.
+  // Function that actually makes patches for the tgt_chunks, on up to |thread_count| threads.
   static bool GeneratePatchesInternal(const ZipModeImage& tgt_image, const ZipModeImage& src_image,
-                                      std::vector<PatchChunk>* patch_chunks);
+                                      std::vector<PatchChunk>* patch_chunks, size_t thread_count);
 
   // size limit in bytes of each chunk. Also, if the length of one zip_entry exceeds the limit,
   // we'll split that entry into several smaller chunks in advance.
@@ -750,6 +750,11 @@ void DataManager::SetDefaultValues()
 	mPersist.SetValue(TW_DISABLE_FREE_SPACE_VAR, "0");
 	mPersist.SetValue(TW_FORCE_DIGEST_CHECK_VAR, "0");
 	mPersist.SetValue(TW_USE_COMPRESSION_VAR, "0");
+	mPersist.SetValue(TW_COMPRESSION_LEVEL_VAR, "6");
+	mPersist.SetValue(TW_COMPRESSION_THREADS_VAR, "0");
+	mPersist.SetValue(TW_SPARSE_IMAGE_BACKUP_VAR, "0");
+	mPersist.SetValue(TW_BACKUP_IO_JOBS_VAR, "2");
+	mPersist.SetValue(TW_BACKUP_INDEX_VAR, "1");
 	mPersist.SetValue(TW_TIME_ZONE_VAR, "CST6CDT,M3.2.0,M11.1.0");
 	mPersist.SetValue(TW_GUI_SORT_ORDER, "1");
 	mPersist.SetValue(TW_RM_RF_VAR, "0");
@@ -68,6 +68,28 @@ struct Value {
         data(str) {}
 };
 
+// A non-owning, read-only view of blob data, e.g. a patch inside the memory-mapped update package.
+// It avoids copying the data into a Value; the viewed memory must outlive the view.
+class BlobView {
+ public:
+  BlobView(const char* data, size_t size) : data_(data), size_(size) {}
+  BlobView(const unsigned char* data, size_t size)
+      : data_(reinterpret_cast<const char*>(data)), size_(size) {}
+  // Implicitly views the contents of a Value, so callers holding one can pass it directly.
+  BlobView(const Value& value) : data_(value.data.data()), size_(value.data.size()) {}
+
+  const char* data() const {
+    return data_;
+  }
+  size_t size() const {
+    return size_;
+  }
+
+ private:
+  const char* data_;
+  size_t size_;
+};
+
 struct Expr;
 
 using Function = Value* (*)(const char* name, State* state,
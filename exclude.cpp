@@ -21,11 +21,11 @@ extern "C" {
 }
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <dirent.h>
 #include <errno.h>
 #include <string>
 #include <vector>
 #include "exclude.hpp"
+#include "twrpScanCache.hpp"
 #include "twrp-functions.hpp"
 #include "gui/gui.hpp"
 #include "twcommon.h"
@@ -38,6 +38,12 @@ TWExclude::TWExclude() {
 	add_relative_dir(".");
 	add_relative_dir("..");
 	add_relative_dir("lost+found");
+	scan_cache = NULL;
+	keep_scan_cache = false;
+}
+
+TWExclude::~TWExclude() {
+	delete scan_cache;
 }
 
 void TWExclude::add_relative_dir(const string& dir) {
@@ -59,36 +65,45 @@ void TWExclude::add_absolute_dir(const string& dir) {
 }
 
 uint64_t TWExclude::Get_Folder_Size(const string& Path) {
-	DIR* d;
-	struct dirent* de;
-	struct stat st;
-	uint64_t dusize = 0;
-	string FullPath;
-
-	d = opendir(Path.c_str());
-	if (d == NULL) {
-		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Path)(strerror(errno)));
-		return 0;
-	}
+	uint64_t dusize;
 
-	while ((de = readdir(d)) != NULL) {
-		FullPath = Path + "/";
-		FullPath += de->d_name;
-		if (lstat(FullPath.c_str(), &st)) {
-			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(FullPath)(strerror(errno)));
-			LOGINFO("Real error: Unable to stat '%s'\n", FullPath.c_str());
-			continue;
-		}
-		if ((st.st_mode & S_IFDIR) && !check_skip_dirs(FullPath) && de->d_type != DT_SOCK) {
-			dusize += Get_Folder_Size(FullPath);
-		} else if (st.st_mode & S_IFREG || st.st_mode & S_IFLNK) {
-			dusize += (uint64_t)(st.st_size);
-		}
+	if (!keep_scan_cache) {
+		Clear_Scan_Cache();
+		return twrpScanCache::Scan_Size(Path, this);
 	}
-	closedir(d);
+
+	// Read everything tar needs in the same pass as the size
+	keep_scan_cache = false;
+	delete scan_cache;
+	scan_cache = new twrpScanCache();
+	scan_cache->Scan(Path, this, true);
+	dusize = scan_cache->Folder_Size(Path);
+	LOGINFO("Kept metadata of %llu entries in '%s' for the backup\n", (unsigned long long)scan_cache->Count(), Path.c_str());
 	return dusize;
 }
 
+void TWExclude::Keep_Scan_Cache() {
+	keep_scan_cache = true;
+}
+
+const twrpScanCache* TWExclude::Get_Scan_Cache(const string& Path) {
+	if (scan_cache != NULL && scan_cache->Complete() && scan_cache->Covers(Path) && scan_cache->Find(Path) >= 0)
+		return scan_cache;
+	delete scan_cache;
+	scan_cache = new twrpScanCache();
+	if (!scan_cache->Scan(Path, this, true)) {
+		Clear_Scan_Cache();
+		return NULL;
+	}
+	return scan_cache;
+}
+
+void TWExclude::Clear_Scan_Cache() {
+	delete scan_cache;
+	scan_cache = NULL;
+	keep_scan_cache = false;
+}
+
 bool TWExclude::check_relative_skip_dirs(const string& dir) {
 	return std::find(relativedir.begin(), relativedir.end(), dir) != relativedir.end();
 }
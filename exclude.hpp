@@ -24,11 +24,17 @@
 
 using namespace std;
 
+class twrpScanCache;
+
 class TWExclude {
 
 public:
 	TWExclude();
+	~TWExclude();
 	uint64_t Get_Folder_Size(const string& Path); // Gets the folder's size using stat
+	void Keep_Scan_Cache(); // The next Get_Folder_Size() keeps the metadata it reads for a backup
+	const twrpScanCache* Get_Scan_Cache(const string& Path); // Scan covering Path, reads it if nothing kept covers it
+	void Clear_Scan_Cache();
 	void add_absolute_dir(const string& Path);
 	void add_relative_dir(const string& Path);
 	bool check_relative_skip_dirs(const string& dir);
@@ -38,6 +44,8 @@ public:
 private:
 	vector<string> absolutedir;
 	vector<string> relativedir;
+	twrpScanCache *scan_cache;
+	bool keep_scan_cache;
 };
 
 #endif
@@ -83,6 +83,25 @@ using SHA256Digest = std::array<uint8_t, SHA256_DIGEST_LENGTH>;
 #ifndef MIN
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #endif
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+enum block_state {
+  BLOCK_FREE,
+  BLOCK_LOADING,  // being fetched from the host
+  BLOCK_READY,    // fetched and verified against its hash
+};
+
+// One entry of the block cache. The data of a ready block doesn't change until the entry is
+// reused for another block, which never happens while the entry is pinned by a read.
+struct cache_block {
+  uint32_t block;
+  block_state state;
+  uint32_t pins;
+  uint64_t last_used;
+  uint8_t* data;
+};
 
 struct fuse_data {
   int ffd;  // file descriptor for the fuse socket
@@ -97,13 +116,27 @@ struct fuse_data {
   uid_t uid;
   gid_t gid;
 
-  uint32_t curr_block;  // cache the block most recently read from the host
-  uint8_t* block_data;
-
-  uint8_t* extra_block;  // another block of storage for reads that span two blocks
-
   uint8_t* hashes;        // SHA-256 hash of each block (all zeros
                           // if block hasn't been read yet)
+
+  // Everything below is guarded by cache_mu, except that the data of a loading block belongs to
+  // the thread fetching it.
+  pthread_mutex_t cache_mu;
+  pthread_cond_t cache_cv;
+  cache_block* cache;
+  uint32_t cache_blocks;
+  uint64_t cache_clock;  // incremented on every use, for the LRU order
+
+  uint32_t last_block;  // the last block of the previous read, to detect sequential reads
+  uint32_t readahead_blocks;
+  uint32_t readahead_next;  // the blocks in [readahead_next, readahead_end) are to be prefetched
+  uint32_t readahead_end;
+  bool readahead_stop;
+  bool readahead_started;
+  pthread_t readahead_thread;
+
+  // Serializes the calls to the provider and the accesses to the hashes.
+  pthread_mutex_t fetch_mu;
 };
 
 static void fuse_reply(const fuse_data* fd, uint64_t unique, const void* data, size_t len) {
@@ -237,16 +270,11 @@ static int handle_release(void* /* data */, fuse_data* /* fd */, const fuse_in_h
   return 0;
 }
 
-// Fetch a block from the host into fd->curr_block and fd->block_data.
-// Returns 0 on successful fetch, negative otherwise.
-static int fetch_block(fuse_data* fd, uint32_t block) {
-  if (block == fd->curr_block) {
-    return 0;
-  }
-
+// Fetch a block from the host into |data| and check it against the hash of its first fetch.
+// Returns 0 on successful fetch, negative otherwise. Must be called with fd->fetch_mu held.
+static int fetch_block(fuse_data* fd, uint32_t block, uint8_t* data) {
   if (block >= fd->file_blocks) {
-    memset(fd->block_data, 0, fd->block_size);
-    fd->curr_block = block;
+    memset(data, 0, fd->block_size);
     return 0;
   }
 
@@ -255,26 +283,24 @@ static int fetch_block(fuse_data* fd, uint32_t block) {
     // If we're reading the last (partial) block of the file, expect a shorter response from the
     // host, and pad the rest of the block with zeroes.
     fetch_size = fd->file_size - (block * fd->block_size);
-    memset(fd->block_data + fetch_size, 0, fd->block_size - fetch_size);
+    memset(data + fetch_size, 0, fd->block_size - fetch_size);
   }
 
-  int result = fd->vtab.read_block(block, fd->block_data, fetch_size);
+  int result = fd->vtab.read_block(block, data, fetch_size);
   if (result < 0) return result;
 
-  fd->curr_block = block;
-
   // Verify the hash of the block we just got from the host.
   //
   // - If the hash of the just-received data matches the stored hash for the block, accept it.
   // - If the stored hash is all zeroes, store the new hash and accept the block (this is the first
   //   time we've read this block).
-  // - Otherwise, return -EINVAL for the read.
+  // - Otherwise, return -EIO for the read.
 
   uint8_t hash[SHA256_DIGEST_LENGTH];
 #ifdef USE_MINCRYPT
-  SHA256_hash(fd->block_data, fd->block_size, hash);
+  SHA256_hash(data, fd->block_size, hash);
 #else
-  SHA256(fd->block_data, fd->block_size, hash);
+  SHA256(data, fd->block_size, hash);
 #endif
   uint8_t* blockhash = fd->hashes + block * SHA256_DIGEST_LENGTH;
   if (memcmp(hash, blockhash, SHA256_DIGEST_LENGTH) == 0) {
@@ -284,7 +310,6 @@ static int fetch_block(fuse_data* fd, uint32_t block) {
   int i;
   for (i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
     if (blockhash[i] != 0) {
-      fd->curr_block = -1;
       return -EIO;
     }
   }
@@ -293,6 +318,133 @@ static int fetch_block(fuse_data* fd, uint32_t block) {
   return 0;
 }
 
+static cache_block* find_cached_block(fuse_data* fd, uint32_t block) {
+  for (uint32_t i = 0; i < fd->cache_blocks; ++i) {
+    cache_block* entry = &fd->cache[i];
+    if (entry->state != BLOCK_FREE && entry->block == block) {
+      return entry;
+    }
+  }
+  return nullptr;
+}
+
+// Returns a free cache entry, or else the least recently used ready one that isn't pinned.
+static cache_block* claim_cache_entry(fuse_data* fd) {
+  cache_block* victim = nullptr;
+  for (uint32_t i = 0; i < fd->cache_blocks; ++i) {
+    cache_block* entry = &fd->cache[i];
+    if (entry->state == BLOCK_FREE) {
+      return entry;
+    }
+    if (entry->state == BLOCK_READY && entry->pins == 0 &&
+        (victim == nullptr || entry->last_used < victim->last_used)) {
+      victim = entry;
+    }
+  }
+  return victim;
+}
+
+// Fetches |block| into the cache entry |entry|, which the caller has marked as loading. Called
+// and returns with fd->cache_mu held.
+static int load_cache_entry(fuse_data* fd, cache_block* entry, uint32_t block) {
+  pthread_mutex_unlock(&fd->cache_mu);
+  pthread_mutex_lock(&fd->fetch_mu);
+  int result = fetch_block(fd, block, entry->data);
+  pthread_mutex_unlock(&fd->fetch_mu);
+  pthread_mutex_lock(&fd->cache_mu);
+
+  entry->state = (result == 0) ? BLOCK_READY : BLOCK_FREE;
+  entry->last_used = ++fd->cache_clock;
+  pthread_cond_broadcast(&fd->cache_cv);
+  return result;
+}
+
+// Looks up |block| in the cache, fetching it from the host on a miss. On success the returned
+// entry is pinned until release_block() is called.
+static int get_block(fuse_data* fd, uint32_t block, cache_block** out) {
+  pthread_mutex_lock(&fd->cache_mu);
+  for (;;) {
+    cache_block* entry = find_cached_block(fd, block);
+    if (entry != nullptr && entry->state == BLOCK_LOADING) {
+      // The read-ahead thread is already fetching it.
+      pthread_cond_wait(&fd->cache_cv, &fd->cache_mu);
+      continue;
+    }
+    if (entry == nullptr) {
+      entry = claim_cache_entry(fd);
+      if (entry == nullptr) {
+        pthread_cond_wait(&fd->cache_cv, &fd->cache_mu);
+        continue;
+      }
+      entry->block = block;
+      entry->state = BLOCK_LOADING;
+      int result = load_cache_entry(fd, entry, block);
+      if (result != 0) {
+        pthread_mutex_unlock(&fd->cache_mu);
+        return result;
+      }
+    }
+
+    entry->pins++;
+    entry->last_used = ++fd->cache_clock;
+    pthread_mutex_unlock(&fd->cache_mu);
+    *out = entry;
+    return 0;
+  }
+}
+
+static void release_block(fuse_data* fd, cache_block* entry) {
+  pthread_mutex_lock(&fd->cache_mu);
+  entry->pins--;
+  pthread_cond_broadcast(&fd->cache_cv);
+  pthread_mutex_unlock(&fd->cache_mu);
+}
+
+// Records that a read ended in |block|. If it continues the previous read, the blocks following
+// it are queued for the read-ahead thread.
+static void schedule_readahead(fuse_data* fd, uint32_t block) {
+  pthread_mutex_lock(&fd->cache_mu);
+  if (fd->readahead_started && (block == fd->last_block || block == fd->last_block + 1)) {
+    uint32_t end = MIN(block + 1 + fd->readahead_blocks, fd->file_blocks);
+    if (fd->readahead_next <= block || fd->readahead_next > end) {
+      fd->readahead_next = block + 1;
+    }
+    fd->readahead_end = end;
+    pthread_cond_broadcast(&fd->cache_cv);
+  }
+  fd->last_block = block;
+  pthread_mutex_unlock(&fd->cache_mu);
+}
+
+static void* readahead_thread(void* cookie) {
+  fuse_data* fd = static_cast<fuse_data*>(cookie);
+
+  pthread_mutex_lock(&fd->cache_mu);
+  while (!fd->readahead_stop) {
+    if (fd->readahead_next >= fd->readahead_end) {
+      pthread_cond_wait(&fd->cache_cv, &fd->cache_mu);
+      continue;
+    }
+
+    uint32_t block = fd->readahead_next++;
+    if (find_cached_block(fd, block) != nullptr) {
+      continue;
+    }
+    cache_block* entry = claim_cache_entry(fd);
+    if (entry == nullptr) {
+      // Everything is in use; drop the rest of the window rather than wait.
+      fd->readahead_next = fd->readahead_end;
+      continue;
+    }
+    entry->block = block;
+    entry->state = BLOCK_LOADING;
+    // A failure is left for the reader of the block to see when it fetches the block itself.
+    load_cache_entry(fd, entry, block);
+  }
+  pthread_mutex_unlock(&fd->cache_mu);
+  return nullptr;
+}
+
 static int handle_read(void* data, fuse_data* fd, const fuse_in_header* hdr) {
   if (hdr->nodeid != PACKAGE_FILE_ID) return -ENOENT;
 
@@ -318,7 +470,8 @@ static int handle_read(void* data, fuse_data* fd, const fuse_in_header* hdr) {
   vec[0].iov_len = sizeof(outhdr);
 
   uint32_t block = offset / fd->block_size;
-  int result = fetch_block(fd, block);
+  cache_block* first;
+  int result = get_block(fd, block, &first);
   if (result != 0) return result;
 
   // Two cases:
@@ -326,40 +479,49 @@ static int handle_read(void* data, fuse_data* fd, const fuse_in_header* hdr) {
   //   - the read request is entirely within this block. In this case we can reply immediately.
   //
   //   - the read request goes over into the next block. Note that since we mount the filesystem
-  //     with max_read=block_size, a read can never span more than two blocks. In this case we copy
-  //     the block to extra_block and issue a fetch for the following block.
+  //     with max_read=block_size, a read can never span more than two blocks. In this case we also
+  //     get the following block and reply with the pieces of both.
 
   uint32_t block_offset = offset - (block * fd->block_size);
 
+  cache_block* second = nullptr;
   int vec_used;
   if (size + block_offset <= fd->block_size) {
     // First case: the read fits entirely in the first block.
 
-    vec[1].iov_base = fd->block_data + block_offset;
+    vec[1].iov_base = first->data + block_offset;
     vec[1].iov_len = size;
     vec_used = 2;
   } else {
     // Second case: the read spills over into the next block.
 
-    memcpy(fd->extra_block, fd->block_data + block_offset, fd->block_size - block_offset);
-    vec[1].iov_base = fd->extra_block;
+    result = get_block(fd, block + 1, &second);
+    if (result != 0) {
+      release_block(fd, first);
+      return result;
+    }
+    vec[1].iov_base = first->data + block_offset;
     vec[1].iov_len = fd->block_size - block_offset;
-
-    result = fetch_block(fd, block + 1);
-    if (result != 0) return result;
-    vec[2].iov_base = fd->block_data;
+    vec[2].iov_base = second->data;
     vec[2].iov_len = size - vec[1].iov_len;
     vec_used = 3;
   }
 
+  // Let the following blocks come in from the host while we reply.
+  schedule_readahead(fd, (second != nullptr) ? block + 1 : block);
+
   if (writev(fd->ffd, vec, vec_used) == -1) {
     printf("*** READ REPLY FAILED: %s ***\n", strerror(errno));
   }
+  release_block(fd, first);
+  if (second != nullptr) {
+    release_block(fd, second);
+  }
   return NO_STATUS;
 }
 
 int run_fuse_sideload(const provider_vtab& vtab, uint64_t file_size, uint32_t block_size,
-                      const char* mount_point) {
+                      const char* mount_point, const sideload_cache_config& cache_config) {
   // If something's already mounted on our mountpoint, try to remove it. (Mostly in case of a
   // previous abnormal exit.)
   umount2(mount_point, MNT_FORCE);
@@ -376,6 +538,9 @@ int run_fuse_sideload(const provider_vtab& vtab, uint64_t file_size, uint32_t bl
 
   fuse_data fd;
   memset(&fd, 0, sizeof(fd));
+  pthread_mutex_init(&fd.cache_mu, nullptr);
+  pthread_cond_init(&fd.cache_cv, nullptr);
+  pthread_mutex_init(&fd.fetch_mu, nullptr);
   fd.vtab = vtab;
   fd.file_size = file_size;
   fd.block_size = block_size;
@@ -399,18 +564,33 @@ int run_fuse_sideload(const provider_vtab& vtab, uint64_t file_size, uint32_t bl
   fd.uid = getuid();
   fd.gid = getgid();
 
-  fd.curr_block = -1;
-  fd.block_data = static_cast<uint8_t*>(malloc(block_size));
-  if (fd.block_data == nullptr) {
-    fprintf(stderr, "failed to allocate %d bites for block_data\n", block_size);
+  // A read pins at most two blocks and the read-ahead thread loads one at a time, so four entries
+  // always leave one to reuse. Keep the read-ahead window within half of the cache so it doesn't
+  // evict the blocks being read.
+  fd.cache_blocks = MAX(cache_config.cache_blocks, 4U);
+  fd.readahead_blocks = MIN(cache_config.readahead_blocks, fd.cache_blocks / 2);
+  fd.cache = static_cast<cache_block*>(calloc(fd.cache_blocks, sizeof(cache_block)));
+  if (fd.cache == nullptr) {
+    fprintf(stderr, "failed to allocate %u cache entries\n", fd.cache_blocks);
     result = -1;
     goto done;
   }
-  fd.extra_block = static_cast<uint8_t*>(malloc(block_size));
-  if (fd.extra_block == nullptr) {
-    fprintf(stderr, "failed to allocate %d bites for extra_block\n", block_size);
-    result = -1;
-    goto done;
+  for (uint32_t i = 0; i < fd.cache_blocks; ++i) {
+    fd.cache[i].data = static_cast<uint8_t*>(malloc(block_size));
+    if (fd.cache[i].data == nullptr) {
+      fprintf(stderr, "failed to allocate %d bites for the block cache\n", block_size);
+      result = -1;
+      goto done;
+    }
+  }
+
+  fd.last_block = -1;
+  if (fd.readahead_blocks > 0) {
+    if (pthread_create(&fd.readahead_thread, nullptr, readahead_thread, &fd) == 0) {
+      fd.readahead_started = true;
+    } else {
+      fprintf(stderr, "failed to start the read-ahead thread, reading on demand only\n");
+    }
   }
 
   fd.ffd = open("/dev/fuse", O_RDWR);
@@ -506,14 +686,29 @@ int run_fuse_sideload(const provider_vtab& vtab, uint64_t file_size, uint32_t bl
   }
 
 done:
+  if (fd.readahead_started) {
+    pthread_mutex_lock(&fd.cache_mu);
+    fd.readahead_stop = true;
+    pthread_cond_broadcast(&fd.cache_cv);
+    pthread_mutex_unlock(&fd.cache_mu);
+    pthread_join(fd.readahead_thread, nullptr);
+  }
+
   fd.vtab.close();
 
   if (umount2(mount_point, MNT_DETACH) == -1) {
     fprintf(stderr, "fuse_sideload umount failed: %s\n", strerror(errno));
   }
 
-  free(fd.block_data);
-  free(fd.extra_block);
+  if (fd.cache != nullptr) {
+    for (uint32_t i = 0; i < fd.cache_blocks; ++i) {
+      free(fd.cache[i].data);
+    }
+    free(fd.cache);
+  }
+  pthread_mutex_destroy(&fd.fetch_mu);
+  pthread_cond_destroy(&fd.cache_cv);
+  pthread_mutex_destroy(&fd.cache_mu);
 
   return result;
 }
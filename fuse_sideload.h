@@ -38,8 +38,16 @@ struct provider_vtab {
   std::function<void(void)> close;
 };
 
+// Blocks fetched from the provider are kept in an LRU cache of cache_blocks blocks. While the
+// package is read sequentially, the next readahead_blocks blocks are fetched in the background.
+struct sideload_cache_config {
+  uint32_t cache_blocks = 32;
+  uint32_t readahead_blocks = 8;
+};
+
 int run_fuse_sideload(const provider_vtab& vtab, uint64_t file_size, uint32_t block_size,
-                      const char* mount_point = FUSE_SIDELOAD_HOST_MOUNTPOINT);
+                      const char* mount_point = FUSE_SIDELOAD_HOST_MOUNTPOINT,
+                      const sideload_cache_config& cache_config = sideload_cache_config());
 
 #ifdef __cplusplus
 extern "C" {
@@ -77,6 +77,9 @@ endif
 ifneq ($(TW_H_OFFSET),)
     LOCAL_CFLAGS += -DTW_H_OFFSET=$(TW_H_OFFSET)
 endif
+ifneq ($(TW_CONSOLE_MAX_LINES),)
+    LOCAL_CFLAGS += -DTW_CONSOLE_MAX_LINES=$(TW_CONSOLE_MAX_LINES)
+endif
 ifeq ($(TW_ROUND_SCREEN), true)
     LOCAL_CFLAGS += -DTW_ROUND_SCREEN
 endif
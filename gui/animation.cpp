@@ -145,3 +145,8 @@ int GUIAnimation::Update(void)
 	return 0;
 }
 
+int GUIAnimation::GetDirtyRect(int& x, int& y, int& w, int& h)
+{
+	return GetRenderPos(x, y, w, h);
+}
+
@@ -28,6 +28,7 @@
 #include <pthread.h>
 
 #include <string>
+#include <set>
 
 extern "C" {
 #include "../twcommon.h"
@@ -41,12 +42,32 @@ extern "C" {
 
 #define GUI_CONSOLE_BUFFER_SIZE 512
 
+// Number of lines kept for the GUI console. Older lines are only
+// available in the log, since stdout goes to /tmp/recovery.log.
+#ifndef TW_CONSOLE_MAX_LINES
+#define TW_CONSOLE_MAX_LINES 4096
+#endif
+
+// A console line and its word wrap for the last font and width it was
+// wrapped to. Slots are reused once the buffer is full, so the strings
+// and vectors keep their storage instead of being reallocated per line.
+struct ConsoleLine
+{
+	std::string text;
+	const std::string* color;
+	void* wrapFont;
+	int wrapWidth;
+	std::vector<std::pair<size_t, size_t> > wrap;
+};
+
 static pthread_mutex_t console_lock;
 static size_t last_message_count = 0;
 static std::vector<Message> gMessages;
 
-static std::vector<std::string> gConsole;
-static std::vector<std::string> gConsoleColor;
+static ConsoleLine gConsole[TW_CONSOLE_MAX_LINES];
+static size_t gConsoleEnd = 0; // sequence number of the next line, line n is in gConsole[n % TW_CONSOLE_MAX_LINES]
+static unsigned int gConsoleGeneration = 0; // changes when the console is cleared
+static std::set<std::string> gConsoleColors; // every color name used so far
 static FILE* ors_file = NULL;
 
 struct InitMutex
@@ -54,6 +75,24 @@ struct InitMutex
 	InitMutex() { pthread_mutex_init(&console_lock, NULL); }
 } initMutex;
 
+// Sequence number of the oldest line still in the buffer, console_lock must be held
+static size_t console_first_line()
+{
+	return gConsoleEnd > TW_CONSOLE_MAX_LINES ? gConsoleEnd - TW_CONSOLE_MAX_LINES : 0;
+}
+
+// Adds a line to the buffer, overwriting the oldest one when full, console_lock must be held
+static void console_add_line(const char* text, const char* color)
+{
+	ConsoleLine& line = gConsole[gConsoleEnd % TW_CONSOLE_MAX_LINES];
+	line.text.assign(text);
+	line.color = &*gConsoleColors.insert(color).first;
+	line.wrapFont = NULL;
+	line.wrapWidth = 0;
+	line.wrap.clear();
+	gConsoleEnd++;
+}
+
 static void internal_gui_print(const char *color, char *buf)
 {
 	// make sure to flush any outstanding messages first to preserve order of outputs
@@ -78,8 +117,7 @@ static void internal_gui_print(const char *color, char *buf)
 		if (*next == '\n')
 		{
 			*next = '\0';
-			gConsole.push_back(start);
-			gConsoleColor.push_back(color);
+			console_add_line(start, color);
 
 			start = ++next;
 		}
@@ -88,10 +126,8 @@ static void internal_gui_print(const char *color, char *buf)
 	}
 
 	// The text after last \n (or whole string if there is no \n)
-	if (*start) {
-		gConsole.push_back(start);
-		gConsoleColor.push_back(color);
-	}
+	if (*start)
+		console_add_line(start, color);
 	pthread_mutex_unlock(&console_lock);
 }
 
@@ -182,15 +218,14 @@ void GUIConsole::Translate_Now()
 
 	for (size_t m = last_message_count; m < message_count; m++) {
 		std::string message = gMessages[m];
-		std::string color = "normal";
+		const char* color = "normal";
 		if (gMessages[m].GetKind() == msg::kError)
 			color = "error";
 		else if (gMessages[m].GetKind() == msg::kHighlight)
 			color = "highlight";
 		else if (gMessages[m].GetKind() == msg::kWarning)
 			color = "warning";
-		gConsole.push_back(message);
-		gConsoleColor.push_back(color);
+		console_add_line(message.c_str(), color);
 	}
 	last_message_count = message_count;
 	pthread_mutex_unlock(&console_lock);
@@ -200,8 +235,8 @@ void GUIConsole::Clear_For_Retranslation()
 {
 	pthread_mutex_lock(&console_lock);
 	last_message_count = 0;
-	gConsole.clear();
-	gConsoleColor.clear();
+	gConsoleEnd = 0;
+	gConsoleGeneration++;
 	pthread_mutex_unlock(&console_lock);
 }
 
@@ -210,6 +245,8 @@ GUIConsole::GUIConsole(xml_node<>* node) : GUIScrollList(node)
 	xml_node<>* child;
 
 	mLastCount = 0;
+	mGeneration = 0;
+	mWrapWidth = 0;
 	scrollToEnd = true;
 	mSlideoutX = mSlideoutY = mSlideoutW = mSlideoutH = 0;
 	mSlideout = 0;
@@ -271,7 +308,7 @@ int GUIConsole::RenderConsole(void)
 {
 	Translate_Now();
 	pthread_mutex_lock(&console_lock);
-	AddLines(&gConsole, &gConsoleColor, &mLastCount, &rConsole, &rConsoleColor);
+	SyncLines();
 	pthread_mutex_unlock(&console_lock);
 	GUIScrollList::Render();
 
@@ -324,7 +361,7 @@ int GUIConsole::Update(void)
 	}
 
 	pthread_mutex_lock(&console_lock);
-	bool addedNewText = AddLines(&gConsole, &gConsoleColor, &mLastCount, &rConsole, &rConsoleColor);
+	bool addedNewText = SyncLines();
 	pthread_mutex_unlock(&console_lock);
 	if (addedNewText) {
 		// someone added new text
@@ -347,6 +384,66 @@ int GUIConsole::Update(void)
 	return 0;
 }
 
+bool GUIConsole::SyncLines(void)
+{
+	if (!mFont || !mFont->GetResource())
+		return false;
+
+	void* font = mFont->GetResource();
+	bool changed = false;
+	if (mGeneration != gConsoleGeneration || mWrapWidth != mRenderW) {
+		// console was cleared or we were resized, wrap everything again
+		changed = !rConsole.empty();
+		rConsole.clear();
+		mLastCount = 0;
+		mGeneration = gConsoleGeneration;
+		mWrapWidth = mRenderW;
+	}
+
+	// Drop the rows of lines that were overwritten by newer ones
+	size_t first = console_first_line();
+	int dropped = 0;
+	while (!rConsole.empty() && rConsole.front().line < first) {
+		rConsole.pop_front();
+		dropped++;
+	}
+	if (dropped) {
+		// keep the rows that are on screen in place
+		firstDisplayedItem -= dropped;
+		if (firstDisplayedItem < 0) {
+			firstDisplayedItem = 0;
+			y_offset = 0;
+		}
+		changed = true;
+	}
+	if (mLastCount < first)
+		mLastCount = first;
+
+	for (; mLastCount < gConsoleEnd; mLastCount++) {
+		ConsoleLine& line = gConsole[mLastCount % TW_CONSOLE_MAX_LINES];
+		// Consoles on different pages usually share the font and width, so only the first one to show a line has to wrap it
+		if (line.wrapFont != font || line.wrapWidth != mRenderW) {
+			WrapText(line.text, &line.wrap);
+			line.wrapFont = font;
+			line.wrapWidth = mRenderW;
+		}
+		for (size_t i = 0; i < line.wrap.size(); i++) {
+			ConsoleRow row = { mLastCount, line.wrap[i].first, line.wrap[i].second, line.color };
+			rConsole.push_back(row);
+		}
+		changed = true;
+	}
+	return changed;
+}
+
+int GUIConsole::GetDirtyRect(int& x, int& y, int& w, int& h)
+{
+	// Showing or hiding the slideout changes the rest of the page too
+	if (mSlideout)
+		return -1;
+	return GUIScrollList::GetDirtyRect(x, y, w, h);
+}
+
 // IsInRegion - Checks if the request is handled by this object
 //  Return 1 if this object handles the request, 0 if not
 int GUIConsole::IsInRegion(int x, int y)
@@ -391,20 +488,28 @@ size_t GUIConsole::GetItemCount()
 
 void GUIConsole::RenderItem(size_t itemindex, int yPos, bool selected __unused)
 {
+	const ConsoleRow& row = rConsole[itemindex];
+
 	// Set the color for the font
-	if (rConsoleColor[itemindex] == "normal") {
+	if (*row.color == "normal") {
 		gr_color(mFontColor.red, mFontColor.green, mFontColor.blue, mFontColor.alpha);
 	} else {
 		COLOR FontColor;
-		std::string color = rConsoleColor[itemindex];
-		ConvertStrToColor(color, &FontColor);
+		ConvertStrToColor(*row.color, &FontColor);
 		FontColor.alpha = 255;
 		gr_color(FontColor.red, FontColor.green, FontColor.blue, FontColor.alpha);
 	}
 
+	// Copy the text out, the line may be overwritten while we render it
+	pthread_mutex_lock(&console_lock);
+	if (mGeneration == gConsoleGeneration && row.line >= console_first_line() && row.line < gConsoleEnd)
+		mRowText.assign(gConsole[row.line % TW_CONSOLE_MAX_LINES].text, row.start, row.length);
+	else
+		mRowText.clear();
+	pthread_mutex_unlock(&console_lock);
+
 	// render text
-	const char* text = rConsole[itemindex].c_str();
-	gr_textEx_scaleW(mRenderX, yPos, text, mFont->GetResource(), mRenderW, TOP_LEFT, 0);
+	gr_textEx_scaleW(mRenderX, yPos, mRowText.c_str(), mFont->GetResource(), mRenderW, TOP_LEFT, 0);
 }
 
 void GUIConsole::NotifySelect(size_t item_selected __unused)
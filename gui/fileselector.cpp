@@ -19,6 +19,8 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <time.h>
 #include <algorithm>
 
 extern "C" {
@@ -32,8 +34,40 @@ extern "C" {
 #include "../twrp-functions.hpp"
 #include "../adbbu/libtwadbbu.hpp"
 
+#define FILESELECTOR_LIST_BATCH 256 // entries the list thread reads before handing them out
+#define FILESELECTOR_CACHE_FOLDERS 8 // folder listings kept by each file selector
+
 int GUIFileSelector::mSortOrder = 0;
 
+// Sorts batch and merges it into the already sorted list
+template <class T, class Compare>
+static void merge_sorted(std::vector<T>& list, std::vector<T>& batch, Compare comp)
+{
+	std::sort(batch.begin(), batch.end(), comp);
+	size_t mid = list.size();
+	list.insert(list.end(), batch.begin(), batch.end());
+	std::inplace_merge(list.begin(), list.begin() + mid, list.end(), comp);
+}
+
+static unsigned char d_type_from_mode(mode_t mode)
+{
+	if (S_ISDIR(mode))
+		return DT_DIR;
+	if (S_ISREG(mode))
+		return DT_REG;
+	if (S_ISLNK(mode))
+		return DT_LNK;
+	if (S_ISBLK(mode))
+		return DT_BLK;
+	if (S_ISCHR(mode))
+		return DT_CHR;
+	if (S_ISFIFO(mode))
+		return DT_FIFO;
+	if (S_ISSOCK(mode))
+		return DT_SOCK;
+	return DT_UNKNOWN;
+}
+
 GUIFileSelector::GUIFileSelector(xml_node<>* node) : GUIScrollList(node)
 {
 	xml_attribute<>* attr;
@@ -44,6 +78,17 @@ GUIFileSelector::GUIFileSelector(xml_node<>* node) : GUIScrollList(node)
 	mUpdate = 0;
 	mPathVar = "cwd";
 	updateFileList = false;
+	mListComplete = true;
+	mListCacheUse = 0;
+	mListCacheGeneration = PartitionManager.Get_Mount_Generation();
+	mListThreadRunning = false;
+	pthread_mutex_init(&mListLock, NULL);
+	pthread_cond_init(&mListCond, NULL);
+	mListStop = false;
+	mListRequest = 0;
+	mListHandled = 0;
+	mListState = LIST_DONE;
+	memset(&mListStat, 0, sizeof(mListStat));
 
 	// Load filter for filtering files (e.g. *.zip for only zips)
 	child = FindNode(node, "filter");
@@ -125,14 +170,16 @@ GUIFileSelector::GUIFileSelector(xml_node<>* node) : GUIScrollList(node)
 	}
 	SetMaxIconSize(iconWidth, iconHeight);
 
-	// Fetch the file/folder list
-	std::string value;
-	DataManager::GetValue(mPathVar, value);
-	GetFileList(value);
+	// Fetch the file/folder list once the selector is shown, so pages that are
+	// never opened do not start a list thread
+	updateFileList = true;
 }
 
 GUIFileSelector::~GUIFileSelector()
 {
+	StopListThread();
+	pthread_cond_destroy(&mListCond);
+	pthread_mutex_destroy(&mListLock);
 }
 
 int GUIFileSelector::Update(void)
@@ -153,6 +200,10 @@ int GUIFileSelector::Update(void)
 			return 0;
 	}
 
+	// Show whatever the list thread found since the last update
+	if (ReceiveFileList())
+		mUpdate = 1;
+
 	if (mUpdate) {
 		mUpdate = 0;
 		if (Render() == 0)
@@ -188,7 +239,7 @@ int GUIFileSelector::NotifyVarChange(const std::string& varName, const std::stri
 	return 0;
 }
 
-bool GUIFileSelector::fileSort(FileData d1, FileData d2)
+bool GUIFileSelector::fileSort(const FileData& d1, const FileData& d2)
 {
 	if (d1.fileName == ".")
 		return -1;
@@ -226,32 +277,116 @@ bool GUIFileSelector::fileSort(FileData d1, FileData d2)
 
 int GUIFileSelector::GetFileList(const std::string folder)
 {
-	DIR* d;
-	struct dirent* de;
 	struct stat st;
 
-	// Clear all data
+	// Mounting, unmounting or decrypting changes what a folder holds without touching its
+	// mtime, FBE file names turn readable for instance, so the listings from before are dropped
+	unsigned int generation = PartitionManager.Get_Mount_Generation();
+	if (generation != mListCacheGeneration) {
+		mListCache.clear();
+		mListCacheGeneration = generation;
+	}
+
+	// Revisiting a folder that has not changed shows the earlier listing right away
+	std::map<std::string, FileListCache>::iterator cached = mListCache.find(folder);
+	if (cached != mListCache.end() && stat(folder.c_str(), &st) == 0 &&
+			st.st_dev == cached->second.dev && st.st_ino == cached->second.ino &&
+			st.st_mtim.tv_sec == cached->second.mtime.tv_sec && st.st_mtim.tv_nsec == cached->second.mtime.tv_nsec) {
+		FileListCache& cache = cached->second;
+		if (cache.sortOrder != mSortOrder) {
+			std::sort(cache.folders.begin(), cache.folders.end(), fileSort);
+			std::sort(cache.files.begin(), cache.files.end(), fileSort);
+			cache.sortOrder = mSortOrder;
+		}
+		cache.lastUse = ++mListCacheUse;
+		mFolderList = cache.folders;
+		mFileList = cache.files;
+		mListedFolder = folder;
+		mListComplete = true;
+
+		// Stop a listing that may still be running for another folder
+		pthread_mutex_lock(&mListLock);
+		mListRequest++;
+		mListHandled = mListRequest;
+		mListFolders.clear();
+		mListFiles.clear();
+		pthread_mutex_unlock(&mListLock);
+		return 0;
+	}
+
+	// Clear all data, the list thread fills it in as it reads the folder
 	mFolderList.clear();
 	mFileList.clear();
+	mListedFolder = folder;
+	mListComplete = false;
+
+	pthread_mutex_lock(&mListLock);
+	unsigned int request = ++mListRequest;
+	mListFolder = folder;
+	mListFolders.clear();
+	mListFiles.clear();
+	mListState = LIST_RUNNING;
+	if (!mListThreadRunning && pthread_create(&mListThread, NULL, ListThread, this) == 0)
+		mListThreadRunning = true;
+	pthread_cond_signal(&mListCond);
+	pthread_mutex_unlock(&mListLock);
+
+	if (!mListThreadRunning) {
+		LOGINFO("GUIFileSelector: unable to start list thread, listing synchronously\n");
+		mListHandled = request;
+		ListFolder(request, folder);
+	}
+	return 0;
+}
 
-	d = opendir(folder.c_str());
-	if (d == NULL) {
-		LOGINFO("Unable to open '%s'\n", folder.c_str());
-		if (folder != "/" && (mShowNavFolders != 0 || mShowFiles != 0)) {
-			size_t found;
-			found = folder.find_last_of('/');
-			if (found != string::npos) {
-				string new_folder = folder.substr(0, found);
+void* GUIFileSelector::ListThread(void* cookie)
+{
+	GUIFileSelector* fs = (GUIFileSelector*)cookie;
 
-				if (new_folder.length() < 2)
-					new_folder = "/";
-				DataManager::SetValue(mPathVar, new_folder);
-			}
-		}
-		return -1;
+	pthread_mutex_lock(&fs->mListLock);
+	for (;;) {
+		while (!fs->mListStop && fs->mListHandled == fs->mListRequest)
+			pthread_cond_wait(&fs->mListCond, &fs->mListLock);
+		if (fs->mListStop)
+			break;
+		unsigned int request = fs->mListHandled = fs->mListRequest;
+		std::string folder = fs->mListFolder;
+		pthread_mutex_unlock(&fs->mListLock);
+
+		fs->ListFolder(request, folder);
+
+		pthread_mutex_lock(&fs->mListLock);
+	}
+	pthread_mutex_unlock(&fs->mListLock);
+	return NULL;
+}
+
+void GUIFileSelector::ListFolder(unsigned int request, const std::string& folder)
+{
+	std::vector<FileData> folders, files;
+	struct stat dir_st;
+	struct dirent* de;
+	struct stat st;
+
+	memset(&dir_st, 0, sizeof(dir_st));
+
+	DIR* d = opendir(folder.c_str());
+	if (d == NULL) {
+		PublishList(request, &folders, &files, LIST_FAILED, &dir_st);
+		return;
 	}
 
+	// Taken before reading so that changes made while we read invalidate the cached listing
+	int dfd = dirfd(d);
+	if (fstat(dfd, &st) == 0)
+		dir_st = st;
+
 	while ((de = readdir(d)) != NULL) {
+		if (ListCancelled(request)) {
+			closedir(d);
+			return;
+		}
+
 		FileData data;
 
 		data.fileName = de->d_name;
@@ -262,8 +397,9 @@ int GUIFileSelector::GetFileList(const std::string folder)
 
 		data.fileType = de->d_type;
 
-		std::string path = folder + "/" + data.fileName;
-		stat(path.c_str(), &st);
+		// Relative to the open folder, so the path is not looked up again for every entry
+		if (fstatat(dfd, de->d_name, &st, 0) != 0)
+			memset(&st, 0, sizeof(st));
 		data.protection = st.st_mode;
 		data.userId = st.st_uid;
 		data.groupId = st.st_gid;
@@ -273,26 +409,144 @@ int GUIFileSelector::GetFileList(const std::string folder)
 		data.lastStatChange = st.st_ctime;
 
 		if (data.fileType == DT_UNKNOWN) {
-			data.fileType = TWFunc::Get_D_Type_From_Stat(path);
+			data.fileType = d_type_from_mode(st.st_mode);
 		}
 		if (data.fileType == DT_DIR) {
 			if (mShowNavFolders || (data.fileName != "." && data.fileName != ".."))
-				mFolderList.push_back(data);
+				folders.push_back(data);
 		} else if (data.fileType == DT_REG || data.fileType == DT_LNK || data.fileType == DT_BLK) {
 			if (mExtn.empty() || (data.fileName.length() > mExtn.length() && data.fileName.substr(data.fileName.length() - mExtn.length()) == mExtn)) {
-				if (mExtn == ".ab" && twadbbu::Check_ADB_Backup_File(path))
-					mFolderList.push_back(data);
+				if (mExtn == ".ab" && twadbbu::Check_ADB_Backup_File(folder + "/" + data.fileName))
+					folders.push_back(data);
 				else
-					mFileList.push_back(data);
+					files.push_back(data);
 			}
 		}
+
+		if (folders.size() + files.size() >= FILESELECTOR_LIST_BATCH &&
+				!PublishList(request, &folders, &files, LIST_RUNNING, &dir_st)) {
+			closedir(d);
+			return;
+		}
 	}
 	closedir(d);
 
-	std::sort(mFolderList.begin(), mFolderList.end(), fileSort);
-	std::sort(mFileList.begin(), mFileList.end(), fileSort);
+	PublishList(request, &folders, &files, LIST_DONE, &dir_st);
+}
 
-	return 0;
+// Hands entries over to the GUI thread, returns false if the listing is no longer wanted
+bool GUIFileSelector::PublishList(unsigned int request, std::vector<FileData>* folders, std::vector<FileData>* files, ListState state, const struct stat* dir_st)
+{
+	pthread_mutex_lock(&mListLock);
+	bool current = (request == mListRequest && !mListStop);
+	if (current) {
+		mListFolders.insert(mListFolders.end(), folders->begin(), folders->end());
+		mListFiles.insert(mListFiles.end(), files->begin(), files->end());
+		mListState = state;
+		mListStat = *dir_st;
+	}
+	pthread_mutex_unlock(&mListLock);
+
+	folders->clear();
+	files->clear();
+	return current;
+}
+
+bool GUIFileSelector::ListCancelled(unsigned int request)
+{
+	pthread_mutex_lock(&mListLock);
+	bool cancelled = (request != mListRequest || mListStop);
+	pthread_mutex_unlock(&mListLock);
+	return cancelled;
+}
+
+void GUIFileSelector::StopListThread(void)
+{
+	if (!mListThreadRunning)
+		return;
+	pthread_mutex_lock(&mListLock);
+	mListStop = true;
+	pthread_cond_signal(&mListCond);
+	pthread_mutex_unlock(&mListLock);
+	pthread_join(mListThread, NULL);
+	mListThreadRunning = false;
+}
+
+bool GUIFileSelector::ReceiveFileList(void)
+{
+	if (mListComplete)
+		return false;
+
+	std::vector<FileData> folders, files;
+	pthread_mutex_lock(&mListLock);
+	folders.swap(mListFolders);
+	files.swap(mListFiles);
+	ListState state = mListState;
+	struct stat dir_st = mListStat;
+	pthread_mutex_unlock(&mListLock);
+
+	if (state == LIST_FAILED) {
+		mListComplete = true;
+		LOGINFO("Unable to open '%s'\n", mListedFolder.c_str());
+		if (mListedFolder != "/" && (mShowNavFolders != 0 || mShowFiles != 0)) {
+			size_t found;
+			found = mListedFolder.find_last_of('/');
+			if (found != string::npos) {
+				string new_folder = mListedFolder.substr(0, found);
+
+				if (new_folder.length() < 2)
+					new_folder = "/";
+				DataManager::SetValue(mPathVar, new_folder);
+			}
+		}
+		return true;
+	}
+
+	if (!folders.empty())
+		merge_sorted(mFolderList, folders, fileSort);
+	if (!files.empty())
+		merge_sorted(mFileList, files, fileSort);
+	if (state == LIST_DONE) {
+		mListComplete = true;
+		CacheFileList(dir_st);
+	}
+	return !folders.empty() || !files.empty() || mListComplete;
+}
+
+void GUIFileSelector::CacheFileList(const struct stat& dir_st)
+{
+	const struct timespec& mtime = dir_st.st_mtim;
+
+	if (mtime.tv_sec == 0 && mtime.tv_nsec == 0)
+		return;
+	// A partition was mounted or decrypted while the folder was being read
+	if (PartitionManager.Get_Mount_Generation() != mListCacheGeneration)
+		return;
+
+	// vfat and exfat only store the mtime in 2 second steps, so a folder that changed just
+	// now may change again without a new mtime
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (now.tv_sec >= mtime.tv_sec && now.tv_sec - mtime.tv_sec < 2)
+		return;
+
+	if (mListCache.size() >= FILESELECTOR_CACHE_FOLDERS && mListCache.find(mListedFolder) == mListCache.end()) {
+		std::map<std::string, FileListCache>::iterator oldest = mListCache.begin();
+		for (std::map<std::string, FileListCache>::iterator it = mListCache.begin(); it != mListCache.end(); ++it) {
+			if (it->second.lastUse < oldest->second.lastUse)
+				oldest = it;
+		}
+		mListCache.erase(oldest);
+	}
+
+	FileListCache& cache = mListCache[mListedFolder];
+	cache.dev = dir_st.st_dev;
+	cache.ino = dir_st.st_ino;
+	cache.mtime = mtime;
+	cache.sortOrder = mSortOrder;
+	cache.lastUse = ++mListCacheUse;
+	cache.folders = mFolderList;
+	cache.files = mFileList;
 }
 
 void GUIFileSelector::SetPageFocus(int inFocus)
@@ -93,7 +93,13 @@ static void flip(void)
 		write(gRecorder, &time, sizeof(timespec));
 		gr_write_frame_to_file(gRecorder);
 	}
-	gr_flip();
+
+	int x, y, w, h;
+	if (PageManager::GetDirtyRect(x, y, w, h))
+		gr_flip_region(x, y, w, h);
+	else
+		gr_flip();
+	PageManager::ClearDirtyRect();
 }
 
 void rapidxml::parse_error_handler(const char *what, void *where)
@@ -612,28 +618,29 @@ static int runPages(const char *page_name, const int stop_on_page_done)
 
 #ifndef PRINT_RENDER_TIME
 			if (ret > 1)
-				PageManager::Render();
+				PageManager::RenderDirty();
 
 			if (ret > 0)
 				flip();
 #else
-			if (ret > 1)
+			if (ret > 0)
 			{
 				timespec start, end;
 				int32_t render_t, flip_t;
+				int x, y, w, h;
 				clock_gettime(CLOCK_MONOTONIC, &start);
-				PageManager::Render();
+				if (ret > 1)
+					PageManager::RenderDirty();
 				clock_gettime(CLOCK_MONOTONIC, &end);
 				render_t = TWFunc::timespec_diff_ms(start, end);
 
+				bool partial = PageManager::GetDirtyRect(x, y, w, h);
 				flip();
 				clock_gettime(CLOCK_MONOTONIC, &start);
 				flip_t = TWFunc::timespec_diff_ms(end, start);
 
-				LOGINFO("Render(): %u ms, flip(): %u ms, total: %u ms\n", render_t, flip_t, render_t+flip_t);
+				LOGINFO("Render(): %u ms, flip(): %u ms, total: %u ms, %s area: %dx%d+%d+%d\n", render_t, flip_t, render_t+flip_t, partial ? "dirty" : "full", w, h, x, y);
 			}
-			else if (ret > 0)
-				flip();
 #endif
 		}
 		else
@@ -58,6 +58,7 @@ void MouseCursor::ResetData(int resX, int resY)
 	m_speedMultiplier = 2.5f;
 	m_image = NULL;
 	m_present = false;
+	m_drawnX = m_drawnY = m_drawnW = m_drawnH = 0;
 
 	ConvertStrToColor("red", &m_color);
 
@@ -96,8 +97,15 @@ void MouseCursor::LoadData(xml_node<>* node)
 
 int MouseCursor::Render(void)
 {
-	if (!m_present)
+	if (!m_present) {
+		m_drawnW = m_drawnH = 0;
 		return 0;
+	}
+
+	m_drawnX = mRenderX;
+	m_drawnY = mRenderY;
+	m_drawnW = mRenderW;
+	m_drawnH = mRenderH;
 
 	if (m_image && m_image->GetResource())
 	{
@@ -129,6 +137,31 @@ int MouseCursor::Update(void)
 	return 0;
 }
 
+int MouseCursor::GetDirtyRect(int& x, int& y, int& w, int& h)
+{
+	// The old position has to be redrawn to clear the cursor from it
+	x = mRenderX;
+	y = mRenderY;
+	w = m_present ? mRenderW : 0;
+	h = m_present ? mRenderH : 0;
+	if (m_drawnW > 0 && m_drawnH > 0) {
+		if (w > 0 && h > 0) {
+			int right = (std::max)(x + w, m_drawnX + m_drawnW);
+			int bottom = (std::max)(y + h, m_drawnY + m_drawnH);
+			x = (std::min)(x, m_drawnX);
+			y = (std::min)(y, m_drawnY);
+			w = right - x;
+			h = bottom - y;
+		} else {
+			x = m_drawnX;
+			y = m_drawnY;
+			w = m_drawnW;
+			h = m_drawnH;
+		}
+	}
+	return 0;
+}
+
 int MouseCursor::SetRenderPos(int x, int y, int w, int h)
 {
 	if (x == mRenderX && y == mRenderY)
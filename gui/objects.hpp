@@ -23,10 +23,12 @@
 
 #include "rapidxml.hpp"
 #include <vector>
+#include <deque>
 #include <string>
 #include <map>
 #include <set>
 #include <time.h>
+#include <pthread.h>
 
 using namespace rapidxml;
 
@@ -71,6 +73,10 @@ public:
 	//  Return 0 on success, <0 on error
 	virtual int SetRenderPos(int x, int y, int w = 0, int h = 0) { mRenderX = x; mRenderY = y; if (w || h) { mRenderW = w; mRenderH = h; } return 0; }
 
+	// GetDirtyRect - Returns the area that changed after Update() returned >0
+	//  Return 0 on success, <0 if the whole screen must be redrawn
+	virtual int GetDirtyRect(int& x __unused, int& y __unused, int& w __unused, int& h __unused) { return -1; }
+
 	// GetPlacement - Returns the current placement
 	virtual int GetPlacement(Placement& placement) { placement = mPlacement; return 0; }
 
@@ -462,6 +468,10 @@ public:
 	//  Return 0 if nothing to update, 1 on success and contiue, >1 if full render required, and <0 on error
 	virtual int Update(void);
 
+	// GetDirtyRect - Returns the area that changed after Update() returned >0
+	//  Return 0 on success, <0 if the whole screen must be redrawn
+	virtual int GetDirtyRect(int& x, int& y, int& w, int& h);
+
 	// NotifyTouch - Notify of a touch event
 	//  Return 0 on success, >0 to ignore remainder of touch, and <0 on error
 	virtual int NotifyTouch(TOUCH_STATE state, int x, int y);
@@ -560,6 +570,8 @@ protected:
 	int fastScroll; // indicates that the inital touch was inside the fastscroll region - makes for easier fast scrolling as the touches don't have to stay within the fast scroll region and you drag your finger
 	int mUpdate; // indicates that a change took place and we need to re-render
 	bool AddLines(std::vector<std::string>* origText, std::vector<std::string>* origColor, size_t* lastCount, std::vector<std::string>* rText, std::vector<std::string>* rColor);
+	// WrapText - Word wraps text to mRenderW, storing the start and length of each resulting line in segments
+	void WrapText(const std::string& text, std::vector<std::pair<size_t, size_t> >* segments);
 };
 
 class GUIFileSelector : public GUIScrollList
@@ -596,13 +608,62 @@ protected:
 		time_t lastStatChange;	  // Uses time_t format from stat
 	};
 
+	// A finished listing of a folder, reused while the same folder's mtime is unchanged
+	struct FileListCache {
+		dev_t dev;
+		ino_t ino;
+		struct timespec mtime;
+		int sortOrder; // mSortOrder that the lists are sorted by
+		unsigned long lastUse;
+		std::vector<FileData> folders;
+		std::vector<FileData> files;
+	};
+
+	enum ListState {
+		LIST_RUNNING,
+		LIST_DONE,
+		LIST_FAILED
+	};
+
 protected:
+	// GetFileList - Shows folder from the cache or starts listing it in the background
+	//  Return 0 on success, <0 on error
 	virtual int GetFileList(const std::string folder);
-	static bool fileSort(FileData d1, FileData d2);
+	static bool fileSort(const FileData& d1, const FileData& d2);
+
+	// List thread, reads a folder and hands out the entries in batches
+	static void* ListThread(void* cookie);
+	void ListFolder(unsigned int request, const std::string& folder);
+	bool PublishList(unsigned int request, std::vector<FileData>* folders, std::vector<FileData>* files, ListState state, const struct stat* dir_st);
+	bool ListCancelled(unsigned int request);
+	void StopListThread(void);
+
+	// ReceiveFileList - Merges entries handed out by the list thread into the lists
+	//  Return true if the lists changed
+	bool ReceiveFileList(void);
+	void CacheFileList(const struct stat& dir_st);
 
 protected:
 	std::vector<FileData> mFolderList;
 	std::vector<FileData> mFileList;
+	std::string mListedFolder; // folder that mFolderList and mFileList belong to
+	bool mListComplete; // false while the list thread is still adding to the lists
+	std::map<std::string, FileListCache> mListCache;
+	unsigned long mListCacheUse; // counter for finding the least recently used cache entry
+	unsigned int mListCacheGeneration; // mount generation of the partitions the cached listings were read from
+
+	// Shared with the list thread, protected by mListLock
+	pthread_t mListThread;
+	bool mListThreadRunning;
+	pthread_mutex_t mListLock;
+	pthread_cond_t mListCond; // signalled when a folder is requested or the thread should exit
+	bool mListStop;
+	unsigned int mListRequest; // incremented for every folder requested
+	unsigned int mListHandled; // last request the list thread has picked up
+	std::string mListFolder; // folder requested
+	std::vector<FileData> mListFolders, mListFiles; // entries not merged into the lists yet
+	ListState mListState;
+	struct stat mListStat; // stat of the folder when the listing started
 	std::string mPathVar; // current path displayed, saved in the data manager
 	std::string mPathDefault; // default value for the path if none is set in mPathVar
 	std::string mExtn; // used for filtering the file list, for example, *.zip
@@ -737,6 +798,10 @@ public:
 	//  Return 0 if nothing to update, 1 on success and contiue, >1 if full render required, and <0 on error
 	virtual int Update(void);
 
+	// GetDirtyRect - Returns the area that changed after Update() returned >0
+	//  Return 0 on success, <0 if the whole screen must be redrawn
+	virtual int GetDirtyRect(int& x, int& y, int& w, int& h);
+
 	// IsInRegion - Checks if the request is handled by this object
 	//  Return 1 if this object handles the request, 0 if not
 	virtual int IsInRegion(int x, int y);
@@ -761,18 +826,31 @@ protected:
 		request_show
 	};
 
+	// One word wrapped line on screen, pointing into the console line buffer
+	struct ConsoleRow
+	{
+		size_t line; // sequence number of the console line
+		size_t start, length; // part of the line shown in this row
+		const std::string* color;
+	};
+
 	ImageResource* mSlideoutImage;
-	size_t mLastCount; // lines from gConsole that are already split and copied into rConsole
+	size_t mLastCount; // sequence number of the next console line to be split into rConsole
+	unsigned int mGeneration; // console buffer generation that rConsole was built from
+	int mWrapWidth; // width that rConsole was wrapped to
 	bool scrollToEnd; // true if we want to keep tracking the last line
 	int mSlideoutX, mSlideoutY, mSlideoutW, mSlideoutH;
 	int mSlideout;
 	SlideoutState mSlideoutState;
-	std::vector<std::string> rConsole;
-	std::vector<std::string> rConsoleColor;
+	std::deque<ConsoleRow> rConsole;
+	std::string mRowText; // text of the row being rendered
 
 protected:
 	int RenderSlideout(void);
 	int RenderConsole(void);
+	// SyncLines - Wraps new console lines and drops rows of lines that left the buffer, console_lock must be held
+	//  Return true if rows were added or removed
+	bool SyncLines(void);
 };
 
 class TerminalEngine;
@@ -827,6 +905,10 @@ public:
 	//  Return 0 if nothing to update, 1 on success and contiue, >1 if full render required, and <0 on error
 	virtual int Update(void);
 
+	// GetDirtyRect - Returns the area that changed after Update() returned >0
+	//  Return 0 on success, <0 if the whole screen must be redrawn
+	virtual int GetDirtyRect(int& x, int& y, int& w, int& h);
+
 protected:
 	AnimationResource* mAnimation;
 	int mFrame;
@@ -850,6 +932,10 @@ public:
 	//  Return 0 if nothing to update, 1 on success and contiue, >1 if full render required, and <0 on error
 	virtual int Update(void);
 
+	// GetDirtyRect - Returns the area that changed after Update() returned >0
+	//  Return 0 on success, <0 if the whole screen must be redrawn
+	virtual int GetDirtyRect(int& x, int& y, int& w, int& h);
+
 	// NotifyVarChange - Notify of a variable change
 	//  Returns 0 on success, <0 on error
 	virtual int NotifyVarChange(const std::string& varName, const std::string& value);
@@ -1155,6 +1241,7 @@ public:
 
 	virtual int Render(void);
 	virtual int Update(void);
+	virtual int GetDirtyRect(int& x, int& y, int& w, int& h);
 	virtual int SetRenderPos(int x, int y, int w = 0, int h = 0);
 
 	void Move(int deltaX, int deltaY);
@@ -1170,6 +1257,7 @@ private:
 	COLOR m_color;
 	ImageResource *m_image;
 	bool m_present;
+	int m_drawnX, m_drawnY, m_drawnW, m_drawnH; // where the cursor was last rendered, m_drawnW is 0 if it is not on screen
 };
 
 class GUIPatternPassword : public GUIObject, public RenderObject, public ActionObject
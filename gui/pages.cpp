@@ -69,6 +69,11 @@ MouseCursor *PageManager::mMouseCursor = NULL;
 HardwareKeyboard *PageManager::mHardwareKeyboard = NULL;
 bool PageManager::mReloadTheme = false;
 std::string PageManager::mStartPage = "main";
+bool PageManager::mDirtyFull = true;
+int PageManager::mDirtyX = 0;
+int PageManager::mDirtyY = 0;
+int PageManager::mDirtyW = 0;
+int PageManager::mDirtyH = 0;
 std::vector<language_struct> Language_List;
 
 int tw_x_offset = 0;
@@ -547,8 +552,19 @@ int Page::Update(void)
 	{
 		int ret = (*iter)->Update();
 		if (ret < 0)
+		{
 			LOGERR("An update request has failed.\n");
-		else if (ret > retCode)
+			continue;
+		}
+		if (ret > 0)
+		{
+			int x, y, w, h;
+			if ((*iter)->GetDirtyRect(x, y, w, h) == 0)
+				PageManager::AddDirtyRect(x, y, w, h);
+			else
+				PageManager::SetFullDirty();
+		}
+		if (ret > retCode)
 			retCode = ret;
 	}
 
@@ -656,12 +672,21 @@ void Page::SetPageFocus(int inFocus)
 
 int Page::NotifyVarChange(std::string varName, std::string value)
 {
+	bool visibilityChanged = false;
+
 	std::vector<GUIObject*>::iterator iter;
 	for (iter = mObjects.begin(); iter != mObjects.end(); ++iter)
 	{
+		bool wasVisible = (*iter)->isConditionTrue();
 		if ((*iter)->NotifyVarChange(varName, value))
 			LOGERR("An action handler errored on NotifyVarChange.\n");
+		if ((*iter)->isConditionTrue() != wasVisible)
+			visibilityChanged = true;
 	}
+
+	// Objects that appear or disappear don't report their area as dirty
+	if (visibilityChanged)
+		gui_forceRender();
 	return 0;
 }
 
@@ -1597,6 +1622,7 @@ int PageManager::IsCurrentPage(Page* page)
 
 int PageManager::Render(void)
 {
+	SetFullDirty();
 	if (blankTimer.isScreenOff())
 		return 0;
 
@@ -1606,6 +1632,76 @@ int PageManager::Render(void)
 	return res;
 }
 
+int PageManager::RenderDirty(void)
+{
+	if (mDirtyFull || !gr_flip_region_supported())
+		return Render();
+
+	if (blankTimer.isScreenOff() || mDirtyW <= 0 || mDirtyH <= 0)
+		return 0;
+
+	// Redraw everything that overlaps the damaged area, but nothing outside it
+	gr_clip_damage(mDirtyX, mDirtyY, mDirtyW, mDirtyH);
+	int res = (mCurrentSet ? mCurrentSet->Render() : -1);
+	if (mMouseCursor)
+		mMouseCursor->Render();
+	gr_noclip_damage();
+	return res;
+}
+
+void PageManager::AddDirtyRect(int x, int y, int w, int h)
+{
+	if (w <= 0 || h <= 0)
+		return;
+
+	if (mDirtyW <= 0 || mDirtyH <= 0)
+	{
+		mDirtyX = x;
+		mDirtyY = y;
+		mDirtyW = w;
+		mDirtyH = h;
+		return;
+	}
+
+	int right = std::max(mDirtyX + mDirtyW, x + w);
+	int bottom = std::max(mDirtyY + mDirtyH, y + h);
+	mDirtyX = std::min(mDirtyX, x);
+	mDirtyY = std::min(mDirtyY, y);
+	mDirtyW = right - mDirtyX;
+	mDirtyH = bottom - mDirtyY;
+}
+
+void PageManager::SetFullDirty(void)
+{
+	mDirtyFull = true;
+}
+
+bool PageManager::GetDirtyRect(int& x, int& y, int& w, int& h)
+{
+	if (mDirtyFull)
+	{
+		x = 0;
+		y = 0;
+		w = gr_fb_width();
+		h = gr_fb_height();
+		return false;
+	}
+	x = mDirtyX;
+	y = mDirtyY;
+	w = mDirtyW;
+	h = mDirtyH;
+	return true;
+}
+
+void PageManager::ClearDirtyRect(void)
+{
+	mDirtyFull = false;
+	mDirtyX = 0;
+	mDirtyY = 0;
+	mDirtyW = 0;
+	mDirtyH = 0;
+}
+
 HardwareKeyboard *PageManager::GetHardwareKeyboard()
 {
 	if (!mHardwareKeyboard)
@@ -1664,6 +1760,14 @@ int PageManager::Update(void)
 	if (mMouseCursor)
 	{
 		int c_res = mMouseCursor->Update();
+		if (c_res > 0)
+		{
+			int x, y, w, h;
+			if (mMouseCursor->GetDirtyRect(x, y, w, h) == 0)
+				AddDirtyRect(x, y, w, h);
+			else
+				SetFullDirty();
+		}
 		if (c_res > res)
 			res = c_res;
 	}
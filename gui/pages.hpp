@@ -177,6 +177,7 @@ public:
 
 	// These are routing routines
 	static int Render(void);
+	static int RenderDirty(void);
 	static int Update(void);
 	static int NotifyTouch(TOUCH_STATE state, int x, int y);
 	static int NotifyKey(int key, bool down);
@@ -192,6 +193,13 @@ public:
 	static xml_node<>* FindStyle(std::string name);
 	static void AddStringResource(std::string resource_source, std::string resource_name, std::string value);
 
+	// Damage tracking for partial redraws. GetDirtyRect returns false if
+	// the whole screen changed since the last flip.
+	static void AddDirtyRect(int x, int y, int w, int h);
+	static void SetFullDirty(void);
+	static bool GetDirtyRect(int& x, int& y, int& w, int& h);
+	static void ClearDirtyRect(void);
+
 protected:
 	static PageSet* FindPackage(std::string name);
 	static void LoadLanguageListDir(std::string dir);
@@ -207,6 +215,8 @@ protected:
 	static bool mReloadTheme;
 	static std::string mStartPage;
 	static LoadingContext* currentLoadingContext;
+	static bool mDirtyFull;
+	static int mDirtyX, mDirtyY, mDirtyW, mDirtyH;
 };
 
 #endif  // _PAGES_HEADER_HPP
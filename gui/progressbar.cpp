@@ -182,6 +182,11 @@ int GUIProgressBar::Update(void)
 	return 2;
 }
 
+int GUIProgressBar::GetDirtyRect(int& x, int& y, int& w, int& h)
+{
+	return GetRenderPos(x, y, w, h);
+}
+
 int GUIProgressBar::NotifyVarChange(const std::string& varName, const std::string& value)
 {
 	GUIObject::NotifyVarChange(varName, value);
@@ -400,6 +400,12 @@ int GUIScrollList::Update(void)
 	return 0;
 }
 
+int GUIScrollList::GetDirtyRect(int& x, int& y, int& w, int& h)
+{
+	// Render() never paints outside of the list area
+	return GetRenderPos(x, y, w, h);
+}
+
 size_t GUIScrollList::HitTestItem(int x __unused, int y)
 {
 	// We only care about y position
@@ -627,34 +633,48 @@ bool GUIScrollList::AddLines(std::vector<std::string>* origText, std::vector<std
 	// Due to word wrap, figure out what / how the newly added text needs to be added to the render vector that is word wrapped
 	// Note, that multiple consoles on different GUI pages may be different widths or use different fonts, so the word wrapping
 	// may different in different console windows
+	std::vector<std::pair<size_t, size_t> > segments;
 	for (size_t i = prevCount; i < *lastCount; i++) {
-		string curr_line = origText->at(i);
-		string curr_color;
-		if (origColor)
-			curr_color = origColor->at(i);
-		for (;;) {
-			size_t line_char_width = gr_ttf_maxExW(curr_line.c_str(), mFont->GetResource(), mRenderW);
-			if (line_char_width < curr_line.size()) {
-				//string left = curr_line.substr(0, line_char_width);
-				size_t wrap_pos = curr_line.find_last_of(" ,./:-_;", line_char_width - 1);
-				if (wrap_pos == string::npos)
-					wrap_pos = line_char_width;
-				else if (wrap_pos < line_char_width - 1)
+		const string& curr_line = origText->at(i);
+		WrapText(curr_line, &segments);
+		for (size_t s = 0; s < segments.size(); s++) {
+			rText->push_back(curr_line.substr(segments[s].first, segments[s].second));
+			if (origColor)
+				rColor->push_back(origColor->at(i));
+		}
+	}
+	return true;
+}
+
+void GUIScrollList::WrapText(const string& text, std::vector<std::pair<size_t, size_t> >* segments)
+{
+	segments->clear();
+	size_t start = 0;
+	for (;;) {
+		size_t remaining = text.size() - start;
+		size_t line_char_width = gr_ttf_maxExW(text.c_str() + start, mFont->GetResource(), mRenderW);
+		if (line_char_width < remaining) {
+			if (line_char_width == 0)
+				line_char_width = 1; // always make progress, even if not a single character fits
+			size_t wrap_pos = text.find_last_of(" ,./:-_;", start + line_char_width - 1);
+			if (wrap_pos == string::npos || wrap_pos < start)
+				wrap_pos = line_char_width;
+			else {
+				wrap_pos -= start;
+				if (wrap_pos < line_char_width - 1)
 					wrap_pos++;
-				rText->push_back(curr_line.substr(0, wrap_pos));
-				if (origColor)
-					rColor->push_back(curr_color);
-				curr_line = curr_line.substr(wrap_pos);
-				/* After word wrapping, delete any leading spaces. Note that the word wrapping is not smart enough to know not
-				 * to wrap in the middle of something like ... so some of the ... could appear on the following line. */
-				curr_line.erase(0, curr_line.find_first_not_of(" "));
-			} else {
-				rText->push_back(curr_line);
-				if (origColor)
-					rColor->push_back(curr_color);
-				break;
+				if (wrap_pos == 0)
+					wrap_pos = line_char_width;
 			}
+			segments->push_back(std::make_pair(start, wrap_pos));
+			/* After word wrapping, skip any leading spaces. Note that the word wrapping is not smart enough to know not
+			 * to wrap in the middle of something like ... so some of the ... could appear on the following line. */
+			start = text.find_first_not_of(" ", start + wrap_pos);
+			if (start == string::npos)
+				start = text.size();
+		} else {
+			segments->push_back(std::make_pair(start, remaining));
+			break;
 		}
 	}
-	return true;
 }
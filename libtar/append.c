@@ -66,11 +66,88 @@ tar_dev_free(tar_dev_t *tdp)
 }
 
 
+libtar_hash_t *
+tar_detach_hardlinks(TAR *t)
+{
+	libtar_hash_t *h = t->h;
+
+	t->h = NULL;
+	return h;
+}
+
+
+void
+tar_attach_hardlinks(TAR *t, libtar_hash_t *h)
+{
+	if (t->h != NULL)
+		libtar_hash_free(t->h, (libtar_freefunc_t)tar_dev_free);
+	t->h = h;
+}
+
+
 /* appends a file to the tar archive */
 int
 tar_append_file(TAR *t, const char *realname, const char *savename)
 {
-	struct stat s;
+	tar_meta_t meta;
+	security_context_t selinux_context = NULL;
+	struct vfs_cap_data cap_data;
+	int rv;
+
+	memset(&meta, 0, sizeof(meta));
+	if (lstat(realname, &meta.st) != 0)
+	{
+#ifdef DEBUG
+		perror("lstat()");
+#endif
+		return -1;
+	}
+
+	/* get selinux context */
+	if (t->options & TAR_STORE_SELINUX)
+	{
+		if (lgetfilecon(realname, &selinux_context) >= 0)
+			meta.selinux_context = selinux_context;
+		else
+		{
+#ifdef DEBUG
+			perror("Failed to get selinux context");
+#endif
+		}
+	}
+
+	/* get posix file capabilities */
+	if (S_ISREG(meta.st.st_mode) && t->options & TAR_STORE_POSIX_CAP)
+	{
+		memset(&cap_data, 0, sizeof(struct vfs_cap_data));
+		if (getxattr(realname, XATTR_NAME_CAPS, &cap_data, sizeof(struct vfs_cap_data)) >= 0)
+			meta.cap_data = &cap_data;
+	}
+
+	/* get android user.default xattr */
+	if (S_ISDIR(meta.st.st_mode) && t->options & TAR_STORE_ANDROID_USER_XATTR)
+	{
+		if (getxattr(realname, "user.default", NULL, 0) >= 0)
+			meta.user_xattrs |= TAR_XATTR_USER_DEFAULT;
+		if (getxattr(realname, "user.inode_cache", NULL, 0) >= 0)
+			meta.user_xattrs |= TAR_XATTR_USER_CACHE;
+		if (getxattr(realname, "user.inode_code_cache", NULL, 0) >= 0)
+			meta.user_xattrs |= TAR_XATTR_USER_CODE_CACHE;
+	}
+
+	rv = tar_append_file_meta(t, realname, savename, &meta);
+	if (selinux_context != NULL)
+		freecon(selinux_context);
+	return rv;
+}
+
+
+/* appends a file to the tar archive using metadata read beforehand */
+int
+tar_append_file_meta(TAR *t, const char *realname, const char *savename,
+		     const tar_meta_t *meta)
+{
+	struct stat s = meta->st;
 	int i;
 	libtar_hashptr_t hp;
 	tar_dev_t *td = NULL;
@@ -78,33 +155,25 @@ tar_append_file(TAR *t, const char *realname, const char *savename)
 	char path[MAXPATHLEN];
 
 #ifdef DEBUG
-	printf("==> tar_append_file(TAR=0x%lx (\"%s\"), realname=\"%s\", "
+	printf("==> tar_append_file_meta(TAR=0x%lx (\"%s\"), realname=\"%s\", "
 	       "savename=\"%s\")\n", t, t->pathname, realname,
 	       (savename ? savename : "[NULL]"));
 #endif
 
-	if (lstat(realname, &s) != 0)
-	{
-#ifdef DEBUG
-		perror("lstat()");
-#endif
-		return -1;
-	}
-
 	/* set header block */
 #ifdef DEBUG
-	puts("tar_append_file(): setting header block...");
+	puts("tar_append_file_meta(): setting header block...");
 #endif
 	memset(&(t->th_buf), 0, sizeof(struct tar_header));
 	th_set_from_stat(t, &s);
 
 	/* set the header path */
 #ifdef DEBUG
-	puts("tar_append_file(): setting header path...");
+	puts("tar_append_file_meta(): setting header path...");
 #endif
 	th_set_path(t, (savename ? savename : realname));
 
-	/* get selinux context */
+	/* set selinux context */
 	if (t->options & TAR_STORE_SELINUX)
 	{
 		if (t->th_buf.selinux_context != NULL)
@@ -113,18 +182,10 @@ tar_append_file(TAR *t, const char *realname, const char *savename)
 			t->th_buf.selinux_context = NULL;
 		}
 
-		security_context_t selinux_context = NULL;
-		if (lgetfilecon(realname, &selinux_context) >= 0)
+		if (meta->selinux_context != NULL)
 		{
-			t->th_buf.selinux_context = strdup(selinux_context);
-			printf("  ==> set selinux context: %s\n", selinux_context);
-			freecon(selinux_context);
-		}
-		else
-		{
-#ifdef DEBUG
-			perror("Failed to get selinux context");
-#endif
+			t->th_buf.selinux_context = strdup(meta->selinux_context);
+			printf("  ==> set selinux context: %s\n", meta->selinux_context);
 		}
 	}
 
@@ -167,7 +228,7 @@ tar_append_file(TAR *t, const char *realname, const char *savename)
 	}
 #endif
 
-	/* get posix file capabilities */
+	/* set posix file capabilities */
 	if (TH_ISREG(t) && t->options & TAR_STORE_POSIX_CAP)
 	{
 		if (t->th_buf.has_cap_data)
@@ -176,8 +237,9 @@ tar_append_file(TAR *t, const char *realname, const char *savename)
 			t->th_buf.has_cap_data = 0;
 		}
 
-		if (getxattr(realname, XATTR_NAME_CAPS, &t->th_buf.cap_data, sizeof(struct vfs_cap_data)) >= 0)
+		if (meta->cap_data != NULL)
 		{
+			memcpy(&t->th_buf.cap_data, meta->cap_data, sizeof(struct vfs_cap_data));
 			t->th_buf.has_cap_data = 1;
 #if 1 //def DEBUG
 			print_caps(&t->th_buf.cap_data);
@@ -185,24 +247,24 @@ tar_append_file(TAR *t, const char *realname, const char *savename)
 		}
 	}
 
-	/* get android user.default xattr */
+	/* set android user.default xattr */
 	if (TH_ISDIR(t) && t->options & TAR_STORE_ANDROID_USER_XATTR)
 	{
-		if (getxattr(realname, "user.default", NULL, 0) >= 0)
+		if (meta->user_xattrs & TAR_XATTR_USER_DEFAULT)
 		{
 			t->th_buf.has_user_default = 1;
 #if 1 //def DEBUG
 			printf("storing xattr user.default\n");
 #endif
 		}
-		if (getxattr(realname, "user.inode_cache", NULL, 0) >= 0)
+		if (meta->user_xattrs & TAR_XATTR_USER_CACHE)
 		{
 			t->th_buf.has_user_cache = 1;
 #if 1 //def DEBUG
 			printf("storing xattr user.inode_cache\n");
 #endif
 		}
-		if (getxattr(realname, "user.inode_code_cache", NULL, 0) >= 0)
+		if (meta->user_xattrs & TAR_XATTR_USER_CODE_CACHE)
 		{
 			t->th_buf.has_user_code_cache = 1;
 #if 1 //def DEBUG
@@ -213,7 +275,7 @@ tar_append_file(TAR *t, const char *realname, const char *savename)
 
 	/* check if it's a hardlink */
 #ifdef DEBUG
-	puts("tar_append_file(): checking inode cache for hardlink...");
+	puts("tar_append_file_meta(): checking inode cache for hardlink...");
 #endif
 	libtar_hashptr_reset(&hp);
 	if (libtar_hash_getkey(t->h, &hp, &(s.st_dev),
@@ -323,7 +385,32 @@ tar_append_eof(TAR *t)
 		}
 	}
 
-	return 0;
+	return tar_flush(t);
+}
+
+
+/* read up to len bytes from a regular file, retrying short reads */
+static ssize_t
+read_file_chunk(int fd, char *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t j;
+
+	while (done < len)
+	{
+		j = read(fd, buf + done, len - done);
+		if (j == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (j == 0)
+			break;
+		done += j;
+	}
+
+	return done;
 }
 
 
@@ -332,8 +419,10 @@ int
 tar_append_regfile(TAR *t, const char *realname)
 {
 	char block[T_BLOCKSIZE];
+	char *buf;
 	int filefd;
 	int64_t i, size;
+	size_t bufsize, chunk, padded;
 	ssize_t j;
 	int rv = -1;
 
@@ -351,26 +440,36 @@ tar_append_regfile(TAR *t, const char *realname)
 	}
 
 	size = th_get_size(t);
-	for (i = size; i > T_BLOCKSIZE; i -= T_BLOCKSIZE)
+
+	/* move the data in T_BULKSIZE chunks, falling back to single blocks */
+	buf = (size > T_BLOCKSIZE ? tar_bulk_buffer(t) : NULL);
+	if (buf != NULL)
+	{
+		bufsize = T_BULKSIZE;
+		posix_fadvise(filefd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+	else
 	{
-		j = read(filefd, &block, T_BLOCKSIZE);
-		if (j != T_BLOCKSIZE)
+		buf = block;
+		bufsize = T_BLOCKSIZE;
+	}
+
+	for (i = size; i > 0; i -= chunk)
+	{
+		chunk = (i > (int64_t)bufsize ? bufsize : (size_t)i);
+		j = read_file_chunk(filefd, buf, chunk);
+		if (j != (ssize_t)chunk)
 		{
 			if (j != -1)
 				errno = EINVAL;
 			goto fail;
 		}
-		if (tar_block_write(t, &block) == -1)
-			goto fail;
-	}
 
-	if (i > 0)
-	{
-		j = read(filefd, &block, i);
-		if (j == -1)
-			goto fail;
-		memset(&(block[i]), 0, T_BLOCKSIZE - i);
-		if (tar_block_write(t, &block) == -1)
+		/* pad the last record of the file out to a full block */
+		padded = (chunk + T_BLOCKSIZE - 1) & ~((size_t)T_BLOCKSIZE - 1);
+		if (padded != chunk)
+			memset(buf + chunk, 0, padded - chunk);
+		if (tar_bulk_write(t, buf, padded) != (ssize_t)padded)
 			goto fail;
 	}
 
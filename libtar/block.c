@@ -12,6 +12,8 @@
 
 #include <internal.h>
 #include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
 
 #ifdef STDC_HEADERS
 # include <string.h>
@@ -733,3 +735,178 @@ th_write(TAR *t)
 }
 
 
+
+/* returns the bulk data buffer, allocating it on first use */
+char *
+tar_bulk_buffer(TAR *t)
+{
+	void *ptr;
+
+	if (t->bulk_buf == NULL)
+	{
+		if (posix_memalign(&ptr, getpagesize(), T_BULKSIZE) != 0)
+		{
+#ifdef DEBUG
+			perror("posix_memalign()");
+#endif
+			return NULL;
+		}
+		t->bulk_buf = (char *)ptr;
+	}
+
+	return t->bulk_buf;
+}
+
+
+/* read len bytes of file data, retrying short reads from pipes */
+ssize_t
+tar_bulk_read(TAR *t, void *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t i;
+
+	if (len % T_BLOCKSIZE != 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	while (done < len)
+	{
+		i = (*(t->type->readfunc))(t->fd, (char *)buf + done, len - done);
+		if (i == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (i == 0)
+			break;
+		done += i;
+	}
+
+	return done;
+}
+
+
+/* pass len bytes straight to the writefunc, retrying short writes */
+static int
+tar_write_all(TAR *t, const char *buf, size_t len)
+{
+	ssize_t i;
+
+	while (len > 0)
+	{
+		if (t->filterfunc != NULL)
+			i = (*(t->filterfunc))(t->filter_cookie, buf, len);
+		else
+			i = (*(t->type->writefunc))(t->fd, buf, len);
+		if (i == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (i == 0)
+		{
+			errno = EIO;
+			return -1;
+		}
+		buf += i;
+		len -= i;
+	}
+
+	return 0;
+}
+
+
+/* write len bytes through the output buffer of t, if it has one */
+ssize_t
+tar_bulk_write(TAR *t, const void *buf, size_t len)
+{
+	const char *ptr = (const char *)buf;
+	size_t left = len, n;
+
+	if (len % T_BLOCKSIZE != 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	while (left > 0)
+	{
+		/* unbuffered, or big enough to bypass an empty buffer */
+		if (t->wbuf == NULL || (t->wbuf_len == 0 && left >= t->wbuf_size))
+		{
+			if (tar_write_all(t, ptr, left) != 0)
+				return -1;
+			t->write_offset += len;
+			return len;
+		}
+
+		n = t->wbuf_size - t->wbuf_len;
+		if (n > left)
+			n = left;
+		memcpy(t->wbuf + t->wbuf_len, ptr, n);
+		t->wbuf_len += n;
+		ptr += n;
+		left -= n;
+		if (t->wbuf_len == t->wbuf_size && tar_flush(t) != 0)
+			return -1;
+	}
+
+	t->write_offset += len;
+	return len;
+}
+
+
+int
+tar_flush(TAR *t)
+{
+	if (t->wbuf == NULL || t->wbuf_len == 0)
+		return 0;
+	if (tar_write_all(t, t->wbuf, t->wbuf_len) != 0)
+		return -1;
+	t->wbuf_len = 0;
+
+	return 0;
+}
+
+
+void
+tar_set_output_filter(TAR *t, filterfunc_t func, void *cookie)
+{
+	t->filterfunc = func;
+	t->filter_cookie = cookie;
+}
+
+
+int
+tar_set_write_buffer(TAR *t, size_t size)
+{
+	void *ptr;
+
+	if (size % T_BLOCKSIZE != 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if (tar_flush(t) != 0)
+		return -1;
+
+	free(t->wbuf);
+	t->wbuf = NULL;
+	t->wbuf_size = 0;
+	if (size == 0)
+		return 0;
+
+	if (posix_memalign(&ptr, getpagesize(), size) != 0)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+	t->wbuf = (char *)ptr;
+	t->wbuf_size = size;
+
+	return 0;
+}
@@ -40,8 +40,6 @@
 #endif
 #include "android_utils.h"
 
-const unsigned long long progress_size = (unsigned long long)(T_BLOCKSIZE);
-
 static int
 tar_set_file_perms(TAR *t, const char *realname)
 {
@@ -108,7 +106,7 @@ tar_set_file_perms(TAR *t, const char *realname)
 
 /* switchboard */
 int
-tar_extract_file(TAR *t, const char *realname, const char *prefix, const int *progress_fd)
+tar_extract_file(TAR *t, const char *realname, const char *prefix, tar_progress_t *progress)
 {
 	int i;
 #ifdef LIBTAR_FILE_HASH
@@ -146,7 +144,7 @@ tar_extract_file(TAR *t, const char *realname, const char *prefix, const int *pr
 	else if (TH_ISFIFO(t))
 		i = tar_extract_fifo(t, realname);
 	else /* if (TH_ISREG(t)) */
-		i = tar_extract_regfile(t, realname, progress_fd);
+		i = tar_extract_regfile(t, realname, progress);
 
 	if (i != 0) {
 		fprintf(stderr, "tar_extract_file(): failed to extract %s !!!\n", realname);
@@ -200,14 +198,39 @@ tar_extract_file(TAR *t, const char *realname, const char *prefix, const int *pr
 }
 
 
+/* write len bytes to an extracted file, retrying short writes */
+static ssize_t
+write_file_chunk(int fd, const char *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t k;
+
+	while (done < len)
+	{
+		k = write(fd, buf + done, len - done);
+		if (k == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		done += k;
+	}
+
+	return done;
+}
+
+
 /* extract regular file */
 int
-tar_extract_regfile(TAR *t, const char *realname, const int *progress_fd)
+tar_extract_regfile(TAR *t, const char *realname, tar_progress_t *progress)
 {
 	int64_t size, i;
 	ssize_t k;
+	size_t bufsize, chunk, padded;
 	int fdout;
-	char buf[T_BLOCKSIZE];
+	char block[T_BLOCKSIZE];
+	char *buf;
 	const char *filename;
 	char *pn;
 
@@ -244,11 +267,22 @@ tar_extract_regfile(TAR *t, const char *realname, const int *progress_fd)
 		return -1;
 	}
 
-	/* extract the file */
-	for (i = size; i > 0; i -= T_BLOCKSIZE)
+	/* extract the file, T_BULKSIZE bytes at a time when possible */
+	buf = (size > T_BLOCKSIZE ? tar_bulk_buffer(t) : NULL);
+	if (buf != NULL)
+		bufsize = T_BULKSIZE;
+	else
 	{
-		k = tar_block_read(t, buf);
-		if (k != T_BLOCKSIZE)
+		buf = block;
+		bufsize = T_BLOCKSIZE;
+	}
+
+	for (i = size; i > 0; i -= chunk)
+	{
+		chunk = (i > (int64_t)bufsize ? bufsize : (size_t)i);
+		padded = (chunk + T_BLOCKSIZE - 1) & ~((size_t)T_BLOCKSIZE - 1);
+		k = tar_bulk_read(t, buf, padded);
+		if (k != (ssize_t)padded)
 		{
 			if (k != -1)
 				errno = EINVAL;
@@ -256,19 +290,15 @@ tar_extract_regfile(TAR *t, const char *realname, const int *progress_fd)
 			return -1;
 		}
 
-		/* write block to output file */
-		if (write(fdout, buf,
-			  ((i > T_BLOCKSIZE) ? T_BLOCKSIZE : i)) == -1)
+		/* write data to output file */
+		if (write_file_chunk(fdout, buf, chunk) == -1)
 		{
 			close(fdout);
 			return -1;
 		}
-		else
-		{
-			if (*progress_fd != 0)
-				write(*progress_fd, &progress_size, sizeof(progress_size));
-		}
+		tar_progress_add(progress, padded, 0);
 	}
+	tar_progress_add(progress, 0, 1);
 
 	/* close output file */
 	if (close(fdout) == -1)
@@ -288,7 +318,9 @@ tar_skip_regfile(TAR *t)
 {
 	int64_t size, i;
 	ssize_t k;
-	char buf[T_BLOCKSIZE];
+	size_t bufsize, chunk;
+	char block[T_BLOCKSIZE];
+	char *buf;
 
 	if (!TH_ISREG(t))
 	{
@@ -297,10 +329,21 @@ tar_skip_regfile(TAR *t)
 	}
 
 	size = th_get_size(t);
-	for (i = size; i > 0; i -= T_BLOCKSIZE)
+	buf = (size > T_BLOCKSIZE ? tar_bulk_buffer(t) : NULL);
+	if (buf != NULL)
+		bufsize = T_BULKSIZE;
+	else
 	{
-		k = tar_block_read(t, buf);
-		if (k != T_BLOCKSIZE)
+		buf = block;
+		bufsize = T_BLOCKSIZE;
+	}
+
+	for (i = size; i > 0; i -= chunk)
+	{
+		chunk = (i > (int64_t)bufsize ? bufsize : (size_t)i);
+		chunk = (chunk + T_BLOCKSIZE - 1) & ~((size_t)T_BLOCKSIZE - 1);
+		k = tar_bulk_read(t, buf, chunk);
+		if (k != (ssize_t)chunk)
 		{
 			if (k != -1)
 				errno = EINVAL;
@@ -114,9 +114,12 @@ tar_fd(TAR *t)
 int
 tar_close(TAR *t)
 {
-	int i;
+	int i, j;
 
+	j = tar_flush(t);
 	i = (*(t->type->closefunc))(t->fd);
+	if (j != 0)
+		i = -1;
 
 	if (t->h != NULL)
 		libtar_hash_free(t->h, ((t->oflags & O_ACCMODE) == O_RDONLY
@@ -124,6 +127,10 @@ tar_close(TAR *t)
 					: (libtar_freefunc_t)tar_dev_free));
 	if (t->th_pathname != NULL)
 		free(t->th_pathname);
+	if (t->bulk_buf != NULL)
+		free(t->bulk_buf);
+	if (t->wbuf != NULL)
+		free(t->wbuf);
 	free(t);
 
 	return i;
@@ -13,6 +13,7 @@
 #ifndef LIBTAR_H
 #define LIBTAR_H
 
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <linux/capability.h>
@@ -33,6 +34,7 @@ extern "C"
 /* useful constants */
 /* see FIXME note in block.c regarding T_BLOCKSIZE */
 #define T_BLOCKSIZE		512
+#define T_BULKSIZE		(1024 * 1024)	/* regular file data chunk, multiple of T_BLOCKSIZE */
 #define T_NAMELEN		100
 #define T_PREFIXLEN		155
 #define T_MAXPATHLEN		(T_NAMELEN + T_PREFIXLEN)
@@ -85,6 +87,7 @@ typedef int (*openfunc_t)(const char *, int, ...);
 typedef int (*closefunc_t)(int);
 typedef ssize_t (*readfunc_t)(int, void *, size_t);
 typedef ssize_t (*writefunc_t)(int, const void *, size_t);
+typedef ssize_t (*filterfunc_t)(void *, const void *, size_t);
 
 typedef struct
 {
@@ -107,6 +110,21 @@ typedef struct
 
 	/* introduced in libtar 1.2.21 */
 	char *th_pathname;
+
+	/* aligned T_BULKSIZE buffer for regular file data, allocated on demand */
+	char *bulk_buf;
+
+	/* optional output buffer, see tar_set_write_buffer() */
+	char *wbuf;
+	size_t wbuf_size;
+	size_t wbuf_len;
+
+	/* optional output filter, see tar_set_output_filter() */
+	filterfunc_t filterfunc;
+	void *filter_cookie;
+
+	/* bytes written to the archive so far, buffered or not */
+	unsigned long long write_offset;
 }
 TAR;
 
@@ -141,9 +159,24 @@ int tar_fdopen(TAR **t, int fd, const char *pathname, tartype_t *type,
 /* returns the descriptor associated with t */
 int tar_fd(TAR *t);
 
-/* close tarfile handle */
+/* close tarfile handle, flushing any buffered output first */
 int tar_close(TAR *t);
 
+/* Buffers output of t in memory and hands it to the writefunc in size
+ * byte chunks (size must be a multiple of T_BLOCKSIZE, 0 disables it).
+ * The buffer belongs to t, so separate handles can be used by separate
+ * threads.
+ */
+int tar_set_write_buffer(TAR *t, size_t size);
+
+/* write out anything held in the output buffer of t */
+int tar_flush(TAR *t);
+
+/* Sends output of t to func(cookie, ...) instead of the writefunc, e.g.
+ * an in-process compressor. The descriptor is still closed by tar_close().
+ */
+void tar_set_output_filter(TAR *t, filterfunc_t func, void *cookie);
+
 
 /***** append.c ************************************************************/
 
@@ -161,6 +194,35 @@ void tar_dev_free(struct tar_dev *tdp);
  */
 int tar_append_file(TAR *t, const char *realname, const char *savename);
 
+/* flags for the user_xattrs field of tar_meta_t */
+#define TAR_XATTR_USER_DEFAULT		1	/* user.default */
+#define TAR_XATTR_USER_CACHE		2	/* user.inode_cache */
+#define TAR_XATTR_USER_CODE_CACHE	4	/* user.inode_code_cache */
+
+/* metadata of a file that was read ahead of appending it */
+typedef struct
+{
+	struct stat st;
+	const char *selinux_context;		/* NULL if it has none */
+	const struct vfs_cap_data *cap_data;	/* NULL if it has none */
+	int user_xattrs;			/* TAR_XATTR_USER_* set on a directory */
+}
+tar_meta_t;
+
+/* Same as tar_append_file(), but takes the stat data, selinux context
+ * and xattrs from meta instead of reading them from realname again.
+ */
+int tar_append_file_meta(TAR *t, const char *realname, const char *savename,
+			 const tar_meta_t *meta);
+
+/* Hands the table of files already appended, used to store later names of
+ * the same inode as hard links, from one archive to the next of a split
+ * backup. tar_detach_hardlinks() leaves t without one, tar_attach_hardlinks()
+ * replaces the table of t.
+ */
+libtar_hash_t *tar_detach_hardlinks(TAR *t);
+void tar_attach_hardlinks(TAR *t, libtar_hash_t *h);
+
 /* write EOF indicator */
 int tar_append_eof(TAR *t);
 
@@ -185,14 +247,21 @@ int tar_append_buffer(TAR *t, void *buf, size_t len);
 
 /* macros for reading/writing tarchive blocks */
 #define tar_block_read(t, buf) \
-	(*((t)->type->readfunc))((t)->fd, (char *)(buf), T_BLOCKSIZE)
+	tar_bulk_read((t), (buf), T_BLOCKSIZE)
 #define tar_block_write(t, buf) \
-	(*((t)->type->writefunc))((t)->fd, (char *)(buf), T_BLOCKSIZE)
+	tar_bulk_write((t), (buf), T_BLOCKSIZE)
 
 /* read/write a header block */
 int th_read(TAR *t);
 int th_write(TAR *t);
 
+/* read/write len bytes of data, len must be a multiple of T_BLOCKSIZE */
+ssize_t tar_bulk_read(TAR *t, void *buf, size_t len);
+ssize_t tar_bulk_write(TAR *t, const void *buf, size_t len);
+
+/* returns the T_BULKSIZE data buffer of t, or NULL if it can't be allocated */
+char *tar_bulk_buffer(TAR *t);
+
 
 /***** decode.c ************************************************************/
 
@@ -260,8 +329,25 @@ void th_finish(TAR *t);
 
 /***** extract.c ***********************************************************/
 
+/* progress counters, may live in memory shared with another process */
+typedef struct
+{
+	uint64_t bytes;		/* archive data processed */
+	uint64_t files;		/* regular files processed */
+}
+tar_progress_t;
+
+/* add to the progress counters (p may be NULL) */
+#define tar_progress_add(p, nbytes, nfiles) \
+	do { \
+		if ((p) != NULL) { \
+			__atomic_fetch_add(&(p)->bytes, (uint64_t)(nbytes), __ATOMIC_RELAXED); \
+			__atomic_fetch_add(&(p)->files, (uint64_t)(nfiles), __ATOMIC_RELAXED); \
+		} \
+	} while (0)
+
 /* sequentially extract next file from t */
-int tar_extract_file(TAR *t, const char *realname, const char *prefix, const int *progress_fd);
+int tar_extract_file(TAR *t, const char *realname, const char *prefix, tar_progress_t *progress);
 
 /* extract different file types */
 int tar_extract_dir(TAR *t, const char *realname);
@@ -272,7 +358,7 @@ int tar_extract_blockdev(TAR *t, const char *realname);
 int tar_extract_fifo(TAR *t, const char *realname);
 
 /* for regfiles, we need to extract the content blocks as well */
-int tar_extract_regfile(TAR *t, const char *realname, const int *progress_fd);
+int tar_extract_regfile(TAR *t, const char *realname, tar_progress_t *progress);
 int tar_skip_regfile(TAR *t);
 
 /* extract regfile to buffer */
@@ -336,7 +422,7 @@ void print_caps(struct vfs_cap_data *cap_data);
 
 /* extract groups of files */
 int tar_extract_glob(TAR *t, char *globname, char *prefix);
-int tar_extract_all(TAR *t, char *prefix, const int *progress_fd);
+int tar_extract_all(TAR *t, char *prefix, tar_progress_t *progress);
 
 /* add a whole tree of files */
 int tar_append_tree(TAR *t, char *realdir, char *savedir);
@@ -28,7 +28,7 @@ tar_extract_glob(TAR *t, char *globname, char *prefix)
 {
 	char *filename;
 	char buf[MAXPATHLEN];
-	int i, fd = 0;
+	int i;
 
 	while ((i = th_read(t)) == 0)
 	{
@@ -45,7 +45,7 @@ tar_extract_glob(TAR *t, char *globname, char *prefix)
 			snprintf(buf, sizeof(buf), "%s/%s", prefix, filename);
 		else
 			strlcpy(buf, filename, sizeof(buf));
-		if (tar_extract_file(t, buf, prefix, &fd) != 0)
+		if (tar_extract_file(t, buf, prefix, NULL) != 0)
 			return -1;
 	}
 
@@ -54,7 +54,7 @@ tar_extract_glob(TAR *t, char *globname, char *prefix)
 
 
 int
-tar_extract_all(TAR *t, char *prefix, const int *progress_fd)
+tar_extract_all(TAR *t, char *prefix, tar_progress_t *progress)
 {
 	char *filename;
 	char buf[MAXPATHLEN];
@@ -81,7 +81,7 @@ tar_extract_all(TAR *t, char *prefix, const int *progress_fd)
 		printf("    tar_extract_all(): calling tar_extract_file(t, "
 		       "\"%s\")\n", buf);
 #endif
-		if (tar_extract_file(t, buf, prefix, progress_fd) != 0)
+		if (tar_extract_file(t, buf, prefix, progress) != 0)
 			return -1;
 	}
 
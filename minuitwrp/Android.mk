@@ -5,6 +5,7 @@ include $(CLEAR_VARS)
 LOCAL_SRC_FILES := \
     graphics.cpp \
     graphics_fbdev.cpp \
+    graphics_pixel.cpp \
     resources.cpp \
     truetype.cpp \
     graphics_utils.cpp \
@@ -223,3 +224,13 @@ LOCAL_MODULE_TAGS := eng
 LOCAL_MODULE := libminuitwrp
 
 include $(BUILD_SHARED_LIBRARY)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := \
+    graphics_pixel.cpp \
+    pixel_benchmark.cpp
+LOCAL_CFLAGS := -Werror
+LOCAL_CLANG := true
+LOCAL_MODULE_HOST_OS := linux
+LOCAL_MODULE := minuitwrp_pixel_benchmark
+include $(BUILD_HOST_EXECUTABLE)
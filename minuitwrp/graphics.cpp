@@ -35,6 +35,7 @@
 #include "../gui/placement.h"
 #include "minui.h"
 #include "graphics.h"
+#include "graphics_pixel.h"
 // For std::min and std::max
 #include <algorithm>
 
@@ -59,6 +60,8 @@ GRSurface* gr_draw = NULL;
 static GGLContext *gr_context = 0;
 GGLSurface gr_mem_surface;
 static int gr_is_curr_clr_opaque = 0;
+// Current color as pixelflinger writes it into an RGBA ordered surface
+static uint32_t gr_current_pixel = 0xffffffff;
 
 int gr_textEx_scaleW(int x, int y, const char *s, void* pFont, int max_width, int placement, int scale)
 {
@@ -110,31 +113,92 @@ int gr_textEx_scaleW(int x, int y, const char *s, void* pFont, int max_width, in
     return gr_ttf_textExWH(gl, x, y + y_scale, s, vfont, measured_width + x, -1, gr_draw);
 }
 
-void gr_clip(int x, int y, int w, int h)
+// Area all drawing is limited to while a partial redraw is in progress
+static bool gr_damage_active = false;
+static int gr_damage_x, gr_damage_y, gr_damage_w, gr_damage_h;
+
+// Scissor area in display coordinates, mirrored for the pixel kernels
+static bool gr_scissor_enabled = false;
+static int gr_scissor_l, gr_scissor_t, gr_scissor_r, gr_scissor_b;
+
+static void gr_scissor(int x, int y, int w, int h)
 {
     GGLContext *gl = gr_context;
+    int l_disp, t_disp, w_disp, h_disp;
 
 #if TW_ROTATION == 0
-    gl->scissor(gl, x, y, w, h);
+    l_disp = x;
+    t_disp = y;
+    w_disp = w;
+    h_disp = h;
 #elif TW_ROTATION == 90
-    gl->scissor(gl, gr_draw->width - y - h, x, h, w);
+    l_disp = gr_draw->width - y - h;
+    t_disp = x;
+    w_disp = h;
+    h_disp = w;
 #elif TW_ROTATION == 270
-    gl->scissor(gl, y, gr_draw->height - x - w, h, w);
+    l_disp = y;
+    t_disp = gr_draw->height - x - w;
+    w_disp = h;
+    h_disp = w;
 #else
-    int t_disp = gr_draw->height - y - h;
-    int l_disp = gr_draw->width - x - w;
-    gl->scissor(gl, l_disp, t_disp, w, h);
+    l_disp = gr_draw->width - x - w;
+    t_disp = gr_draw->height - y - h;
+    w_disp = w;
+    h_disp = h;
 #endif
+    gl->scissor(gl, l_disp, t_disp, w_disp, h_disp);
     gl->enable(gl, GGL_SCISSOR_TEST);
+
+    gr_scissor_enabled = true;
+    gr_scissor_l = l_disp;
+    gr_scissor_t = t_disp;
+    gr_scissor_r = l_disp + w_disp;
+    gr_scissor_b = t_disp + h_disp;
+}
+
+void gr_clip(int x, int y, int w, int h)
+{
+    if (gr_damage_active) {
+        int right = std::min(x + w, gr_damage_x + gr_damage_w);
+        int bottom = std::min(y + h, gr_damage_y + gr_damage_h);
+        x = std::max(x, gr_damage_x);
+        y = std::max(y, gr_damage_y);
+        w = std::max(right - x, 0);
+        h = std::max(bottom - y, 0);
+    }
+    gr_scissor(x, y, w, h);
 }
 
 void gr_noclip()
 {
+    if (gr_damage_active) {
+        gr_scissor(gr_damage_x, gr_damage_y, gr_damage_w, gr_damage_h);
+        return;
+    }
+
     GGLContext *gl = gr_context;
     gl->scissor(gl, 0, 0,
                 gr_draw->width - 2 * overscan_offset_x,
                 gr_draw->height - 2 * overscan_offset_y);
     gl->disable(gl, GGL_SCISSOR_TEST);
+    gr_scissor_enabled = false;
+}
+
+void gr_clip_damage(int x, int y, int w, int h)
+{
+    gr_damage_active = true;
+    gr_damage_x = x;
+    gr_damage_y = y;
+    gr_damage_w = std::max(w, 0);
+    gr_damage_h = std::max(h, 0);
+    gr_scissor(gr_damage_x, gr_damage_y, gr_damage_w, gr_damage_h);
+}
+
+void gr_noclip_damage()
+{
+    gr_damage_active = false;
+    gr_noclip();
 }
 
 void gr_line(int x0, int y0, int x1, int y1, int width)
@@ -210,6 +274,11 @@ void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a
     gl->color4xv(gl, color);
 
     gr_is_curr_clr_opaque = (a == 255);
+#if defined(RECOVERY_ABGR) || defined(RECOVERY_BGRA)
+    gr_current_pixel = b | (g << 8) | (r << 16) | ((uint32_t)a << 24);
+#else
+    gr_current_pixel = r | (g << 8) | (b << 16) | ((uint32_t)a << 24);
+#endif
 }
 
 void gr_clear()
@@ -236,15 +305,45 @@ void gr_clear()
     }
 }
 
+// The pixel kernels handle 32 bpp surfaces with R and B in either order;
+// everything else goes through pixelflinger.
+static bool gr_pixel_kernels_usable()
+{
+    if (gr_draw->pixel_bytes != 4)
+        return false;
+    return gr_draw->format == GGL_PIXEL_FORMAT_RGBA_8888 ||
+           gr_draw->format == GGL_PIXEL_FORMAT_RGBX_8888 ||
+           gr_draw->format == GGL_PIXEL_FORMAT_BGRA_8888;
+}
+
+// Clips a rectangle in display coordinates to the drawing surface and the
+// scissor area. Returns false if nothing is left.
+static bool gr_clip_disp(int* l_disp, int* t_disp, int* r_disp, int* b_disp)
+{
+    *l_disp = std::max(*l_disp, 0);
+    *t_disp = std::max(*t_disp, 0);
+    *r_disp = std::min(*r_disp, gr_draw->width);
+    *b_disp = std::min(*b_disp, gr_draw->height);
+    if (gr_scissor_enabled) {
+        *l_disp = std::max(*l_disp, gr_scissor_l);
+        *t_disp = std::max(*t_disp, gr_scissor_t);
+        *r_disp = std::min(*r_disp, gr_scissor_r);
+        *b_disp = std::min(*b_disp, gr_scissor_b);
+    }
+    return *l_disp < *r_disp && *t_disp < *b_disp;
+}
+
+static inline uint32_t* gr_draw_pixel(int x_disp, int y_disp)
+{
+    return reinterpret_cast<uint32_t*>(gr_draw->data + y_disp * gr_draw->row_bytes) + x_disp;
+}
+
 void gr_fill(int x, int y, int w, int h)
 {
     GGLContext *gl = gr_context;
     int x0_disp, y0_disp, x1_disp, y1_disp;
     int l_disp, r_disp, t_disp, b_disp;
 
-    if(gr_is_curr_clr_opaque)
-        gl->disable(gl, GGL_BLEND);
-
     x0_disp = ROTATION_X_DISP(x, y, gr_draw);
     y0_disp = ROTATION_Y_DISP(x, y, gr_draw);
     x1_disp = ROTATION_X_DISP(x + w, y + h, gr_draw);
@@ -254,12 +353,63 @@ void gr_fill(int x, int y, int w, int h)
     t_disp = std::min(y0_disp, y1_disp);
     b_disp = std::max(y0_disp, y1_disp);
 
+    // Opaque fills don't blend, so they are plain stores
+    if (gr_is_curr_clr_opaque && gr_pixel_kernels_usable()) {
+        if (!gr_clip_disp(&l_disp, &t_disp, &r_disp, &b_disp))
+            return;
+        uint32_t pixel = gr_current_pixel;
+        if (gr_draw->format == GGL_PIXEL_FORMAT_BGRA_8888)
+            pixel = (pixel & 0xff00ff00) | ((pixel >> 16) & 0xff) | ((pixel & 0xff) << 16);
+        const gr_pixel_ops* ops = gr_pixel_get_ops();
+        for (int row = t_disp; row < b_disp; ++row)
+            ops->fill(gr_draw_pixel(l_disp, row), pixel, r_disp - l_disp);
+        return;
+    }
+
+    if(gr_is_curr_clr_opaque)
+        gl->disable(gl, GGL_BLEND);
+
     gl->recti(gl, l_disp, t_disp, r_disp, b_disp);
 
     if(gr_is_curr_clr_opaque)
         gl->enable(gl, GGL_BLEND);
 }
 
+// Copies an opaque RGBX texture without going through pixelflinger. The
+// texel for display pixel x,y is (x - l_disp + sx, y - t_disp + sy), like
+// with GGL_ONE_TO_ONE texture coordinates. Returns false if the caller has
+// to draw it with pixelflinger instead.
+static bool gr_blit_opaque(GGLSurface* texture, int sx, int sy,
+                           int l_disp, int t_disp, int r_disp, int b_disp)
+{
+    if (texture->format != GGL_PIXEL_FORMAT_RGBX_8888 || !gr_pixel_kernels_usable())
+        return false;
+
+    int cl = l_disp, ct = t_disp, cr = r_disp, cb = b_disp;
+    if (!gr_clip_disp(&cl, &ct, &cr, &cb))
+        return true;
+
+    // Anything that would wrap around the texture is left to pixelflinger
+    int src_x = cl - l_disp + sx;
+    int src_y = ct - t_disp + sy;
+    if (src_x < 0 || src_y < 0 ||
+        src_x + (cr - cl) > (int)texture->width ||
+        src_y + (cb - ct) > (int)texture->height)
+        return false;
+
+    const gr_pixel_ops* ops = gr_pixel_get_ops();
+    bool swap = gr_draw->format == GGL_PIXEL_FORMAT_BGRA_8888;
+    const uint32_t* src = reinterpret_cast<const uint32_t*>(texture->data) +
+                          src_y * texture->stride + src_x;
+    for (int row = ct; row < cb; ++row, src += texture->stride) {
+        if (swap)
+            ops->blit_opaque_swizzle(gr_draw_pixel(cl, row), src, cr - cl);
+        else
+            ops->blit_opaque(gr_draw_pixel(cl, row), src, cr - cl);
+    }
+    return true;
+}
+
 void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy)
 {
     if (gr_context == NULL) {
@@ -300,17 +450,20 @@ void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy)
     surface_rotated.data    = (GGLubyte*) malloc(surface_rotated.stride * surface_rotated.height * 4);
     surface_ROTATION_transform((gr_surface) &surface_rotated, (const gr_surface) surface, 4);
 
-    gl->bindTexture(gl, &surface_rotated);
+    GGLSurface *texture = &surface_rotated;
 #else
-    gl->bindTexture(gl, surface);
+    GGLSurface *texture = surface;
 #endif
-    gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
-    gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-    gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-    gl->enable(gl, GGL_TEXTURE_2D);
-    gl->texCoord2i(gl, sx - l_disp, sy - t_disp);
-    gl->recti(gl, l_disp, t_disp, r_disp, b_disp);
-    gl->disable(gl, GGL_TEXTURE_2D);
+    if (!gr_blit_opaque(texture, sx, sy, l_disp, t_disp, r_disp, b_disp)) {
+        gl->bindTexture(gl, texture);
+        gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
+        gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
+        gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
+        gl->enable(gl, GGL_TEXTURE_2D);
+        gl->texCoord2i(gl, sx - l_disp, sy - t_disp);
+        gl->recti(gl, l_disp, t_disp, r_disp, b_disp);
+        gl->disable(gl, GGL_TEXTURE_2D);
+    }
 
 #if TW_ROTATION != 0
     free(surface_rotated.data);
@@ -342,6 +495,34 @@ void gr_flip() {
     gr_context->colorBuffer(gr_context, &gr_mem_surface);
 }
 
+bool gr_flip_region_supported()
+{
+    return gr_backend->flip_region != NULL;
+}
+
+void gr_flip_region(int x, int y, int w, int h)
+{
+    if (!gr_backend->flip_region) {
+        gr_flip();
+        return;
+    }
+
+    int x0_disp = ROTATION_X_DISP(x, y, gr_draw);
+    int y0_disp = ROTATION_Y_DISP(x, y, gr_draw);
+    int x1_disp = ROTATION_X_DISP(x + w, y + h, gr_draw);
+    int y1_disp = ROTATION_Y_DISP(x + w, y + h, gr_draw);
+    int l_disp = std::max(std::min(x0_disp, x1_disp), 0);
+    int r_disp = std::min(std::max(x0_disp, x1_disp), gr_draw->width);
+    int t_disp = std::max(std::min(y0_disp, y1_disp), 0);
+    int b_disp = std::min(std::max(y0_disp, y1_disp), gr_draw->height);
+
+    gr_draw = gr_backend->flip_region(gr_backend, l_disp, t_disp,
+                                      std::max(r_disp - l_disp, 0),
+                                      std::max(b_disp - t_disp, 0));
+    gr_mem_surface.data = (GGLubyte*)gr_draw->data;
+    gr_context->colorBuffer(gr_context, &gr_mem_surface);
+}
+
 static void get_memory_surface(GGLSurface* ms) {
     ms->version = sizeof(*ms);
     ms->width = gr_draw->width;
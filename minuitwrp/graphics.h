@@ -17,6 +17,8 @@
 #ifndef _GRAPHICS_H_
 #define _GRAPHICS_H_
 
+#include <string.h>
+
 #include "minui.h"
 
 // TODO: lose the function pointers.
@@ -34,8 +36,42 @@ struct minui_backend {
 
     // Device cleanup when drawing is done.
     void (*exit)(minui_backend*);
+
+    // Like flip(), but only the given area (in display coordinates) of
+    // the drawing surface changed since the previous flip. Backends that
+    // do not preserve the drawing surface between frames leave this NULL.
+    GRSurface* (*flip_region)(minui_backend*, int x, int y, int w, int h);
 };
 
+// Grows the area x,y,w,h so that it also covers x2,y2,w2,h2.
+static inline void gr_region_union(int* x, int* y, int* w, int* h,
+                                   int x2, int y2, int w2, int h2) {
+    if (w2 <= 0 || h2 <= 0) return;
+    if (*w <= 0 || *h <= 0) {
+        *x = x2; *y = y2; *w = w2; *h = h2;
+        return;
+    }
+    int right = (*x + *w > x2 + w2) ? *x + *w : x2 + w2;
+    int bottom = (*y + *h > y2 + h2) ? *y + *h : y2 + h2;
+    if (x2 < *x) *x = x2;
+    if (y2 < *y) *y = y2;
+    *w = right - *x;
+    *h = bottom - *y;
+}
+
+// Copies the area x,y,w,h of the surface src into dst, which has the
+// same geometry.
+static inline void gr_region_copy(unsigned char* dst, const GRSurface* src,
+                                  int x, int y, int w, int h) {
+    size_t offset = y * src->row_bytes + x * src->pixel_bytes;
+    if (x == 0 && w == src->width) {
+        memcpy(dst + offset, src->data + offset, h * src->row_bytes);
+        return;
+    }
+    for (int row = 0; row < h; ++row, offset += src->row_bytes)
+        memcpy(dst + offset, src->data + offset, w * src->pixel_bytes);
+}
+
 minui_backend* open_fbdev();
 minui_backend* open_adf();
 minui_backend* open_drm();
@@ -44,6 +44,10 @@ static drm_surface *drm_surfaces[2];
 static int current_buffer;
 static GRSurface *draw_buf = NULL;
 
+// Area of the next buffer to be flipped that is older than draw_buf, see
+// drm_flip_region().
+static int stale_x, stale_y, stale_w, stale_h;
+
 static drmModeCrtc *main_monitor_crtc;
 static drmModeConnector *main_monitor_connector;
 
@@ -474,6 +478,10 @@ static GRSurface* drm_init(minui_backend* backend __unused) {
     }
 
     current_buffer = 0;
+    stale_x = 0;
+    stale_y = 0;
+    stale_w = draw_buf->width;
+    stale_h = draw_buf->height;
 
     drm_enable_crtc(drm_fd, main_monitor_crtc, drm_surfaces[1]);
 
@@ -493,6 +501,35 @@ static GRSurface* drm_flip(minui_backend* backend __unused) {
         return NULL;
     }
     current_buffer = 1 - current_buffer;
+    stale_x = 0;
+    stale_y = 0;
+    stale_w = draw_buf->width;
+    stale_h = draw_buf->height;
+    return draw_buf;
+}
+
+static GRSurface* drm_flip_region(minui_backend* backend __unused,
+                                  int x, int y, int w, int h) {
+    int ret;
+    // The buffer about to be shown still holds the frame before the
+    // one on screen, so the previous damage has to be copied as well.
+    int copy_x = x, copy_y = y, copy_w = w, copy_h = h;
+    gr_region_union(&copy_x, &copy_y, &copy_w, &copy_h,
+                    stale_x, stale_y, stale_w, stale_h);
+    gr_region_copy(drm_surfaces[current_buffer]->base.data, draw_buf,
+                   copy_x, copy_y, copy_w, copy_h);
+
+    ret = drmModePageFlip(drm_fd, main_monitor_crtc->crtc_id,
+                          drm_surfaces[current_buffer]->fb_id, 0, NULL);
+    if (ret < 0) {
+        printf("drmModePageFlip failed ret=%d\n", ret);
+        return NULL;
+    }
+    current_buffer = 1 - current_buffer;
+    stale_x = x;
+    stale_y = y;
+    stale_w = w;
+    stale_h = h;
     return draw_buf;
 }
 
@@ -511,6 +548,7 @@ static minui_backend drm_backend = {
     .flip = drm_flip,
     .blank = drm_blank,
     .exit = drm_exit,
+    .flip_region = drm_flip_region,
 };
 
 minui_backend* open_drm() {
@@ -32,10 +32,12 @@
 
 #include "minui.h"
 #include "graphics.h"
+#include "graphics_pixel.h"
 #include <pixelflinger/pixelflinger.h>
 
 static GRSurface* fbdev_init(minui_backend*);
 static GRSurface* fbdev_flip(minui_backend*);
+static GRSurface* fbdev_flip_region(minui_backend*, int, int, int, int);
 static void fbdev_blank(minui_backend*, bool);
 static void fbdev_exit(minui_backend*);
 
@@ -44,6 +46,11 @@ static bool double_buffered;
 static GRSurface* gr_draw = NULL;
 static int displayed_buffer;
 
+// Area of the back buffer that is older than the drawing surface. The
+// back buffer still holds the frame before the one just displayed, so
+// that frame's damage has to be copied again on the next partial flip.
+static int stale_x, stale_y, stale_w, stale_h;
+
 static fb_var_screeninfo vi;
 static int fb_fd = -1;
 static __u32 smem_len;
@@ -53,6 +60,7 @@ static minui_backend my_backend = {
     .flip = fbdev_flip,
     .blank = fbdev_blank,
     .exit = fbdev_exit,
+    .flip_region = fbdev_flip_region,
 };
 
 minui_backend* open_fbdev() {
@@ -279,29 +287,64 @@ static GRSurface* fbdev_init(minui_backend* backend) {
 
     smem_len = fi.smem_len;
 
+    stale_x = 0;
+    stale_y = 0;
+    stale_w = gr_draw->width;
+    stale_h = gr_draw->height;
+
     return gr_draw;
 }
 
-static GRSurface* fbdev_flip(minui_backend* backend __unused) {
+// Copies the area x,y,w,h of the drawing surface into the framebuffer fb.
+static void copy_to_framebuffer(GRSurface* fb, int x, int y, int w, int h) {
 #if defined(RECOVERY_BGRA)
-    // In case of BGRA, do some byte swapping
-    unsigned char* ucfb_vaddr = (unsigned char*)gr_draw->data;
-    for (int idx = 0 ; idx < (gr_draw->height * gr_draw->row_bytes);
-            idx += 4) {
-        unsigned char tmp = ucfb_vaddr[idx];
-        ucfb_vaddr[idx    ] = ucfb_vaddr[idx + 2];
-        ucfb_vaddr[idx + 2] = tmp;
+    // In case of BGRA, swap R and B on the way out so that the drawing
+    // surface stays valid for partial redraws.
+    const gr_pixel_ops* ops = gr_pixel_get_ops();
+    size_t offset = y * gr_draw->row_bytes + x * gr_draw->pixel_bytes;
+    for (int row = 0; row < h; ++row, offset += gr_draw->row_bytes) {
+        ops->swizzle_copy(reinterpret_cast<uint32_t*>(fb->data + offset),
+                          reinterpret_cast<const uint32_t*>(gr_draw->data + offset), w);
     }
+#else
+    gr_region_copy(fb->data, gr_draw, x, y, w, h);
 #endif
+}
+
+static GRSurface* fbdev_flip(minui_backend* backend __unused) {
     if (double_buffered) {
         // Copy from the in-memory surface to the framebuffer.
-        memcpy(gr_framebuffer[1-displayed_buffer].data, gr_draw->data,
-               gr_draw->height * gr_draw->row_bytes);
+        copy_to_framebuffer(gr_framebuffer + 1 - displayed_buffer,
+                            0, 0, gr_draw->width, gr_draw->height);
         set_displayed_framebuffer(1-displayed_buffer);
+        stale_x = 0;
+        stale_y = 0;
+        stale_w = gr_draw->width;
+        stale_h = gr_draw->height;
     } else {
         // Copy from the in-memory surface to the framebuffer.
-        memcpy(gr_framebuffer[0].data, gr_draw->data,
-               gr_draw->height * gr_draw->row_bytes);
+        copy_to_framebuffer(gr_framebuffer, 0, 0, gr_draw->width, gr_draw->height);
+    }
+    return gr_draw;
+}
+
+static GRSurface* fbdev_flip_region(minui_backend* backend __unused,
+                                    int x, int y, int w, int h) {
+    if (double_buffered) {
+        // Copy the damaged area plus whatever the back buffer missed
+        // while the previous frame was being displayed.
+        int copy_x = x, copy_y = y, copy_w = w, copy_h = h;
+        gr_region_union(&copy_x, &copy_y, &copy_w, &copy_h,
+                        stale_x, stale_y, stale_w, stale_h);
+        copy_to_framebuffer(gr_framebuffer + 1 - displayed_buffer,
+                            copy_x, copy_y, copy_w, copy_h);
+        set_displayed_framebuffer(1-displayed_buffer);
+        stale_x = x;
+        stale_y = y;
+        stale_w = w;
+        stale_h = h;
+    } else {
+        copy_to_framebuffer(gr_framebuffer, x, y, w, h);
     }
     return gr_draw;
 }
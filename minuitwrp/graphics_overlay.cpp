@@ -38,6 +38,7 @@
 
 #include "minui.h"
 #include "graphics.h"
+#include "graphics_pixel.h"
 #include <pixelflinger/pixelflinger.h>
 
 #define MDP_V4_0 400
@@ -423,6 +424,18 @@ int allocate_overlay(int fd, GRSurface gr_fb)
     return 0;
 }
 
+// Copies a frame into the overlay buffer. For BGRA, R and B are swapped on
+// the way, leaving the drawing surface as it was drawn.
+static void copy_frame(void* dst, const void* src, size_t size)
+{
+#if defined(RECOVERY_BGRA)
+    gr_pixel_get_ops()->swizzle_copy(reinterpret_cast<uint32_t*>(dst),
+                                     reinterpret_cast<const uint32_t*>(src), size / 4);
+#else
+    memcpy(dst, src, size);
+#endif
+}
+
 int overlay_display_frame(int fd, void* data, size_t size)
 {
     int ret = 0;
@@ -435,7 +448,7 @@ int overlay_display_frame(int fd, void* data, size_t size)
             return -EINVAL;
         }
 
-        memcpy(mem_info.mem_buf, data, size);
+        copy_frame(mem_info.mem_buf, data, size);
 
         memset(&ovdataL, 0, sizeof(struct msmfb_overlay_data));
 
@@ -456,7 +469,7 @@ int overlay_display_frame(int fd, void* data, size_t size)
             return -EINVAL;
         }
 
-        memcpy(mem_info.mem_buf, data, size);
+        copy_frame(mem_info.mem_buf, data, size);
 
         memset(&ovdataL, 0, sizeof(struct msmfb_overlay_data));
 
@@ -498,16 +511,6 @@ int overlay_display_frame(int fd, void* data, size_t size)
 }
 
 static GRSurface* overlay_flip(minui_backend* backend __unused) {
-#if defined(RECOVERY_BGRA)
-    // In case of BGRA, do some byte swapping
-    unsigned char* ucfb_vaddr = (unsigned char*)gr_draw->data;
-    for (int idx = 0 ; idx < (gr_draw->height * gr_draw->row_bytes);
-            idx += 4) {
-        unsigned char tmp = ucfb_vaddr[idx];
-        ucfb_vaddr[idx    ] = ucfb_vaddr[idx + 2];
-        ucfb_vaddr[idx + 2] = tmp;
-    }
-#endif
     // Copy from the in-memory surface to the framebuffer.
     overlay_display_frame(fb_fd, gr_draw->data, frame_size);
     return gr_draw;
@@ -0,0 +1,275 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define GR_PIXEL_NEON 1
+#include <arm_neon.h>
+#if !defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#elif defined(__SSE2__)
+#define GR_PIXEL_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#include "graphics_pixel.h"
+
+#define ALPHA_MASK 0xff000000u
+
+static inline uint32_t swap_rb(uint32_t p) {
+    return (p & 0xff00ff00u) | ((p >> 16) & 0xffu) | ((p & 0xffu) << 16);
+}
+
+static void scalar_swizzle(uint32_t* px, size_t count) {
+    for (size_t i = 0; i < count; ++i)
+        px[i] = swap_rb(px[i]);
+}
+
+static void scalar_swizzle_copy(uint32_t* dst, const uint32_t* src, size_t count) {
+    for (size_t i = 0; i < count; ++i)
+        dst[i] = swap_rb(src[i]);
+}
+
+static void scalar_blit_opaque(uint32_t* dst, const uint32_t* src, size_t count) {
+    for (size_t i = 0; i < count; ++i)
+        dst[i] = src[i] | ALPHA_MASK;
+}
+
+static void scalar_blit_opaque_swizzle(uint32_t* dst, const uint32_t* src, size_t count) {
+    for (size_t i = 0; i < count; ++i)
+        dst[i] = swap_rb(src[i]) | ALPHA_MASK;
+}
+
+static void scalar_fill(uint32_t* dst, uint32_t value, size_t count) {
+    for (size_t i = 0; i < count; ++i)
+        dst[i] = value;
+}
+
+static const gr_pixel_ops scalar_ops = {
+    .name = "scalar",
+    .swizzle = scalar_swizzle,
+    .swizzle_copy = scalar_swizzle_copy,
+    .blit_opaque = scalar_blit_opaque,
+    .blit_opaque_swizzle = scalar_blit_opaque_swizzle,
+    .fill = scalar_fill,
+};
+
+#if defined(GR_PIXEL_NEON)
+// vld4q_u8 splits 16 pixels into one register per byte, so swapping R
+// and B is just a matter of storing the registers in a different order.
+
+static void neon_swizzle(uint32_t* px, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        uint8x16x4_t v = vld4q_u8(reinterpret_cast<uint8_t*>(px + i));
+        uint8x16_t tmp = v.val[0];
+        v.val[0] = v.val[2];
+        v.val[2] = tmp;
+        vst4q_u8(reinterpret_cast<uint8_t*>(px + i), v);
+    }
+    scalar_swizzle(px + i, count - i);
+}
+
+static void neon_swizzle_copy(uint32_t* dst, const uint32_t* src, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        uint8x16x4_t v = vld4q_u8(reinterpret_cast<const uint8_t*>(src + i));
+        uint8x16_t tmp = v.val[0];
+        v.val[0] = v.val[2];
+        v.val[2] = tmp;
+        vst4q_u8(reinterpret_cast<uint8_t*>(dst + i), v);
+    }
+    scalar_swizzle_copy(dst + i, src + i, count - i);
+}
+
+static void neon_blit_opaque(uint32_t* dst, const uint32_t* src, size_t count) {
+    const uint32x4_t alpha = vdupq_n_u32(ALPHA_MASK);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        uint32x4_t a = vld1q_u32(src + i);
+        uint32x4_t b = vld1q_u32(src + i + 4);
+        vst1q_u32(dst + i, vorrq_u32(a, alpha));
+        vst1q_u32(dst + i + 4, vorrq_u32(b, alpha));
+    }
+    scalar_blit_opaque(dst + i, src + i, count - i);
+}
+
+static void neon_blit_opaque_swizzle(uint32_t* dst, const uint32_t* src, size_t count) {
+    const uint8x16_t opaque = vdupq_n_u8(0xff);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        uint8x16x4_t v = vld4q_u8(reinterpret_cast<const uint8_t*>(src + i));
+        uint8x16_t tmp = v.val[0];
+        v.val[0] = v.val[2];
+        v.val[2] = tmp;
+        v.val[3] = opaque;
+        vst4q_u8(reinterpret_cast<uint8_t*>(dst + i), v);
+    }
+    scalar_blit_opaque_swizzle(dst + i, src + i, count - i);
+}
+
+static void neon_fill(uint32_t* dst, uint32_t value, size_t count) {
+    const uint32x4_t v = vdupq_n_u32(value);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        vst1q_u32(dst + i, v);
+        vst1q_u32(dst + i + 4, v);
+        vst1q_u32(dst + i + 8, v);
+        vst1q_u32(dst + i + 12, v);
+    }
+    scalar_fill(dst + i, value, count - i);
+}
+
+static const gr_pixel_ops neon_ops = {
+    .name = "neon",
+    .swizzle = neon_swizzle,
+    .swizzle_copy = neon_swizzle_copy,
+    .blit_opaque = neon_blit_opaque,
+    .blit_opaque_swizzle = neon_blit_opaque_swizzle,
+    .fill = neon_fill,
+};
+
+static bool neon_supported() {
+#if defined(__aarch64__)
+    return true;
+#else
+    return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#endif
+}
+#endif  // GR_PIXEL_NEON
+
+#if defined(GR_PIXEL_SSE2)
+// SSE2 has no byte shuffle, but swapping R and B is two shifts and masks
+// on 32 bit lanes.
+
+static inline __m128i sse2_swap_rb(__m128i v) {
+    const __m128i ga = _mm_set1_epi32(static_cast<int>(0xff00ff00u));
+    const __m128i low = _mm_set1_epi32(0xff);
+    __m128i r = _mm_and_si128(_mm_srli_epi32(v, 16), low);
+    __m128i b = _mm_slli_epi32(_mm_and_si128(v, low), 16);
+    return _mm_or_si128(_mm_and_si128(v, ga), _mm_or_si128(r, b));
+}
+
+static void sse2_swizzle(uint32_t* px, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i* p = reinterpret_cast<__m128i*>(px + i);
+        __m128i a = _mm_loadu_si128(p);
+        __m128i b = _mm_loadu_si128(p + 1);
+        _mm_storeu_si128(p, sse2_swap_rb(a));
+        _mm_storeu_si128(p + 1, sse2_swap_rb(b));
+    }
+    scalar_swizzle(px + i, count - i);
+}
+
+static void sse2_swizzle_copy(uint32_t* dst, const uint32_t* src, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m128i* s = reinterpret_cast<const __m128i*>(src + i);
+        __m128i* d = reinterpret_cast<__m128i*>(dst + i);
+        __m128i a = _mm_loadu_si128(s);
+        __m128i b = _mm_loadu_si128(s + 1);
+        _mm_storeu_si128(d, sse2_swap_rb(a));
+        _mm_storeu_si128(d + 1, sse2_swap_rb(b));
+    }
+    scalar_swizzle_copy(dst + i, src + i, count - i);
+}
+
+static void sse2_blit_opaque(uint32_t* dst, const uint32_t* src, size_t count) {
+    const __m128i alpha = _mm_set1_epi32(static_cast<int>(ALPHA_MASK));
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m128i* s = reinterpret_cast<const __m128i*>(src + i);
+        __m128i* d = reinterpret_cast<__m128i*>(dst + i);
+        __m128i a = _mm_loadu_si128(s);
+        __m128i b = _mm_loadu_si128(s + 1);
+        _mm_storeu_si128(d, _mm_or_si128(a, alpha));
+        _mm_storeu_si128(d + 1, _mm_or_si128(b, alpha));
+    }
+    scalar_blit_opaque(dst + i, src + i, count - i);
+}
+
+static void sse2_blit_opaque_swizzle(uint32_t* dst, const uint32_t* src, size_t count) {
+    const __m128i alpha = _mm_set1_epi32(static_cast<int>(ALPHA_MASK));
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m128i* s = reinterpret_cast<const __m128i*>(src + i);
+        __m128i* d = reinterpret_cast<__m128i*>(dst + i);
+        __m128i a = _mm_loadu_si128(s);
+        __m128i b = _mm_loadu_si128(s + 1);
+        _mm_storeu_si128(d, _mm_or_si128(sse2_swap_rb(a), alpha));
+        _mm_storeu_si128(d + 1, _mm_or_si128(sse2_swap_rb(b), alpha));
+    }
+    scalar_blit_opaque_swizzle(dst + i, src + i, count - i);
+}
+
+static void sse2_fill(uint32_t* dst, uint32_t value, size_t count) {
+    const __m128i v = _mm_set1_epi32(static_cast<int>(value));
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i* d = reinterpret_cast<__m128i*>(dst + i);
+        _mm_storeu_si128(d, v);
+        _mm_storeu_si128(d + 1, v);
+        _mm_storeu_si128(d + 2, v);
+        _mm_storeu_si128(d + 3, v);
+    }
+    scalar_fill(dst + i, value, count - i);
+}
+
+static const gr_pixel_ops sse2_ops = {
+    .name = "sse2",
+    .swizzle = sse2_swizzle,
+    .swizzle_copy = sse2_swizzle_copy,
+    .blit_opaque = sse2_blit_opaque,
+    .blit_opaque_swizzle = sse2_blit_opaque_swizzle,
+    .fill = sse2_fill,
+};
+
+static bool sse2_supported() {
+    // Every x86 Android ABI requires at least SSSE3, so this only matters
+    // for host builds on very old machines.
+    return __builtin_cpu_supports("sse2");
+}
+#endif  // GR_PIXEL_SSE2
+
+size_t gr_pixel_list_ops(const gr_pixel_ops** ops, size_t max) {
+    size_t count = 0;
+#if defined(GR_PIXEL_NEON)
+    if (count < max && neon_supported())
+        ops[count++] = &neon_ops;
+#endif
+#if defined(GR_PIXEL_SSE2)
+    if (count < max && sse2_supported())
+        ops[count++] = &sse2_ops;
+#endif
+    if (count < max)
+        ops[count++] = &scalar_ops;
+    return count;
+}
+
+static const gr_pixel_ops* select_ops() {
+    const gr_pixel_ops* ops[1];
+    return gr_pixel_list_ops(ops, 1) ? ops[0] : &scalar_ops;
+}
+
+const gr_pixel_ops* gr_pixel_get_ops() {
+    static const gr_pixel_ops* selected = select_ops();
+    return selected;
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _GRAPHICS_PIXEL_H_
+#define _GRAPHICS_PIXEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Kernels for 32 bits per pixel scanlines. Pixels are handled as little
+// endian words, so the first byte in memory is bits 0-7 and the alpha (or
+// X) byte is bits 24-31. Pointers only need 4 byte alignment.
+struct gr_pixel_ops {
+    const char* name;
+
+    // Swaps the first and third byte of every pixel in place.
+    void (*swizzle)(uint32_t* px, size_t count);
+
+    // Copies pixels with the first and third byte swapped, e.g. from the
+    // drawing surface into a BGRA scanout buffer.
+    void (*swizzle_copy)(uint32_t* dst, const uint32_t* src, size_t count);
+
+    // Copies pixels with the alpha byte forced to 0xff.
+    void (*blit_opaque)(uint32_t* dst, const uint32_t* src, size_t count);
+
+    // Like blit_opaque(), also swapping the first and third byte.
+    void (*blit_opaque_swizzle)(uint32_t* dst, const uint32_t* src, size_t count);
+
+    // Sets every pixel to value.
+    void (*fill)(uint32_t* dst, uint32_t value, size_t count);
+};
+
+// Returns the fastest kernels this CPU supports.
+const gr_pixel_ops* gr_pixel_get_ops();
+
+// Stores up to max kernel sets this CPU supports in ops, fastest first.
+// The portable scalar set is always last. Returns the number stored.
+size_t gr_pixel_list_ops(const gr_pixel_ops** ops, size_t max);
+
+#endif
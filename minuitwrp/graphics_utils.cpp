@@ -54,7 +54,9 @@ int gr_save_screenshot(const char *dest)
     surface.stride = gr_mem_surface.stride;
     surface.data = img_data;
 
-#if defined(RECOVERY_BGRA)
+    // gr_color() swaps R and B for these, and no backend swaps the drawing
+    // surface back in place, so a BGRA target gives the PNG writer RGB bytes.
+#if defined(RECOVERY_ABGR) || defined(RECOVERY_BGRA)
     surface.format = GGL_PIXEL_FORMAT_BGRA_8888;
 #else
     surface.format = GGL_PIXEL_FORMAT_RGBA_8888;
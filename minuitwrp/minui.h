@@ -42,11 +42,19 @@ int gr_fb_width(void);
 int gr_fb_height(void);
 gr_pixel *gr_fb_data(void);
 void gr_flip(void);
+// Only the area x,y,w,h changed since the last flip. Falls back to
+// gr_flip() when the backend cannot flip partially.
+void gr_flip_region(int x, int y, int w, int h);
+bool gr_flip_region_supported(void);
 void gr_fb_blank(bool blank);
 
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a);
 void gr_clip(int x, int y, int w, int h);
 void gr_noclip();
+// Limit all drawing, including later gr_clip() areas, to the damaged area
+// of a partial redraw until gr_noclip_damage().
+void gr_clip_damage(int x, int y, int w, int h);
+void gr_noclip_damage();
 void gr_fill(int x, int y, int w, int h);
 void gr_line(int x0, int y0, int x1, int y1, int width);
 gr_surface gr_render_circle(int radius, unsigned char r, unsigned char g, unsigned char b, unsigned char a);
@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Runs the pixel kernels on plain memory buffers the size of a frame and
+// reports the time per frame for every kernel set this CPU supports.
+//
+// Usage: minuitwrp_pixel_benchmark [width height [frames]]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "graphics_pixel.h"
+
+static double now_ms() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+struct frame {
+    uint32_t* src;
+    uint32_t* dst;
+    uint32_t* expected;
+    size_t count;
+};
+
+enum kernel {
+    SWIZZLE,
+    SWIZZLE_COPY,
+    BLIT_OPAQUE,
+    BLIT_OPAQUE_SWIZZLE,
+    FILL,
+    KERNEL_COUNT
+};
+
+static const char* kernel_names[KERNEL_COUNT] = {
+    "swizzle", "swizzle_copy", "blit_opaque", "blit_opaque_swizzle", "fill",
+};
+
+static void run_kernel(const gr_pixel_ops* ops, kernel k, frame* f) {
+    switch (k) {
+        case SWIZZLE:
+            ops->swizzle(f->dst, f->count);
+            break;
+        case SWIZZLE_COPY:
+            ops->swizzle_copy(f->dst, f->src, f->count);
+            break;
+        case BLIT_OPAQUE:
+            ops->blit_opaque(f->dst, f->src, f->count);
+            break;
+        case BLIT_OPAQUE_SWIZZLE:
+            ops->blit_opaque_swizzle(f->dst, f->src, f->count);
+            break;
+        case FILL:
+            ops->fill(f->dst, 0x80402010, f->count);
+            break;
+        default:
+            break;
+    }
+}
+
+// Checks one run of the kernel against the last (scalar) kernel set.
+// The count is odd on purpose so the scalar tail of the SIMD loops runs.
+static bool verify(const gr_pixel_ops* ops, const gr_pixel_ops* reference,
+                   kernel k, frame* f) {
+    size_t count = f->count;
+    f->count = count - 3;
+    memcpy(f->dst, f->src, count * sizeof(uint32_t));
+    run_kernel(reference, k, f);
+    memcpy(f->expected, f->dst, count * sizeof(uint32_t));
+
+    memcpy(f->dst, f->src, count * sizeof(uint32_t));
+    run_kernel(ops, k, f);
+    f->count = count;
+    return memcmp(f->expected, f->dst, count * sizeof(uint32_t)) == 0;
+}
+
+int main(int argc, char** argv) {
+    int width = 1440;
+    int height = 2560;
+    int frames = 200;
+
+    if (argc >= 3) {
+        width = atoi(argv[1]);
+        height = atoi(argv[2]);
+    }
+    if (argc >= 4)
+        frames = atoi(argv[3]);
+    if (width <= 0 || height <= 0 || frames <= 0) {
+        fprintf(stderr, "usage: %s [width height [frames]]\n", argv[0]);
+        return 2;
+    }
+
+    frame f;
+    f.count = (size_t)width * height;
+    f.src = (uint32_t*)malloc(f.count * sizeof(uint32_t));
+    f.dst = (uint32_t*)malloc(f.count * sizeof(uint32_t));
+    f.expected = (uint32_t*)malloc(f.count * sizeof(uint32_t));
+    if (!f.src || !f.dst || !f.expected) {
+        fprintf(stderr, "failed to allocate %dx%d buffers\n", width, height);
+        return 1;
+    }
+
+    srand(1);
+    for (size_t i = 0; i < f.count; ++i)
+        f.src[i] = ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+    memcpy(f.dst, f.src, f.count * sizeof(uint32_t));
+
+    const gr_pixel_ops* ops[8];
+    size_t ops_count = gr_pixel_list_ops(ops, 8);
+    const gr_pixel_ops* reference = ops[ops_count - 1];
+
+    printf("%dx%d, %d frames, selected: %s\n", width, height, frames, gr_pixel_get_ops()->name);
+    printf("%-10s %-20s %10s %10s\n", "ops", "kernel", "ms/frame", "MiB/s");
+
+    int failed = 0;
+    for (size_t i = 0; i < ops_count; ++i) {
+        for (int k = 0; k < KERNEL_COUNT; ++k) {
+            if (!verify(ops[i], reference, (kernel)k, &f)) {
+                printf("%-10s %-20s MISMATCH\n", ops[i]->name, kernel_names[k]);
+                failed = 1;
+                continue;
+            }
+
+            // One untimed frame to fault in the pages
+            run_kernel(ops[i], (kernel)k, &f);
+            double start = now_ms();
+            for (int n = 0; n < frames; ++n)
+                run_kernel(ops[i], (kernel)k, &f);
+            double per_frame = (now_ms() - start) / frames;
+            double mib = f.count * sizeof(uint32_t) / (1024.0 * 1024.0);
+            printf("%-10s %-20s %10.3f %10.0f\n", ops[i]->name, kernel_names[k],
+                   per_frame, per_frame > 0 ? mib * 1000.0 / per_frame : 0.0);
+        }
+    }
+
+    free(f.src);
+    free(f.dst);
+    free(f.expected);
+    return failed;
+}
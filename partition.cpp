@@ -39,6 +39,9 @@
 #include "data.hpp"
 #include "twrp-functions.hpp"
 #include "twrpTar.hpp"
+#include "twrpDigestDriver.hpp"
+#include "twrpReadAhead.hpp"
+#include "twrpSparseImage.hpp"
 #include "exclude.hpp"
 #include "infomanager.hpp"
 #include "set_metadata.h"
@@ -1398,6 +1401,7 @@ bool TWPartition::Mount(bool Display_Error) {
 		return false;
 	}
 
+	PartitionManager.Mounts_Changed();
 	Find_Actual_Block_Device();
 
 	// Check the current file system before mounting
@@ -1541,6 +1545,7 @@ bool TWPartition::UnMount(bool Display_Error) {
 		if (!Symlink_Mount_Point.empty())
 			umount(Symlink_Mount_Point.c_str());
 
+		PartitionManager.Mounts_Changed();
 		umount(Mount_Point.c_str());
 		if (Is_Mounted()) {
 			if (Display_Error)
@@ -2490,6 +2495,9 @@ bool TWPartition::Backup_Tar(PartitionSettings *part_settings, pid_t *tar_fork_p
 	gui_msg(Msg("backing_up=Backing up {1}...")(Backup_Display_Name));
 
 	DataManager::GetValue(TW_USE_COMPRESSION_VAR, tar.use_compression);
+	DataManager::GetValue(TW_COMPRESSION_LEVEL_VAR, tar.compression_level);
+	DataManager::GetValue(TW_COMPRESSION_THREADS_VAR, tar.compression_threads);
+	DataManager::GetValue(TW_BACKUP_INDEX_VAR, tar.write_index);
 
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
 	if (Can_Encrypt_Backup) {
@@ -2517,8 +2525,12 @@ bool TWPartition::Backup_Tar(PartitionSettings *part_settings, pid_t *tar_fork_p
 	tar.setsize(Backup_Size);
 	tar.partition_name = Backup_Name;
 	tar.backup_folder = part_settings->Backup_Folder;
-	if (tar.createTarFork(tar_fork_pid) != 0)
+	if (tar.createTarFork(tar_fork_pid) != 0) {
+		backup_exclusions.Clear_Scan_Cache();
 		return false;
+	}
+	backup_exclusions.Clear_Scan_Cache();
+	part_settings->digest_written = tar.writesDigest();
 	return true;
 }
 
@@ -2557,11 +2569,16 @@ bool TWPartition::Backup_Image(PartitionSettings *part_settings) {
 bool TWPartition::Raw_Read_Write(PartitionSettings *part_settings) {
 	unsigned long long RW_Block_Size, Remain = Backup_Size;
 	int src_fd = -1, dest_fd = -1;
-	ssize_t bs;
+	size_t bs;
 	bool ret = false;
-	void* buffer = NULL;
+	const void* buffer = NULL;
+	twrpReadAhead* reader = NULL;
+	twrpSparseImage* sparse = NULL;
+	int use_sparse = 0;
 	unsigned long long backedup_size = 0;
 	string srcfn, destfn;
+	twrpDigest *digest = NULL;
+	bool use_sha2 = false;
 
 	if (part_settings->PM_Method == PM_BACKUP) {
 		srcfn = Actual_Block_Device;
@@ -2595,42 +2612,67 @@ bool TWPartition::Raw_Read_Write(PartitionSettings *part_settings) {
 
 	LOGINFO("Reading '%s', writing '%s'\n", srcfn.c_str(), destfn.c_str());
 
-	if (part_settings->adbbackup) {
-		RW_Block_Size = MAX_ADB_READ;
-		bs = MAX_ADB_READ;
-	}
-	else {
-		RW_Block_Size = 1048576LLU; // 1MB
-		bs = (ssize_t)(RW_Block_Size);
-	}
+	// The adb stream carries data in blocks of up to 1MB as well
+	RW_Block_Size = DATA_MAX_CHUNK_SIZE;
 
-	buffer = malloc((size_t)bs);
-	if (!buffer) {
-		LOGINFO("Raw_Read_Write failed to malloc\n");
+	// Read the next blocks while the current one is written. The adb fifo
+	// is already fed by another process, read it in place so a cancelled
+	// restore never leaves a thread blocked on it.
+	if (part_settings->adbbackup)
+		reader = new twrpReadAhead(src_fd, RW_Block_Size, 1, false);
+	else
+		reader = new twrpReadAhead(src_fd, RW_Block_Size, READ_AHEAD_BLOCKS, true);
+	if (!reader->Start(Remain)) {
+		LOGINFO("Raw_Read_Write failed to allocate buffers\n");
 		goto exit;
 	}
 
 	if (part_settings->progress)
 		part_settings->progress->SetPartitionSize(part_settings->total_restore_size);
 
-	while (Remain > 0) {
-		if (Remain < RW_Block_Size)
-			bs = (ssize_t)(Remain);
-		if (read(src_fd, buffer, bs) != bs) {
-			LOGINFO("Error reading source fd (%s)\n", strerror(errno));
-			goto exit;
+	// Store unused space as FILL chunks, simg2img can only restore whole blocks
+	if (part_settings->PM_Method == PM_BACKUP && !part_settings->adbbackup) {
+		DataManager::GetValue(TW_SPARSE_IMAGE_BACKUP_VAR, use_sparse);
+		if (use_sparse && Remain % SPARSE_BLOCK_SIZE == 0) {
+			sparse = new twrpSparseImage(dest_fd);
+			if (!sparse->Start(Remain))
+				goto exit;
 		}
-		if (write(dest_fd, buffer, bs) != bs) {
+	}
+
+	// Digest the image as it is written instead of reading it back afterwards.
+	// The sparse header is only final once the whole image is written.
+	if (part_settings->PM_Method == PM_BACKUP && !part_settings->adbbackup && part_settings->generate_digest && !sparse) {
+		use_sha2 = twrpDigestDriver::Use_SHA2();
+		digest = twrpDigestDriver::New_Digest(use_sha2);
+	}
+
+	while ((buffer = reader->Get_Block(&bs)) != NULL) {
+		if (sparse) {
+			if (!sparse->Write(buffer, bs))
+				goto exit;
+		} else if (write(dest_fd, buffer, bs) != (ssize_t)bs) {
 			LOGINFO("Error writing destination fd (%s)\n", strerror(errno));
 			goto exit;
 		}
+		if (digest)
+			digest->update((const unsigned char*)buffer, bs);
+		reader->Put_Block();
 		backedup_size += (unsigned long long)(bs);
-		Remain -= (unsigned long long)(bs);
 		if (part_settings->progress)
 			part_settings->progress->UpdateSize(backedup_size);
 		if (PartitionManager.Check_Backup_Cancel() != 0)
 			goto exit;
 	}
+	if (reader->Failed()) {
+		LOGINFO("Error reading source fd '%s'\n", srcfn.c_str());
+		goto exit;
+	}
+	if (sparse) {
+		if (!sparse->Finish())
+			goto exit;
+		LOGINFO("Sparse image of %llu bytes for %llu bytes of '%s'\n", (unsigned long long)sparse->Written(), backedup_size, srcfn.c_str());
+	}
 	if (part_settings->progress)
 		part_settings->progress->UpdateDisplayDetails(true);
 	fsync(dest_fd);
@@ -2640,14 +2682,21 @@ bool TWPartition::Raw_Read_Write(PartitionSettings *part_settings) {
 		LOGINFO("Restored default metadata for %s\n", destfn.c_str());
 	}
 
+	if (digest) {
+		if (!twrpDigestDriver::Save_Digest(destfn, digest, use_sha2))
+			goto exit;
+		part_settings->digest_written = true;
+	}
+
 	ret = true;
 exit:
+	delete reader;
+	delete sparse;
 	if (src_fd >= 0)
 		close(src_fd);
 	if (dest_fd >= 0)
 		close(dest_fd);
-	if (buffer)
-		free(buffer);
+	delete digest;
 	return ret;
 }
 
@@ -2720,6 +2769,15 @@ bool TWPartition::Restore_Tar(PartitionSettings *part_settings) {
 	bool ret = false;
 	string Restore_File_System = Get_Restore_File_System(part_settings);
 
+	// Later split archives may still be verifying while extracting, but
+	// nothing is wiped unless the first archive matched
+	Full_FileName = part_settings->Backup_Folder + "/" + Backup_FileName;
+	if (part_settings->digest_verifier != NULL) {
+		std::vector<string> backup_files = twrpDigestDriver::Get_Backup_Files(Full_FileName);
+		if (!backup_files.empty() && !part_settings->digest_verifier->Wait(backup_files[0]))
+			return false;
+	}
+
 	if (Has_Android_Secure) {
 		if (!Wipe_AndSec())
 			return false;
@@ -2741,7 +2799,6 @@ bool TWPartition::Restore_Tar(PartitionSettings *part_settings) {
 	if (!ReMount_RW(true))
 		return false;
 
-	Full_FileName = part_settings->Backup_Folder + "/" + Backup_FileName;
 	twrpTar tar;
 	tar.part_settings = part_settings;
 	tar.setdir(Backup_Path);
@@ -2796,10 +2853,18 @@ bool TWPartition::Restore_Image(PartitionSettings *part_settings) {
 	else
 		Full_FileName = part_settings->Backup_Folder + "/" + Backup_FileName;
 
+	if (part_settings->digest_verifier != NULL && !part_settings->adbbackup && !part_settings->digest_verifier->Wait(Full_FileName))
+		return false;
+
 	if (Restore_File_System == "emmc") {
 		if (!part_settings->adbbackup)
 			part_settings->total_restore_size = (uint64_t)(TWFunc::Get_File_Size(Full_FileName));
-		if (!Raw_Read_Write(part_settings))
+		if (!part_settings->adbbackup && Is_Sparse_Image(Full_FileName)) {
+			if (!Flash_Sparse_Image(Full_FileName))
+				return false;
+			if (part_settings->progress)
+				part_settings->progress->UpdateSize(part_settings->total_restore_size);
+		} else if (!Raw_Read_Write(part_settings))
 			return false;
 	} else if (Restore_File_System == "mtd" || Restore_File_System == "bml") {
 		if (!Flash_Image_FI(Full_FileName, part_settings->progress))
@@ -3105,7 +3170,8 @@ bool TWPartition::Flash_Sparse_Image(const string& Filename) {
 
 	Command = "simg2img '" + Filename + "' '" + Actual_Block_Device + "'";
 	LOGINFO("Flash command: '%s'\n", Command.c_str());
-	TWFunc::Exec_Cmd(Command);
+	if (TWFunc::Exec_Cmd(Command) != 0)
+		return false;
 	return true;
 }
 
@@ -52,6 +52,7 @@
 #include "gui/gui.hpp"
 #include "progresstracking.hpp"
 #include "twrpDigestDriver.hpp"
+#include "twrpBackupScheduler.hpp"
 #include "adbbu/libtwadbbu.hpp"
 
 #ifdef TW_HAS_MTP
@@ -98,6 +99,7 @@ TWPartitionManager::TWPartitionManager(void) {
 	mtp_write_fd = -1;
 	uevent_pfd.fd = -1;
 	stop_backup.set_value(0);
+	mount_generation = 0;
 #ifdef AB_OTA_UPDATER
 	char slot_suffix[PROPERTY_VALUE_MAX];
 	property_get("ro.boot.slot_suffix", slot_suffix, "error");
@@ -665,22 +667,19 @@ int TWPartitionManager::Check_Backup_Name(const std::string& Backup_Name, bool D
 
 bool TWPartitionManager::Backup_Partition(PartitionSettings *part_settings) {
 	time_t start, stop;
-	int use_compression;
-	string backup_log = part_settings->Backup_Folder + "/recovery.log";
 
 	if (part_settings->Part == NULL)
 		return true;
 
-	DataManager::GetValue(TW_USE_COMPRESSION_VAR, use_compression);
-
-	TWFunc::SetPerformanceMode(true);
 	time(&start);
 
+	part_settings->digest_written = false;
 	if (part_settings->Part->Backup(part_settings, &tar_fork_pid)) {
 		sync();
 		sync();
 		string Full_Filename = part_settings->Backup_Folder + "/" + part_settings->Part->Backup_FileName;
-		if (!part_settings->adbbackup && part_settings->generate_digest) {
+		// Only read the backup back if its digest could not be computed while it was written
+		if (!part_settings->adbbackup && part_settings->generate_digest && !part_settings->digest_written) {
 			if (!twrpDigestDriver::Make_Digest(Full_Filename))
 				goto backup_error;
 		}
@@ -692,13 +691,14 @@ bool TWPartitionManager::Backup_Partition(PartitionSettings *part_settings) {
 			for (subpart = Partitions.begin(); subpart != Partitions.end(); subpart++) {
 				if ((*subpart)->Can_Be_Backed_Up && (*subpart)->Is_SubPartition && (*subpart)->SubPartition_Of == parentPart->Mount_Point) {
 					part_settings->Part = *subpart;
+					part_settings->digest_written = false;
 					if (!(*subpart)->Backup(part_settings, &tar_fork_pid)) {
 						goto backup_error;
 					}
 					sync();
 					sync();
 					string Full_Filename = part_settings->Backup_Folder + "/" + part_settings->Part->Backup_FileName;
-					if (!part_settings->adbbackup && part_settings->generate_digest) {
+					if (!part_settings->adbbackup && part_settings->generate_digest && !part_settings->digest_written) {
 						if (!twrpDigestDriver::Make_Digest(Full_Filename)) {
 							goto backup_error;
 						}
@@ -717,15 +717,10 @@ bool TWPartitionManager::Backup_Partition(PartitionSettings *part_settings) {
 			part_settings->img_time += backup_time;
 
 		}
-
-		TWFunc::SetPerformanceMode(false);
 		return true;
 	}
 backup_error:
-	Clean_Backup_Folder(part_settings->Backup_Folder);
-	TWFunc::copy_file("/tmp/recovery.log", backup_log, 0644);
-	tw_set_default_metadata(backup_log.c_str());
-	TWFunc::SetPerformanceMode(false);
+	// Run_Backup() cleans up once every running backup has stopped
 	return false;
 }
 
@@ -739,6 +734,7 @@ void TWPartitionManager::Clean_Backup_Folder(string Backup_Folder) {
 	ext.push_back("win");
 	ext.push_back("md5");
 	ext.push_back("sha2");
+	ext.push_back("idx");
 	ext.push_back("info");
 
 	gui_msg("backup_clean=Backup Failed. Cleaning Backup Folder.");
@@ -793,6 +789,21 @@ int TWPartitionManager::Cancel_Backup() {
 	return 0;
 }
 
+// Drops the metadata the size calculation kept for a backup however the
+// backup ends, including partitions it fails or stops before reaching
+class ScanCacheGuard {
+public:
+	ScanCacheGuard(std::vector<TWPartition*> *Partitions) : partitions(Partitions) {}
+	~ScanCacheGuard() {
+		std::vector<TWPartition*>::iterator iter;
+
+		for (iter = partitions->begin(); iter != partitions->end(); iter++)
+			(*iter)->backup_exclusions.Clear_Scan_Cache();
+	}
+private:
+	std::vector<TWPartition*> *partitions;
+};
+
 int TWPartitionManager::Run_Backup(bool adbbackup) {
 	PartitionSettings part_settings;
 	int partition_count = 0, disable_free_space_check = 0, skip_digest = 0;
@@ -814,10 +825,25 @@ int TWPartitionManager::Run_Backup(bool adbbackup) {
 	part_settings.img_bytes = 0;
 	part_settings.file_bytes = 0;
 	part_settings.PM_Method = PM_BACKUP;
+	part_settings.digest_verifier = NULL;
 
 	part_settings.adbbackup = adbbackup;
 	time(&total_start);
 
+	// The size calculation of the selected partitions keeps what it reads
+	// so their tar backups do not have to walk the folders again
+	ScanCacheGuard scan_cache_guard(&Partitions);
+	DataManager::GetValue("tw_backup_list", Backup_List);
+	end_pos = Backup_List.find(";", start_pos);
+	while (end_pos != string::npos && start_pos < Backup_List.size()) {
+		TWPartition* Part = Find_Partition_By_Path(Backup_List.substr(start_pos, end_pos - start_pos));
+		if (Part != NULL && Part->Backup_Method == BM_FILES)
+			Part->backup_exclusions.Keep_Scan_Cache();
+		start_pos = end_pos + 1;
+		end_pos = Backup_List.find(";", start_pos);
+	}
+	start_pos = 0;
+
 	Update_System_Details();
 
 	if (!Mount_Current_Storage(true))
@@ -844,7 +870,6 @@ int TWPartitionManager::Run_Backup(bool adbbackup) {
 	LOGINFO("Backup_Folder is: '%s'\n", part_settings.Backup_Folder.c_str());
 
 	LOGINFO("Calculating backup details...\n");
-	DataManager::GetValue("tw_backup_list", Backup_List);
 	if (!Backup_List.empty()) {
 		end_pos = Backup_List.find(";", start_pos);
 		while (end_pos != string::npos && start_pos < Backup_List.size()) {
@@ -933,16 +958,41 @@ int TWPartitionManager::Run_Backup(bool adbbackup) {
 
 	DataManager::SetProgress(0.0);
 
+	// Raw partitions on different storage devices, or light enough to share
+	// one, are backed up at the same time. Tar runs in a fork and so runs
+	// alone. The adb stream takes one at a time.
+	int io_jobs = 1, use_compression = 0, compression_threads = 0;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1 || adbbackup)
+		cpus = 1;
+	if (!adbbackup)
+		DataManager::GetValue(TW_BACKUP_IO_JOBS_VAR, io_jobs);
+	DataManager::GetValue(TW_USE_COMPRESSION_VAR, use_compression);
+	DataManager::GetValue(TW_COMPRESSION_THREADS_VAR, compression_threads);
+	twrpBackupScheduler scheduler(io_jobs, (unsigned)cpus, twrpBackupScheduler::Get_Folder_Disk(part_settings.Backup_Folder));
+
 	start_pos = 0;
 	end_pos = Backup_List.find(";", start_pos);
 	while (end_pos != string::npos && start_pos < Backup_List.size()) {
-		if (stop_backup.get_value() != 0)
-			return -1;
 		backup_path = Backup_List.substr(start_pos, end_pos - start_pos);
 		part_settings.Part = Find_Partition_By_Path(backup_path);
 		if (part_settings.Part != NULL) {
-			if (!Backup_Partition(&part_settings))
-				return false;
+			bool forks = false;
+			unsigned cpu_cost = 1;
+
+			// Tar runs in a fork and compresses on one thread per core unless told otherwise
+			for (subpart = Partitions.begin(); subpart != Partitions.end(); subpart++) {
+				if (*subpart != part_settings.Part && !((*subpart)->Can_Be_Backed_Up && (*subpart)->Is_SubPartition && (*subpart)->SubPartition_Of == part_settings.Part->Mount_Point))
+					continue;
+				if ((*subpart)->Backup_Method != BM_DD)
+					forks = true;
+				if ((*subpart)->Backup_Method == BM_FILES && use_compression) {
+					unsigned threads = compression_threads > 0 ? compression_threads : cpus;
+					if (threads > cpu_cost)
+						cpu_cost = threads;
+				}
+			}
+			scheduler.Add(part_settings, twrpBackupScheduler::Get_Disk(part_settings.Part->Actual_Block_Device), cpu_cost, forks);
 		} else {
 			gui_msg(Msg(msg::kError, "unable_to_locate_partition=Unable to locate '{1}' partition for backup calculations.")(backup_path));
 		}
@@ -950,6 +1000,19 @@ int TWPartitionManager::Run_Backup(bool adbbackup) {
 		end_pos = Backup_List.find(";", start_pos);
 	}
 
+	TWFunc::SetPerformanceMode(true);
+	bool backup_ok = scheduler.Run(&part_settings);
+	TWFunc::SetPerformanceMode(false);
+	if (stop_backup.get_value() != 0)
+		return -1;
+	if (!backup_ok) {
+		string backup_log = part_settings.Backup_Folder + "/recovery.log";
+		Clean_Backup_Folder(part_settings.Backup_Folder);
+		TWFunc::copy_file("/tmp/recovery.log", backup_log, 0644);
+		tw_set_default_metadata(backup_log.c_str());
+		return false;
+	}
+
 	// Average BPS
 	if (part_settings.img_time == 0)
 		part_settings.img_time = 1;
@@ -974,7 +1037,7 @@ int TWPartitionManager::Run_Backup(bool adbbackup) {
 		actual_backup_size = part_settings.file_bytes + part_settings.img_bytes;
 	actual_backup_size /= (1024LLU * 1024LLU);
 
-	int prev_img_bps = 0, use_compression = 0;
+	int prev_img_bps = 0;
 	unsigned long long prev_file_bps = 0;
 	DataManager::GetValue(TW_BACKUP_AVG_IMG_RATE, prev_img_bps);
 	img_bps += (prev_img_bps * 4);
@@ -1055,6 +1118,7 @@ bool TWPartitionManager::Restore_Partition(PartitionSettings *part_settings) {
 
 int TWPartitionManager::Run_Restore(const string& Restore_Name) {
 	PartitionSettings part_settings;
+	twrpDigestVerifier digest_verifier;
 	int check_digest;
 
 	time_t rStart, rStop;
@@ -1067,6 +1131,7 @@ int TWPartitionManager::Run_Restore(const string& Restore_Name) {
 	part_settings.partition_count = 0;
 	part_settings.total_restore_size = 0;
 	part_settings.adbbackup = false;
+	part_settings.digest_verifier = NULL;
 	part_settings.PM_Method = PM_RESTORE;
 
 	gui_msg("restore_started=[RESTORE STARTED]");
@@ -1077,7 +1142,7 @@ int TWPartitionManager::Run_Restore(const string& Restore_Name) {
 
 	DataManager::GetValue(TW_SKIP_DIGEST_CHECK_VAR, check_digest);
 	if (check_digest > 0) {
-		// Check Digest files first before restoring to ensure that all of them match before starting a restore
+		// Digests are checked in the background, each file is waited for before it is restored
 		TWFunc::GUI_Operation_Text(TW_VERIFY_DIGEST_TEXT, gui_parse_text("{@verifying_digest}"));
 		gui_msg("verifying_digest=Verifying Digest");
 	} else {
@@ -1099,8 +1164,8 @@ int TWPartitionManager::Run_Restore(const string& Restore_Name) {
 
 				string Full_Filename = part_settings.Backup_Folder + "/" + part_settings.Part->Backup_FileName;
 
-				if (check_digest > 0 && !twrpDigestDriver::Check_Digest(Full_Filename))
-					return false;
+				if (check_digest > 0)
+					digest_verifier.Add(Full_Filename);
 				part_settings.partition_count++;
 				part_settings.total_restore_size += part_settings.Part->Get_Restore_Size(&part_settings);
 				if (part_settings.Part->Has_SubPartition) {
@@ -1110,8 +1175,8 @@ int TWPartitionManager::Run_Restore(const string& Restore_Name) {
 					for (subpart = Partitions.begin(); subpart != Partitions.end(); subpart++) {
 						part_settings.Part = *subpart;
 						if ((*subpart)->Is_SubPartition && (*subpart)->SubPartition_Of == parentPart->Mount_Point) {
-							if (check_digest > 0 && !twrpDigestDriver::Check_Digest(Full_Filename))
-								return false;
+							if (check_digest > 0)
+								digest_verifier.Add(part_settings.Backup_Folder + "/" + (*subpart)->Backup_FileName);
 							part_settings.total_restore_size += (*subpart)->Get_Restore_Size(&part_settings);
 						}
 					}
@@ -1128,6 +1193,13 @@ int TWPartitionManager::Run_Restore(const string& Restore_Name) {
 		gui_err("no_part_restore=No partitions selected for restore.");
 		return false;
 	}
+	if (check_digest > 0) {
+		if (!digest_verifier.Start()) {
+			gui_msg("digest_error=Digest Error!");
+			return false;
+		}
+		part_settings.digest_verifier = &digest_verifier;
+	}
 
 	gui_msg(Msg("restore_part_count=Restoring {1} partitions...")(part_settings.partition_count));
 	gui_msg(Msg("total_restore_size=Total restore size is {1}MB")(part_settings.total_restore_size / 1048576));
@@ -1153,6 +1225,9 @@ int TWPartitionManager::Run_Restore(const string& Restore_Name) {
 			end_pos = Restore_List.find(";", start_pos);
 		}
 	}
+	// Anything that was queued but not restored still has to match
+	if (part_settings.digest_verifier != NULL && !digest_verifier.Wait_All())
+		return false;
 	TWFunc::GUI_Operation_Text(TW_UPDATE_SYSTEM_DETAILS_TEXT, gui_parse_text("{@updating_system_details}"));
 	UnMount_By_Path(Get_Android_Root_Path(), false);
 	Update_System_Details();
@@ -1635,6 +1710,7 @@ void TWPartitionManager::Update_System_Details(void) {
 void TWPartitionManager::Post_Decrypt(const string& Block_Device) {
 	TWPartition* dat = Find_Partition_By_Path("/data");
 	if (dat != NULL) {
+		Mounts_Changed();
 		DataManager::SetValue(TW_IS_DECRYPTED, 1);
 		dat->Is_Decrypted = true;
 		if (!Block_Device.empty()) {
@@ -2560,6 +2636,7 @@ bool TWPartitionManager::Flash_Image(string& path, string& filename) {
 	ProgressTracking progress(total_bytes);
 	part_settings.progress = &progress;
 	part_settings.adbbackup = false;
+	part_settings.digest_verifier = NULL;
 	part_settings.PM_Method = PM_RESTORE;
 	gui_msg("calc_restore=Calculating restore details...");
 	if (!Flash_List.empty()) {
@@ -2830,6 +2907,14 @@ string TWPartitionManager::Get_Active_Slot_Display() {
 	return Active_Slot_Display;
 }
 
+unsigned int TWPartitionManager::Get_Mount_Generation() {
+	return __atomic_load_n(&mount_generation, __ATOMIC_ACQUIRE);
+}
+
+void TWPartitionManager::Mounts_Changed() {
+	__atomic_add_fetch(&mount_generation, 1, __ATOMIC_RELEASE);
+}
+
 string TWPartitionManager::Get_Android_Root_Path() {
 	std::string Android_Root = getenv("ANDROID_ROOT");
 	if (Android_Root == "")
@@ -3064,6 +3149,7 @@ bool TWPartitionManager::Prepare_Repack(TWPartition* Part, const std::string& Te
 	part_settings.adbbackup = false;
 	part_settings.generate_digest = false;
 	part_settings.generate_md5 = false;
+	part_settings.digest_verifier = NULL;
 	part_settings.PM_Method = PM_BACKUP;
 	part_settings.progress = NULL;
 	pid_t not_a_pid = 0;
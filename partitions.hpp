@@ -94,6 +94,7 @@ enum PartitionManager_Op {                                                    //
 };
 
 class TWPartition;
+class twrpDigestVerifier;
 
 struct PartitionSettings {                                                    // Settings for backup session
 	TWPartition* Part;                                                        // Partition to pass to the partition backup loop
@@ -102,6 +103,8 @@ struct PartitionSettings {                                                    //
 	bool adb_compression;                                                     // 0 == uncompressed, 1 == compressed
 	bool generate_digest;                                                      // tell system to create digest for partitions
 	bool generate_md5;                                                        // tell system to create md5 for partitions
+	bool digest_written;                                                      // digest files were written along with the backup files
+	twrpDigestVerifier *digest_verifier;                                      // digests still being checked while restoring, NULL if not checking
 	uint64_t total_restore_size;                                              // Total size of restored backup
 	uint64_t img_bytes_remaining;                                             // remaining img/emmc bytes to backup for progress indicator
 	uint64_t file_bytes_remaining;                                            // remaining file bytes to backup for progress indicator
@@ -296,6 +299,7 @@ friend class DataManager;
 friend class GUIPartitionList;
 friend class GUIAction;
 friend class PageManager;
+friend class ScanCacheGuard;
 };
 
 class TWPartitionManager
@@ -369,6 +373,8 @@ public:
 	string Get_Active_Slot_Suffix();                                          // Returns active slot _a or _b
 	string Get_Active_Slot_Display();                                         // Returns active slot A or B for display purposes
 	string Get_Android_Root_Path();                                           // Returns path of ANDROID_ROOT environment variable
+	unsigned int Get_Mount_Generation();                                      // Changes whenever a partition is mounted, unmounted or decrypted
+	void Mounts_Changed();                                                    // Moves the mount generation on
 	struct pollfd uevent_pfd;                                                 // Used for uevent code
 	void Remove_Uevent_Devices(const string& sysfs_path);                     // Removes subpartitions from the Partitions vector for a matched uevent device
 	void Handle_Uevent(const Uevent_Block_Data& uevent_data);                 // Handle uevent data
@@ -397,11 +403,14 @@ private:
 	bool mtp_was_enabled;
 	int mtp_write_fd;
 	pid_t tar_fork_pid;                                                       // PID of twrpTar fork
+	unsigned int mount_generation;                                            // Read by the GUI while backup threads mount
 	Backup_Method_enum Backup_Method;                                         // Method used for backup
 
 private:
 	std::vector<TWPartition*> Partitions;                                     // Vector list of all partitions
 	string Active_Slot_Display;                                               // Current Active Slot (A or B) for display purposes
+
+friend class twrpBackupScheduler;
 };
 
 extern TWPartitionManager PartitionManager;
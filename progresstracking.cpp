@@ -31,7 +31,21 @@
 const int32_t update_interval_ms = 200; // Update interval in ms
 
 ProgressTracking::ProgressTracking(const unsigned long long backup_size) {
+	Init();
 	total_backup_size = backup_size;
+}
+
+ProgressTracking::ProgressTracking(ProgressTracking *aggregate_tracker) {
+	Init();
+	aggregate = aggregate_tracker;
+}
+
+ProgressTracking::~ProgressTracking() {
+	pthread_mutex_destroy(&lock);
+}
+
+void ProgressTracking::Init() {
+	total_backup_size = 0;
 	partition_size = 0;
 	file_count = 0;
 	current_size = 0;
@@ -39,6 +53,14 @@ ProgressTracking::ProgressTracking(const unsigned long long backup_size) {
 	previous_partitions_size = 0;
 	display_file_count = false;
 	clock_gettime(CLOCK_MONOTONIC, &last_update);
+	aggregate = NULL;
+	reported_size = 0;
+	reported_file_count = 0;
+	reported_count = 0;
+	jobs_size = 0;
+	jobs_file_count = 0;
+	jobs_count = 0;
+	pthread_mutex_init(&lock, NULL);
 }
 
 void ProgressTracking::SetPartitionSize(const unsigned long long part_size) {
@@ -72,6 +94,36 @@ void ProgressTracking::DisplayFileCount(const bool display) {
 }
 
 void ProgressTracking::UpdateDisplayDetails(const bool force) {
+	if (aggregate != NULL) {
+		// Only hand on what changed, the aggregate tracker sums every running backup
+		unsigned long long size = previous_partitions_size + current_size;
+		unsigned long long f_count = 0, count = 0;
+
+		if (display_file_count && file_count != 0) {
+			f_count = file_count;
+			count = current_count;
+		}
+		aggregate->Add_Job_Progress(size - reported_size, f_count - reported_file_count, count - reported_count, force);
+		reported_size = size;
+		reported_file_count = f_count;
+		reported_count = count;
+		return;
+	}
+	pthread_mutex_lock(&lock);
+	Display(force);
+	pthread_mutex_unlock(&lock);
+}
+
+void ProgressTracking::Add_Job_Progress(const long long size, const long long f_count, const long long count, const bool force) {
+	pthread_mutex_lock(&lock);
+	jobs_size += size;
+	jobs_file_count += f_count;
+	jobs_count += count;
+	Display(force);
+	pthread_mutex_unlock(&lock);
+}
+
+void ProgressTracking::Display(const bool force) {
 #ifndef BUILD_TWRPTAR_MAIN
 	if (!force) {
 		// Do something to check the time frame and only update periodically to reduce the total number of GUI updates
@@ -84,24 +136,27 @@ void ProgressTracking::UpdateDisplayDetails(const bool force) {
 	}
 	clock_gettime(CLOCK_MONOTONIC, &last_update);
 	double display_percent = 0.0, progress_percent;
+	unsigned long long done_size = current_size + previous_partitions_size + jobs_size;
+	unsigned long long total_files = file_count + jobs_file_count;
+	unsigned long long done_files = current_count + jobs_count;
 	string size_prog = gui_lookup("size_progress", "%lluMB of %lluMB, %i%%");
 	char size_progress[1024];
 
 	if (total_backup_size != 0) // prevent division by 0
-		display_percent = (double)(current_size + previous_partitions_size) / (double)(total_backup_size) * 100;
-	sprintf(size_progress, size_prog.c_str(), (current_size + previous_partitions_size) / 1048576, total_backup_size / 1048576, (int)(display_percent));
+		display_percent = (double)(done_size) / (double)(total_backup_size) * 100;
+	sprintf(size_progress, size_prog.c_str(), done_size / 1048576, total_backup_size / 1048576, (int)(display_percent));
 	DataManager::SetValue("tw_size_progress", size_progress);
 	progress_percent = (display_percent / 100);
 	DataManager::SetProgress((float)(progress_percent));
 
-	if (!display_file_count || file_count == 0) {
+	if ((!display_file_count && jobs_file_count == 0) || total_files == 0) {
 		DataManager::SetValue("tw_file_progress", "");
 	} else {
 		string file_prog = gui_lookup("file_progress", "%llu of %llu files, %i%%");
 		char file_progress[1024];
 
-		display_percent = (double)(current_count) / (double)(file_count) * 100;
-		sprintf(file_progress, file_prog.c_str(), current_count, file_count, (int)(display_percent));
+		display_percent = (double)(done_files) / (double)(total_files) * 100;
+		sprintf(file_progress, file_prog.c_str(), done_files, total_files, (int)(display_percent));
 		DataManager::SetValue("tw_file_progress", file_progress);
 	}
 #endif
@@ -19,6 +19,7 @@
 #ifndef __PROGRESSTRACKING_HPP
 #define __PROGRESSTRACKING_HPP
 
+#include <pthread.h>
 #include <time.h>
 
 // Progress tracking class for tracking backup progess and updating the progress bar as appropriate
@@ -26,6 +27,8 @@ class ProgressTracking
 {
 public:
 	ProgressTracking(const unsigned long long backup_size);
+	ProgressTracking(ProgressTracking *aggregate_tracker); // Tracks one of several backups running at once, aggregate_tracker displays their sum
+	~ProgressTracking();
 
 	void SetPartitionSize(const unsigned long long part_size);
 	void SetSizeCount(const unsigned long long part_size, unsigned long long f_count);
@@ -37,6 +40,10 @@ public:
 	void UpdateDisplayDetails(const bool force);
 
 private:
+	void Init();
+	void Add_Job_Progress(const long long size, const long long f_count, const long long count, const bool force);
+	void Display(const bool force);
+
 	unsigned long long total_backup_size;              // Overall size (for the progress bar)
 
 	unsigned long long partition_size;                 // Size of the current partition
@@ -49,6 +56,16 @@ private:
 
 	bool display_file_count;                           // Inidicates if we will display the file count text
 	timespec last_update;                              // Tracks last update of the displayed progress (frequent updates tax the CPU and slow us down)
+
+	ProgressTracking *aggregate;                       // Tracker that displays this backup's progress, NULL if this one displays it
+	unsigned long long reported_size;                  // Size, file count and count last added to the aggregate tracker
+	unsigned long long reported_file_count;
+	unsigned long long reported_count;
+
+	unsigned long long jobs_size;                      // Sums reported by the trackers of backups running at once
+	unsigned long long jobs_file_count;
+	unsigned long long jobs_count;
+	pthread_mutex_t lock;                              // Serializes the updates of backups running at once
 };
 
 #endif //__PROGRESSTRACKING_HPP
@@ -854,7 +854,8 @@ TEST(ImgdiffTest, zip_mode_deflate_large_apk) {
   TemporaryFile split_info_file;
   TemporaryDir debug_dir;
   ASSERT_TRUE(ZipModeImage::GeneratePatches(split_tgt_images, split_src_images, split_src_ranges,
-                                            patch_file.path, split_info_file.path, debug_dir.path));
+                                            patch_file.path, split_info_file.path, debug_dir.path,
+                                            4));
 
   // Verify the content of split info.
   // Expect 5 pieces of patch. ["a","b"; "c"; "d-0"; "d-1"; "e"]
@@ -1070,3 +1071,55 @@ TEST(ImgdiffTest, zip_mode_large_apk_skipped_small_target_chunk) {
   // src_piece 1: a-0 1 block, CD
   GenerateAndCheckSplitTarget(debug_dir.path, 2, tgt);
 }
+
+TEST(ImgdiffTest, zip_mode_thread_count_deterministic) {
+  // Generate 40 blocks of random data.
+  std::string random_data;
+  random_data.reserve(4096 * 40);
+  generate_n(back_inserter(random_data), 4096 * 40, []() { return rand() % 256; });
+
+  TemporaryFile tgt_file;
+  FILE* tgt_file_ptr = fdopen(tgt_file.release(), "wb");
+  ZipWriter tgt_writer(tgt_file_ptr);
+  construct_deflate_entry({ { "a", 0, 4 }, { "b", 4, 6 }, { "c", 12, 3 }, { "d", 16, 5 },
+                            { "e", 22, 4 }, { "f", 30, 8 } },
+                          &tgt_writer, random_data);
+  ASSERT_EQ(0, tgt_writer.Finish());
+  ASSERT_EQ(0, fclose(tgt_file_ptr));
+
+  // Entries "e" and "f" have no match in the source, so they are diffed against the pseudo source
+  // and share its suffix array index.
+  TemporaryFile src_file;
+  FILE* src_file_ptr = fdopen(src_file.release(), "wb");
+  ZipWriter src_writer(src_file_ptr);
+  construct_deflate_entry({ { "a", 1, 4 }, { "b", 5, 6 }, { "c", 11, 3 }, { "d", 15, 5 } },
+                          &src_writer, random_data);
+  construct_store_entry({ { "g", 2, 'g' } }, &src_writer);
+  ASSERT_EQ(0, src_writer.Finish());
+  ASSERT_EQ(0, fclose(src_file_ptr));
+
+  // The patch must not depend on the number of threads that computed it.
+  TemporaryFile patch_file1;
+  std::vector<const char*> args1 = {
+    "imgdiff", "-z", "--thread-count=1", src_file.path, tgt_file.path, patch_file1.path,
+  };
+  ASSERT_EQ(0, imgdiff(args1.size(), args1.data()));
+
+  TemporaryFile patch_file4;
+  std::vector<const char*> args4 = {
+    "imgdiff", "-z", "--thread-count=4", src_file.path, tgt_file.path, patch_file4.path,
+  };
+  ASSERT_EQ(0, imgdiff(args4.size(), args4.data()));
+
+  std::string src;
+  ASSERT_TRUE(android::base::ReadFileToString(src_file.path, &src));
+  std::string tgt;
+  ASSERT_TRUE(android::base::ReadFileToString(tgt_file.path, &tgt));
+  std::string patch1;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file1.path, &patch1));
+  std::string patch4;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file4.path, &patch4));
+
+  ASSERT_EQ(patch1, patch4);
+  verify_patched_image(src, patch4, tgt);
+}
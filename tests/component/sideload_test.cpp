@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <string.h>
 #include <unistd.h>
 
 #include <string>
@@ -96,3 +97,79 @@ TEST(SideloadTest, run_fuse_sideload) {
   ASSERT_EQ(0, WEXITSTATUS(status));
   ASSERT_EQ(EXIT_SUCCESS, WEXITSTATUS(status));
 }
+
+TEST(SideloadTest, run_fuse_sideload_cache) {
+  // 64 blocks of distinct content, with a short last block.
+  std::string content(64 * 4096 - 100, '\0');
+  for (size_t i = 0; i < content.size(); ++i) {
+    content[i] = static_cast<char>((i * 7) ^ (i / 4096));
+  }
+
+  // The provider runs in the child; it logs the block numbers it's asked for into a file so the
+  // parent can check how often each block was fetched.
+  TemporaryFile fetch_log;
+  provider_vtab vtab;
+  vtab.close = [](void) {};
+  vtab.read_block = [&content, &fetch_log](uint32_t block, uint8_t* buffer, uint32_t fetch_size) {
+    if (block * 4096 + fetch_size > content.size()) return -1;
+    if (!android::base::WriteFully(fetch_log.fd, &block, sizeof(block))) return -1;
+    content.copy(reinterpret_cast<char*>(buffer), fetch_size, block * 4096);
+    return 0;
+  };
+
+  sideload_cache_config cache_config;
+  cache_config.cache_blocks = 8;
+  cache_config.readahead_blocks = 4;
+
+  TemporaryDir mount_point;
+  pid_t pid = fork();
+  if (pid == 0) {
+    ASSERT_EQ(0, run_fuse_sideload(vtab, content.size(), 4096, mount_point.path, cache_config));
+    _exit(EXIT_SUCCESS);
+  }
+
+  std::string package = std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_FILENAME;
+  int status;
+  static constexpr int kSideloadInstallTimeout = 10;
+  for (int i = 0; i < kSideloadInstallTimeout; ++i) {
+    ASSERT_NE(-1, waitpid(pid, &status, WNOHANG));
+
+    struct stat sb;
+    if (stat(package.c_str(), &sb) == 0) {
+      break;
+    }
+
+    if (errno == ENOENT && i < kSideloadInstallTimeout - 1) {
+      sleep(1);
+      continue;
+    }
+    FAIL() << "Timed out waiting for the fuse-provided package.";
+  }
+
+  std::string content_via_fuse;
+  ASSERT_TRUE(android::base::ReadFileToString(package, &content_via_fuse));
+  ASSERT_EQ(content, content_via_fuse);
+
+  std::string exit_flag = std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_EXIT_FLAG;
+  struct stat sb;
+  ASSERT_EQ(0, stat(exit_flag.c_str(), &sb));
+
+  waitpid(pid, &status, 0);
+  ASSERT_EQ(EXIT_SUCCESS, WEXITSTATUS(status));
+
+  // A sequential read, including what the read-ahead thread fetched, gets each block from the
+  // host (and hashes it) exactly once.
+  std::string log;
+  ASSERT_TRUE(android::base::ReadFileToString(fetch_log.path, &log));
+  ASSERT_EQ(64 * sizeof(uint32_t), log.size());
+  std::vector<int> fetches(64);
+  for (size_t i = 0; i < log.size(); i += sizeof(uint32_t)) {
+    uint32_t block;
+    memcpy(&block, log.data() + i, sizeof(block));
+    ASSERT_LT(block, 64U);
+    fetches[block]++;
+  }
+  for (size_t i = 0; i < fetches.size(); ++i) {
+    ASSERT_EQ(1, fetches[i]) << "block " << i;
+  }
+}
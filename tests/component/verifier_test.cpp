@@ -177,6 +177,31 @@ TEST(VerifierTest, BadPackage_SignatureStartOutOfBounds) {
                                         package.size(), certs));
 }
 
+TEST(VerifierTest, HashDataCallback) {
+  std::string testkey_v3;
+  ASSERT_TRUE(android::base::ReadFileToString(from_testdata_base("testkey_v3.txt"), &testkey_v3));
+  TemporaryFile key_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(testkey_v3, key_file.path));
+  std::vector<Certificate> certs;
+  ASSERT_TRUE(load_keys(key_file.path, certs));
+
+  std::string package;
+  ASSERT_TRUE(android::base::ReadFileToString(from_testdata_base("otasigned_v3.zip"), &package));
+
+  // The callback sees the signed region exactly once, in order: everything up to the comment
+  // length field of the EOCD record.
+  std::string hashed;
+  auto hash_data = [&hashed](const unsigned char* data, size_t len) {
+    hashed.append(reinterpret_cast<const char*>(data), len);
+  };
+  ASSERT_EQ(VERIFY_SUCCESS, verify_file(reinterpret_cast<const unsigned char*>(package.data()),
+                                        package.size(), certs, nullptr, hash_data));
+  size_t comment_size = static_cast<unsigned char>(package[package.size() - 2]) +
+                        (static_cast<unsigned char>(package[package.size() - 1]) << 8);
+  ASSERT_EQ(package.size() - comment_size - 2, hashed.size());
+  ASSERT_EQ(package.substr(0, hashed.size()), hashed);
+}
+
 TEST_P(VerifierSuccessTest, VerifySucceed) {
   ASSERT_EQ(verify_file(memmap.addr, memmap.length, certs, nullptr), VERIFY_SUCCESS);
 }
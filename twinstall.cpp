@@ -339,7 +339,11 @@ static int Run_Update_Binary(const char *path, ZipWrap *Zip, int* wipe_cache, zi
 }
 
 int TWinstall_zip(const char* path, int* wipe_cache) {
-	int ret_val, zip_verify = 1;
+	int ret_val = VERIFY_SUCCESS, zip_verify = 1;
+	string digest_file;
+	twrpDigest* digest = NULL;
+	bool digest_sha2 = false;
+	size_t digested = 0;
 
 	if (strcmp(path, "error") == 0) {
 		LOGERR("Failed to get adb sideload file: '%s'\n", path);
@@ -348,14 +352,15 @@ int TWinstall_zip(const char* path, int* wipe_cache) {
 
 	gui_msg(Msg("installing_zip=Installing zip file '{1}'")(path));
 	if (strlen(path) < 9 || strncmp(path, "/sideload", 9) != 0) {
-		string digest_str;
 		string Full_Filename = path;
 
 		gui_msg("check_for_digest=Checking for Digest file...");
 
-		if (*path != '@' && !twrpDigestDriver::Check_File_Digest(Full_Filename)) {
-			LOGERR("Aborting zip install: Digest verification failed\n");
-			return INSTALL_CORRUPT;
+		// The digest is computed while the signature is verified so the zip is only read once
+		if (*path != '@') {
+			digest_file = twrpDigestDriver::Find_Digest_File(Full_Filename, &digest_sha2);
+			if (!digest_file.empty())
+				digest = twrpDigestDriver::New_Digest(digest_sha2);
 		}
 	}
 
@@ -371,6 +376,7 @@ int TWinstall_zip(const char* path, int* wipe_cache) {
 	if (!map.MapFile(path)) {
 #endif
 		gui_msg(Msg(msg::kError, "fail_sysmap=Failed to map file '{1}'")(path));
+		delete digest;
 		return -1;
 	}
 
@@ -386,10 +392,34 @@ int TWinstall_zip(const char* path, int* wipe_cache) {
 #ifdef USE_MINZIP
 			sysReleaseMap(&map);
 #endif
+			delete digest;
 			return -1;
 		}
-		ret_val = verify_file(map.addr, map.length, loadedKeys, std::bind(&DataManager::SetProgress, std::placeholders::_1));
+		ret_val = verify_file(map.addr, map.length, loadedKeys, std::bind(&DataManager::SetProgress, std::placeholders::_1),
+				[digest, &digested](const unsigned char* data, size_t len) {
+					if (digest) {
+						digest->update(data, len);
+						digested += len;
+					}
+				});
 #endif
+	}
+
+	if (digest) {
+		// Hash whatever the signature check did not cover, all of it when there is no signature check
+		digest->update(map.addr + digested, map.length - digested);
+		bool digest_ok = twrpDigestDriver::Compare_Digest(path, digest_file, digest, digest_sha2);
+		delete digest;
+		if (!digest_ok) {
+			LOGERR("Aborting zip install: Digest verification failed\n");
+#ifdef USE_MINZIP
+			sysReleaseMap(&map);
+#endif
+			return INSTALL_CORRUPT;
+		}
+	}
+
+	if (zip_verify) {
 		if (ret_val != VERIFY_SUCCESS) {
 			LOGINFO("Zip signature verification failed: %i\n", ret_val);
 			gui_err("verify_zip_fail=Zip signature verification failed!");
@@ -53,6 +53,7 @@
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
 	#include "openaes/inc/oaes_lib.h"
 #endif
+#include "twrpAes.hpp"
 #include "set_metadata.h"
 
 extern "C" {
@@ -190,15 +191,19 @@ bool TWFunc::Path_Exists(string Path) {
 Archive_Type TWFunc::Get_File_Type(string fn) {
 	string::size_type i = 0;
 	int firstbyte = 0, secondbyte = 0;
-	char header[3];
+	char header[8] = "";
+	size_t header_len;
 
 	ifstream f;
 	f.open(fn.c_str(), ios::in | ios::binary);
-	f.get(header, 3);
+	f.read(header, sizeof(header));
+	header_len = f.gcount();
 	f.close();
 	firstbyte = header[i] & 0xff;
 	secondbyte = header[++i] & 0xff;
 
+	if (twrpAes::Is_Encrypted(header, header_len))
+		return ENCRYPTED;
 	if (firstbyte == 0x1f && secondbyte == 0x8b)
 		return COMPRESSED;
 	else if (firstbyte == 0x4f && secondbyte == 0x41)
@@ -206,6 +211,48 @@ Archive_Type TWFunc::Get_File_Type(string fn) {
 	return UNCOMPRESSED; // default
 }
 
+// Try_Decrypting_File() for archives written by twrpAes
+static int Try_Decrypting_Aes(string fn, string password) {
+	twrpAes aes(password, 1);
+	uint8_t buffer[512];
+	size_t out_len = 0;
+	int fd;
+
+	fd = open(fn.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		LOGERR("Failed to open '%s' to try decrypt: %s\n", fn.c_str(), strerror(errno));
+		return -1;
+	}
+	// The header holds a check value, a wrong password is caught without decrypting anything
+	if (!aes.Start_Decrypting(fd)) {
+		LOGERR("Failed to decrypt file '%s'\n", fn.c_str());
+		close(fd);
+		return 0;
+	}
+	while (out_len < sizeof(buffer)) {
+		ssize_t len = aes.Read(buffer + out_len, sizeof(buffer) - out_len);
+		if (len <= 0)
+			break;
+		out_len += len;
+	}
+	close(fd);
+	if (out_len >= 2 && buffer[0] == 0x1f && buffer[1] == 0x8b) {
+		LOGINFO("Successfully decrypted '%s' and file is compressed.\n", fn.c_str());
+		return 3; // Compressed
+	}
+	if (out_len >= 262 && strncmp((char*)buffer + 257, "ustar", 5) == 0) {
+		LOGINFO("Successfully decrypted '%s' and file is tar format.\n", fn.c_str());
+		return 2; // Tar
+	}
+	// An archive thread that got no files writes only the end of archive blocks
+	if (out_len == sizeof(buffer) && std::count(buffer, buffer + out_len, 0) == (ssize_t)out_len) {
+		LOGINFO("Successfully decrypted '%s' and file is an empty tar.\n", fn.c_str());
+		return 2; // Tar
+	}
+	LOGINFO("No errors decrypting '%s' but no known file format.\n", fn.c_str());
+	return 1; // Decrypted successfully
+}
+
 int TWFunc::Try_Decrypting_File(string fn, string password) {
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
 	OAES_CTX * ctx = NULL;
@@ -219,6 +266,9 @@ int TWFunc::Try_Decrypting_File(string fn, string password) {
 	size_t _j = 0;
 	size_t _key_data_len = 0;
 
+	if (twrpAes::Is_Encrypted_File(fn))
+		return Try_Decrypting_Aes(fn, password);
+
 	// mostly kanged from OpenAES oaes.c
 	for ( _j = 0; _j < 32; _j++ )
 		_key_data[_j] = _j + 1;
@@ -388,6 +438,32 @@ int32_t TWFunc::timespec_diff_ms(timespec& start, timespec& end)
 			((start.tv_sec * 1000) + start.tv_nsec/1000000);
 }
 
+int TWFunc::read_file(string fn, string& results) {
+	ifstream file;
+	file.open(fn.c_str(), ios::in);
+
+	if (file.is_open()) {
+		file >> results;
+		file.close();
+		return 0;
+	}
+
+	LOGINFO("Cannot find file %s\n", fn.c_str());
+	return -1;
+}
+
+int TWFunc::write_to_file(const string& fn, const string& line) {
+	FILE *file;
+	file = fopen(fn.c_str(), "w");
+	if (file != NULL) {
+		fwrite(line.c_str(), line.size(), 1, file);
+		fclose(file);
+		return 0;
+	}
+	LOGINFO("Cannot find file %s\n", fn.c_str());
+	return -1;
+}
+
 #ifndef BUILD_TWRPTAR_MAIN
 
 // Returns "/path" from a full /path/to/file.name
@@ -798,20 +874,6 @@ unsigned int TWFunc::Get_D_Type_From_Stat(string Path) {
 	return DT_UNKNOWN;
 }
 
-int TWFunc::read_file(string fn, string& results) {
-	ifstream file;
-	file.open(fn.c_str(), ios::in);
-
-	if (file.is_open()) {
-		file >> results;
-		file.close();
-		return 0;
-	}
-
-	LOGINFO("Cannot find file %s\n", fn.c_str());
-	return -1;
-}
-
 int TWFunc::read_file(string fn, vector<string>& results) {
 	ifstream file;
 	string line;
@@ -840,18 +902,6 @@ int TWFunc::read_file(string fn, uint64_t& results) {
 	return -1;
 }
 
-int TWFunc::write_to_file(const string& fn, const string& line) {
-	FILE *file;
-	file = fopen(fn.c_str(), "w");
-	if (file != NULL) {
-		fwrite(line.c_str(), line.size(), 1, file);
-		fclose(file);
-		return 0;
-	}
-	LOGINFO("Cannot find file %s\n", fn.c_str());
-	return -1;
-}
-
 bool TWFunc::Try_Decrypting_Backup(string Restore_Path, string Password) {
 	DIR* d;
 
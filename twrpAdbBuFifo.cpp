@@ -175,6 +175,7 @@ bool twrpAdbBuFifo::Restore_ADB_Backup(void) {
 	char cmd[512];
 
 	part_settings.total_restore_size = 0;
+	part_settings.digest_verifier = NULL;
 
 	PartitionManager.Mount_All_Storage();
 	LOGINFO("opening TW_ADB_BU_CONTROL\n");
@@ -201,7 +202,7 @@ bool twrpAdbBuFifo::Restore_ADB_Backup(void) {
 				memcpy(&twhdr, cmd, sizeof(cmd));
 				LOGINFO("ADB Partition count: %" PRIu64 "\n", twhdr.partition_count);
 				LOGINFO("ADB version: %" PRIu64 "\n", twhdr.version);
-				if (twhdr.version != ADB_BACKUP_VERSION) {
+				if (twhdr.version < ADB_BACKUP_MIN_VERSION || twhdr.version > ADB_BACKUP_VERSION) {
 					LOGERR("Incompatible adb backup version!\n");
 					ret = false;
 					break;
@@ -0,0 +1,589 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#ifndef TW_NO_AES_LIBRARY
+#include <openssl/evp.h>
+#endif
+#include "twrpAes.hpp"
+#include "twcommon.h"
+
+#define TWRP_AES_MAGIC "TWAESCTR"
+#define TWRP_AES_VERSION 1
+
+const size_t min_slice_size = 64 * 1024; // Smallest part of a buffer worth handing to another thread
+
+// Start of every archive, the encrypted tar or gzip stream follows it
+struct twrp_aes_header {
+	char magic[8];
+	uint8_t version;
+	uint8_t key_size;                                    // 16, 24 or 32, follows the password length like openaes
+	uint8_t reserved[6];
+	uint8_t nonce[8];                                    // Random, high half of every counter block
+	uint8_t check[8];                                    // Start of the key stream for counter 0, tells a wrong password apart
+};
+
+static uint8_t sbox[256];
+static uint32_t te[4][256];                                  // Rounds as table lookups, te[i] is te[0] rotated by 8 * i bits
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static inline uint8_t rotl8(uint8_t x, int shift) {
+	return (uint8_t)((x << shift) | (x >> (8 - shift)));
+}
+
+static inline uint8_t xtime(uint8_t x) {
+	return (uint8_t)((x << 1) ^ ((x & 0x80) ? 0x1b : 0));
+}
+
+static inline uint32_t get_u32(const unsigned char *p) {
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline void put_u32(unsigned char *p, uint32_t v) {
+	p[0] = (unsigned char)(v >> 24);
+	p[1] = (unsigned char)(v >> 16);
+	p[2] = (unsigned char)(v >> 8);
+	p[3] = (unsigned char)v;
+}
+
+// The S-box is the multiplicative inverse in GF(2^8) followed by the affine
+// transform, walking the field with generator 3 gives both at once
+static void Build_Tables() {
+	uint8_t p = 1, q = 1;
+
+	do {
+		p = p ^ (uint8_t)(p << 1) ^ ((p & 0x80) ? 0x1b : 0);
+		q ^= q << 1;
+		q ^= q << 2;
+		q ^= q << 4;
+		if (q & 0x80)
+			q ^= 0x09;
+		sbox[p] = q ^ rotl8(q, 1) ^ rotl8(q, 2) ^ rotl8(q, 3) ^ rotl8(q, 4) ^ 0x63;
+	} while (p != 1);
+	sbox[0] = 0x63;
+
+	for (int i = 0; i < 256; i++) {
+		uint8_t s = sbox[i], s2 = xtime(s);
+		uint32_t word = ((uint32_t)s2 << 24) | ((uint32_t)s << 16) | ((uint32_t)s << 8) | (uint32_t)(s2 ^ s);
+
+		te[0][i] = word;
+		te[1][i] = (word >> 8) | (word << 24);
+		te[2][i] = (word >> 16) | (word << 16);
+		te[3][i] = (word >> 24) | (word << 8);
+	}
+}
+
+static void Encrypt_Block(const uint32_t *rk, unsigned rounds, const unsigned char in[16], unsigned char out[16]) {
+	uint32_t s0, s1, s2, s3, t0, t1, t2, t3;
+
+	s0 = get_u32(in) ^ rk[0];
+	s1 = get_u32(in + 4) ^ rk[1];
+	s2 = get_u32(in + 8) ^ rk[2];
+	s3 = get_u32(in + 12) ^ rk[3];
+	for (unsigned r = 1; r < rounds; r++) {
+		rk += 4;
+		t0 = te[0][s0 >> 24] ^ te[1][(s1 >> 16) & 0xff] ^ te[2][(s2 >> 8) & 0xff] ^ te[3][s3 & 0xff] ^ rk[0];
+		t1 = te[0][s1 >> 24] ^ te[1][(s2 >> 16) & 0xff] ^ te[2][(s3 >> 8) & 0xff] ^ te[3][s0 & 0xff] ^ rk[1];
+		t2 = te[0][s2 >> 24] ^ te[1][(s3 >> 16) & 0xff] ^ te[2][(s0 >> 8) & 0xff] ^ te[3][s1 & 0xff] ^ rk[2];
+		t3 = te[0][s3 >> 24] ^ te[1][(s0 >> 16) & 0xff] ^ te[2][(s1 >> 8) & 0xff] ^ te[3][s2 & 0xff] ^ rk[3];
+		s0 = t0;
+		s1 = t1;
+		s2 = t2;
+		s3 = t3;
+	}
+	// The last round has no MixColumns
+	rk += 4;
+	put_u32(out, (((uint32_t)sbox[s0 >> 24] << 24) | ((uint32_t)sbox[(s1 >> 16) & 0xff] << 16) | ((uint32_t)sbox[(s2 >> 8) & 0xff] << 8) | sbox[s3 & 0xff]) ^ rk[0]);
+	put_u32(out + 4, (((uint32_t)sbox[s1 >> 24] << 24) | ((uint32_t)sbox[(s2 >> 16) & 0xff] << 16) | ((uint32_t)sbox[(s3 >> 8) & 0xff] << 8) | sbox[s0 & 0xff]) ^ rk[1]);
+	put_u32(out + 8, (((uint32_t)sbox[s2 >> 24] << 24) | ((uint32_t)sbox[(s3 >> 16) & 0xff] << 16) | ((uint32_t)sbox[(s0 >> 8) & 0xff] << 8) | sbox[s1 & 0xff]) ^ rk[2]);
+	put_u32(out + 12, (((uint32_t)sbox[s3 >> 24] << 24) | ((uint32_t)sbox[(s0 >> 16) & 0xff] << 16) | ((uint32_t)sbox[(s1 >> 8) & 0xff] << 8) | sbox[s2 & 0xff]) ^ rk[3]);
+}
+
+twrpAes::twrpAes(const std::string &Password, unsigned threads) {
+	unsigned char key_data[32];
+
+	pthread_once(&tables_once, Build_Tables);
+#ifndef TW_NO_AES_LIBRARY
+	engine = ENGINE_LIBRARY;
+#else
+	engine = ENGINE_TABLE;
+#endif
+	if (threads == 0) {
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cores > 0 ? cores : 1;
+	}
+	thread_count = threads;
+	pool_started = false;
+	pool_stop = false;
+	pthread_mutex_init(&pool_lock, NULL);
+	pthread_cond_init(&pool_work, NULL);
+	pthread_cond_init(&pool_done, NULL);
+	next_slice = 0;
+	slices_left = 0;
+	fd = -1;
+	position = 0;
+	memset(nonce, 0, sizeof(nonce));
+
+	// Same key as openaes makes from the password: 1, 2, 3... padded to 16, 24 or 32 bytes
+	for (int i = 0; i < 32; i++)
+		key_data[i] = i + 1;
+	memcpy(key_data, Password.data(), Password.size() < 32 ? Password.size() : 32);
+	if (Password.size() <= 16)
+		Set_Key(key_data, 16);
+	else if (Password.size() <= 24)
+		Set_Key(key_data, 24);
+	else
+		Set_Key(key_data, 32);
+	memset(key_data, 0, sizeof(key_data));
+}
+
+twrpAes::~twrpAes() {
+	pthread_mutex_lock(&pool_lock);
+	pool_stop = true;
+	pthread_cond_broadcast(&pool_work);
+	pthread_mutex_unlock(&pool_lock);
+	for (size_t i = 0; i < pool.size(); i++)
+		pthread_join(pool[i], NULL);
+	pthread_cond_destroy(&pool_done);
+	pthread_cond_destroy(&pool_work);
+	pthread_mutex_destroy(&pool_lock);
+	memset(key, 0, sizeof(key));
+	memset(round_keys, 0, sizeof(round_keys));
+}
+
+void twrpAes::Set_Key(const unsigned char *key_data, size_t len) {
+	unsigned words = len / 4, total;
+	uint8_t rcon = 1;
+
+	memcpy(key, key_data, len);
+	key_size = len;
+	rounds = words + 6;
+	total = 4 * (rounds + 1);
+	for (unsigned i = 0; i < words; i++)
+		round_keys[i] = get_u32(key_data + 4 * i);
+	for (unsigned i = words; i < total; i++) {
+		uint32_t t = round_keys[i - 1];
+
+		if (i % words == 0) {
+			t = (t << 8) | (t >> 24);
+			t = ((uint32_t)sbox[t >> 24] << 24) | ((uint32_t)sbox[(t >> 16) & 0xff] << 16) | ((uint32_t)sbox[(t >> 8) & 0xff] << 8) | sbox[t & 0xff];
+			t ^= (uint32_t)rcon << 24;
+			rcon = xtime(rcon);
+		} else if (words > 6 && i % words == 4) {
+			t = ((uint32_t)sbox[t >> 24] << 24) | ((uint32_t)sbox[(t >> 16) & 0xff] << 16) | ((uint32_t)sbox[(t >> 8) & 0xff] << 8) | sbox[t & 0xff];
+		}
+		round_keys[i] = round_keys[i - words] ^ t;
+	}
+}
+
+bool twrpAes::Start_Encrypting(int out_fd) {
+	struct twrp_aes_header header;
+	size_t done = 0;
+	int random_fd;
+
+	random_fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	if (random_fd < 0) {
+		LOGINFO("twrpAes: unable to open /dev/urandom: %s\n", strerror(errno));
+		return false;
+	}
+	memset(nonce, 0, sizeof(nonce));
+	while (done < 8) {
+		ssize_t n = read(random_fd, nonce + done, 8 - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			LOGINFO("twrpAes: unable to read a nonce: %s\n", strerror(errno));
+			close(random_fd);
+			return false;
+		}
+		done += n;
+	}
+	close(random_fd);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TWRP_AES_MAGIC, sizeof(header.magic));
+	header.version = TWRP_AES_VERSION;
+	header.key_size = key_size;
+	memcpy(header.nonce, nonce, sizeof(header.nonce));
+	Check_Value(header.check);
+
+	fd = out_fd;
+	position = 0;
+	for (done = 0; done < sizeof(header);) {
+		ssize_t n = write(fd, (const char*)&header + done, sizeof(header) - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			LOGINFO("twrpAes: unable to write the header: %s\n", strerror(errno));
+			return false;
+		}
+		done += n;
+	}
+	return true;
+}
+
+ssize_t twrpAes::Write(const void *buf, size_t len) {
+	size_t done = 0;
+
+	if (buffer.size() < len)
+		buffer.resize(len);
+	Crypt(position, (const unsigned char*)buf, &buffer[0], len);
+	while (done < len) {
+		ssize_t n = write(fd, &buffer[done], len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			LOGINFO("twrpAes: write failed: %s\n", strerror(errno));
+			return -1;
+		}
+		done += n;
+	}
+	position += len;
+	return len;
+}
+
+bool twrpAes::Start_Decrypting(int in_fd) {
+	struct twrp_aes_header header;
+	unsigned char check[8];
+	size_t done = 0;
+
+	while (done < sizeof(header)) {
+		ssize_t n = read(in_fd, (char*)&header + done, sizeof(header) - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			LOGINFO("twrpAes: unable to read the header\n");
+			return false;
+		}
+		done += n;
+	}
+	if (!Is_Encrypted(&header, sizeof(header)) || header.version != TWRP_AES_VERSION) {
+		LOGINFO("twrpAes: unknown header\n");
+		return false;
+	}
+	// The key size comes from the password length, so a mismatch is a wrong password
+	memset(nonce, 0, sizeof(nonce));
+	memcpy(nonce, header.nonce, sizeof(header.nonce));
+	Check_Value(check);
+	if (header.key_size != key_size || memcmp(check, header.check, sizeof(check)) != 0) {
+		LOGINFO("twrpAes: wrong password\n");
+		return false;
+	}
+	fd = in_fd;
+	position = 0;
+	return true;
+}
+
+ssize_t twrpAes::Read(void *buf, size_t len) {
+	ssize_t n;
+
+	do {
+		n = read(fd, buf, len);
+	} while (n < 0 && errno == EINTR);
+	if (n <= 0)
+		return n;
+	Crypt(position, (unsigned char*)buf, (unsigned char*)buf, n);
+	position += n;
+	return n;
+}
+
+bool twrpAes::Read_At(uint64_t offset, void *buf, size_t len) {
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t n = pread(fd, (char*)buf + done, len - done, Header_Size() + offset + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		done += n;
+	}
+	Crypt(offset, (unsigned char*)buf, (unsigned char*)buf, len);
+	return true;
+}
+
+void twrpAes::Crypt(uint64_t offset, const unsigned char *in, unsigned char *out, size_t len) {
+	size_t count = thread_count, slice_len, start = 0;
+	bool failed = false;
+
+	if (count > len / min_slice_size)
+		count = len / min_slice_size;
+	if (count > 1)
+		Start_Pool();
+	if (count <= 1 || pool.empty()) {
+		failed = !Crypt_Slice(offset, in, out, len);
+	} else {
+		// Every slice but the last is a whole number of blocks, this thread takes slices too
+		slice_len = (len / count + 15) & ~(size_t)15;
+		pthread_mutex_lock(&pool_lock);
+		slices.resize(count);
+		for (size_t i = 0; i < count; i++) {
+			slices[i].offset = offset + start;
+			slices[i].in = in + start;
+			slices[i].out = out + start;
+			slices[i].len = i == count - 1 ? len - start : slice_len;
+			slices[i].failed = false;
+			start += slices[i].len;
+		}
+		next_slice = 0;
+		slices_left = count;
+		pthread_cond_broadcast(&pool_work);
+		Run_Slices();
+		while (slices_left > 0)
+			pthread_cond_wait(&pool_done, &pool_lock);
+		for (size_t i = 0; i < count; i++)
+			failed = failed || slices[i].failed;
+		pthread_mutex_unlock(&pool_lock);
+	}
+
+	// Only changed here, with every slice done, so the pool never sees it change
+	if (failed && engine == ENGINE_LIBRARY) {
+		LOGERR("twrpAes: libcrypto failed, falling back to the built in engine\n");
+		engine = ENGINE_TABLE;
+	}
+}
+
+void twrpAes::Start_Pool() {
+	pthread_t thread;
+
+	if (pool_started)
+		return;
+	pool_started = true;
+	for (unsigned i = 1; i < thread_count; i++) {
+		if (pthread_create(&thread, NULL, Pool_Thread, this) != 0) {
+			LOGINFO("twrpAes: unable to start thread %u\n", i);
+			break;
+		}
+		pool.push_back(thread);
+	}
+}
+
+void twrpAes::Run_Slices() {
+	while (next_slice < slices.size()) {
+		Slice &slice = slices[next_slice++];
+
+		pthread_mutex_unlock(&pool_lock);
+		slice.failed = !Crypt_Slice(slice.offset, slice.in, slice.out, slice.len);
+		pthread_mutex_lock(&pool_lock);
+		if (--slices_left == 0)
+			pthread_cond_signal(&pool_done);
+	}
+}
+
+void* twrpAes::Pool_Thread(void *cookie) {
+	twrpAes *aes = (twrpAes*) cookie;
+
+	pthread_mutex_lock(&aes->pool_lock);
+	for (;;) {
+		while (!aes->pool_stop && aes->next_slice >= aes->slices.size())
+			pthread_cond_wait(&aes->pool_work, &aes->pool_lock);
+		if (aes->pool_stop)
+			break;
+		aes->Run_Slices();
+	}
+	pthread_mutex_unlock(&aes->pool_lock);
+	return NULL;
+}
+
+// Counter 0 is for the check value, the data starts at counter 1
+bool twrpAes::Crypt_Slice(uint64_t offset, const unsigned char *in, unsigned char *out, size_t len) {
+	uint64_t block = 1 + offset / 16;
+	size_t skip = offset % 16;
+
+	if (engine == ENGINE_LIBRARY)
+		return Library_Ctr(block, skip, in, out, len);
+	Table_Ctr(block, skip, in, out, len);
+	return true;
+}
+
+void twrpAes::Table_Ctr(uint64_t block, size_t skip, const unsigned char *in, unsigned char *out, size_t len) {
+	unsigned char counter[16], stream[16];
+
+	while (len > 0) {
+		size_t n = 16 - skip < len ? 16 - skip : len;
+
+		Counter_Block(block, counter);
+		Encrypt_Block(round_keys, rounds, counter, stream);
+		if (n == 16) {
+			uint64_t a, b, c, d;
+
+			memcpy(&a, in, 8);
+			memcpy(&b, in + 8, 8);
+			memcpy(&c, stream, 8);
+			memcpy(&d, stream + 8, 8);
+			a ^= c;
+			b ^= d;
+			memcpy(out, &a, 8);
+			memcpy(out + 8, &b, 8);
+		} else {
+			for (size_t i = 0; i < n; i++)
+				out[i] = in[i] ^ stream[skip + i];
+		}
+		in += n;
+		out += n;
+		len -= n;
+		skip = 0;
+		block++;
+	}
+}
+
+bool twrpAes::Library_Ctr(uint64_t block, size_t skip, const unsigned char *in, unsigned char *out, size_t len) {
+#ifndef TW_NO_AES_LIBRARY
+	const EVP_CIPHER *cipher = key_size == 16 ? EVP_aes_128_ctr() : key_size == 24 ? EVP_aes_192_ctr() : EVP_aes_256_ctr();
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	unsigned char counter[16], discard[16];
+	bool ok = ctx != NULL;
+	size_t done = 0;                                     // Bytes libcrypto has done
+	int n;
+
+	Counter_Block(block, counter);
+	ok = ok && EVP_EncryptInit_ex(ctx, cipher, NULL, key, counter) == 1;
+	// Start part way into the first block by throwing away its first bytes
+	if (ok && skip > 0) {
+		memset(discard, 0, sizeof(discard));
+		ok = EVP_EncryptUpdate(ctx, discard, &n, discard, skip) == 1;
+	}
+	while (ok && done < len) {
+		size_t chunk = len - done < (1 << 30) ? len - done : (1 << 30);
+
+		ok = EVP_EncryptUpdate(ctx, out + done, &n, in + done, chunk) == 1;
+		if (ok)
+			done += chunk;
+	}
+	if (ctx != NULL)
+		EVP_CIPHER_CTX_free(ctx);
+	if (!ok) {
+		// Redo everything from the first chunk that failed, with the counter moved past what is done
+		size_t pos = skip + done;
+
+		Table_Ctr(block + pos / 16, pos % 16, in + done, out + done, len - done);
+	}
+	return ok;
+#else
+	Table_Ctr(block, skip, in, out, len);
+	return true;
+#endif
+}
+
+// The low 8 bytes of the nonce count blocks, the high 8 stay the same
+void twrpAes::Counter_Block(uint64_t block, unsigned char counter[16]) const {
+	uint64_t low = 0;
+
+	for (int i = 8; i < 16; i++)
+		low = (low << 8) | nonce[i];
+	low += block;
+	memcpy(counter, nonce, 8);
+	for (int i = 15; i >= 8; i--) {
+		counter[i] = (unsigned char)low;
+		low >>= 8;
+	}
+}
+
+void twrpAes::Check_Value(unsigned char check[8]) {
+	unsigned char counter[16], stream[16];
+
+	Counter_Block(0, counter);
+	Encrypt_Block(round_keys, rounds, counter, stream);
+	memcpy(check, stream, 8);
+}
+
+bool twrpAes::Set_Engine(Engine new_engine) {
+#ifdef TW_NO_AES_LIBRARY
+	if (new_engine == ENGINE_LIBRARY)
+		return false;
+#endif
+	engine = new_engine;
+	return true;
+}
+
+twrpAes::Engine twrpAes::Get_Engine() const {
+	return engine;
+}
+
+const char* twrpAes::Engine_Name(Engine engine) {
+	return engine == ENGINE_LIBRARY ? "libcrypto" : "T-table";
+}
+
+bool twrpAes::Is_Encrypted(const void *buf, size_t len) {
+	return len >= 8 && memcmp(buf, TWRP_AES_MAGIC, 8) == 0;
+}
+
+bool twrpAes::Is_Encrypted_File(const std::string &Filename) {
+	char magic[8];
+	ssize_t n;
+	int file_fd = open(Filename.c_str(), O_RDONLY | O_CLOEXEC);
+
+	if (file_fd < 0)
+		return false;
+	n = read(file_fd, magic, sizeof(magic));
+	close(file_fd);
+	return n == sizeof(magic) && Is_Encrypted(magic, sizeof(magic));
+}
+
+size_t twrpAes::Header_Size() {
+	return sizeof(struct twrp_aes_header);
+}
+
+bool twrpAes::Self_Test() {
+	static const unsigned char key128[16] = {
+		0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c };
+	static const unsigned char key256[32] = {
+		0x60, 0x3d, 0xeb, 0x10, 0x15, 0xca, 0x71, 0xbe, 0x2b, 0x73, 0xae, 0xf0, 0x85, 0x7d, 0x77, 0x81,
+		0x1f, 0x35, 0x2c, 0x07, 0x3b, 0x61, 0x08, 0xd7, 0x2d, 0x98, 0x10, 0xa3, 0x09, 0x14, 0xdf, 0xf4 };
+	// Initial counter f0f1...feff less one, Crypt() starts the data at counter 1
+	static const unsigned char counter[16] = {
+		0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xfe };
+	static const unsigned char plain[32] = {
+		0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+		0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51 };
+	static const unsigned char cipher128[32] = {
+		0x87, 0x4d, 0x61, 0x91, 0xb6, 0x20, 0xe3, 0x26, 0x1b, 0xef, 0x68, 0x64, 0x99, 0x0d, 0xb6, 0xce,
+		0x98, 0x06, 0xf6, 0x6b, 0x79, 0x70, 0xfd, 0xff, 0x86, 0x17, 0x18, 0x7b, 0xb9, 0xff, 0xfd, 0xff };
+	static const unsigned char cipher256[32] = {
+		0x60, 0x1e, 0xc3, 0x13, 0x77, 0x57, 0x89, 0xa5, 0xb7, 0xa7, 0xf5, 0x04, 0xbb, 0xf3, 0xd2, 0x28,
+		0xf4, 0x43, 0xe3, 0xca, 0x4d, 0x62, 0xb5, 0x9a, 0xca, 0x84, 0xe9, 0x90, 0xca, 0xca, 0xf5, 0xc5 };
+	bool ok = true;
+
+	for (int e = ENGINE_TABLE; e <= ENGINE_LIBRARY; e++) {
+		twrpAes aes("", 1);
+		unsigned char out[32];
+
+		if (!aes.Set_Engine((Engine) e))
+			continue;
+		memcpy(aes.nonce, counter, sizeof(counter));
+		aes.Set_Key(key128, sizeof(key128));
+		aes.Crypt(0, plain, out, sizeof(out));
+		if (memcmp(out, cipher128, sizeof(out)) != 0) {
+			LOGERR("twrpAes: %s AES-128 self test failed\n", Engine_Name((Engine) e));
+			ok = false;
+		}
+		aes.Set_Key(key256, sizeof(key256));
+		// Two pieces, the second one starting in the middle of a block
+		aes.Crypt(0, plain, out, 7);
+		aes.Crypt(7, plain + 7, out + 7, sizeof(out) - 7);
+		if (memcmp(out, cipher256, sizeof(out)) != 0) {
+			LOGERR("twrpAes: %s AES-256 self test failed\n", Engine_Name((Engine) e));
+			ok = false;
+		}
+	}
+	return ok;
+}
@@ -0,0 +1,105 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRPAES_HPP
+#define __TWRPAES_HPP
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+// In-process replacement for piping backups through openaes. Archives are
+// encrypted with AES in counter mode instead of CBC, so every part of an
+// archive can be encrypted or decrypted on its own: big buffers are split
+// across threads and a few bytes can be decrypted without reading anything
+// before them. The key is made from the password the same way openaes does
+// it. Rounds run on libcrypto, which uses the AES instructions of the CPU
+// when it has them, or on built in 32 bit T-tables.
+// Archives written by openaes start with a different header and are still
+// restored through the openaes binary.
+class twrpAes
+{
+public:
+	enum Engine {
+		ENGINE_TABLE,                                // Built in T-table rounds
+		ENGINE_LIBRARY                               // libcrypto, hardware AES where the CPU has it
+	};
+
+	twrpAes(const std::string &Password, unsigned threads); // threads 0 uses one per core
+	~twrpAes();
+
+	bool Start_Encrypting(int out_fd);                   // Writes the header with a new nonce to out_fd
+	ssize_t Write(const void *buf, size_t len);          // Encrypts buf to out_fd, returns len or -1 on error
+	bool Start_Decrypting(int in_fd);                    // Reads the header from in_fd, false if it is not ours or the password is wrong
+	ssize_t Read(void *buf, size_t len);                 // Reads and decrypts up to len bytes, 0 at the end
+	bool Read_At(uint64_t offset, void *buf, size_t len); // Decrypts len bytes at offset of the plain stream without moving Read()
+	void Crypt(uint64_t offset, const unsigned char *in, unsigned char *out, size_t len); // Encrypts or decrypts len bytes at offset of the plain stream
+	bool Set_Engine(Engine engine);                      // false if engine is not built in
+	Engine Get_Engine() const;
+	static const char* Engine_Name(Engine engine);
+	static bool Is_Encrypted(const void *buf, size_t len); // buf starts with the header of an archive written by twrpAes
+	static bool Is_Encrypted_File(const std::string &Filename);
+	static size_t Header_Size();
+	static bool Self_Test();                             // Checks both engines against the NIST SP 800-38A vectors
+
+private:
+	struct Slice {
+		uint64_t offset;
+		const unsigned char *in;
+		unsigned char *out;
+		size_t len;
+		bool failed;                                 // libcrypto failed, the slice was finished with the T-tables
+	};
+
+	void Set_Key(const unsigned char *key_data, size_t len);
+	bool Crypt_Slice(uint64_t offset, const unsigned char *in, unsigned char *out, size_t len); // false if libcrypto failed
+	void Table_Ctr(uint64_t block, size_t skip, const unsigned char *in, unsigned char *out, size_t len);
+	bool Library_Ctr(uint64_t block, size_t skip, const unsigned char *in, unsigned char *out, size_t len);
+	void Counter_Block(uint64_t block, unsigned char counter[16]) const;
+	void Check_Value(unsigned char check[8]);
+	void Start_Pool();
+	void Run_Slices();                                   // Works on slices until none are left to take, pool_lock held
+	static void* Pool_Thread(void *cookie);
+
+	Engine engine;
+	unsigned thread_count;
+	unsigned char key[32];
+	size_t key_size;
+	uint32_t round_keys[60];                             // Expanded key for the T-table rounds
+	unsigned rounds;
+	unsigned char nonce[16];                             // Counter block for counter 0, the low 8 bytes count 16 byte blocks
+	int fd;
+	uint64_t position;                                   // Offset in the plain stream of the next Write() or Read()
+	std::vector<unsigned char> buffer;                   // Encrypted copy of the data handed to Write()
+
+	// Threads that take slices of the buffers handed to Crypt(), started
+	// by the first buffer big enough to split and kept until destruction
+	std::vector<pthread_t> pool;
+	bool pool_started;
+	bool pool_stop;
+	pthread_mutex_t pool_lock;
+	pthread_cond_t pool_work;                            // Signalled when slices are queued or the pool should exit
+	pthread_cond_t pool_done;                            // Signalled when the last slice of a Crypt() is done
+	std::vector<Slice> slices;                           // Slices of the running Crypt()
+	size_t next_slice;                                   // Next slice for a thread to take
+	size_t slices_left;                                  // Slices not finished yet
+};
+
+#endif // __TWRPAES_HPP
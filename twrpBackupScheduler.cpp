@@ -0,0 +1,229 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include "twrpBackupScheduler.hpp"
+#include "twrp-functions.hpp"
+#include "twcommon.h"
+
+twrpBackupScheduler::twrpBackupScheduler(unsigned io_jobs, unsigned cpus, const std::string &dest) {
+	io_budget = io_jobs ? io_jobs : 1;
+	cpu_budget = cpus ? cpus : 1;
+	dest_device = dest;
+	cpu_used = 0;
+	running = 0;
+	fork_running = false;
+	failed = false;
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+}
+
+twrpBackupScheduler::~twrpBackupScheduler() {
+	for (size_t i = 0; i < jobs.size(); i++) {
+		delete jobs[i]->progress;
+		delete jobs[i];
+	}
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&lock);
+}
+
+void twrpBackupScheduler::Add(const PartitionSettings &part_settings, const std::string &io_device, unsigned cpu_cost, bool forks) {
+	Job *job = new Job;
+
+	job->part_settings = part_settings;
+	job->progress = NULL;
+	job->io_device = io_device;
+	// A backup needing every core still has to run once nothing else is
+	job->cpu_cost = cpu_cost < cpu_budget ? cpu_cost : cpu_budget;
+	job->forks = forks;
+	job->started = false;
+	job->result = false;
+	job->threaded = false;
+	job->scheduler = this;
+	jobs.push_back(job);
+}
+
+bool twrpBackupScheduler::Run(PartitionSettings *part_settings) {
+	std::vector<Job*> started;
+	size_t pending = jobs.size();
+	bool ret = true;
+
+	pthread_mutex_lock(&lock);
+	failed = false;
+	while (pending > 0) {
+		Job *next = NULL;
+
+		if (failed || PartitionManager.Check_Backup_Cancel() != 0)
+			break;
+		for (size_t i = 0; i < jobs.size(); i++) {
+			if (!jobs[i]->started && Can_Start(*jobs[i])) {
+				next = jobs[i];
+				break;
+			}
+		}
+		if (next == NULL) {
+			// Wait for a running backup to free up its device and cores
+			pthread_cond_wait(&cond, &lock);
+			continue;
+		}
+		next->started = true;
+		next->progress = new ProgressTracking(part_settings->progress);
+		next->part_settings.progress = next->progress;
+		cpu_used += next->cpu_cost;
+		running++;
+		if (next->forks)
+			fork_running = true;
+		running_devices.push_back(next->io_device);
+		if (next->io_device != dest_device)
+			running_devices.push_back(dest_device);
+		LOGINFO("Starting backup of %s (device %s, %u cores, %u backups running)\n", next->part_settings.Part->Backup_Display_Name.c_str(), next->io_device.c_str(), next->cpu_cost, running);
+		next->threaded = pthread_create(&next->thread, NULL, Worker, next) == 0;
+		if (!next->threaded) {
+			LOGINFO("twrpBackupScheduler: unable to start a thread, backing up %s here\n", next->part_settings.Part->Backup_Display_Name.c_str());
+			pthread_mutex_unlock(&lock);
+			Worker(next);
+			pthread_mutex_lock(&lock);
+		}
+		started.push_back(next);
+		pending--;
+	}
+	while (running > 0)
+		pthread_cond_wait(&cond, &lock);
+	pthread_mutex_unlock(&lock);
+
+	for (size_t i = 0; i < started.size(); i++) {
+		if (started[i]->threaded)
+			pthread_join(started[i]->thread, NULL);
+		if (!started[i]->result)
+			ret = false;
+		part_settings->file_time += started[i]->part_settings.file_time;
+		part_settings->img_time += started[i]->part_settings.img_time;
+	}
+	if (started.size() != jobs.size())
+		ret = false;
+	return ret;
+}
+
+std::string twrpBackupScheduler::Get_Disk(const std::string &Block_Device) {
+	struct stat st;
+
+	if (stat(Block_Device.c_str(), &st) != 0 || !S_ISBLK(st.st_mode))
+		return Block_Device;
+	return Get_Disk(st.st_rdev, Block_Device);
+}
+
+std::string twrpBackupScheduler::Get_Folder_Disk(const std::string &Folder) {
+	struct stat st;
+
+	if (stat(Folder.c_str(), &st) != 0)
+		return Folder;
+	return Get_Disk(st.st_dev, Folder);
+}
+
+std::string twrpBackupScheduler::Get_Disk(dev_t dev, const std::string &Fallback) {
+	char sys_path[PATH_MAX], real_path[PATH_MAX];
+	std::string path;
+
+	snprintf(sys_path, sizeof(sys_path), "/sys/dev/block/%u:%u", major(dev), minor(dev));
+	path = sys_path;
+
+	// Device mapper (decrypted data) sits on top of the partition listed in slaves
+	DIR *d = opendir((path + "/slaves").c_str());
+	if (d != NULL) {
+		struct dirent *de;
+		std::string slave;
+
+		while ((de = readdir(d)) != NULL) {
+			if (de->d_name[0] != '.') {
+				slave = de->d_name;
+				break;
+			}
+		}
+		closedir(d);
+		if (!slave.empty())
+			path = "/sys/class/block/" + slave;
+	}
+
+	if (realpath(path.c_str(), real_path) == NULL)
+		return Fallback;
+	path = real_path;
+	// Partitions are listed in the directory of the disk they are on
+	if (TWFunc::Path_Exists(path + "/partition"))
+		path = path.substr(0, path.find_last_of('/'));
+	return TWFunc::Get_Filename(path);
+}
+
+void* twrpBackupScheduler::Worker(void *cookie) {
+	Job *job = (Job*) cookie;
+	twrpBackupScheduler *scheduler = job->scheduler;
+	bool result = PartitionManager.Backup_Partition(&job->part_settings);
+
+	pthread_mutex_lock(&scheduler->lock);
+	job->result = result;
+	scheduler->cpu_used -= job->cpu_cost;
+	scheduler->running--;
+	if (job->forks)
+		scheduler->fork_running = false;
+	scheduler->Remove_Device(job->io_device);
+	if (job->io_device != scheduler->dest_device)
+		scheduler->Remove_Device(scheduler->dest_device);
+	if (!result) {
+		LOGINFO("Backup of %s failed, not starting any more backups\n", job->part_settings.Part->Backup_Display_Name.c_str());
+		scheduler->failed = true;
+	}
+	pthread_cond_broadcast(&scheduler->cond);
+	pthread_mutex_unlock(&scheduler->lock);
+	return NULL;
+}
+
+bool twrpBackupScheduler::Can_Start(const Job &job) {
+	if (running == 0)
+		return true;
+	// A fork only copies the thread calling it, locks held by the others stay locked in the child
+	if (job.forks || fork_running)
+		return false;
+	if (cpu_used + job.cpu_cost > cpu_budget)
+		return false;
+	return Device_Jobs(job.io_device) < io_budget && Device_Jobs(dest_device) < io_budget;
+}
+
+void twrpBackupScheduler::Remove_Device(const std::string &io_device) {
+	for (size_t i = 0; i < running_devices.size(); i++) {
+		if (running_devices[i] == io_device) {
+			running_devices.erase(running_devices.begin() + i);
+			break;
+		}
+	}
+}
+
+unsigned twrpBackupScheduler::Device_Jobs(const std::string &io_device) {
+	unsigned count = 0;
+
+	for (size_t i = 0; i < running_devices.size(); i++) {
+		if (running_devices[i] == io_device)
+			count++;
+	}
+	return count;
+}
@@ -0,0 +1,81 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRPBACKUPSCHEDULER_HPP
+#define __TWRPBACKUPSCHEDULER_HPP
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include "partitions.hpp"
+#include "progresstracking.hpp"
+
+// Runs the backups of several partitions at the same time. A backup is
+// started, in the order they were added, once the storage device it reads
+// from and the one the backup folder is on are each used by fewer than
+// io_budget backups and the cores it needs fit in what cpu_budget has left.
+// Backups that fork (tar and dump_image) only run alone. The forked tar
+// keeps logging and reading settings, which would deadlock on a lock
+// another backup thread held at the moment of the fork.
+// Every backup gets its own copy of the PartitionSettings and a tracker
+// that adds its progress to the one passed to Run().
+class twrpBackupScheduler
+{
+public:
+	twrpBackupScheduler(unsigned io_budget, unsigned cpu_budget, const std::string &dest_device);
+	~twrpBackupScheduler();
+
+	void Add(const PartitionSettings &part_settings, const std::string &io_device, unsigned cpu_cost, bool forks);
+	bool Run(PartitionSettings *part_settings);          // Backs up everything added, times are added to part_settings, false if any backup failed or was cancelled
+	static std::string Get_Disk(const std::string &Block_Device); // Name of the storage device holding a partition, for io_device
+	static std::string Get_Folder_Disk(const std::string &Folder); // Name of the storage device a folder is on, for dest_device
+
+private:
+	struct Job {
+		PartitionSettings part_settings;
+		ProgressTracking *progress;
+		std::string io_device;
+		unsigned cpu_cost;
+		bool forks;
+		bool started;
+		bool result;
+		bool threaded;                               // thread was started and has to be joined
+		pthread_t thread;
+		twrpBackupScheduler *scheduler;
+	};
+
+	static void* Worker(void *cookie);
+	static std::string Get_Disk(dev_t dev, const std::string &Fallback);
+	bool Can_Start(const Job &job);
+	unsigned Device_Jobs(const std::string &io_device);
+	void Remove_Device(const std::string &io_device);  // Drops one running_devices entry of io_device
+
+	std::vector<Job*> jobs;
+	unsigned io_budget;
+	unsigned cpu_budget;
+	std::string dest_device;                             // Storage device every backup writes to
+	unsigned cpu_used;                                   // Sum of the cpu_cost of the running backups
+	unsigned running;
+	bool fork_running;
+	bool failed;                                         // A backup failed, no more are started
+	std::vector<std::string> running_devices;            // io_device and dest_device of each running backup
+	pthread_mutex_t lock;
+	pthread_cond_t cond;                                 // Signalled when a backup finishes
+};
+
+#endif // __TWRPBACKUPSCHEDULER_HPP
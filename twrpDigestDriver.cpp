@@ -17,78 +17,64 @@
 */
 
 
+#include <errno.h>
 #include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <algorithm>
 #include <string>
 #include <unistd.h>
+#ifndef BUILD_TWRPTAR_MAIN
 #include "data.hpp"
 #include "partitions.hpp"
 #include "set_metadata.h"
-#include "twrpDigestDriver.hpp"
+#include "variables.h"
+#endif
 #include "twrp-functions.hpp"
+#include "twrpDigestDriver.hpp"
 #include "twcommon.h"
-#include "variables.h"
 #include "gui/gui.hpp"
 #include "twrpDigest/twrpDigest.hpp"
 #include "twrpDigest/twrpMD5.hpp"
+#ifndef TW_NO_SHA2_LIBRARY
 #include "twrpDigest/twrpSHA.hpp"
+#endif
 
 
-bool twrpDigestDriver::Check_File_Digest(const string& Filename) {
-	twrpDigest *digest;
-	string digestfile = Filename, file_name = Filename;
-	string digest_str;
-	bool use_sha2 = false;
+string twrpDigestDriver::Find_Digest_File(const string& Filename, bool* use_sha2) {
+	string digestfile;
 
+	*use_sha2 = false;
 #ifndef TW_NO_SHA2_LIBRARY
-
-	digestfile += ".sha2";
+	digestfile = Filename + ".sha2";
 	if (TWFunc::Path_Exists(digestfile)) {
-		digest = new twrpSHA256();
-		use_sha2 = true;
+		*use_sha2 = true;
+		return digestfile;
 	}
-	else {
-		digestfile = Filename + ".sha256";
-		if (TWFunc::Path_Exists(digestfile)) {
-			digest = new twrpSHA256();
-			use_sha2 = true;
-		} else {
-			digest = new twrpMD5();
-			digestfile = Filename + ".md5";
-			if (!TWFunc::Path_Exists(digestfile)) {
-				digestfile = Filename + ".md5sum";
-			}
-		}
-	}
-#else
-	digest = new twrpMD5();
-	digestfile = Filename + ".md5";
-	if (!TWFunc::Path_Exists(digestfile)) {
-		digestfile = Filename + ".md5sum";
+	digestfile = Filename + ".sha256";
+	if (TWFunc::Path_Exists(digestfile)) {
+		*use_sha2 = true;
+		return digestfile;
 	}
-
 #endif
+	digestfile = Filename + ".md5";
+	if (TWFunc::Path_Exists(digestfile))
+		return digestfile;
+	digestfile = Filename + ".md5sum";
+	if (TWFunc::Path_Exists(digestfile))
+		return digestfile;
+	return "";
+}
 
-	if (!TWFunc::Path_Exists(digestfile)) {
-		delete digest;
-		if (Filename.find(".zip") == std::string::npos && Filename.find(".map") == std::string::npos) {
-			gui_msg(Msg(msg::kError, "no_digest_found=No digest file found for '{1}'. Please unselect Enable Digest verification to restore.")(Filename));
-		} else {
-			return true;
-		}
-		return false;
-	}
-
+bool twrpDigestDriver::Compare_Digest(const string& Filename, const string& digestfile, twrpDigest* digest, bool use_sha2) {
+	string digest_str;
 
 	if (TWFunc::read_file(digestfile, digest_str) != 0) {
 		gui_msg("digest_error=Digest Error!");
-		delete digest;
 		return false;
 	}
 
-	if (!stream_file_to_digest(file_name, digest)) {
-		delete digest;
-		return false;
-	}
 	string digest_check = digest->return_digest_string();
 	if (digest_check == digest_str) {
 		if (use_sha2)
@@ -96,76 +82,113 @@ bool twrpDigestDriver::Check_File_Digest(const string& Filename) {
 		else
 			LOGINFO("MD5 Digest: %s  %s\n", digest_str.c_str(), TWFunc::Get_Filename(Filename).c_str());
 		gui_msg(Msg("digest_matched=Digest matched for '{1}'.")(Filename));
-		delete digest;
 		return true;
 	}
 
 	gui_msg(Msg(msg::kError, "digest_fail_match=Digest failed to match on '{1}'.")(Filename));
-	delete digest;
 	return false;
 }
 
+bool twrpDigestDriver::Check_File_Digest(const string& Filename) {
+	twrpDigest *digest;
+	string digestfile;
+	bool use_sha2 = false;
+
+	digestfile = Find_Digest_File(Filename, &use_sha2);
+	if (digestfile.empty()) {
+		if (Filename.find(".zip") == std::string::npos && Filename.find(".map") == std::string::npos) {
+			gui_msg(Msg(msg::kError, "no_digest_found=No digest file found for '{1}'. Please unselect Enable Digest verification to restore.")(Filename));
+		} else {
+			return true;
+		}
+		return false;
+	}
+
+	digest = New_Digest(use_sha2);
+	if (!stream_file_to_digest(Filename, digest)) {
+		delete digest;
+		return false;
+	}
+	bool ret = Compare_Digest(Filename, digestfile, digest, use_sha2);
+	delete digest;
+	return ret;
+}
+
 bool twrpDigestDriver::Check_Digest(string Full_Filename) {
+	twrpDigestVerifier verifier;
+
+	verifier.Add(Full_Filename);
+	if (!verifier.Start())
+		return false;
+	return verifier.Wait_All();
+}
+
+std::vector<string> twrpDigestDriver::Get_Backup_Files(string Full_Filename) {
+	std::vector<string> backup_files;
 	char split_filename[512];
-	int index = 0;
-
-	sync();
-	if (!TWFunc::Path_Exists(Full_Filename)) {
-		// This is a split archive, we presume
-		memset(split_filename, 0, sizeof(split_filename));
-		while (index < 1000) {
-			sprintf(split_filename, "%s%03i", Full_Filename.c_str(), index);
+	int set, index;
+
+	if (TWFunc::Path_Exists(Full_Filename)) {
+		backup_files.push_back(Full_Filename); // Single file archive
+		return backup_files;
+	}
+	// This is a split archive, we presume. Each archive thread writes its
+	// own sequence, 000-099 for the first, 100-199 for the second and so on.
+	for (set = 0; ; set++) {
+		for (index = 0; index < 100; index++) {
+			sprintf(split_filename, "%s%i%02i", Full_Filename.c_str(), set, index);
 			if (!TWFunc::Path_Exists(split_filename))
 				break;
-				LOGINFO("split_filename: %s\n", split_filename);
-				if (!Check_File_Digest(split_filename))
-					return false;
-				index++;
+			LOGINFO("split_filename: %s\n", split_filename);
+			backup_files.push_back(split_filename);
 		}
-		return true;
+		if (index == 0)
+			break;
 	}
-	return Check_File_Digest(Full_Filename); // Single file archive
+	return backup_files;
 }
 
 bool twrpDigestDriver::Write_Digest(string Full_Filename) {
-	twrpDigest *digest;
-	string digest_filename, digest_str;
-	int use_sha2;
+	bool use_sha2 = Use_SHA2();
+	twrpDigest *digest = New_Digest(use_sha2);
+
+	if (!stream_file_to_digest(Full_Filename, digest)) {
+		delete digest;
+		return false;
+	}
+	bool ret = Save_Digest(Full_Filename, digest, use_sha2);
+	delete digest;
+	return ret;
+}
 
-#ifdef TW_NO_SHA2_LIBRARY
-	use_sha2 = 0;
-#else
+bool twrpDigestDriver::Use_SHA2() {
+	int use_sha2 = 0;
+
+#if !defined(TW_NO_SHA2_LIBRARY) && !defined(BUILD_TWRPTAR_MAIN)
 	DataManager::GetValue(TW_USE_SHA2, use_sha2);
 #endif
+	return use_sha2 != 0;
+}
 
-	if (use_sha2) {
+twrpDigest* twrpDigestDriver::New_Digest(bool use_sha2) {
 #ifndef TW_NO_SHA2_LIBRARY
-		digest = new twrpSHA256();
+	if (use_sha2)
+		return new twrpSHA256();
+#endif
+	return new twrpMD5();
+}
+
+bool twrpDigestDriver::Save_Digest(string Full_Filename, twrpDigest* digest, bool use_sha2) {
+	string digest_filename, digest_str;
+
+	digest_str = digest->return_digest_string();
+	if (digest_str.empty())
+		return false;
+	if (use_sha2) {
 		digest_filename = Full_Filename + ".sha2";
-		if (!stream_file_to_digest(Full_Filename, digest)) {
-			delete digest;
-			return false;
-		}
-		digest_str = digest->return_digest_string();
-		if (digest_str.empty()) {
-			delete digest;
-			return false;
-		}
 		LOGINFO("SHA2 Digest: %s  %s\n", digest_str.c_str(), TWFunc::Get_Filename(Full_Filename).c_str());
-#endif
-	}
-	else  {
-		digest = new twrpMD5();
+	} else {
 		digest_filename = Full_Filename + ".md5";
-		if (!stream_file_to_digest(Full_Filename, digest)) {
-			delete digest;
-			return false;
-		}
-		digest_str = digest->return_digest_string();
-		if (digest_str.empty()) {
-			delete digest;
-			return false;
-		}
 		LOGINFO("MD5 Digest: %s  %s\n", digest_str.c_str(), TWFunc::Get_Filename(Full_Filename).c_str());
 	}
 
@@ -173,61 +196,197 @@ bool twrpDigestDriver::Write_Digest(string Full_Filename) {
 	LOGINFO("digest_filename: %s\n", digest_filename.c_str());
 
 	if (TWFunc::write_to_file(digest_filename, digest_str) == 0) {
+#ifndef BUILD_TWRPTAR_MAIN
 		tw_set_default_metadata(digest_filename.c_str());
+#endif
 		gui_msg("digest_created= * Digest Created.");
 	}
 	else {
 		gui_err("digest_error= * Digest Error!");
-		delete digest;
 		return false;
 	}
-	delete digest;
 	return true;
 }
 
 bool twrpDigestDriver::Make_Digest(string Full_Filename) {
-	string command, result;
+	std::vector<string> backup_files;
 
+#ifndef BUILD_TWRPTAR_MAIN
 	TWFunc::GUI_Operation_Text(TW_GENERATE_DIGEST_TEXT, gui_parse_text("{@generating_digest1}"));
+#endif
 	gui_msg("generating_digest2= * Generating digest...");
-	if (TWFunc::Path_Exists(Full_Filename)) {
-		if (!Write_Digest(Full_Filename))
+	backup_files = Get_Backup_Files(Full_Filename);
+	if (backup_files.empty()) {
+		LOGERR("Backup file: '%s' not found!\n", Full_Filename.c_str());
+		return false;
+	}
+	for (size_t i = 0; i < backup_files.size(); i++) {
+		if (!Write_Digest(backup_files[i]))
 			return false;
-	} else {
-		char filename[512];
-		int index = 0;
-		sprintf(filename, "%s%03i", Full_Filename.c_str(), index);
-		while (index < 1000) {
-			string digest_src(filename);
-			if (TWFunc::Path_Exists(filename)) {
-				if (!Write_Digest(filename))
-					return false;
-				}
-				else
-					break;
-				index++;
-				sprintf(filename, "%s%03i", Full_Filename.c_str(), index);
-			}
-			if (index == 0) {
-				LOGERR("Backup file: '%s' not found!\n", filename);
-					return false;
-			}
-			gui_msg("digest_created= * Digest Created.");
 	}
+	if (backup_files.size() > 1)
+		gui_msg("digest_created= * Digest Created.");
 	return true;
 }
 
 bool twrpDigestDriver::stream_file_to_digest(string filename, twrpDigest* digest) {
-	char buf[4096];
-	int bytes;
+	const size_t buf_size = 1024 * 1024;
+	unsigned char *buf;
+	ssize_t bytes;
+	bool ret = true;
 
-	int fd = open(filename.c_str(), O_RDONLY);
+	int fd = open(filename.c_str(), O_RDONLY | O_LARGEFILE);
 	if (fd < 0) {
 		return false;
 	}
-	while ((bytes = read(fd, &buf, sizeof(buf))) != 0) {
-		digest->update((unsigned char*)buf, bytes);
+	buf = (unsigned char*)malloc(buf_size);
+	if (!buf) {
+		close(fd);
+		return false;
 	}
+	// Let the kernel read ahead aggressively, the restore reads the same data right after
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	while ((bytes = read(fd, buf, buf_size)) != 0) {
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			LOGINFO("Error reading '%s' for digest (%s)\n", filename.c_str(), strerror(errno));
+			ret = false;
+			break;
+		}
+		digest->update(buf, bytes);
+	}
+	free(buf);
 	close(fd);
+	return ret;
+}
+
+twrpDigestVerifier::twrpDigestVerifier() {
+	results = NULL;
+	next_file = 0;
+	stopping = false;
+	pthread_mutex_init(&lock, NULL);
+}
+
+twrpDigestVerifier::~twrpDigestVerifier() {
+	Stop();
+	if (results)
+		munmap(results, files.size() * sizeof(int));
+	pthread_mutex_destroy(&lock);
+}
+
+void twrpDigestVerifier::Add(string Full_Filename) {
+	std::vector<string> backup_files = twrpDigestDriver::Get_Backup_Files(Full_Filename);
+	size_t first_set = 0;
+	bool later_digests = false;
+	bool use_sha2;
+
+	// Backups made before every archive thread got a digest only have them
+	// for the first sequence, the archives after it were never checked
+	while (first_set < backup_files.size() && backup_files[first_set].compare(0, Full_Filename.size() + 1, Full_Filename + "0") == 0)
+		first_set++;
+	if (first_set > 0 && first_set < backup_files.size()) {
+		for (size_t i = first_set; i < backup_files.size() && !later_digests; i++)
+			later_digests = !twrpDigestDriver::Find_Digest_File(backup_files[i], &use_sha2).empty();
+		if (!later_digests) {
+			LOGINFO("No digests after '%s', only the first archive thread is checked\n", backup_files[first_set - 1].c_str());
+			backup_files.resize(first_set);
+		}
+	}
+	for (size_t i = 0; i < backup_files.size(); i++) {
+		if (std::find(files.begin(), files.end(), backup_files[i]) == files.end())
+			files.push_back(backup_files[i]);
+	}
+}
+
+bool twrpDigestVerifier::Start() {
+	const unsigned max_threads = 4; // Reads are mostly storage bound, more threads just seek
+	unsigned thread_count;
+	long cores;
+
+	if (files.empty())
+		return true;
+	results = (int*)mmap(NULL, files.size() * sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (results == MAP_FAILED) {
+		results = NULL;
+		LOGINFO("Unable to map digest results (%s)\n", strerror(errno));
+		return false;
+	}
+	memset(results, 0, files.size() * sizeof(int));
+
+	cores = sysconf(_SC_NPROCESSORS_ONLN);
+	thread_count = cores > 0 ? (unsigned)cores : 1;
+	if (thread_count > max_threads)
+		thread_count = max_threads;
+	if (thread_count > files.size())
+		thread_count = files.size();
+	for (unsigned i = 0; i < thread_count; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, Worker, this) != 0) {
+			LOGINFO("Unable to start digest thread %u\n", i);
+			break;
+		}
+		workers.push_back(thread);
+	}
+	if (workers.empty()) {
+		// Check everything up front like before
+		Worker(this);
+	}
 	return true;
 }
+
+bool twrpDigestVerifier::Wait(string Filename) {
+	std::vector<string>::iterator it = std::find(files.begin(), files.end(), Filename);
+
+	if (it == files.end()) {
+		// Only archives without a digest to check are left out by Add()
+		LOGINFO("No digest queued for '%s'\n", Filename.c_str());
+		return true;
+	}
+	if (results == NULL)
+		return twrpDigestDriver::Check_File_Digest(Filename);
+	int *result = &results[it - files.begin()];
+	// Polled rather than signalled so forked processes can wait as well
+	while (__atomic_load_n(result, __ATOMIC_ACQUIRE) == 0)
+		usleep(20000);
+	return *result > 0;
+}
+
+bool twrpDigestVerifier::Wait_All() {
+	bool ret = true;
+
+	for (size_t i = 0; i < files.size(); i++) {
+		if (!Wait(files[i]))
+			ret = false;
+	}
+	return ret;
+}
+
+void twrpDigestVerifier::Stop() {
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	pthread_mutex_unlock(&lock);
+	for (size_t i = 0; i < workers.size(); i++)
+		pthread_join(workers[i], NULL);
+	workers.clear();
+}
+
+void* twrpDigestVerifier::Worker(void *cookie) {
+	twrpDigestVerifier *verifier = (twrpDigestVerifier*) cookie;
+
+	for (;;) {
+		size_t index;
+
+		pthread_mutex_lock(&verifier->lock);
+		if (verifier->stopping || verifier->next_file >= verifier->files.size()) {
+			pthread_mutex_unlock(&verifier->lock);
+			break;
+		}
+		index = verifier->next_file++;
+		pthread_mutex_unlock(&verifier->lock);
+
+		int result = twrpDigestDriver::Check_File_Digest(verifier->files[index]) ? 1 : -1;
+		__atomic_store_n(&verifier->results[index], result, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
@@ -18,16 +18,49 @@
 
 #ifndef __TWRP_DIGEST_DRIVER
 #define __TWRP_DIGEST_DRIVER
+#include <pthread.h>
 #include <string>
+#include <vector>
 #include "twrpDigest/twrpDigest.hpp"
 
 class twrpDigestDriver {
 public:
 
 	static bool Check_File_Digest(const string& Filename);		//Check the digest of a TWRP partition backup
+	static string Find_Digest_File(const string& Filename, bool* use_sha2);	//Find the .sha2/.sha256/.md5/.md5sum file for Filename, empty if there is none
+	static bool Compare_Digest(const string& Filename, const string& digestfile, twrpDigest* digest, bool use_sha2); //Compare a digest streamed by the caller to digestfile
 	static bool Check_Digest(string Full_Filename);				//Check to make sure the digest is correct
 	static bool Write_Digest(string Full_Filename);				//Write the digest to a file
 	static bool Make_Digest(string Full_Filename);				//Create the digest for a partition backup
+	static bool Use_SHA2();								//Whether new digests are SHA2 or MD5
+	static twrpDigest* New_Digest(bool use_sha2);					//Create an initialized digest to stream a backup file into
+	static bool Save_Digest(string Full_Filename, twrpDigest* digest, bool use_sha2); //Write an already streamed digest to its file
 	static bool stream_file_to_digest(string filename, twrpDigest* digest); //Stream the file to twrpDigest
+	static std::vector<string> Get_Backup_Files(string Full_Filename);		//List the file or the split files of every archive thread that make up a backup
+};
+
+// Checks the digests of a set of backup files on a small pool of threads.
+// Results live in shared memory so a restore, including the forked tar
+// process, can start on the first files while later ones are still being
+// checked. Files must all be added before Start() and before any fork.
+class twrpDigestVerifier {
+public:
+	twrpDigestVerifier();
+	~twrpDigestVerifier();
+	void Add(string Full_Filename);						//Queue a backup, split archives are checked file by file
+	bool Start();								//Start checking the queued files in the background
+	bool Wait(string Filename);						//Wait for one file, false if its digest did not match, true if it was not queued
+	bool Wait_All();							//Wait for every queued file
+
+private:
+	static void* Worker(void *cookie);
+	void Stop();
+
+	std::vector<string> files;
+	int *results;								//One per file in a shared mapping, 0 pending, 1 matched, -1 failed
+	size_t next_file;							//Next file for a worker to pick up
+	bool stopping;
+	pthread_mutex_t lock;
+	std::vector<pthread_t> workers;
 };
 #endif //__TWRP_DIGEST_DRIVER
@@ -0,0 +1,295 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+#include <zlib.h>
+#include "twrpGzip.hpp"
+#include "twcommon.h"
+#include "twrpDigest/twrpDigest.hpp"
+
+#define GZIP_BLOCK_SIZE (128 * 1024) // Same default block size as pigz
+#define GZIP_DICT_SIZE  (32 * 1024)  // Size of the deflate window
+
+twrpGzip::twrpGzip(int out_fd, int compression_level, int threads) {
+	fd = out_fd;
+	digest = NULL;
+	filter = NULL;
+	filter_cookie = NULL;
+	level = compression_level;
+	if (level < Z_DEFAULT_COMPRESSION || level > Z_BEST_COMPRESSION)
+		level = Z_DEFAULT_COMPRESSION;
+	if (threads <= 0) {
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cores > 0 ? (int)cores : 1;
+	}
+	thread_count = threads;
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&work_cond, NULL);
+	pthread_cond_init(&done_cond, NULL);
+	current = NULL;
+	crc = crc32(0L, Z_NULL, 0);
+	total_in = 0;
+	stopping = false;
+	failed = false;
+}
+
+twrpGzip::~twrpGzip() {
+	Stop();
+	while (!in_flight.empty()) {
+		delete in_flight.front();
+		in_flight.pop_front();
+	}
+	delete current;
+	pthread_cond_destroy(&done_cond);
+	pthread_cond_destroy(&work_cond);
+	pthread_mutex_destroy(&lock);
+}
+
+bool twrpGzip::Start() {
+	// Fixed header: no name, no mtime, OS unix, same as pigz -n
+	unsigned char header[10] = { 0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0, 3 };
+
+	if (level == Z_BEST_COMPRESSION)
+		header[8] = 2;
+	else if (level == Z_BEST_SPEED)
+		header[8] = 4;
+
+	for (unsigned i = 0; i < thread_count; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, Worker, this) != 0) {
+			LOGINFO("twrpGzip: unable to start compression thread %u\n", i);
+			break;
+		}
+		workers.push_back(thread);
+	}
+	if (workers.empty())
+		return false;
+	thread_count = workers.size();
+	return Write_All(header, sizeof(header));
+}
+
+ssize_t twrpGzip::Write(const void *buf, size_t len) {
+	const unsigned char *data = (const unsigned char*)buf;
+	size_t remaining = len;
+
+	if (failed)
+		return -1;
+	while (remaining > 0) {
+		if (current == NULL) {
+			current = new Block;
+			current->in.reserve(GZIP_BLOCK_SIZE);
+		}
+		size_t space = GZIP_BLOCK_SIZE - current->in.size();
+		size_t n = remaining < space ? remaining : space;
+		current->in.insert(current->in.end(), data, data + n);
+		data += n;
+		remaining -= n;
+		if (current->in.size() == GZIP_BLOCK_SIZE && !Submit(false))
+			return -1;
+	}
+	return len;
+}
+
+bool twrpGzip::Finish() {
+	unsigned char trailer[8];
+
+	if (failed)
+		return false;
+	if (current == NULL)
+		current = new Block;
+	if (!Submit(true) || !Drain(0))
+		return false;
+	Stop();
+
+	for (int i = 0; i < 4; i++) {
+		trailer[i] = (crc >> (8 * i)) & 0xff;
+		trailer[i + 4] = (total_in >> (8 * i)) & 0xff;
+	}
+	return Write_All(trailer, sizeof(trailer));
+}
+
+void twrpGzip::Tee_Digest(twrpDigest *output_digest) {
+	digest = output_digest;
+}
+
+void twrpGzip::Output_Filter(ssize_t (*func)(void *cookie, const void *buf, size_t len), void *cookie) {
+	filter = func;
+	filter_cookie = cookie;
+}
+
+bool twrpGzip::Submit(bool last) {
+	Block *block = current;
+	current = NULL;
+
+	// Prime each block with the input preceding it so the ratio matches
+	// a single-threaded stream
+	block->dict.swap(tail);
+	if (block->in.size() >= GZIP_DICT_SIZE) {
+		tail.assign(block->in.end() - GZIP_DICT_SIZE, block->in.end());
+	} else {
+		tail = block->dict;
+		tail.insert(tail.end(), block->in.begin(), block->in.end());
+		if (tail.size() > GZIP_DICT_SIZE)
+			tail.erase(tail.begin(), tail.end() - GZIP_DICT_SIZE);
+	}
+	block->crc = 0;
+	block->last = last;
+	block->done = false;
+	block->failed = false;
+
+	pthread_mutex_lock(&lock);
+	in_flight.push_back(block);
+	queued.push_back(block);
+	pthread_cond_signal(&work_cond);
+	pthread_mutex_unlock(&lock);
+
+	// Keep every worker busy with a block queued behind it while bounding memory use
+	if (!Drain(thread_count * 2)) {
+		failed = true;
+		return false;
+	}
+	return true;
+}
+
+bool twrpGzip::Drain(size_t keep) {
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		if (in_flight.empty() || (in_flight.size() <= keep && !in_flight.front()->done)) {
+			pthread_mutex_unlock(&lock);
+			return true;
+		}
+		Block *block = in_flight.front();
+		while (!block->done)
+			pthread_cond_wait(&done_cond, &lock);
+		in_flight.pop_front();
+		pthread_mutex_unlock(&lock);
+
+		bool ok = !block->failed && Write_All(block->out.data(), block->out.size());
+		if (ok) {
+			crc = crc32_combine(crc, block->crc, block->in.size());
+			total_in += block->in.size();
+		} else if (block->failed) {
+			LOGINFO("twrpGzip: deflate failed\n");
+		}
+		delete block;
+		if (!ok) {
+			failed = true;
+			return false;
+		}
+	}
+}
+
+bool twrpGzip::Write_All(const unsigned char *buf, size_t len) {
+	if (digest)
+		digest->update(buf, len);
+	while (len > 0) {
+		ssize_t n = filter != NULL ? filter(filter_cookie, buf, len) : write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			LOGINFO("twrpGzip: write failed: %s\n", strerror(errno));
+			return false;
+		}
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+void twrpGzip::Stop() {
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&lock);
+	for (size_t i = 0; i < workers.size(); i++)
+		pthread_join(workers[i], NULL);
+	workers.clear();
+}
+
+void* twrpGzip::Worker(void *cookie) {
+	twrpGzip *gz = (twrpGzip*)cookie;
+	z_stream strm;
+	bool init_ok;
+
+	memset(&strm, 0, sizeof(strm));
+	// Raw deflate, the gzip header and trailer are written by the caller
+	init_ok = deflateInit2(&strm, gz->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+
+	for (;;) {
+		pthread_mutex_lock(&gz->lock);
+		while (gz->queued.empty() && !gz->stopping)
+			pthread_cond_wait(&gz->work_cond, &gz->lock);
+		if (gz->queued.empty()) {
+			pthread_mutex_unlock(&gz->lock);
+			break;
+		}
+		Block *block = gz->queued.front();
+		gz->queued.pop_front();
+		pthread_mutex_unlock(&gz->lock);
+
+		bool ok = init_ok && Compress(&strm, block);
+
+		pthread_mutex_lock(&gz->lock);
+		block->failed = !ok;
+		block->done = true;
+		pthread_cond_broadcast(&gz->done_cond);
+		pthread_mutex_unlock(&gz->lock);
+	}
+
+	if (init_ok)
+		deflateEnd(&strm);
+	return NULL;
+}
+
+bool twrpGzip::Compress(void *stream, Block *block) {
+	z_stream *strm = (z_stream*)stream;
+	int flush = block->last ? Z_FINISH : Z_SYNC_FLUSH;
+	int ret;
+
+	if (deflateReset(strm) != Z_OK)
+		return false;
+	if (!block->dict.empty() && deflateSetDictionary(strm, block->dict.data(), block->dict.size()) != Z_OK)
+		return false;
+
+	// Room for the sync marker on top of the worst case expansion
+	block->out.resize(deflateBound(strm, block->in.size()) + 16);
+	strm->next_in = block->in.data();
+	strm->avail_in = block->in.size();
+	strm->next_out = block->out.data();
+	strm->avail_out = block->out.size();
+	for (;;) {
+		ret = deflate(strm, flush);
+		if (ret == Z_STREAM_ERROR)
+			return false;
+		if (strm->avail_out != 0)
+			break;
+		size_t used = block->out.size();
+		block->out.resize(used * 2);
+		strm->next_out = block->out.data() + used;
+		strm->avail_out = block->out.size() - used;
+	}
+	// A repeated sync flush with nothing left to emit reports Z_BUF_ERROR
+	if (block->last ? ret != Z_STREAM_END : (ret != Z_OK && ret != Z_BUF_ERROR) || strm->avail_in != 0)
+		return false;
+	block->out.resize(block->out.size() - strm->avail_out);
+	block->crc = crc32(0L, block->in.data(), block->in.size());
+	return true;
+}
@@ -0,0 +1,83 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRPGZIP_HPP
+#define __TWRPGZIP_HPP
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <deque>
+#include <vector>
+
+class twrpDigest;
+
+// In-process replacement for piping backups through pigz. Input is cut
+// into blocks which are deflated on a pool of worker threads, each block
+// primed with the last 32K of the one before it the same way pigz does it,
+// and the results are written to out_fd in order as one gzip stream.
+class twrpGzip
+{
+public:
+	twrpGzip(int out_fd, int level, int threads);        // level -1 (default) to 9, threads 0 uses one per core
+	~twrpGzip();
+
+	bool Start();                                        // Starts the workers and writes the gzip header
+	ssize_t Write(const void *buf, size_t len);          // Queues data to be compressed, returns len or -1 on error
+	bool Finish();                                       // Compresses the remaining data and writes the gzip trailer
+	void Tee_Digest(twrpDigest *output_digest);          // Also feeds everything written to out_fd into output_digest
+	void Output_Filter(ssize_t (*func)(void *cookie, const void *buf, size_t len), void *cookie); // Hands the gzip stream to func instead of writing it to out_fd
+
+private:
+	struct Block {
+		std::vector<unsigned char> in;                   // Uncompressed data
+		std::vector<unsigned char> dict;                 // Tail of the previous block used as the deflate dictionary
+		std::vector<unsigned char> out;                  // Raw deflate data for this block
+		unsigned long crc;                               // crc32 of in
+		bool last;                                       // Last block of the stream, ends with Z_FINISH
+		bool done;                                       // Set by the worker once out is ready
+		bool failed;                                     // Set by the worker if deflate failed
+	};
+
+	static void* Worker(void *cookie);
+	static bool Compress(void *strm, Block *block);
+	bool Submit(bool last);
+	bool Drain(size_t keep);
+	bool Write_All(const unsigned char *buf, size_t len);
+	void Stop();
+
+	int fd;
+	twrpDigest *digest;
+	ssize_t (*filter)(void *cookie, const void *buf, size_t len);
+	void *filter_cookie;
+	int level;
+	unsigned thread_count;
+	std::vector<pthread_t> workers;
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;                            // Signalled when a block is queued or on shutdown
+	pthread_cond_t done_cond;                            // Signalled when a worker finishes a block
+	std::deque<Block*> queued;                           // Blocks waiting for a worker
+	std::deque<Block*> in_flight;                        // Blocks not yet written, in stream order
+	Block *current;                                      // Block being filled by Write()
+	std::vector<unsigned char> tail;                     // Last 32K of input seen so far
+	unsigned long crc;                                   // crc32 of everything written
+	unsigned long long total_in;                         // Uncompressed length of everything written
+	bool stopping;
+	bool failed;
+};
+
+#endif // __TWRPGZIP_HPP
@@ -0,0 +1,197 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "twrpReadAhead.hpp"
+#include "twcommon.h"
+
+#define DIRECT_ALIGN 4096 // O_DIRECT needs buffers, offsets and lengths aligned to the logical block size
+
+twrpReadAhead::twrpReadAhead(int src_fd, size_t size, unsigned block_count, bool use_direct) {
+	fd = src_fd;
+	block_size = (size + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN - 1);
+	direct = false;
+	if (block_count < 1)
+		block_count = 1;
+	for (unsigned i = 0; i < block_count; i++) {
+		Block block;
+		if (posix_memalign(&block.data, DIRECT_ALIGN, block_size) != 0)
+			break;
+		block.len = 0;
+		blocks.push_back(block);
+	}
+	threaded = false;
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+	head = 0;
+	filled = 0;
+	remaining = 0;
+	stopping = false;
+	failed = blocks.empty();
+
+	// Keeps a whole partition image from pushing everything else out of the page cache
+	if (use_direct && !failed) {
+		int flags = fcntl(fd, F_GETFL);
+		if (flags >= 0 && fcntl(fd, F_SETFL, flags | O_DIRECT) == 0)
+			direct = true;
+	}
+}
+
+twrpReadAhead::~twrpReadAhead() {
+	Stop();
+	for (size_t i = 0; i < blocks.size(); i++)
+		free(blocks[i].data);
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&lock);
+}
+
+bool twrpReadAhead::Start(unsigned long long size) {
+	remaining = size;
+	if (failed)
+		return false;
+	if (blocks.size() > 1) {
+		if (pthread_create(&thread, NULL, Reader, this) == 0)
+			threaded = true;
+		else
+			LOGINFO("twrpReadAhead: unable to start reader thread, reading synchronously\n");
+	}
+	return true;
+}
+
+const void* twrpReadAhead::Get_Block(size_t *len) {
+	const void *data = NULL;
+
+	if (!threaded) {
+		if (failed || remaining == 0)
+			return NULL;
+		blocks[0].len = remaining < block_size ? remaining : block_size;
+		if (!Read_Block(&blocks[0])) {
+			failed = true;
+			return NULL;
+		}
+		remaining -= blocks[0].len;
+		*len = blocks[0].len;
+		return blocks[0].data;
+	}
+
+	pthread_mutex_lock(&lock);
+	while (filled == 0 && remaining > 0 && !failed)
+		pthread_cond_wait(&cond, &lock);
+	if (filled > 0) {
+		data = blocks[head].data;
+		*len = blocks[head].len;
+	}
+	pthread_mutex_unlock(&lock);
+	return data;
+}
+
+void twrpReadAhead::Put_Block() {
+	if (!threaded)
+		return;
+	pthread_mutex_lock(&lock);
+	head = (head + 1) % blocks.size();
+	filled--;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+bool twrpReadAhead::Failed() {
+	bool ret;
+
+	pthread_mutex_lock(&lock);
+	ret = failed;
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+void twrpReadAhead::Stop() {
+	if (!threaded)
+		return;
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+	pthread_join(thread, NULL);
+	threaded = false;
+}
+
+void* twrpReadAhead::Reader(void *cookie) {
+	twrpReadAhead *ra = (twrpReadAhead*)cookie;
+
+	pthread_mutex_lock(&ra->lock);
+	while (ra->remaining > 0) {
+		while (ra->filled == ra->blocks.size() && !ra->stopping)
+			pthread_cond_wait(&ra->cond, &ra->lock);
+		if (ra->stopping)
+			break;
+		// Only Reader touches the block after the ones handed out
+		Block *block = &ra->blocks[(ra->head + ra->filled) % ra->blocks.size()];
+		block->len = ra->remaining < ra->block_size ? ra->remaining : ra->block_size;
+		pthread_mutex_unlock(&ra->lock);
+
+		bool ok = ra->Read_Block(block);
+
+		pthread_mutex_lock(&ra->lock);
+		if (!ok) {
+			ra->failed = true;
+			pthread_cond_signal(&ra->cond);
+			break;
+		}
+		ra->remaining -= block->len;
+		ra->filled++;
+		pthread_cond_signal(&ra->cond);
+	}
+	pthread_mutex_unlock(&ra->lock);
+	return NULL;
+}
+
+bool twrpReadAhead::Read_Block(Block *block) {
+	char *buf = (char*)block->data;
+	size_t got = 0;
+
+	while (got < block->len) {
+		size_t want = block->len - got;
+		// The tail of an image may not be aligned, O_DIRECT reads past it and stops at the end of the file
+		if (direct) {
+			want = (want + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN - 1);
+			if (want > block_size - got)
+				want = block_size - got;
+		}
+		ssize_t n = read(fd, buf + got, want);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EINVAL && direct) {
+			// Not every file system supports O_DIRECT, carry on through the page cache
+			int flags = fcntl(fd, F_GETFL);
+			if (flags >= 0 && fcntl(fd, F_SETFL, flags & ~O_DIRECT) == 0) {
+				direct = false;
+				continue;
+			}
+		}
+		if (n <= 0) {
+			LOGINFO("twrpReadAhead: error reading source fd (%s)\n", n < 0 ? strerror(errno) : "unexpected end of file");
+			return false;
+		}
+		got += n;
+	}
+	return true;
+}
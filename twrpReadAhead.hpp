@@ -0,0 +1,68 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRPREADAHEAD_HPP
+#define __TWRPREADAHEAD_HPP
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <vector>
+
+#define READ_AHEAD_BLOCKS 4 // Blocks in flight for raw image copies
+
+// Reads a file or block device on a background thread into a ring of
+// page aligned buffers so the caller can write one block while the next
+// ones are being read. With a block count of 1 every block is read
+// synchronously by Get_Block() instead.
+class twrpReadAhead
+{
+public:
+	twrpReadAhead(int fd, size_t block_size, unsigned block_count, bool direct); // direct tries O_DIRECT reads on fd
+	~twrpReadAhead();
+
+	bool Start(unsigned long long size);                 // Starts reading size bytes from the current offset
+	const void* Get_Block(size_t *len);                  // Waits for the next block, NULL at the end or on error
+	void Put_Block();                                    // Hands the block from Get_Block() back to be refilled
+	bool Failed();                                       // True if reading the source failed
+
+private:
+	struct Block {
+		void *data;
+		size_t len;
+	};
+
+	static void* Reader(void *cookie);
+	bool Read_Block(Block *block);
+	void Stop();
+
+	int fd;
+	size_t block_size;
+	bool direct;
+	std::vector<Block> blocks;
+	pthread_t thread;
+	bool threaded;                                       // Reader thread is running
+	pthread_mutex_t lock;
+	pthread_cond_t cond;                                 // Signalled when a block is filled or handed back
+	unsigned head;                                       // Next block for Get_Block()
+	unsigned filled;                                     // Blocks read but not yet handed back
+	unsigned long long remaining;                        // Bytes left to read from fd
+	bool stopping;
+	bool failed;
+};
+
+#endif // __TWRPREADAHEAD_HPP
@@ -0,0 +1,326 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/xattr.h>
+#include <linux/xattr.h>
+#include <selinux/selinux.h>
+#include "twrpScanCache.hpp"
+#include "exclude.hpp"
+#include "twrp-functions.hpp"
+#include "gui/gui.hpp"
+#include "twcommon.h"
+
+#define SCAN_DIRENT_BUF_SIZE (32 * 1024)
+
+// Layout of the records returned by getdents64
+struct scan_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+twrpScanCache::twrpScanCache() {
+	exclusions = NULL;
+	metadata = false;
+	recording = true;
+	complete = false;
+}
+
+bool twrpScanCache::Scan(const std::string &Path, TWExclude *exclude, bool read_metadata) {
+	struct stat st;
+	twrpScanEntry entry;
+	uint64_t size = 0;
+	bool ret;
+	int fd;
+
+	root = TWFunc::Remove_Trailing_Slashes(Path);
+	exclusions = exclude;
+	metadata = read_metadata;
+	entries.clear();
+	names.clear();
+	contexts.clear();
+	context_index.clear();
+	caps.clear();
+	contexts.push_back("");
+	complete = false;
+	dirent_buf.resize(SCAN_DIRENT_BUF_SIZE);
+
+	fd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(root)(strerror(errno)));
+		if (fd >= 0)
+			close(fd);
+		entries.clear();
+		return false;
+	}
+	if (recording) {
+		memset(&entry, 0, sizeof(entry));
+		entry.ino = st.st_ino;
+		entry.dev = st.st_dev;
+		entry.mtime = st.st_mtime;
+		entry.mode = st.st_mode;
+		entry.uid = st.st_uid;
+		entry.gid = st.st_gid;
+		names.push_back('\0');
+		if (metadata)
+			Read_Metadata(root, &entry);
+		entries.push_back(entry);
+	}
+	ret = Scan_Folder(fd, 0, root, &size);
+	close(fd);
+	if (recording) {
+		entries[0].size = size;
+		entries[0].end = entries.size();
+	}
+	dirent_buf.clear();
+	complete = ret;
+	return ret;
+}
+
+uint64_t twrpScanCache::Scan_Size(const std::string &Path, TWExclude *exclude) {
+	twrpScanCache scanner;
+	struct stat st;
+	uint64_t size = 0;
+	int fd;
+
+	scanner.recording = false;
+	scanner.exclusions = exclude;
+	scanner.dirent_buf.resize(SCAN_DIRENT_BUF_SIZE);
+	fd = open(Path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Path)(strerror(errno)));
+		if (fd >= 0)
+			close(fd);
+		return 0;
+	}
+	scanner.Scan_Folder(fd, 0, TWFunc::Remove_Trailing_Slashes(Path), &size);
+	close(fd);
+	return size;
+}
+
+bool twrpScanCache::Scan_Folder(int dir_fd, uint32_t dir_index, const std::string &path, uint64_t *size) {
+	std::string folder_names, full_path;
+	struct stat st;
+	bool ret = true;
+
+	// Read every name first, the buffer is reused by the folders below
+	for (;;) {
+		long len = syscall(SYS_getdents64, dir_fd, &dirent_buf[0], dirent_buf.size());
+		if (len < 0) {
+			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(path)(strerror(errno)));
+			return false;
+		}
+		if (len == 0)
+			break;
+		for (long pos = 0; pos < len;) {
+			struct scan_dirent64 *de = (struct scan_dirent64*)(&dirent_buf[0] + pos);
+
+			if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) {
+				folder_names.append(de->d_name);
+				folder_names.push_back('\0');
+			}
+			pos += de->d_reclen;
+		}
+	}
+
+	for (size_t pos = 0; pos < folder_names.size(); pos += strlen(&folder_names[pos]) + 1) {
+		const char *name = &folder_names[pos];
+		size_t index = entries.size();
+
+		full_path = path + "/" + name;
+		if (exclusions != NULL && exclusions->check_skip_dirs(full_path))
+			continue;
+		if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(full_path)(strerror(errno)));
+			LOGINFO("Real error: Unable to stat '%s'\n", full_path.c_str());
+			continue;
+		}
+		if (recording) {
+			twrpScanEntry entry;
+
+			memset(&entry, 0, sizeof(entry));
+			if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode))
+				entry.size = st.st_size;
+			entry.ino = st.st_ino;
+			entry.dev = st.st_dev;
+			entry.mtime = st.st_mtime;
+			entry.mode = st.st_mode;
+			entry.uid = st.st_uid;
+			entry.gid = st.st_gid;
+			entry.parent = dir_index;
+			entry.name = names.size();
+			entry.end = index + 1;
+			names.insert(names.end(), name, name + strlen(name) + 1);
+			if (metadata)
+				Read_Metadata(full_path, &entry);
+			entries.push_back(entry);
+		}
+
+		if (S_ISDIR(st.st_mode)) {
+			uint64_t folder_size = 0;
+			int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+			if (fd < 0) {
+				gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(full_path)(strerror(errno)));
+				ret = false;
+				continue;
+			}
+			if (!Scan_Folder(fd, index, full_path, &folder_size))
+				ret = false;
+			close(fd);
+			*size += folder_size;
+			if (recording) {
+				entries[index].size = folder_size;
+				entries[index].end = entries.size();
+			}
+		} else if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode)) {
+			*size += st.st_size;
+		}
+	}
+	return ret;
+}
+
+void twrpScanCache::Read_Metadata(const std::string &path, twrpScanEntry *entry) {
+	security_context_t context = NULL;
+
+	if (lgetfilecon(path.c_str(), &context) >= 0) {
+		std::map<std::string, uint32_t>::iterator it = context_index.find(context);
+
+		if (it == context_index.end()) {
+			entry->context = contexts.size();
+			context_index[context] = entry->context;
+			contexts.push_back(context);
+		} else {
+			entry->context = it->second;
+		}
+		freecon(context);
+	}
+	if (S_ISREG(entry->mode)) {
+		struct vfs_cap_data cap_data;
+
+		memset(&cap_data, 0, sizeof(cap_data));
+		if (getxattr(path.c_str(), XATTR_NAME_CAPS, &cap_data, sizeof(cap_data)) >= 0) {
+			caps.push_back(cap_data);
+			entry->cap = caps.size();
+		}
+	} else if (S_ISDIR(entry->mode)) {
+		if (getxattr(path.c_str(), "user.default", NULL, 0) >= 0)
+			entry->user_xattrs |= TAR_XATTR_USER_DEFAULT;
+		if (getxattr(path.c_str(), "user.inode_cache", NULL, 0) >= 0)
+			entry->user_xattrs |= TAR_XATTR_USER_CACHE;
+		if (getxattr(path.c_str(), "user.inode_code_cache", NULL, 0) >= 0)
+			entry->user_xattrs |= TAR_XATTR_USER_CODE_CACHE;
+	}
+}
+
+bool twrpScanCache::Covers(const std::string &Path) const {
+	std::string path = TWFunc::Remove_Trailing_Slashes(Path);
+
+	if (entries.empty())
+		return false;
+	return path == root || path.compare(0, root.size() + 1, root + "/") == 0;
+}
+
+int twrpScanCache::Find(const std::string &Path) const {
+	std::string path = TWFunc::Remove_Trailing_Slashes(Path);
+	size_t index = 0, start, end;
+
+	if (!Covers(path))
+		return -1;
+	for (start = root.size(); start < path.size(); start = end) {
+		std::string name;
+		size_t child;
+
+		start++;
+		end = path.find('/', start);
+		if (end == std::string::npos)
+			end = path.size();
+		name = path.substr(start, end - start);
+		if (name.empty())
+			continue;
+		// Step over whole folders to get from one child to the next
+		for (child = index + 1; child < entries[index].end; child = S_ISDIR(entries[child].mode) ? entries[child].end : child + 1) {
+			if (name == &names[entries[child].name])
+				break;
+		}
+		if (child >= entries[index].end)
+			return -1;
+		index = child;
+	}
+	return index;
+}
+
+uint64_t twrpScanCache::Folder_Size(const std::string &Path) const {
+	int index = Find(Path);
+
+	if (index < 0)
+		return 0;
+	return entries[index].size;
+}
+
+size_t twrpScanCache::Count() const {
+	return entries.size();
+}
+
+const twrpScanEntry& twrpScanCache::Entry(size_t index) const {
+	return entries[index];
+}
+
+std::string twrpScanCache::Path(size_t index) const {
+	std::vector<size_t> chain;
+	std::string path = root;
+
+	for (; index != 0; index = entries[index].parent)
+		chain.push_back(index);
+	for (size_t i = chain.size(); i > 0; i--) {
+		path += "/";
+		path += &names[entries[chain[i - 1]].name];
+	}
+	return path;
+}
+
+void twrpScanCache::Get_Meta(size_t index, tar_meta_t *meta) const {
+	const twrpScanEntry &entry = entries[index];
+
+	memset(meta, 0, sizeof(*meta));
+	meta->st.st_ino = entry.ino;
+	meta->st.st_dev = entry.dev;
+	meta->st.st_mtime = entry.mtime;
+	meta->st.st_mode = entry.mode;
+	meta->st.st_uid = entry.uid;
+	meta->st.st_gid = entry.gid;
+	if (!S_ISDIR(entry.mode))
+		meta->st.st_size = entry.size;
+	if (entry.context != 0)
+		meta->selinux_context = contexts[entry.context].c_str();
+	if (entry.cap != 0)
+		meta->cap_data = &caps[entry.cap - 1];
+	meta->user_xattrs = entry.user_xattrs;
+}
+
+bool twrpScanCache::Complete() const {
+	return complete;
+}
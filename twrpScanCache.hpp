@@ -0,0 +1,91 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRPSCANCACHE_HPP
+#define __TWRPSCANCACHE_HPP
+
+extern "C" {
+	#include "libtar/libtar.h"
+}
+#include <stdint.h>
+#include <sys/types.h>
+#include <map>
+#include <string>
+#include <vector>
+
+class TWExclude;
+
+// Metadata of one file or folder, names and selinux contexts are kept in
+// shared tables so the cache stays small for folders like /data with
+// hundreds of thousands of entries
+struct twrpScanEntry {
+	uint64_t size;                                       // File size, for folders the size of all files and links below
+	uint64_t ino;
+	uint64_t dev;
+	int64_t mtime;
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t parent;                                     // Index of the folder holding it, the root is its own parent
+	uint32_t name;                                       // Offset of the name in the name arena
+	uint32_t end;                                        // Folders: index after the last entry below it
+	uint32_t context;                                    // Index into the selinux contexts, 0 if none
+	uint32_t cap;                                        // Index + 1 into the file capabilities, 0 if none
+	uint32_t user_xattrs;                                // TAR_XATTR_USER_* for folders
+};
+
+// Walks a folder once with openat/fstatat/getdents64 and keeps what the
+// backup needs from every entry: sizes for the size calculation, the file
+// list in directory order for twrpTar and the stat data, selinux context
+// and xattrs tar writes into the headers. Excluded folders are skipped.
+// Entries are stored depth first, so everything below a folder follows it.
+class twrpScanCache
+{
+public:
+	twrpScanCache();
+
+	bool Scan(const std::string &Path, TWExclude *exclusions, bool metadata); // Reads Path, false if any folder could not be read; metadata also reads contexts and xattrs
+	static uint64_t Scan_Size(const std::string &Path, TWExclude *exclusions); // Size of Path without keeping anything
+
+	bool Covers(const std::string &Path) const;          // Path is the scanned folder or inside it
+	int Find(const std::string &Path) const;             // Index of the entry for Path, -1 if not found
+	uint64_t Folder_Size(const std::string &Path) const; // Size of the files and links below Path, or of Path itself
+	size_t Count() const;
+	const twrpScanEntry& Entry(size_t index) const;
+	std::string Path(size_t index) const;                // Full path of an entry
+	void Get_Meta(size_t index, tar_meta_t *meta) const; // Fills the tar metadata of an entry
+	bool Complete() const;                               // Every folder below the root could be read
+
+private:
+	bool Scan_Folder(int dir_fd, uint32_t dir_index, const std::string &path, uint64_t *size);
+	void Read_Metadata(const std::string &path, twrpScanEntry *entry);
+
+	std::string root;
+	TWExclude *exclusions;
+	bool metadata;
+	bool recording;                                      // Entries are kept, off for Scan_Size()
+	bool complete;
+	std::vector<twrpScanEntry> entries;
+	std::vector<char> names;                             // Arena of nul terminated entry names
+	std::vector<std::string> contexts;                   // Distinct selinux contexts, 0 is the empty context
+	std::map<std::string, uint32_t> context_index;
+	std::vector<struct vfs_cap_data> caps;
+	std::vector<char> dirent_buf;                        // getdents64 buffer, shared by all folders
+};
+
+#endif // __TWRPSCANCACHE_HPP
@@ -0,0 +1,160 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sparse_format.h>
+#include "twrpSparseImage.hpp"
+#include "twcommon.h"
+
+#define SPARSE_MAX_RAW_BLOCKS 65536 // Keeps total_sz of a RAW chunk well inside 32 bits
+
+static void Fill_Header(sparse_header_t *header, uint32_t total_blocks, uint32_t total_chunks) {
+	memset(header, 0, sizeof(*header));
+	header->magic = SPARSE_HEADER_MAGIC;
+	header->major_version = SPARSE_HEADER_MAJOR_VER;
+	header->minor_version = 0;
+	header->file_hdr_sz = SPARSE_HEADER_LEN;
+	header->chunk_hdr_sz = CHUNK_HEADER_LEN;
+	header->blk_sz = SPARSE_BLOCK_SIZE;
+	header->total_blks = total_blocks;
+	header->total_chunks = total_chunks;
+}
+
+twrpSparseImage::twrpSparseImage(int out_fd) {
+	fd = out_fd;
+	total_blocks = 0;
+	total_chunks = 0;
+	blocks_written = 0;
+	fill_blocks = 0;
+	fill_value = 0;
+	written = 0;
+}
+
+bool twrpSparseImage::Start(uint64_t image_size) {
+	sparse_header_t header;
+
+	if (image_size % SPARSE_BLOCK_SIZE != 0 || image_size / SPARSE_BLOCK_SIZE > UINT32_MAX)
+		return false;
+	total_blocks = image_size / SPARSE_BLOCK_SIZE;
+	Fill_Header(&header, total_blocks, 0);
+	return Write_All(&header, sizeof(header));
+}
+
+bool twrpSparseImage::Write(const void *buf, size_t len) {
+	const unsigned char *data = (const unsigned char*)buf;
+	size_t blocks = len / SPARSE_BLOCK_SIZE;
+	size_t raw_start = 0, raw_count = 0;
+
+	if (len % SPARSE_BLOCK_SIZE != 0 || blocks > total_blocks - blocks_written - fill_blocks)
+		return false;
+
+	for (size_t i = 0; i < blocks; i++) {
+		const unsigned char *block = data + i * SPARSE_BLOCK_SIZE;
+		// Equal to itself shifted by 4 bytes means one 32 bit value repeated
+		if (memcmp(block, block + 4, SPARSE_BLOCK_SIZE - 4) == 0) {
+			uint32_t value;
+
+			memcpy(&value, block, sizeof(value));
+			if (raw_count > 0) {
+				if (!Write_Chunk(CHUNK_TYPE_RAW, raw_count, data + raw_start * SPARSE_BLOCK_SIZE, raw_count * SPARSE_BLOCK_SIZE))
+					return false;
+				raw_count = 0;
+			}
+			if (fill_blocks > 0 && value != fill_value && !Flush_Fill())
+				return false;
+			fill_value = value;
+			fill_blocks++;
+		} else {
+			if (fill_blocks > 0 && !Flush_Fill())
+				return false;
+			if (raw_count == SPARSE_MAX_RAW_BLOCKS) {
+				if (!Write_Chunk(CHUNK_TYPE_RAW, raw_count, data + raw_start * SPARSE_BLOCK_SIZE, raw_count * SPARSE_BLOCK_SIZE))
+					return false;
+				raw_count = 0;
+			}
+			if (raw_count == 0)
+				raw_start = i;
+			raw_count++;
+		}
+	}
+	if (raw_count > 0)
+		return Write_Chunk(CHUNK_TYPE_RAW, raw_count, data + raw_start * SPARSE_BLOCK_SIZE, raw_count * SPARSE_BLOCK_SIZE);
+	return true;
+}
+
+bool twrpSparseImage::Finish() {
+	sparse_header_t header;
+
+	if (fill_blocks > 0 && !Flush_Fill())
+		return false;
+	if (blocks_written != total_blocks) {
+		LOGINFO("twrpSparseImage: %u of %u blocks written\n", blocks_written, total_blocks);
+		return false;
+	}
+	Fill_Header(&header, total_blocks, total_chunks);
+	if (pwrite(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+		LOGINFO("twrpSparseImage: unable to update header: %s\n", strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+uint64_t twrpSparseImage::Written() {
+	return written;
+}
+
+bool twrpSparseImage::Flush_Fill() {
+	uint32_t blocks = fill_blocks;
+
+	fill_blocks = 0;
+	return Write_Chunk(CHUNK_TYPE_FILL, blocks, &fill_value, sizeof(fill_value));
+}
+
+bool twrpSparseImage::Write_Chunk(uint16_t type, uint32_t blocks, const void *data, size_t len) {
+	chunk_header_t chunk;
+
+	memset(&chunk, 0, sizeof(chunk));
+	chunk.chunk_type = type;
+	chunk.chunk_sz = blocks;
+	chunk.total_sz = CHUNK_HEADER_LEN + len;
+	if (!Write_All(&chunk, sizeof(chunk)) || !Write_All(data, len))
+		return false;
+	blocks_written += blocks;
+	total_chunks++;
+	return true;
+}
+
+bool twrpSparseImage::Write_All(const void *buf, size_t len) {
+	const unsigned char *data = (const unsigned char*)buf;
+
+	while (len > 0) {
+		ssize_t n = write(fd, data, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			LOGINFO("twrpSparseImage: write failed: %s\n", strerror(errno));
+			return false;
+		}
+		data += n;
+		len -= n;
+		written += n;
+	}
+	return true;
+}
@@ -0,0 +1,56 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRPSPARSEIMAGE_HPP
+#define __TWRPSPARSEIMAGE_HPP
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define SPARSE_BLOCK_SIZE 4096
+
+// Writes a raw partition image to out_fd in Android sparse format so it can
+// be restored with simg2img. Blocks filled with a single repeated 32 bit
+// value, most often unused zeroed space, are stored as FILL chunks and
+// everything else as RAW chunks. out_fd must be seekable, the file header
+// is rewritten with the final chunk count by Finish().
+class twrpSparseImage
+{
+public:
+	twrpSparseImage(int out_fd);
+
+	bool Start(uint64_t image_size);                     // Writes the file header, image_size must be a multiple of SPARSE_BLOCK_SIZE
+	bool Write(const void *buf, size_t len);             // Adds image data, len must be a multiple of SPARSE_BLOCK_SIZE
+	bool Finish();                                       // Writes the last chunk and updates the file header
+	uint64_t Written();                                  // Size of the sparse file so far
+
+private:
+	bool Flush_Fill();
+	bool Write_Chunk(uint16_t type, uint32_t blocks, const void *data, size_t len);
+	bool Write_All(const void *buf, size_t len);
+
+	int fd;
+	uint32_t total_blocks;
+	uint32_t total_chunks;
+	uint32_t blocks_written;
+	uint32_t fill_blocks;                                // Length of the FILL run not written yet
+	uint32_t fill_value;
+	uint64_t written;
+};
+
+#endif // __TWRPSPARSEIMAGE_HPP
@@ -38,9 +38,14 @@ extern "C" {
 #include <libgen.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <poll.h>
 #include <zlib.h>
 #include <semaphore.h>
 #include "twrpTar.hpp"
+#include "twrpGzip.hpp"
+#include "twrpAes.hpp"
+#include "twrpScanCache.hpp"
+#include "twrpTarIndex.hpp"
 #include "twcommon.h"
 #include "variables.h"
 #include "adbbu/libtwadbbu.hpp"
@@ -52,6 +57,8 @@ extern "C" {
 #include "infomanager.hpp"
 #include "set_metadata.h"
 #endif //ndef BUILD_TWRPTAR_MAIN
+#include "twrpDigestDriver.hpp"
+#include "twrpDigest/twrpDigest.hpp"
 
 #ifdef TW_INCLUDE_FBE
 #include "crypto/ext4crypt/ext4crypt_tar.h"
@@ -62,6 +69,10 @@ extern "C" {
 
 using namespace std;
 
+const int progress_poll_ms = 200; // How often the parent samples the shared progress counters
+const unsigned long long min_batch_size = 8 * 1024 * 1024; // Smallest batch of files an archive thread takes at once
+const size_t min_batch_entries = 1024; // Fewest entries a batch ends at, for folders of many small files
+
 twrpTar::twrpTar(void) {
 	use_encryption = 0;
 	userdata_encryption = 0;
@@ -77,14 +88,36 @@ twrpTar::twrpTar(void) {
 	tar_type.readfunc = read;
 	input_fd = -1;
 	output_fd = -1;
+	progress_counters = NULL;
 	backup_exclusions = NULL;
+	scan_cache = NULL;
+	work_queue = NULL;
+	part_index = 0;
+	ItemList = NULL;
+	thread_id = 0;
+	compression_level = 6;
+	compression_threads = 0;
+	archive_threads = 0;
+	write_index = 0;
+	gzip = NULL;
+	aes = NULL;
+	decrypting = false;
+	decrypt_fd = -1;
+	tee_digest = false;
+	digest = NULL;
+	digest_sha2 = false;
+	index = NULL;
 #ifdef TW_INCLUDE_FBE
 	e4crypt_set_mode();
 #endif
 }
 
 twrpTar::~twrpTar(void) {
-	// Do nothing
+	finishDecryption();
+	delete gzip;
+	delete aes;
+	delete digest;
+	delete index;
 }
 
 void twrpTar::setfn(string fn) {
@@ -111,6 +144,15 @@ void twrpTar::Set_Archive_Type(Archive_Type archive_type) {
 	current_archive_type = archive_type;
 }
 
+bool twrpTar::writesDigest() {
+#ifndef BUILD_TWRPTAR_MAIN
+	// Encrypted archives are digested once they are written, the archive threads do not tee them
+	return part_settings->generate_digest && !part_settings->adbbackup && !use_encryption;
+#else
+	return false;
+#endif
+}
+
 int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 	int status = 0;
 	int progress_pipe[2];
@@ -129,9 +171,14 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 	}
 #endif
 
-	if (pipe(progress_pipe) < 0) {
+	if (mapProgress() != 0) {
+		gui_err("backup_error=Error creating backup.");
+		return -1;
+	}
+	if (pipe2(progress_pipe, O_CLOEXEC) < 0) {
 		LOGINFO("Error creating progress tracking pipe\n");
 		gui_err("backup_error=Error creating backup.");
+		unmapProgress();
 		return -1;
 	}
 	if ((*tar_fork_pid = fork()) == -1) {
@@ -139,6 +186,7 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 		gui_err("backup_error=Error creating backup.");
 		close(progress_pipe[0]);
 		close(progress_pipe[1]);
+		unmapProgress();
 		return -1;
 	}
 
@@ -149,28 +197,29 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 		close(progress_pipe[0]);
 		progress_pipe_fd = progress_pipe[1];
 
+		// One pass over the folder, usually already made by the size
+		// calculation, gives the file lists, the sizes and the headers
+		scan_cache = backup_exclusions->Get_Scan_Cache(tardir);
+		if (scan_cache == NULL) {
+			gui_err("backup_error=Error creating backup.");
+			close(progress_pipe[1]);
+			_exit(-1);
+		}
+
 		if (use_encryption || userdata_encryption) {
 			LOGINFO("Using encryption\n");
 			DIR* d;
 			struct dirent* de;
-			unsigned long long regular_size = 0, encrypt_size = 0, target_size = 0, total_size;
-			unsigned enc_thread_id = 1, regular_thread_id = 0, i, start_thread_id = 1, core_count = 1;
-			int item_len, ret, thread_error = 0;
+			unsigned long long regular_size = 0, encrypt_size = 0, total_size;
+			unsigned i, first_thread_id = 0, core_count = 1;
+			long cpus;
+			int item_len, ret;
 			std::vector<TarListStruct> RegularList;
 			std::vector<TarListStruct> EncryptList;
 			string FileName;
 			struct TarListStruct TarItem;
-			twrpTar reg, enc[9];
-			struct stat st;
-			pthread_t enc_thread[9];
-			pthread_attr_t tattr;
-			void *thread_return;
-
-			core_count = sysconf(_SC_NPROCESSORS_CONF);
-			if (core_count > 8)
-				core_count = 8;
-			LOGINFO("   Core Count      : %u\n", core_count);
-			Archive_Current_Size = 0;
+			TarWorkQueue queue;
+			twrpTar reg;
 
 			d = opendir(tardir.c_str());
 			if (d == NULL) {
@@ -178,7 +227,7 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 				close(progress_pipe[1]);
 				_exit(-1);
 			}
-			// Figure out the size of all data to be encrypted and create a list of unencrypted files
+			// Split the files into the ones kept unencrypted and the ones to encrypt
 			while ((de = readdir(d)) != NULL) {
 				FileName = tardir + "/" + de->d_name;
 
@@ -187,88 +236,44 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 				if (de->d_type == DT_DIR) {
 					item_len = strlen(de->d_name);
 					if (userdata_encryption && ((item_len >= 3 && strncmp(de->d_name, "app", 3) == 0) || (item_len >= 6 && strncmp(de->d_name, "dalvik", 6) == 0))) {
-						ret = Generate_TarList(FileName, &RegularList, &target_size, &regular_thread_id);
-						if (ret < 0) {
-							LOGINFO("Error in Generate_TarList with regular list!\n");
-							gui_err("backup_error=Error creating backup.");
-							closedir(d);
-							close(progress_pipe_fd);
-							close(progress_pipe[1]);
-							_exit(-1);
-						}
-						file_count = (unsigned long long)(ret);
-						regular_size += backup_exclusions->Get_Folder_Size(FileName);
+						ret = Generate_TarList(FileName, &RegularList);
+						regular_size += scan_cache->Folder_Size(FileName);
 					} else {
-						encrypt_size += backup_exclusions->Get_Folder_Size(FileName);
+						ret = Generate_TarList(FileName, &EncryptList);
+						encrypt_size += scan_cache->Folder_Size(FileName);
 					}
-				} else if (de->d_type == DT_REG) {
-					stat(FileName.c_str(), &st);
-					encrypt_size += (unsigned long long)(st.st_size);
-				}
-			}
-			closedir(d);
-
-			target_size = encrypt_size / core_count;
-			target_size++;
-			LOGINFO("   Unencrypted size: %llu\n", regular_size);
-			LOGINFO("   Encrypted size  : %llu\n", encrypt_size);
-			LOGINFO("   Target size     : %llu\n", target_size);
-			if (!userdata_encryption) {
-				enc_thread_id = 0;
-				start_thread_id = 0;
-				core_count--;
-			}
-			Archive_Current_Size = 0;
-
-			d = opendir(tardir.c_str());
-			if (d == NULL) {
-				gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tardir)(strerror(errno)));
-				close(progress_pipe[1]);
-				_exit(-1);
-			}
-			// Divide up the encrypted file list for threading
-			while ((de = readdir(d)) != NULL) {
-				FileName = tardir + "/" + de->d_name;
-
-				if (de->d_type == DT_BLK || de->d_type == DT_CHR || backup_exclusions->check_skip_dirs(FileName))
-					continue;
-				if (de->d_type == DT_DIR) {
-					item_len = strlen(de->d_name);
-					if (userdata_encryption && ((item_len >= 3 && strncmp(de->d_name, "app", 3) == 0) || (item_len >= 6 && strncmp(de->d_name, "dalvik", 6) == 0))) {
-						// Do nothing, we added these to RegularList earlier
-					} else {
-						FileName = tardir + "/" + de->d_name;
-						ret = Generate_TarList(FileName, &EncryptList, &target_size, &enc_thread_id);
-						if (ret < 0) {
-							LOGINFO("Error in Generate_TarList with encrypted list!\n");
-							gui_err("backup_error=Error creating backup.");
-							closedir(d);
-							close(progress_pipe[1]);
-							_exit(-1);
-						}
-						file_count += (unsigned long long)(ret);
+					if (ret < 0) {
+						LOGINFO("Error in Generate_TarList!\n");
+						gui_err("backup_error=Error creating backup.");
+						closedir(d);
+						close(progress_pipe[1]);
+						_exit(-1);
 					}
+					file_count += (unsigned long long)(ret);
 				} else if (de->d_type == DT_REG || de->d_type == DT_LNK) {
-					stat(FileName.c_str(), &st);
-					if (de->d_type == DT_REG)
-						Archive_Current_Size += (unsigned long long)(st.st_size);
+					TarItem.entry = scan_cache->Find(FileName);
+					if (TarItem.entry < 0)
+						continue;
+					if (de->d_type == DT_REG) {
+						encrypt_size += scan_cache->Entry(TarItem.entry).size;
+						file_count++;
+					}
 					TarItem.fn = FileName;
-					TarItem.thread_id = enc_thread_id;
 					EncryptList.push_back(TarItem);
-					file_count++;
 				}
 			}
 			closedir(d);
-			if (enc_thread_id != core_count) {
-				LOGINFO("Error dividing up threads for encryption, %u threads for %u cores!\n", enc_thread_id, core_count);
-				if (enc_thread_id > core_count) {
-					gui_err("backup_error=Error creating backup.");
-					close(progress_pipe[1]);
-					_exit(-1);
-				} else {
-					LOGINFO("Continuining anyway.");
-				}
-			}
+
+			// One archive thread per core unless told otherwise, more than there are files to hand out is pointless
+			cpus = sysconf(_SC_NPROCESSORS_ONLN);
+			core_count = cpus > 0 ? (unsigned)cpus : 1;
+			if (archive_threads > 0)
+				core_count = archive_threads;
+			if (core_count > EncryptList.size())
+				core_count = EncryptList.size() ? EncryptList.size() : 1;
+			LOGINFO("   Core Count      : %u\n", core_count);
+			LOGINFO("   Unencrypted size: %llu\n", regular_size);
+			LOGINFO("   Encrypted size  : %llu\n", encrypt_size);
 
 			// Send file count to parent
 			write(progress_pipe_fd, &file_count, sizeof(file_count));
@@ -277,14 +282,18 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 			write(progress_pipe_fd, &total_size, sizeof(total_size));
 
 			if (userdata_encryption) {
-				// Create a backup of unencrypted data
+				// Create a backup of unencrypted data, the encrypted archives follow it
 				reg.setfn(tarfn);
 				reg.ItemList = &RegularList;
 				reg.thread_id = 0;
 				reg.use_encryption = 0;
 				reg.use_compression = use_compression;
+				reg.compression_level = compression_level;
+				reg.compression_threads = compression_threads;
+				reg.write_index = write_index;
 				reg.split_archives = 1;
-				reg.progress_pipe_fd = progress_pipe_fd;
+				reg.scan_cache = scan_cache;
+				reg.progress_counters = progress_counters;
 				reg.part_settings = part_settings;
 				LOGINFO("Creating unencrypted backup...\n");
 				if (createList((void*)&reg) != 0) {
@@ -293,84 +302,43 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 					close(progress_pipe[1]);
 					_exit(-1);
 				}
+				first_thread_id = 1;
 			}
 
-			if (pthread_attr_init(&tattr)) {
-				LOGINFO("Unable to pthread_attr_init\n");
-				gui_err("backup_error=Error creating backup.");
-				close(progress_pipe[1]);
-				_exit(-1);
-			}
-			if (pthread_attr_setdetachstate(&tattr, PTHREAD_CREATE_JOINABLE)) {
-				LOGINFO("Error setting pthread_attr_setdetachstate\n");
-				gui_err("backup_error=Error creating backup.");
-				close(progress_pipe[1]);
-				_exit(-1);
-			}
-			if (pthread_attr_setscope(&tattr, PTHREAD_SCOPE_SYSTEM)) {
-				LOGINFO("Error setting pthread_attr_setscope\n");
-				gui_err("backup_error=Error creating backup.");
-				close(progress_pipe[1]);
-				_exit(-1);
-			}
-			/*if (pthread_attr_setstacksize(&tattr, 524288)) {
-				LOGERR("Error setting pthread_attr_setstacksize\n");
-				_exit(-1);
-			}*/
-
-			// Create threads for the divided up encryption lists
-			for (i = start_thread_id; i <= core_count; i++) {
+			// Every thread writes its own archive sequence from the batches it takes
+			queue.TarList = &EncryptList;
+			queue.Parts = NULL;
+			queue.next = 0;
+			queue.end = EncryptList.size();
+			queue.remaining_size = encrypt_size;
+			queue.workers = core_count;
+			queue.failed = false;
+			pthread_mutex_init(&queue.lock, NULL);
+			pthread_cond_init(&queue.cond, NULL);
+			std::vector<twrpTar> enc(core_count);
+			for (i = 0; i < core_count; i++) {
 				enc[i].setdir(tardir);
 				enc[i].setfn(tarfn);
 				enc[i].ItemList = &EncryptList;
-				enc[i].thread_id = i;
+				enc[i].work_queue = &queue;
+				enc[i].thread_id = first_thread_id + i;
 				enc[i].use_encryption = use_encryption;
 				enc[i].setpassword(password);
 				enc[i].use_compression = use_compression;
+				enc[i].compression_level = compression_level;
+				// The archives already run one thread per core, so unless told
+				// otherwise each of them compresses on a single thread
+				enc[i].compression_threads = compression_threads ? compression_threads : 1;
 				enc[i].split_archives = 1;
-				enc[i].progress_pipe_fd = progress_pipe_fd;
+				enc[i].write_index = write_index;
+				enc[i].scan_cache = scan_cache;
+				enc[i].progress_counters = progress_counters;
 				enc[i].part_settings = part_settings;
-				LOGINFO("Start encryption thread %i\n", i);
-				ret = pthread_create(&enc_thread[i], &tattr, createList, (void*)&enc[i]);
-				if (ret) {
-					LOGINFO("Unable to create %i thread for encryption! %i\nContinuing in same thread (backup will be slower).\n", i, ret);
-					if (createList((void*)&enc[i]) != 0) {
-						LOGINFO("Error creating encrypted backup %i.\n", i);
-						gui_err("backup_error=Error creating backup.");
-						close(progress_pipe[1]);
-						_exit(-1);
-					} else {
-						enc[i].thread_id = i + 1;
-					}
-				}
-				usleep(100000); // Need a short delay before starting the next thread or the threads will never finish for some reason.
-			}
-			if (pthread_attr_destroy(&tattr)) {
-				LOGINFO("Failed to pthread_attr_destroy\n");
-			}
-			for (i = start_thread_id; i <= core_count; i++) {
-				if (enc[i].thread_id == i) {
-					if (pthread_join(enc_thread[i], &thread_return)) {
-						LOGINFO("Error joining thread %i\n", i);
-						gui_err("backup_error=Error creating backup.");
-						close(progress_pipe[1]);
-						_exit(-1);
-					} else {
-						LOGINFO("Joined thread %i.\n", i);
-						ret = (int)(intptr_t)thread_return;
-						if (ret != 0) {
-							thread_error = 1;
-							LOGINFO("Thread %i returned an error %i.\n", i, ret);
-							gui_err("backup_error=Error creating backup.");
-							close(progress_pipe[1]);
-							_exit(-1);
-						}
-					}
-				} else {
-					LOGINFO("Skipping joining thread %i because of pthread failure.\n", i);
-				}
 			}
-			if (thread_error) {
+			ret = Run_Workers(&enc, createList);
+			pthread_cond_destroy(&queue.cond);
+			pthread_mutex_destroy(&queue.lock);
+			if (ret != 0) {
 				LOGINFO("Error returned by one or more threads.\n");
 				gui_err("backup_error=Error creating backup.");
 				close(progress_pipe[1]);
@@ -382,13 +350,11 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 		} else {
 			// Not encrypted
 			std::vector<TarListStruct> FileList;
-			unsigned thread_id = 0;
-			unsigned long long target_size = 0;
 			twrpTar reg;
 			int ret;
 
 			// Generate list of files to back up
-			ret = Generate_TarList(tardir, &FileList, &target_size, &thread_id);
+			ret = Generate_TarList(tardir, &FileList);
 			if (ret < 0) {
 				LOGINFO("Error in Generate_TarList!\n");
 				gui_err("backup_error=Error creating backup.");
@@ -402,8 +368,13 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 			reg.thread_id = 0;
 			reg.use_encryption = 0;
 			reg.use_compression = use_compression;
+			reg.compression_level = compression_level;
+			reg.compression_threads = compression_threads;
+			reg.write_index = write_index;
+			reg.tee_digest = writesDigest();
 			reg.setsize(Total_Backup_Size);
-			reg.progress_pipe_fd = progress_pipe_fd;
+			reg.scan_cache = scan_cache;
+			reg.progress_counters = progress_counters;
 			reg.part_settings = part_settings;
 			if (Total_Backup_Size > MAX_ARCHIVE_SIZE && !part_settings->adbbackup) {
 				gui_msg("split_backup=Breaking backup file into multiple archives...");
@@ -424,34 +395,23 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 		}
 	} else {
 		// Parent side
-		unsigned long long fs, size_backup = 0, files_backup = 0, file_count = 0;
-		int first_data = 0;
+		unsigned long long size_backup = 0, files_backup = 0, file_count = 0, total_size = 0;
 
 		// Parent closes output side
 		close(progress_pipe[1]);
 
-		// Read progress data from children
-		while (read(progress_pipe[0], &fs, sizeof(fs)) > 0) {
-			if (first_data == 0) {
-				// First incoming data is the file count
-				file_count = fs;
-				if (file_count == 0) file_count = 1; // prevent division by 0 below
-				first_data = 1;
-			} else if (first_data == 1) {
-				// Second incoming data is total size
-				first_data = 2;
-				part_settings->progress->SetSizeCount(fs, file_count);
-			} else {
-				if (fs > 0) {
-					size_backup += fs;
-					part_settings->progress->UpdateSize(size_backup);
-				} else { // fs == 0 increments the file counter
-					files_backup++;
-					part_settings->progress->UpdateSizeCount(size_backup, files_backup);
-				}
-			}
+		// The child sends the file count and total size, after that the
+		// pipe is only used to signal completion by being closed
+		if (read(progress_pipe[0], &file_count, sizeof(file_count)) == sizeof(file_count) &&
+			read(progress_pipe[0], &total_size, sizeof(total_size)) == sizeof(total_size)) {
+			if (file_count == 0) file_count = 1; // prevent division by 0 below
+			part_settings->progress->SetSizeCount(total_size, file_count);
 		}
+		pollProgress(progress_pipe[0], true);
 		close(progress_pipe[0]);
+		size_backup = __atomic_load_n(&progress_counters->bytes, __ATOMIC_ACQUIRE);
+		files_backup = __atomic_load_n(&progress_counters->files, __ATOMIC_ACQUIRE);
+		unmapProgress();
 #ifndef BUILD_TWRPTAR_MAIN
 		DataManager::SetValue("tw_file_progress", "");
 		DataManager::SetValue("tw_size_progress", "");
@@ -484,9 +444,14 @@ int twrpTar::extractTarFork() {
 	pid_t tar_fork_pid;
 	int progress_pipe[2];
 
-	if (pipe(progress_pipe) < 0) {
+	if (mapProgress() != 0) {
+		gui_err("restore_error=Error during restore process.");
+		return -1;
+	}
+	if (pipe2(progress_pipe, O_CLOEXEC) < 0) {
 		LOGINFO("Error creating progress tracking pipe\n");
 		gui_err("restore_error=Error during restore process.");
+		unmapProgress();
 		return -1;
 	}
 
@@ -508,12 +473,9 @@ int twrpTar::extractTarFork() {
 				LOGINFO("Multiple archives\n");
 				string temp;
 				char actual_filename[255];
-				twrpTar tars[9];
-				pthread_t tar_thread[9];
-				pthread_attr_t tattr;
-				unsigned thread_count = 0, i, start_thread_id = 1;
-				int ret, thread_error = 0;
-				void *thread_return;
+				std::vector<TarArchivePart> parts;
+				TarArchivePart part;
+				unsigned start_thread_id = 1;
 
 				basefn = tarfn;
 				temp = basefn + "%i%02i";
@@ -524,95 +486,41 @@ int twrpTar::extractTarFork() {
 					close(progress_pipe_fd);
 					_exit(-1);
 				}
+				part.done = false;
 				if (TWFunc::Get_File_Type(tarfn) != 2) {
+					// The unencrypted data (app and dalvik) goes back ahead of the encrypted archives
 					LOGINFO("First tar file '%s' not encrypted\n", tarfn.c_str());
-					tars[0].basefn = basefn;
-					tars[0].thread_id = 0;
-					tars[0].progress_pipe_fd = progress_pipe_fd;
-					tars[0].part_settings = part_settings;
-					if (extractMulti((void*)&tars[0]) != 0) {
+					part.set = 0;
+					for (part.part = 0; part.part < 100; part.part++) {
+						sprintf(actual_filename, temp.c_str(), part.set, part.part);
+						if (!TWFunc::Path_Exists(actual_filename))
+							break;
+						part.fn = actual_filename;
+						parts.push_back(part);
+					}
+					if (extractParts(&parts) != 0) {
 						LOGINFO("Error extracting split archive.\n");
 						gui_err("restore_error=Error during restore process.");
 						close(progress_pipe_fd);
 						_exit(-1);
 					}
+					parts.clear();
 				} else {
 					start_thread_id = 0;
 				}
-				// Start threading encrypted restores
-				if (pthread_attr_init(&tattr)) {
-					LOGINFO("Unable to pthread_attr_init\n");
-					gui_err("restore_error=Error during restore process.");
-					close(progress_pipe_fd);
-					_exit(-1);
-				}
-				if (pthread_attr_setdetachstate(&tattr, PTHREAD_CREATE_JOINABLE)) {
-					LOGINFO("Error setting pthread_attr_setdetachstate\n");
-					gui_err("restore_error=Error during restore process.");
-					close(progress_pipe_fd);
-					_exit(-1);
-				}
-				if (pthread_attr_setscope(&tattr, PTHREAD_SCOPE_SYSTEM)) {
-					LOGINFO("Error setting pthread_attr_setscope\n");
-					gui_err("restore_error=Error during restore process.");
-					close(progress_pipe_fd);
-					_exit(-1);
-				}
-				/*if (pthread_attr_setstacksize(&tattr, 524288)) {
-					LOGERR("Error setting pthread_attr_setstacksize\n");
-					close(progress_pipe_fd);
-					_exit(-1);
-				}*/
-				for (i = start_thread_id; i < 9; i++) {
-					sprintf(actual_filename, temp.c_str(), i, 0);
-					if (TWFunc::Path_Exists(actual_filename)) {
-						thread_count++;
-						tars[i].basefn = basefn;
-						tars[i].setpassword(password);
-						tars[i].thread_id = i;
-						tars[i].progress_pipe_fd = progress_pipe_fd;
-						tars[i].part_settings = part_settings;
-						LOGINFO("Creating extract thread ID %i\n", i);
-						ret = pthread_create(&tar_thread[i], &tattr, extractMulti, (void*)&tars[i]);
-						if (ret) {
-							LOGINFO("Unable to create %i thread for extraction! %i\nContinuing in same thread (restore will be slower).\n", i, ret);
-							if (extractMulti((void*)&tars[i]) != 0) {
-								LOGINFO("Error extracting backup in thread %i.\n", i);
-								gui_err("restore_error=Error during restore process.");
-								close(progress_pipe_fd);
-								_exit(-1);
-							} else {
-								tars[i].thread_id = i + 1;
-							}
-						}
-						usleep(100000); // Need a short delay before starting the next thread or the threads will never finish for some reason.
-					} else {
-						break;
-					}
-				}
-				for (i = start_thread_id; i < thread_count + start_thread_id; i++) {
-					if (tars[i].thread_id == i) {
-						if (pthread_join(tar_thread[i], &thread_return)) {
-							LOGINFO("Error joining thread %i\n", i);
-							gui_err("restore_error=Error during restore process.");
-							close(progress_pipe_fd);
-							_exit(-1);
-						} else {
-							LOGINFO("Joined thread %i.\n", i);
-							ret = (int)(intptr_t)thread_return;
-							if (ret != 0) {
-								thread_error = 1;
-								LOGINFO("Thread %i returned an error %i.\n", i, ret);
-								gui_err("restore_error=Error during restore process.");
-								close(progress_pipe_fd);
-								_exit(-1);
-							}
-						}
-					} else {
-						LOGINFO("Skipping joining thread %i because of pthread failure.\n", i);
+				// Every archive thread of the backup left a sequence numbered from start_thread_id up
+				for (part.set = start_thread_id; ; part.set++) {
+					for (part.part = 0; part.part < 100; part.part++) {
+						sprintf(actual_filename, temp.c_str(), part.set, part.part);
+						if (!TWFunc::Path_Exists(actual_filename))
+							break;
+						part.fn = actual_filename;
+						parts.push_back(part);
 					}
+					if (part.part == 0)
+						break;
 				}
-				if (thread_error) {
+				if (extractParts(&parts) != 0) {
 					LOGINFO("Error returned by one or more threads.\n");
 					gui_err("restore_error=Error during restore process.");
 					close(progress_pipe_fd);
@@ -625,17 +533,13 @@ int twrpTar::extractTarFork() {
 		}
 		else // parent process
 		{
-			unsigned long long fs, size_backup = 0;
-
 			// Parent closes output side
 			close(progress_pipe[1]);
 
-			// Read progress data from children
-			while (read(progress_pipe[0], &fs, sizeof(fs)) > 0) {
-				size_backup += fs;
-				part_settings->progress->UpdateSize(size_backup);
-			}
+			// Sample the shared progress counters until the child is done
+			pollProgress(progress_pipe[0], false);
 			close(progress_pipe[0]);
+			unmapProgress();
 			part_settings->progress->UpdateDisplayDetails(true);
 
 			if (TWFunc::Wait_For_Child(tar_fork_pid, &status, "extractTarFork()") != 0)
@@ -646,54 +550,35 @@ int twrpTar::extractTarFork() {
 	{
 		close(progress_pipe[0]);
 		close(progress_pipe[1]);
+		unmapProgress();
 		LOGINFO("extract tar failed to fork.\n");
 		return -1;
 	}
 	return 0;
 }
 
-int twrpTar::Generate_TarList(string Path, std::vector<TarListStruct> *TarList, unsigned long long *Target_Size, unsigned *thread_id) {
-	DIR* d;
-	struct dirent* de;
-	struct stat st;
-	string FileName;
+int twrpTar::Generate_TarList(string Path, std::vector<TarListStruct> *TarList) {
 	struct TarListStruct TarItem;
-	int ret, file_count;
-	file_count = 0;
+	int index, end, file_count = 0;
 
-	d = opendir(Path.c_str());
-	if (d == NULL) {
-		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Path)(strerror(errno)));
-		closedir(d);
+	index = scan_cache->Find(Path);
+	if (index < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Path)(strerror(ENOENT)));
 		return -1;
 	}
-	while ((de = readdir(d)) != NULL) {
-		FileName = Path + "/" + de->d_name;
+	// Everything below Path follows it in the scan, in directory order
+	end = scan_cache->Entry(index).end;
+	for (index++; index < end; index++) {
+		const twrpScanEntry &entry = scan_cache->Entry(index);
 
-		if (de->d_type == DT_BLK || de->d_type == DT_CHR || backup_exclusions->check_skip_dirs(FileName))
+		if (!S_ISDIR(entry.mode) && !S_ISREG(entry.mode) && !S_ISLNK(entry.mode))
 			continue;
-		TarItem.fn = FileName;
-		TarItem.thread_id = *thread_id;
-		if (de->d_type == DT_DIR) {
-			TarList->push_back(TarItem);
-			ret = Generate_TarList(FileName, TarList, Target_Size, thread_id);
-			if (ret < 0)
-				return -1;
-			file_count += ret;
-		} else if (de->d_type == DT_REG || de->d_type == DT_LNK) {
-			stat(FileName.c_str(), &st);
-			TarList->push_back(TarItem);
-			if (de->d_type == DT_REG) {
-				file_count++;
-				Archive_Current_Size += st.st_size;
-			}
-			if (Archive_Current_Size != 0 && *Target_Size != 0 && Archive_Current_Size > *Target_Size) {
-				*thread_id = *thread_id + 1;
-				Archive_Current_Size = 0;
-			}
-		}
+		TarItem.fn = scan_cache->Path(index);
+		TarItem.entry = index;
+		TarList->push_back(TarItem);
+		if (S_ISREG(entry.mode))
+			file_count++;
 	}
-	closedir(d);
 	return file_count;
 }
 
@@ -701,16 +586,23 @@ int twrpTar::extractTar() {
 	char* charRootDir = (char*) tardir.c_str();
 	if (openTar() == -1)
 		return -1;
-	if (tar_extract_all(t, charRootDir, &progress_pipe_fd) != 0) {
+	if ((work_queue != NULL ? extractEntries() : tar_extract_all(t, charRootDir, progress_counters)) != 0) {
 		LOGINFO("Unable to extract tar archive '%s'\n", tarfn.c_str());
 		gui_err("restore_error=Error during restore process.");
+		if (decrypting) {
+			// Closing the pipe stops the decryption thread
+			tar_close(t);
+			finishDecryption();
+		}
 		return -1;
 	}
 	if (tar_close(t) != 0) {
 		LOGINFO("Unable to close tar file\n");
 		gui_err("restore_error=Error during restore process.");
+		finishDecryption();
 		return -1;
 	}
+	finishDecryption();
 #ifndef BUILD_TWRPTAR_MAIN
 	if (part_settings->adbbackup) {
 		if (!twadbbu::Write_TWEOF())
@@ -721,6 +613,9 @@ int twrpTar::extractTar() {
 }
 
 int twrpTar::extract() {
+	// The digest may still be being checked by the parent
+	if (part_settings->digest_verifier != NULL && !part_settings->adbbackup && !part_settings->digest_verifier->Wait(tarfn))
+		return -1;
 	if (!part_settings->adbbackup)  {
 		LOGINFO("Setting archive type\n");
 		Set_Archive_Type(TWFunc::Get_File_Type(tarfn));
@@ -761,12 +656,15 @@ int twrpTar::extract() {
 }
 
 int twrpTar::tarList(std::vector<TarListStruct> *TarList, unsigned thread_id) {
-	struct stat st;
+	tar_meta_t meta;
 	char buf[PATH_MAX];
-	int list_size = TarList->size(), i = 0, archive_count = 0;
+	int archive_count = 0;
+	size_t i, start = 0, end = TarList->size();
 	string temp;
 	char actual_filename[PATH_MAX];
 	unsigned long long fs;
+	std::vector<size_t> folders;                         // Folders the batch starts in, written again ahead of it
+	bool more;
 
 	if (split_archives) {
 		basefn = tarfn;
@@ -790,16 +688,30 @@ int twrpTar::tarList(std::vector<TarListStruct> *TarList, unsigned thread_id) {
 	}
 	Archive_Current_Size = 0;
 
-	while (i < list_size) {
-		if (TarList->at(i).thread_id == thread_id) {
+	// Alone the whole list is ours, otherwise keep taking batches until none are left
+	more = work_queue == NULL || Next_Batch(&start, &end, &folders);
+	while (more) {
+		for (i = 0; i < folders.size(); i++) {
+			scan_cache->Get_Meta(TarList->at(folders[i]).entry, &meta);
+			if (addFile(TarList->at(folders[i]).fn, include_root_dir, &meta) != 0) {
+				LOGINFO("Error adding folder '%s' to '%s'\n", TarList->at(folders[i]).fn.c_str(), tarfn.c_str());
+				gui_err("backup_error=Error creating backup.");
+				return -1;
+			}
+		}
+		for (i = start; i < end; i++) {
 			strcpy(buf, TarList->at(i).fn.c_str());
-			lstat(buf, &st);
-			if (S_ISREG(st.st_mode)) { // item is a regular file
-				fs = (unsigned long long)(st.st_size);
+			scan_cache->Get_Meta(TarList->at(i).entry, &meta);
+			if (S_ISREG(meta.st.st_mode)) { // item is a regular file
+				fs = (unsigned long long)(meta.st.st_size);
 				if (split_archives && Archive_Current_Size + fs > MAX_ARCHIVE_SIZE) {
+					// Later names of a file in an earlier archive of this thread stay hard links
+					libtar_hash_t *hardlinks = tar_detach_hardlinks(t);
+
 					if (closeTar() != 0) {
 						LOGINFO("Error closing '%s' on thread %i\n", tarfn.c_str(), thread_id);
 						gui_err("backup_error=Error creating backup.");
+						libtar_hash_free(hardlinks, (libtar_freefunc_t)tar_dev_free);
 						return -3;
 					}
 					archive_count++;
@@ -807,6 +719,7 @@ int twrpTar::tarList(std::vector<TarListStruct> *TarList, unsigned thread_id) {
 					if (archive_count > 99) {
 						LOGINFO("Too many archives for thread %i\n", thread_id);
 						gui_err("backup_error=Error creating backup.");
+						libtar_hash_free(hardlinks, (libtar_freefunc_t)tar_dev_free);
 						return -4;
 					}
 					sprintf(actual_filename, temp.c_str(), thread_id, archive_count);
@@ -814,22 +727,23 @@ int twrpTar::tarList(std::vector<TarListStruct> *TarList, unsigned thread_id) {
 					if (createTar() != 0) {
 						LOGINFO("Error creating tar '%s' for thread %i\n", tarfn.c_str(), thread_id);
 						gui_err("backup_error=Error creating backup.");
+						libtar_hash_free(hardlinks, (libtar_freefunc_t)tar_dev_free);
 						return -2;
 					}
+					tar_attach_hardlinks(t, hardlinks);
 					Archive_Current_Size = 0;
 				}
 				Archive_Current_Size += fs;
-				fs = 0; // Sending a 0 size to the pipe tells it to increment the file counter
-				write(progress_pipe_fd, &fs, sizeof(fs));
+				tar_progress_add(progress_counters, 0, 1);
 			}
 			LOGINFO("addFile '%s' including root: %i\n", buf, include_root_dir);
-			if (addFile(buf, include_root_dir) != 0) {
+			if (addFile(buf, include_root_dir, &meta) != 0) {
 				LOGINFO("Error adding file '%s' to '%s'\n", buf, tarfn.c_str());
 				gui_err("backup_error=Error creating backup.");
 				return -1;
 			}
 		}
-		i++;
+		more = work_queue != NULL && Next_Batch(&start, &end, &folders);
 	}
 	if (closeTar() != 0) {
 		LOGINFO("Error closing '%s' on thread %i\n", tarfn.c_str(), thread_id);
@@ -844,6 +758,7 @@ void* twrpTar::createList(void *cookie) {
 	twrpTar* threadTar = (twrpTar*) cookie;
 	if (threadTar->tarList(threadTar->ItemList, threadTar->thread_id) != 0) {
 		LOGINFO("ERROR tarList for thread ID %i\n", threadTar->thread_id);
+		threadTar->Fail_Queue();
 		return (void*)-2;
 	}
 	LOGINFO("Thread ID %i finished successfully.\n", threadTar->thread_id);
@@ -852,31 +767,334 @@ void* twrpTar::createList(void *cookie) {
 
 void* twrpTar::extractMulti(void *cookie) {
 	twrpTar* threadTar = (twrpTar*) cookie;
-	int archive_count = 0;
-	string temp = threadTar->basefn + "%i%02i";
-	char actual_filename[255];
-	sprintf(actual_filename, temp.c_str(), threadTar->thread_id, archive_count);
-	while (TWFunc::Path_Exists(actual_filename)) {
-		threadTar->tarfn = actual_filename;
+
+	while (threadTar->Next_Archive_Part(&threadTar->part_index)) {
+		threadTar->tarfn = threadTar->work_queue->Parts->at(threadTar->part_index).fn;
 		if (threadTar->extract() != 0) {
-			LOGINFO("Error extracting '%s' in thread ID %i\n", actual_filename, threadTar->thread_id);
+			LOGINFO("Error extracting '%s'\n", threadTar->tarfn.c_str());
+			threadTar->Fail_Queue();
 			return (void*)-2;
 		}
-		archive_count++;
-		if (archive_count > 99)
-			break;
-		sprintf(actual_filename, temp.c_str(), threadTar->thread_id, archive_count);
+		threadTar->Finish_Archive_Part(threadTar->part_index);
 	}
-	LOGINFO("Thread ID %i finished successfully.\n", threadTar->thread_id);
 	return (void*)0;
 }
 
+int twrpTar::extractParts(std::vector<TarArchivePart> *parts) {
+	TarWorkQueue queue;
+	unsigned core_count, i;
+	long cpus;
+	int ret;
+
+	if (parts->empty())
+		return 0;
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	core_count = cpus > 0 ? (unsigned)cpus : 1;
+	if (core_count > parts->size())
+		core_count = parts->size();
+	LOGINFO("Restoring %zu archives with %u threads\n", parts->size(), core_count);
+
+	// Archives are handed out in order, so the earlier archives of a
+	// sequence that one waits for are already being extracted
+	queue.TarList = NULL;
+	queue.Parts = parts;
+	queue.next = 0;
+	queue.end = parts->size();
+	queue.remaining_size = 0;
+	queue.workers = core_count;
+	queue.failed = false;
+	pthread_mutex_init(&queue.lock, NULL);
+	pthread_cond_init(&queue.cond, NULL);
+	std::vector<twrpTar> tars(core_count);
+	for (i = 0; i < core_count; i++) {
+		tars[i].basefn = basefn;
+		tars[i].setpassword(password);
+		tars[i].work_queue = &queue;
+		tars[i].progress_counters = progress_counters;
+		tars[i].part_settings = part_settings;
+	}
+	ret = Run_Workers(&tars, extractMulti);
+	pthread_cond_destroy(&queue.cond);
+	pthread_mutex_destroy(&queue.lock);
+	return ret;
+}
+
+int twrpTar::extractEntries() {
+	char* charRootDir = (char*) tardir.c_str();
+	char buf[PATH_MAX];
+	string ready_parent;                                 // Folder of the last entry, already set up
+	int i;
+
+	while ((i = th_read(t)) == 0) {
+		string dir, parent;
+		size_t slash;
+
+		snprintf(buf, sizeof(buf), "%s/%s", charRootDir, th_get_pathname(t));
+		// A batch of the backup can start in any folder, so every entry
+		// that moves to another folder checks that it was set up first
+		parent = TWFunc::Remove_Trailing_Slashes(buf);
+		slash = parent.find_last_of('/');
+		parent = slash == string::npos ? "" : parent.substr(0, slash);
+		if (parent != ready_parent) {
+			if (!Wait_For_Parents(buf))
+				return -1;
+			ready_parent = parent;
+		}
+		// The file a hard link points to may be in an earlier archive
+		if (TH_ISLNK(t) && !Wait_For_Link(string(charRootDir) + "/" + th_get_linkname(t)))
+			return -1;
+		if (TH_ISDIR(t)) {
+			bool restored;
+
+			// Every set that writes into a folder carries its entry, the first one to get there sets it up
+			dir = TWFunc::Remove_Trailing_Slashes(buf);
+			pthread_mutex_lock(&work_queue->lock);
+			while (!work_queue->failed && work_queue->extracting_dirs.count(dir))
+				Wait_Queue();
+			if (work_queue->failed) {
+				pthread_mutex_unlock(&work_queue->lock);
+				return -1;
+			}
+			restored = work_queue->restored_dirs.count(dir) != 0;
+			if (!restored)
+				work_queue->extracting_dirs.insert(dir);
+			pthread_mutex_unlock(&work_queue->lock);
+			if (restored)
+				continue;
+		}
+		if (tar_extract_file(t, buf, charRootDir, progress_counters) != 0)
+			return -1;
+		if (TH_ISDIR(t)) {
+			pthread_mutex_lock(&work_queue->lock);
+			work_queue->extracting_dirs.erase(dir);
+			work_queue->restored_dirs.insert(dir);
+			pthread_cond_broadcast(&work_queue->cond);
+			pthread_mutex_unlock(&work_queue->lock);
+		}
+	}
+	return (i == 1 ? 0 : -1);
+}
+
+bool twrpTar::Next_Batch(size_t *start, size_t *end, std::vector<size_t> *folders) {
+	unsigned long long batch_size, size = 0;
+	size_t batch_entries;
+	std::vector<size_t> &open_folders = work_queue->open_folders;
+	bool ret = false;
+
+	pthread_mutex_lock(&work_queue->lock);
+	if (!work_queue->failed && work_queue->next < work_queue->end) {
+		// Batches shrink as the work runs out so the threads finish
+		// together, a file bigger than that is a batch of its own. Folders
+		// of many small files are split by their entry count.
+		batch_size = work_queue->remaining_size / (2 * work_queue->workers);
+		if (batch_size < min_batch_size)
+			batch_size = min_batch_size;
+		batch_entries = (work_queue->end - work_queue->next) / (2 * work_queue->workers);
+		if (batch_entries < min_batch_entries)
+			batch_entries = min_batch_entries;
+		*start = work_queue->next;
+		// Sets are restored in parallel, and a folder made by mkdirhier for
+		// another set's files would lose the metadata and encryption policy
+		// of its entry. A batch starting inside folders repeats their entries
+		// first, so every set has the entry of each folder it writes into.
+		while (work_queue->next < work_queue->end) {
+			size_t index = work_queue->TarList->at(work_queue->next).entry;
+			const twrpScanEntry &entry = scan_cache->Entry(index);
+
+			while (!open_folders.empty()) {
+				size_t folder = work_queue->TarList->at(open_folders.back()).entry;
+				if (index > folder && index < scan_cache->Entry(folder).end)
+					break;
+				open_folders.pop_back();
+			}
+			if (work_queue->next == *start)
+				*folders = open_folders;
+			else if (size >= batch_size || work_queue->next - *start >= batch_entries)
+				break;
+			if (S_ISDIR(entry.mode))
+				open_folders.push_back(work_queue->next);
+			if (S_ISREG(entry.mode))
+				size += entry.size;
+			work_queue->next++;
+		}
+		*end = work_queue->next;
+		work_queue->remaining_size -= size < work_queue->remaining_size ? size : work_queue->remaining_size;
+		ret = true;
+	}
+	pthread_mutex_unlock(&work_queue->lock);
+	return ret;
+}
+
+bool twrpTar::Next_Archive_Part(size_t *index) {
+	bool ret = false;
+
+	pthread_mutex_lock(&work_queue->lock);
+	if (!work_queue->failed && work_queue->next < work_queue->end) {
+		*index = work_queue->next++;
+		ret = true;
+	}
+	pthread_mutex_unlock(&work_queue->lock);
+	return ret;
+}
+
+void twrpTar::Finish_Archive_Part(size_t index) {
+	pthread_mutex_lock(&work_queue->lock);
+	work_queue->Parts->at(index).done = true;
+	pthread_cond_broadcast(&work_queue->cond);
+	pthread_mutex_unlock(&work_queue->lock);
+}
+
+bool twrpTar::Wait_For_Parents(const string &Path) {
+	string path = TWFunc::Remove_Trailing_Slashes(Path);
+	size_t pos = 0;
+	bool ret = true;
+
+	pthread_mutex_lock(&work_queue->lock);
+	// A restored folder's own parents were set up before it
+	pos = path.find_last_of('/');
+	if (pos != string::npos && pos > 0 && work_queue->restored_dirs.count(path.substr(0, pos))) {
+		pthread_mutex_unlock(&work_queue->lock);
+		return true;
+	}
+	pos = 0;
+	while (ret && (pos = path.find('/', pos + 1)) != string::npos) {
+		string dir = path.substr(0, pos);
+
+		if (dir.empty() || dir[dir.size() - 1] == '/')
+			continue;
+		while (!work_queue->failed && !Parent_Ready(dir))
+			Wait_Queue();
+		ret = !work_queue->failed;
+	}
+	pthread_mutex_unlock(&work_queue->lock);
+	return ret;
+}
+
+bool twrpTar::Wait_For_Link(const string &Target) {
+	struct stat st;
+	bool ret;
+
+	// Extracting into an existing file keeps its inode, so a link made
+	// while an earlier archive still writes the file ends up complete
+	pthread_mutex_lock(&work_queue->lock);
+	while (!work_queue->failed && lstat(Target.c_str(), &st) != 0 && !Earlier_Parts_Done())
+		Wait_Queue();
+	ret = !work_queue->failed;
+	pthread_mutex_unlock(&work_queue->lock);
+	return ret;
+}
+
+bool twrpTar::Parent_Ready(const string &Dir) {
+	struct stat st;
+
+	if (work_queue->restored_dirs.count(Dir))
+		return true;
+	// Another thread is extracting the folder's entry right now, whichever set it is in
+	if (work_queue->extracting_dirs.count(Dir))
+		return false;
+	// A folder that exists and is not being set up either came from before
+	// the restore or is a parent the backup did not store
+	if (stat(Dir.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+		return true;
+	// A set writing into a folder holds the folder's entry ahead of that, so
+	// once the earlier archives of this set are done nothing else will make it
+	return Earlier_Parts_Done();
+}
+
+bool twrpTar::Earlier_Parts_Done() {
+	const TarArchivePart &part = work_queue->Parts->at(part_index);
+
+	for (size_t i = part_index; i > 0; i--) {
+		const TarArchivePart &prev = work_queue->Parts->at(i - 1);
+
+		if (prev.set != part.set)
+			break;
+		if (!prev.done)
+			return false;
+	}
+	return true;
+}
+
+void twrpTar::Wait_Queue() {
+	struct timespec deadline;
+
+	// Files and folders made by another thread for an unarchived parent do
+	// not signal, so check again now and then
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_nsec += 100000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(&work_queue->cond, &work_queue->lock, &deadline);
+}
+
+void twrpTar::Fail_Queue() {
+	if (work_queue == NULL)
+		return;
+	pthread_mutex_lock(&work_queue->lock);
+	work_queue->failed = true;
+	pthread_mutex_unlock(&work_queue->lock);
+}
+
+int twrpTar::Run_Workers(std::vector<twrpTar> *workers, void *(*worker)(void*)) {
+	std::vector<pthread_t> threads(workers->size());
+	std::vector<bool> threaded(workers->size(), false);
+	pthread_attr_t tattr;
+	void *thread_return;
+	int ret = 0;
+	size_t i;
+
+	if (pthread_attr_init(&tattr)) {
+		LOGINFO("Unable to pthread_attr_init\n");
+		return -1;
+	}
+	if (pthread_attr_setdetachstate(&tattr, PTHREAD_CREATE_JOINABLE)) {
+		LOGINFO("Error setting pthread_attr_setdetachstate\n");
+		pthread_attr_destroy(&tattr);
+		return -1;
+	}
+	if (pthread_attr_setscope(&tattr, PTHREAD_SCOPE_SYSTEM)) {
+		LOGINFO("Error setting pthread_attr_setscope\n");
+		pthread_attr_destroy(&tattr);
+		return -1;
+	}
+	for (i = 0; i < workers->size(); i++) {
+		LOGINFO("Starting archive thread %zu\n", i);
+		if (pthread_create(&threads[i], &tattr, worker, (void*)&workers->at(i)) == 0) {
+			threaded[i] = true;
+		} else {
+			// The threads already running pick up the work this one would have done
+			LOGINFO("Unable to create archive thread %zu, continuing with %zu threads\n", i, i);
+			if (i == 0 && worker((void*)&workers->at(i)) != 0)
+				ret = -1;
+			break;
+		}
+	}
+	if (pthread_attr_destroy(&tattr)) {
+		LOGINFO("Failed to pthread_attr_destroy\n");
+	}
+	for (i = 0; i < workers->size(); i++) {
+		if (!threaded[i])
+			continue;
+		if (pthread_join(threads[i], &thread_return)) {
+			LOGINFO("Error joining thread %zu\n", i);
+			ret = -1;
+		} else if ((intptr_t)thread_return != 0) {
+			LOGINFO("Thread %zu returned an error %i.\n", i, (int)(intptr_t)thread_return);
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
 int twrpTar::addFilesToExistingTar(vector <string> files, string fn) {
 	char* charTarFile = (char*) fn.c_str();
 
 	if (tar_open(&t, charTarFile, NULL, O_RDONLY | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) == -1)
 		return -1;
 	removeEOT(charTarFile);
+	unlink(twrpTarIndex::Index_Name(fn).c_str());
 	if (tar_open(&t, charTarFile, NULL, O_WRONLY | O_APPEND | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) == -1)
 		return -1;
 	for (unsigned int i = 0; i < files.size(); ++i) {
@@ -895,218 +1113,103 @@ int twrpTar::createTar() {
 	char* charTarFile = (char*) tarfn.c_str();
 	char* charRootDir = (char*) tardir.c_str();
 
+#ifndef BUILD_TWRPTAR_MAIN
+	if (tee_digest) {
+		delete digest;
+		digest_sha2 = twrpDigestDriver::Use_SHA2();
+		digest = twrpDigestDriver::New_Digest(digest_sha2);
+	}
+#endif
+	delete index;
+	index = NULL;
+	// The index lists every member in plain text, so encrypted archives go without one
+	if (write_index && !part_settings->adbbackup && !use_encryption)
+		index = new twrpTarIndex();
+
 	if (use_encryption && use_compression) {
 		// Compressed and encrypted
 		current_archive_type = COMPRESSED_ENCRYPTED;
 		LOGINFO("Using encryption and compression...\n");
-		int i, pipes[4];
-
-		if (pipe(pipes) < 0) {
-			LOGINFO("Error creating first pipe\n");
-			gui_err("backup_error=Error creating backup.");
+		fd = open(tarfn.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+		if (fd < 0) {
+			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tarfn)(strerror(errno)));
 			return -1;
 		}
-		if (pipe(pipes + 2) < 0) {
-			LOGINFO("Error creating second pipe\n");
+		// tar -> gzip -> AES -> file, all in this process, the tar handle owns the fd
+		if (startEncryption(fd) != 0 || startCompression(fd) != 0) {
+			close(fd);
 			gui_err("backup_error=Error creating backup.");
 			return -1;
 		}
-		output_fd = open(tarfn.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
-		if (output_fd < 0) {
-			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tarfn)(strerror(errno)));
-			for (i = 0; i < 4; i++)
-				close(pipes[i]); // close all
-			return -1;
-		}
-		pigz_pid = fork();
-
-		if (pigz_pid < 0) {
-			LOGINFO("pigz fork() failed\n");
+		tar_type.writefunc = write_tar_no_buffer;
+		if (tar_fdopen(&t, fd, charRootDir, &tar_type, O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
+			close(fd);
+			LOGINFO("tar_fdopen failed\n");
 			gui_err("backup_error=Error creating backup.");
-			close(output_fd);
-			for (i = 0; i < 4; i++)
-				close(pipes[i]); // close all
 			return -1;
-		} else if (pigz_pid == 0) {
-			// pigz Child
-			close(pipes[1]);
-			close(pipes[2]);
-			int stdinfd = fileno(stdin);
-			int stdoutfd = fileno(stdout);
-			close(stdinfd);
-			dup2(pipes[0], stdinfd);
-			close(stdoutfd);
-			dup2(pipes[3], stdoutfd);
-			if (execlp("pigz", "pigz", "-", NULL) < 0) {
-				LOGINFO("execlp pigz ERROR!\n");
-				gui_err("backup_error=Error creating backup.");
-				close(output_fd);
-				close(pipes[0]);
-				close(pipes[3]);
-				_exit(-1);
-			}
-		} else {
-			// Parent
-			oaes_pid = fork();
-
-			if (oaes_pid < 0) {
-				LOGINFO("openaes fork() failed\n");
-				gui_err("backup_error=Error creating backup.");
-				close(output_fd);
-				for (i = 0; i < 4; i++)
-					close(pipes[i]); // close all
-				return -1;
-			} else if (oaes_pid == 0) {
-				// openaes Child
-				close(pipes[0]);
-				close(pipes[1]);
-				close(pipes[3]);
-				int stdinfd = fileno(stdin);
-				int stdoutfd = fileno(stdout);
-				close(stdinfd);
-				dup2(pipes[2], stdinfd);
-				close(stdoutfd);
-				dup2(output_fd, stdoutfd);
-				if (execlp("openaes", "openaes", "enc", "--key", password.c_str(), NULL) < 0) {
-					LOGINFO("execlp openaes ERROR!\n");
-					gui_err("backup_error=Error creating backup.");
-					close(pipes[2]);
-					close(output_fd);
-					_exit(-1);
-				}
-			} else {
-				// Parent
-				close(pipes[0]);
-				close(pipes[2]);
-				close(pipes[3]);
-				fd = pipes[1];
-				init_libtar_no_buffer(progress_pipe_fd);
-				tar_type.writefunc = write_tar_no_buffer;
-				if (tar_fdopen(&t, fd, charRootDir, &tar_type, O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
-					close(fd);
-					LOGINFO("tar_fdopen failed\n");
-					gui_err("backup_error=Error creating backup.");
-					return -1;
-				}
-				return 0;
-			}
 		}
+		tar_set_output_filter(t, compressTar, this);
 	} else if (use_compression) {
 		// Compressed
 		current_archive_type = COMPRESSED;
 		LOGINFO("Using compression...\n");
-		int pigzfd[2];
 		if (part_settings->adbbackup) {
 			LOGINFO("opening TW_ADB_BACKUP compressed stream\n");
 			output_fd = open(TW_ADB_BACKUP, O_WRONLY);
 		}
 		else {
-			output_fd = open(tarfn.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+			output_fd = open(tarfn.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
 		}
 		if (output_fd < 0) {
 			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tarfn)(strerror(errno)));
-			close(pigzfd[0]);
 			return -1;
 		}
-
-		if (pipe(pigzfd) < 0) {
-			LOGINFO("Error creating pipe\n");
+		// The gzip stream goes straight to the output, the tar handle owns the fd from here
+		fd = output_fd;
+		output_fd = -1;
+		if (startCompression(fd) != 0) {
+			close(fd);
 			gui_err("backup_error=Error creating backup.");
-			close(output_fd);
 			return -1;
 		}
-		pigz_pid = fork();
-
-		if (pigz_pid < 0) {
-			LOGINFO("fork() failed\n");
+		tar_type.writefunc = write_tar_no_buffer;
+		if (tar_fdopen(&t, fd, charRootDir, &tar_type, O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
+			close(fd);
+			LOGINFO("tar_fdopen failed\n");
 			gui_err("backup_error=Error creating backup.");
-			close(output_fd);
-			close(pigzfd[0]);
-			close(pigzfd[1]);
 			return -1;
-		} else if (pigz_pid == 0) {
-			// Child
-			close(pigzfd[1]);   // close unused output pipe
-			dup2(pigzfd[0], fileno(stdin)); // remap stdin
-			dup2(output_fd, fileno(stdout)); // remap stdout to output file
-			if (execlp("pigz", "pigz", "-", NULL) < 0) {
-				LOGINFO("execlp pigz ERROR!\n");
-				gui_err("backup_error=Error creating backup.");
-				close(output_fd);
-				close(pigzfd[0]);
-				_exit(-1);
-			}
-		} else {
-			// Parent
-			close(pigzfd[0]); // close parent input
-			fd = pigzfd[1];   // copy parent output
-			init_libtar_no_buffer(progress_pipe_fd);
-			tar_type.writefunc = write_tar_no_buffer;
-			if (tar_fdopen(&t, fd, charRootDir, &tar_type, O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
-				close(fd);
-				LOGINFO("tar_fdopen failed\n");
-				gui_err("backup_error=Error creating backup.");
-				return -1;
-			}
 		}
+		tar_set_output_filter(t, compressTar, this);
 	} else if (use_encryption) {
 		// Encrypted
 		current_archive_type = ENCRYPTED;
 		LOGINFO("Using encryption...\n");
-		int oaesfd[2];
-		output_fd = open(tarfn.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
-		if (output_fd < 0) {
+		fd = open(tarfn.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+		if (fd < 0) {
 			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tarfn)(strerror(errno)));
 			return -1;
 		}
-		if (pipe(oaesfd) < 0) {
-			LOGINFO("Error creating pipe\n");
+		if (startEncryption(fd) != 0) {
+			close(fd);
 			gui_err("backup_error=Error creating backup.");
-			close(output_fd);
 			return -1;
 		}
-		oaes_pid = fork();
-
-		if (oaes_pid < 0) {
-			LOGINFO("fork() failed\n");
+		init_libtar_no_buffer(progress_counters);
+		tar_type.writefunc = write_tar_no_buffer;
+		if (tar_fdopen(&t, fd, charRootDir, &tar_type, O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
+			close(fd);
+			LOGINFO("tar_fdopen failed\n");
 			gui_err("backup_error=Error creating backup.");
-			close(output_fd);
-			close(oaesfd[0]);
-			close(oaesfd[1]);
 			return -1;
-		} else if (oaes_pid == 0) {
-			// Child
-			close(oaesfd[1]);   // close unused
-			dup2(oaesfd[0], fileno(stdin)); // remap stdin
-			dup2(output_fd, fileno(stdout)); // remap stdout to output file
-			if (execlp("openaes", "openaes", "enc", "--key", password.c_str(), NULL) < 0) {
-				LOGINFO("execlp openaes ERROR!\n");
-				gui_err("backup_error=Error creating backup.");
-				close(output_fd);
-				close(oaesfd[0]);
-				_exit(-1);
-			}
-		} else {
-			// Parent
-			close(oaesfd[0]); // close parent input
-			fd = oaesfd[1];   // copy parent output
-			init_libtar_no_buffer(progress_pipe_fd);
-			tar_type.writefunc = write_tar_no_buffer;
-			if (tar_fdopen(&t, fd, charRootDir, &tar_type, O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
-				close(fd);
-				LOGINFO("tar_fdopen failed\n");
-				gui_err("backup_error=Error creating backup.");
-				return -1;
-			}
-			return 0;
 		}
+		tar_set_output_filter(t, encryptTar, this);
 	} else {
 		// Not compressed or encrypted
 		current_archive_type = UNCOMPRESSED;
-		init_libtar_buffer(0, progress_pipe_fd);
+		init_libtar_no_buffer(progress_counters);
+		tar_type.writefunc = write_tar_no_buffer;
 		if (part_settings->adbbackup) {
 			LOGINFO("Opening TW_ADB_BACKUP uncompressed stream\n");
-			tar_type.writefunc = write_tar_no_buffer;
 			output_fd = open(TW_ADB_BACKUP, O_WRONLY);
 			if(tar_fdopen(&t, output_fd, charRootDir, &tar_type, O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
 				close(output_fd);
@@ -1115,7 +1218,6 @@ int twrpTar::createTar() {
 			}
 		}
 		else {
-			tar_type.writefunc = write_tar;
 			if (tar_open(&t, charTarFile, &tar_type, O_WRONLY | O_CREAT | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) == -1) {
 				LOGERR("tar_open error opening '%s'\n", tarfn.c_str());
 				gui_err("backup_error=Error creating backup.");
@@ -1123,6 +1225,11 @@ int twrpTar::createTar() {
 			}
 		}
 	}
+	// Each archive gets its own output buffer so threads can all write buffered
+	if (tar_set_write_buffer(t, T_BULKSIZE) != 0)
+		LOGINFO("Unable to allocate tar write buffer, writing unbuffered\n");
+	if (digest != NULL && gzip == NULL && aes == NULL)
+		tar_set_output_filter(t, digestTar, this);
 	return 0;
 }
 
@@ -1134,19 +1241,20 @@ int twrpTar::openTar() {
 	if (current_archive_type == COMPRESSED_ENCRYPTED) {
 		LOGINFO("Opening encrypted and compressed backup...\n");
 		int i, pipes[4];
-		input_fd = open(tarfn.c_str(), O_RDONLY | O_LARGEFILE);
+		bool in_process = twrpAes::Is_Encrypted_File(tarfn); // Written by twrpAes rather than openaes
+		input_fd = open(tarfn.c_str(), O_RDONLY | O_LARGEFILE | O_CLOEXEC);
 		if (input_fd < 0) {
 			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tarfn)(strerror(errno)));
 			return -1;
 		}
 
-		if (pipe(pipes) < 0) {
+		if (pipe2(pipes, O_CLOEXEC) < 0) {
 			LOGINFO("Error creating first pipe\n");
 			gui_err("restore_error=Error during restore process.");
 			close(input_fd);
 			return -1;
 		}
-		if (pipe(pipes + 2) < 0) {
+		if (pipe2(pipes + 2, O_CLOEXEC) < 0) {
 			LOGINFO("Error creating second pipe\n");
 			gui_err("restore_error=Error during restore process.");
 			close(pipes[0]);
@@ -1154,7 +1262,7 @@ int twrpTar::openTar() {
 			close(input_fd);
 			return -1;
 		}
-		oaes_pid = fork();
+		oaes_pid = in_process ? 0 : fork();
 
 		if (oaes_pid < 0) {
 			LOGINFO("pigz fork() failed\n");
@@ -1163,7 +1271,7 @@ int twrpTar::openTar() {
 			for (i = 0; i < 4; i++)
 				close(pipes[i]); // close all
 			return -1;
-		} else if (oaes_pid == 0) {
+		} else if (oaes_pid == 0 && !in_process) {
 			// openaes Child
 			close(pipes[0]); // Close pipes that are not used by this child
 			close(pipes[2]);
@@ -1213,8 +1321,17 @@ int twrpTar::openTar() {
 			} else {
 				// Parent
 				close(pipes[0]); // Close pipes not used by parent
-				close(pipes[1]);
 				close(pipes[3]);
+				if (!in_process) {
+					close(pipes[1]);
+				} else if (startDecryption(pipes[1]) != 0) {
+					// pigz sees the end of its input and exits
+					close(pipes[2]);
+					gui_err("restore_error=Error during restore process.");
+					waitpid(pigz_pid, NULL, 0);
+					pigz_pid = 0;
+					return -1;
+				}
 				fd = pipes[2];
 				if (tar_fdopen(&t, fd, charRootDir, NULL, O_RDONLY | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
 					close(fd);
@@ -1227,19 +1344,37 @@ int twrpTar::openTar() {
 	} else if (current_archive_type == ENCRYPTED) {
 		LOGINFO("Opening encrypted backup...\n");
 		int oaesfd[2];
-		input_fd = open(tarfn.c_str(), O_RDONLY | O_LARGEFILE);
+		input_fd = open(tarfn.c_str(), O_RDONLY | O_LARGEFILE | O_CLOEXEC);
 		if (input_fd < 0) {
 			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tarfn)(strerror(errno)));
 			return -1;
 		}
 
-		if (pipe(oaesfd) < 0) {
+		if (pipe2(oaesfd, O_CLOEXEC) < 0) {
 			LOGINFO("Error creating pipe\n");
 			gui_err("restore_error=Error during restore process.");
 			close(input_fd);
 			return -1;
 		}
 
+		if (twrpAes::Is_Encrypted_File(tarfn)) {
+			// Written by twrpAes, a thread decrypts it into the pipe
+			if (startDecryption(oaesfd[1]) != 0) {
+				gui_err("restore_error=Error during restore process.");
+				close(oaesfd[0]);
+				return -1;
+			}
+			fd = oaesfd[0];
+			if (tar_fdopen(&t, fd, charRootDir, NULL, O_RDONLY | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
+				close(fd);
+				finishDecryption();
+				LOGINFO("tar_fdopen failed\n");
+				gui_err("restore_error=Error during restore process.");
+				return -1;
+			}
+			return 0;
+		}
+
 		oaes_pid = fork();
 		if (oaes_pid < 0) {
 			LOGINFO("fork() failed\n");
@@ -1282,14 +1417,14 @@ int twrpTar::openTar() {
 			input_fd = open(TW_ADB_RESTORE, O_RDONLY | O_LARGEFILE);
 		}
 		else
-			input_fd = open(tarfn.c_str(), O_RDONLY | O_LARGEFILE);
+			input_fd = open(tarfn.c_str(), O_RDONLY | O_LARGEFILE | O_CLOEXEC);
 
 		if (input_fd < 0) {
 			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tarfn)(strerror(errno)));
 			return -1;
 		}
 
-		if (pipe(pigzfd) < 0) {
+		if (pipe2(pigzfd, O_CLOEXEC) < 0) {
 			LOGINFO("Error creating pipe\n");
 			gui_err("restore_error=Error during restore process.");
 			close(input_fd);
@@ -1368,41 +1503,59 @@ string twrpTar::Strip_Root_Dir(string Path) {
 	return temp;
 }
 
-int twrpTar::addFile(string fn, bool include_root) {
+int twrpTar::addFile(string fn, bool include_root, const tar_meta_t *meta) {
 	char* charTarFile = (char*) fn.c_str();
+	unsigned long long offset = t->write_offset;
+
 	if (include_root) {
-		if (tar_append_file(t, charTarFile, NULL) == -1)
+		if (tar_append_file_meta(t, charTarFile, NULL, meta) == -1)
 			return -1;
 	} else {
 		string temp = Strip_Root_Dir(fn);
 		char* charTarPath = (char*) temp.c_str();
-		if (tar_append_file(t, charTarFile, charTarPath) == -1)
+		if (tar_append_file_meta(t, charTarFile, charTarPath, meta) == -1)
 			return -1;
 	}
+	// The header of the member just written is still in t
+	if (index != NULL)
+		index->Add(th_get_pathname(t), offset, TH_ISREG(t) ? th_get_size(t) : 0, TH_ISREG(t));
 	return 0;
 }
 
 int twrpTar::closeTar() {
+	unsigned long long stream_size;
+
 	LOGINFO("Closing tar\n");
-	flush_libtar_buffer(t->fd);
 	if (tar_append_eof(t) != 0) {
 		LOGINFO("tar_append_eof(): %s\n", strerror(errno));
 		tar_close(t);
 		return -1;
 	}
+	stream_size = t->write_offset;
+	if (gzip != NULL) {
+		bool finished = gzip->Finish();
+		delete gzip;
+		gzip = NULL;
+		if (!finished) {
+			LOGINFO("Unable to finish compressing '%s'\n", tarfn.c_str());
+			tar_close(t);
+			return -1;
+		}
+	}
+	// tar_close() closes fd as well
+	delete aes;
+	aes = NULL;
 	if (tar_close(t) != 0) {
 		LOGINFO("Unable to close tar archive: '%s'\n", tarfn.c_str());
 		return -1;
 	}
 	if (current_archive_type > 0) {
-		close(fd);
 		int status;
 		if (pigz_pid > 0 && TWFunc::Wait_For_Child(pigz_pid, &status, "pigz") != 0)
 			return -1;
 		if (oaes_pid > 0 && TWFunc::Wait_For_Child(oaes_pid, &status, "openaes") != 0)
 			return -1;
 	}
-	free_libtar_buffer();
 	if (!part_settings->adbbackup) {
 		if (use_compression && !use_encryption) {
 			string gzname = tarfn + ".gz";
@@ -1416,7 +1569,26 @@ int twrpTar::closeTar() {
 		}
 #ifndef BUILD_TWRPTAR_MAIN
 		tw_set_default_metadata(tarfn.c_str());
+		if (digest != NULL) {
+			bool saved = twrpDigestDriver::Save_Digest(tarfn, digest, digest_sha2);
+			delete digest;
+			digest = NULL;
+			if (!saved)
+				return -1;
+		}
 #endif
+		// Without its index the archive still restores, just more slowly
+		if (index != NULL) {
+			if (index->Write(tarfn, stream_size)) {
+#ifndef BUILD_TWRPTAR_MAIN
+				tw_set_default_metadata(twrpTarIndex::Index_Name(tarfn).c_str());
+#endif
+			} else {
+				LOGINFO("Unable to write the index of '%s'\n", tarfn.c_str());
+			}
+			delete index;
+			index = NULL;
+		}
 	}
 	else {
 #ifndef BUILD_TWRPTAR_MAIN
@@ -1426,11 +1598,137 @@ int twrpTar::closeTar() {
 	}
 	if (input_fd >= 0)
 		close(input_fd);
-	if (output_fd >= 0)
+	if (output_fd >= 0) {
 		close(output_fd);
+		output_fd = -1;
+	}
 	return 0;
 }
 
+int twrpTar::startCompression(int out_fd) {
+	gzip = new twrpGzip(out_fd, compression_level, compression_threads);
+	if (digest != NULL)
+		gzip->Tee_Digest(digest);
+	// Encrypted archives get the gzip stream, header included, through the cipher
+	if (aes != NULL)
+		gzip->Output_Filter(encryptTar, this);
+	if (!gzip->Start()) {
+		LOGINFO("Unable to start compression\n");
+		delete gzip;
+		gzip = NULL;
+		return -1;
+	}
+	init_libtar_no_buffer(progress_counters);
+	return 0;
+}
+
+ssize_t twrpTar::compressTar(void *cookie, const void *buf, size_t len) {
+	twrpTar *tar = (twrpTar*) cookie;
+	ssize_t ret = tar->gzip->Write(buf, len);
+
+	// Progress is counted in uncompressed bytes, same as the other archive types
+	if (ret > 0)
+		tar_progress_add(tar->progress_counters, ret, 0);
+	return ret;
+}
+
+int twrpTar::startEncryption(int out_fd) {
+	delete aes;
+	aes = new twrpAes(password, compression_threads);
+	if (!aes->Start_Encrypting(out_fd)) {
+		LOGINFO("Unable to start encryption\n");
+		delete aes;
+		aes = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+ssize_t twrpTar::encryptTar(void *cookie, const void *buf, size_t len) {
+	twrpTar *tar = (twrpTar*) cookie;
+	ssize_t ret = tar->aes->Write(buf, len);
+
+	// Compressed archives already counted their progress before deflating
+	if (ret > 0 && tar->gzip == NULL)
+		tar_progress_add(tar->progress_counters, ret, 0);
+	return ret;
+}
+
+int twrpTar::startDecryption(int out_fd) {
+	delete aes;
+	// Split archives are restored one thread per core already
+	aes = new twrpAes(password, work_queue != NULL ? 1 : 0);
+	if (!aes->Start_Decrypting(input_fd)) {
+		LOGINFO("Unable to decrypt '%s'\n", tarfn.c_str());
+		delete aes;
+		aes = NULL;
+		close(out_fd);
+		return -1;
+	}
+	decrypt_fd = out_fd;
+	if (pthread_create(&decrypt_thread, NULL, decryptThread, this) != 0) {
+		LOGINFO("Unable to start the decryption thread\n");
+		delete aes;
+		aes = NULL;
+		close(out_fd);
+		decrypt_fd = -1;
+		return -1;
+	}
+	decrypting = true;
+	return 0;
+}
+
+void twrpTar::finishDecryption() {
+	if (!decrypting)
+		return;
+	pthread_join(decrypt_thread, NULL);
+	decrypting = false;
+	delete aes;
+	aes = NULL;
+	// The thread was the only reader of the archive
+	close(input_fd);
+	input_fd = -1;
+}
+
+void* twrpTar::decryptThread(void *cookie) {
+	twrpTar *tar = (twrpTar*) cookie;
+	std::vector<char> buf(T_BULKSIZE);
+	sigset_t sigs;
+	ssize_t len, written;
+
+	// The reader may stop early, for example once tar_find() has its entry
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+	while ((len = tar->aes->Read(&buf[0], buf.size())) > 0) {
+		// Progress is counted by the extraction, not here
+		for (written = 0; written < len; ) {
+			ssize_t n = write(tar->decrypt_fd, &buf[written], len - written);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				break;
+			written += n;
+		}
+		if (written < len)
+			break;
+	}
+	if (len < 0)
+		LOGINFO("Unable to read '%s': %s\n", tar->tarfn.c_str(), strerror(errno));
+	close(tar->decrypt_fd);
+	tar->decrypt_fd = -1;
+	return NULL;
+}
+
+ssize_t twrpTar::digestTar(void *cookie, const void *buf, size_t len) {
+	twrpTar *tar = (twrpTar*) cookie;
+	ssize_t ret = write_tar_no_buffer(tar_fd(tar->t), buf, len);
+
+	if (ret > 0)
+		tar->digest->update((const unsigned char*) buf, ret);
+	return ret;
+}
+
 int twrpTar::removeEOT(string tarFile) {
 	char* charTarFile = (char*) tarFile.c_str();
 	off_t tarFileEnd = 0;
@@ -1448,17 +1746,26 @@ int twrpTar::removeEOT(string tarFile) {
 
 int twrpTar::entryExists(string entry) {
 	char* searchstr = (char*)entry.c_str();
+	twrpTarIndex archive_index;
 	int ret;
 
+	if (archive_index.Load(tarfn))
+		return archive_index.Find(entry, NULL, NULL);
+
 	Set_Archive_Type(TWFunc::Get_File_Type(tarfn));
 
 	if (openTar() == -1)
-		ret = 0;
-	else
-		ret = tar_find(t, searchstr);
+		return 0;
+	ret = tar_find(t, searchstr);
 
-	if (closeTar() != 0)
+	if (tar_close(t) != 0)
 		LOGINFO("Unable to close tar after searching for entry.\n");
+	// Closing the pipe early stops pigz and openaes or the decryption thread, only reap them
+	if (pigz_pid > 0)
+		waitpid(pigz_pid, NULL, 0);
+	if (oaes_pid > 0)
+		waitpid(oaes_pid, NULL, 0);
+	finishDecryption();
 
 	return ret;
 }
@@ -1484,9 +1791,11 @@ unsigned long long twrpTar::get_size() {
 				LOGERR("Unable to locate '%s' or '%s'\n", basefn.c_str(), tarfn.c_str());
 				return 0;
 			}
-			for (int i = 0; i < 9; i++) {
+			for (int i = 0; ; i++) {
 				archive_count = 0;
 				sprintf(actual_filename, temp.c_str(), i, archive_count);
+				if (!TWFunc::Path_Exists(actual_filename))
+					break;
 				while (TWFunc::Path_Exists(actual_filename)) {
 					total_restore_size += uncompressedSize(actual_filename);
 					archive_count++;
@@ -1513,6 +1822,14 @@ unsigned long long twrpTar::uncompressedSize(string filename) {
 	unsigned long long total_size = 0;
 	string Tar, Command, result;
 	vector<string> split;
+	twrpTarIndex archive_index;
+
+	// The index has the size without decrypting or decompressing anything.
+	// Encrypted archives have no index and read the size through AES-CTR.
+	if (archive_index.Load(filename))
+		return archive_index.Stream_Size();
+	if (twrpAes::Is_Encrypted_File(filename))
+		return encryptedSize(filename);
 
 	Set_Archive_Type(TWFunc::Get_File_Type(tarfn));
 	if (current_archive_type == UNCOMPRESSED) {
@@ -1568,8 +1885,76 @@ unsigned long long twrpTar::uncompressedSize(string filename) {
 	return total_size;
 }
 
-extern "C" ssize_t write_tar(int fd, const void *buffer, size_t size) {
-	return (ssize_t) write_libtar_buffer(fd, buffer, size);
+// Archives written by twrpAes decrypt at any offset, so a compressed one
+// only needs the gzip trailer holding the size modulo 2^32, same as pigz -l
+unsigned long long twrpTar::encryptedSize(string filename) {
+	unsigned long long total_size = 0, stream_size;
+	unsigned char trailer[4];
+	struct stat st;
+	int ret, size_fd;
+
+	ret = TWFunc::Try_Decrypting_File(filename, password);
+	if (ret < 1) {
+		gui_msg(Msg(msg::kError, "fail_decrypt_tar=Failed to decrypt tar file '{1}'")(filename));
+		return TWFunc::Get_File_Size(filename);
+	}
+	size_fd = open(filename.c_str(), O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+	if (size_fd < 0)
+		return 0;
+	if (fstat(size_fd, &st) == 0 && (unsigned long long)st.st_size > twrpAes::Header_Size()) {
+		stream_size = st.st_size - twrpAes::Header_Size();
+		if (ret != 3) {
+			total_size = stream_size;
+		} else {
+			twrpAes size_aes(password, 1);
+
+			if (stream_size >= sizeof(trailer) && size_aes.Start_Decrypting(size_fd) && size_aes.Read_At(stream_size - sizeof(trailer), trailer, sizeof(trailer)))
+				total_size = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | ((unsigned long long)trailer[3] << 24);
+		}
+	}
+	close(size_fd);
+	return total_size;
+}
+
+int twrpTar::mapProgress() {
+	progress_counters = (tar_progress_t*) mmap(NULL, sizeof(tar_progress_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (progress_counters == MAP_FAILED) {
+		LOGINFO("Error mapping progress counters: %s\n", strerror(errno));
+		progress_counters = NULL;
+		return -1;
+	}
+	memset(progress_counters, 0, sizeof(tar_progress_t));
+	return 0;
+}
+
+void twrpTar::unmapProgress() {
+	if (progress_counters != NULL)
+		munmap(progress_counters, sizeof(tar_progress_t));
+	progress_counters = NULL;
+}
+
+void twrpTar::pollProgress(int pipe_fd, bool update_count) {
+	struct pollfd pfd;
+	unsigned long long size, count, data;
+	int ret;
+
+	pfd.fd = pipe_fd;
+	pfd.events = POLLIN;
+	for (;;) {
+		ret = poll(&pfd, 1, progress_poll_ms);
+		size = __atomic_load_n(&progress_counters->bytes, __ATOMIC_RELAXED);
+		if (update_count) {
+			count = __atomic_load_n(&progress_counters->files, __ATOMIC_RELAXED);
+			part_settings->progress->UpdateSizeCount(size, count);
+		} else {
+			part_settings->progress->UpdateSize(size);
+		}
+		if (ret < 0 && errno != EINTR)
+			break;
+		// Readable means the child closed its end of the pipe
+		if (ret > 0 && read(pipe_fd, &data, sizeof(data)) <= 0)
+			break;
+	}
 }
 
 extern "C" ssize_t write_tar_no_buffer(int fd, const void *buffer, size_t size) {
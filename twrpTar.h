@@ -19,7 +19,6 @@
 #ifndef _TWRPTAR_HEADER
 #define _TWRPTAR_HEADER
 
-ssize_t write_tar(int fd, const void *buffer, size_t size);
 ssize_t write_tar_no_buffer(int fd, const void *buffer, size_t size);
 
 #endif  // _TWRPTAR_HEADER
@@ -24,7 +24,9 @@ extern "C" {
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <fstream>
+#include <set>
 #include <string>
 #include <vector>
 #include "exclude.hpp"
@@ -36,7 +38,7 @@ using namespace std;
 
 struct TarListStruct {
 	std::string fn;
-	unsigned thread_id;
+	int entry;                                                                      // Index in the scan cache the list was made from
 };
 
 struct thread_data_struct {
@@ -44,6 +46,39 @@ struct thread_data_struct {
 	unsigned thread_id;
 };
 
+// One archive of a split backup, the thread that wrote it and its place
+// in that thread's sequence
+struct TarArchivePart {
+	std::string fn;
+	unsigned set;
+	unsigned part;
+	bool done;
+};
+
+// Work shared by the archive threads of a split backup or restore. Backups
+// hand out batches of TarList entries, restores single archives, so a
+// thread that finishes early keeps pulling work instead of going idle.
+struct TarWorkQueue {
+	std::vector<TarListStruct> *TarList;                                            // Files to back up, NULL for a restore
+	std::vector<TarArchivePart> *Parts;                                             // Archives to restore, NULL for a backup
+	size_t next;                                                                    // Next TarList entry or archive to hand out
+	size_t end;
+	unsigned long long remaining_size;                                              // Bytes of the files not handed out yet
+	std::vector<size_t> open_folders;                                               // TarList folders holding the next entry, outermost first
+	unsigned workers;
+	bool failed;                                                                    // A thread failed, nothing more is handed out
+	std::set<std::string> restored_dirs;                                            // Folders extracted with all their metadata
+	std::set<std::string> extracting_dirs;                                          // Folders being set up by a thread right now
+	pthread_mutex_t lock;
+	pthread_cond_t cond;                                                            // Signalled when a folder or archive is done
+};
+
+class twrpAes;
+class twrpGzip;
+class twrpDigest;
+class twrpScanCache;
+class twrpTarIndex;
+
 class twrpTar {
 public:
 	twrpTar();
@@ -56,36 +91,67 @@ public:
 	void setpassword(string pass);
 	unsigned long long get_size();
 	void Set_Archive_Type(Archive_Type archive_type);
+	bool writesDigest();                                                            // Digest files are written along with the archives
 
 public:
 	int use_encryption;
 	int userdata_encryption;
 	int use_compression;
 	int split_archives;
+	int compression_level;                                                          // gzip level used when use_compression is set
+	int compression_threads;                                                        // Threads per compressed archive, 0 uses one per core
+	unsigned archive_threads;                                                       // Threads writing encrypted archives, 0 uses one per core
+	int write_index;                                                                // Write an index next to each archive
 	string backup_name;
 	int progress_pipe_fd;
+	tar_progress_t *progress_counters;
 	string partition_name;
 	string backup_folder;
 	PartitionSettings *part_settings;
 	TWExclude *backup_exclusions;
+	const twrpScanCache *scan_cache;                                                // Metadata of tardir, read once by the fork
 
 private:
 	int extract();
 	int addFilesToExistingTar(vector <string> files, string tarFile);
 	int createTar();
-	int addFile(string fn, bool include_root);
+	int addFile(string fn, bool include_root, const tar_meta_t *meta);              // Appends fn using the metadata read by the scan
 	int entryExists(string entry);
 	int closeTar();
 	int removeEOT(string tarFile);
 	int extractTar();
 	string Strip_Root_Dir(string Path);
 	int openTar();
-	int Generate_TarList(string Path, std::vector<TarListStruct> *TarList, unsigned long long *Target_Size, unsigned *thread_id);
+	int Generate_TarList(string Path, std::vector<TarListStruct> *TarList);
 	static void* createList(void *cookie);
 	static void* extractMulti(void *cookie);
+	int extractParts(std::vector<TarArchivePart> *parts);                           // Extracts independent archives on one thread per core
+	int extractEntries();                                                           // tar_extract_all() that keeps folders ahead of the files going into them
 	int tarList(std::vector<TarListStruct> *TarList, unsigned thread_id);
+	bool Next_Batch(size_t *start, size_t *end, std::vector<size_t> *folders);     // Claims the next TarList entries from work_queue and the folders they start in
+	bool Next_Archive_Part(size_t *index);                                          // Claims the next archive to restore from work_queue
+	void Finish_Archive_Part(size_t index);
+	bool Wait_For_Parents(const string &Path);                                      // Waits until earlier archives set up the folders holding Path
+	bool Wait_For_Link(const string &Target);                                       // Waits until the file a hard link points to exists
+	bool Parent_Ready(const string &Dir);
+	bool Earlier_Parts_Done();                                                      // The archives before part_index in its sequence are extracted
+	void Wait_Queue();                                                              // Waits a moment for work_queue to change, lock held
+	void Fail_Queue();                                                              // Stops work_queue from handing out more work
+	int Run_Workers(std::vector<twrpTar> *workers, void *(*worker)(void*));       // Runs worker on each twrpTar in its own thread, 0 if all succeeded
 	unsigned long long uncompressedSize(string filename);
+	unsigned long long encryptedSize(string filename);                              // uncompressedSize() of an archive written by twrpAes
+	int mapProgress();
+	void unmapProgress();
+	void pollProgress(int pipe_fd, bool update_count);
 	static void Signal_Kill(int signum);
+	int startCompression(int out_fd);
+	static ssize_t compressTar(void *cookie, const void *buf, size_t len);
+	int startEncryption(int out_fd);
+	static ssize_t encryptTar(void *cookie, const void *buf, size_t len);
+	int startDecryption(int out_fd);                                                // Feeds the decrypted input_fd into out_fd from a thread, which closes out_fd
+	void finishDecryption();
+	static void* decryptThread(void *cookie);
+	static ssize_t digestTar(void *cookie, const void *buf, size_t len);
 
 	enum Archive_Type current_archive_type;
 	unsigned long long Archive_Current_Size;
@@ -97,6 +163,15 @@ private:
 	int input_fd;                                                                   // this stores the fd for libtar to write to
 	pid_t pigz_pid;
 	pid_t oaes_pid;
+	twrpGzip *gzip;                                                                 // In-process compressor, replaces piping through pigz
+	twrpAes *aes;                                                                   // In-process encryption, replaces piping through openaes
+	pthread_t decrypt_thread;
+	bool decrypting;                                                                // decrypt_thread is running and has to be joined
+	int decrypt_fd;                                                                 // Pipe decrypt_thread writes the plain archive to
+	bool tee_digest;                                                                // Digest each archive as it is written
+	twrpDigest *digest;                                                             // Digest of the archive currently being written
+	twrpTarIndex *index;                                                            // Index of the archive currently being written
+	bool digest_sha2;
 	unsigned long long file_count;
 
 	string tardir;
@@ -105,6 +180,8 @@ private:
 	string password;
 
 	std::vector<TarListStruct> *ItemList;
+	TarWorkQueue *work_queue;                                                       // Shared with the other archive threads, NULL when working alone
+	size_t part_index;                                                              // Archive of work_queue being extracted
 	int output_fd;                                                                  // this stores the output fd that gzip will read from
 	unsigned thread_id;
 };
@@ -0,0 +1,249 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include "twrpTarIndex.hpp"
+#include "twcommon.h"
+
+#define TAR_INDEX_MAGIC "TWRPIDX1"
+#define TAR_INDEX_FILE 1                                     // Entry flag for regular files
+
+// Layout of an index file: this header, entry_count entries sorted by name
+// and names_size bytes of nul terminated names, all in host byte order
+struct tar_index_header {
+	char magic[8];
+	uint64_t archive_size;                               // Size of the archive when the index was written
+	uint64_t stream_size;
+	uint64_t entry_count;
+	uint64_t file_count;
+	uint64_t names_size;
+};
+
+struct twrpTarIndex::Name_Less {
+	const char *names;
+
+	bool operator()(const Entry &a, const Entry &b) const {
+		return strcmp(names + a.name, names + b.name) < 0;
+	}
+	bool operator()(const Entry &a, const char *b) const {
+		return strcmp(names + a.name, b) < 0;
+	}
+};
+
+static bool Write_All(int fd, const void *buf, size_t len) {
+	const char *ptr = (const char*) buf;
+
+	while (len > 0) {
+		ssize_t ret = write(fd, ptr, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false;
+		ptr += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+static bool Read_All(int fd, void *buf, size_t len) {
+	char *ptr = (char*) buf;
+
+	while (len > 0) {
+		ssize_t ret = read(fd, ptr, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false;
+		ptr += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+twrpTarIndex::twrpTarIndex() {
+	stream_size = 0;
+	file_count = 0;
+}
+
+void twrpTarIndex::Add(const std::string &Name, uint64_t Offset, uint64_t Size, bool Is_File) {
+	std::string name = Normalize(Name);
+	Entry entry;
+
+	entry.offset = Offset;
+	entry.size = Size;
+	entry.name = names.size();
+	entry.flags = Is_File ? TAR_INDEX_FILE : 0;
+	names.insert(names.end(), name.c_str(), name.c_str() + name.size() + 1);
+	entries.push_back(entry);
+	if (Is_File)
+		file_count++;
+}
+
+bool twrpTarIndex::Write(const std::string &Archive, uint64_t Stream_Size) {
+	std::string index_name = Index_Name(Archive);
+	struct tar_index_header header;
+	struct stat st;
+	Name_Less less;
+	bool written;
+	int fd;
+
+	if (stat(Archive.c_str(), &st) != 0) {
+		LOGINFO("twrpTarIndex: unable to stat '%s': %s\n", Archive.c_str(), strerror(errno));
+		return false;
+	}
+	stream_size = Stream_Size;
+	less.names = names.empty() ? NULL : &names[0];
+	std::stable_sort(entries.begin(), entries.end(), less);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TAR_INDEX_MAGIC, sizeof(header.magic));
+	header.archive_size = st.st_size;
+	header.stream_size = stream_size;
+	header.entry_count = entries.size();
+	header.file_count = file_count;
+	header.names_size = names.size();
+
+	fd = open(index_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+	if (fd < 0) {
+		LOGINFO("twrpTarIndex: unable to create '%s': %s\n", index_name.c_str(), strerror(errno));
+		return false;
+	}
+	written = Write_All(fd, &header, sizeof(header))
+		&& (entries.empty() || Write_All(fd, &entries[0], entries.size() * sizeof(Entry)))
+		&& (names.empty() || Write_All(fd, &names[0], names.size()));
+	if (close(fd) != 0)
+		written = false;
+	if (!written) {
+		LOGINFO("twrpTarIndex: unable to write '%s': %s\n", index_name.c_str(), strerror(errno));
+		unlink(index_name.c_str());
+	}
+	return written;
+}
+
+bool twrpTarIndex::Load(const std::string &Archive) {
+	std::string index_name = Index_Name(Archive);
+	struct tar_index_header header;
+	struct stat st, index_st;
+	bool ret = false;
+	int fd;
+
+	Clear();
+	if (stat(Archive.c_str(), &st) != 0)
+		return false;
+	fd = open(index_name.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	if (fstat(fd, &index_st) != 0 || !Read_All(fd, &header, sizeof(header)))
+		goto done;
+	if (memcmp(header.magic, TAR_INDEX_MAGIC, sizeof(header.magic)) != 0) {
+		LOGINFO("twrpTarIndex: '%s' is not an archive index\n", index_name.c_str());
+		goto done;
+	}
+	if (header.archive_size != (uint64_t)st.st_size) {
+		LOGINFO("twrpTarIndex: '%s' does not match '%s', ignoring it\n", index_name.c_str(), Archive.c_str());
+		goto done;
+	}
+	// Check the sizes before trusting them with an allocation
+	if (header.names_size > UINT32_MAX || header.entry_count > (uint64_t)index_st.st_size / sizeof(Entry)
+		|| sizeof(header) + header.entry_count * sizeof(Entry) + header.names_size != (uint64_t)index_st.st_size
+		|| (header.entry_count > 0 && header.names_size == 0)) {
+		LOGINFO("twrpTarIndex: '%s' is damaged\n", index_name.c_str());
+		goto done;
+	}
+	entries.resize(header.entry_count);
+	names.resize(header.names_size);
+	if ((!entries.empty() && !Read_All(fd, &entries[0], entries.size() * sizeof(Entry)))
+		|| (!names.empty() && !Read_All(fd, &names[0], names.size()))) {
+		LOGINFO("twrpTarIndex: unable to read '%s'\n", index_name.c_str());
+		goto done;
+	}
+	if (!names.empty() && names.back() != '\0') {
+		LOGINFO("twrpTarIndex: '%s' is damaged\n", index_name.c_str());
+		goto done;
+	}
+	for (size_t i = 0; i < entries.size(); i++) {
+		if (entries[i].name >= names.size()) {
+			LOGINFO("twrpTarIndex: '%s' is damaged\n", index_name.c_str());
+			goto done;
+		}
+	}
+	stream_size = header.stream_size;
+	file_count = header.file_count;
+	ret = true;
+
+done:
+	close(fd);
+	if (!ret)
+		Clear();
+	return ret;
+}
+
+bool twrpTarIndex::Find(const std::string &Name, uint64_t *Offset, uint64_t *Size) const {
+	std::string name = Normalize(Name);
+	std::vector<Entry>::const_iterator it;
+	Name_Less less;
+
+	if (entries.empty())
+		return false;
+	less.names = &names[0];
+	it = std::lower_bound(entries.begin(), entries.end(), name.c_str(), less);
+	if (it == entries.end() || name != &names[it->name])
+		return false;
+	if (Offset != NULL)
+		*Offset = it->offset;
+	if (Size != NULL)
+		*Size = it->size;
+	return true;
+}
+
+uint64_t twrpTarIndex::Stream_Size() const {
+	return stream_size;
+}
+
+uint64_t twrpTarIndex::Entry_Count() const {
+	return entries.size();
+}
+
+uint64_t twrpTarIndex::File_Count() const {
+	return file_count;
+}
+
+void twrpTarIndex::Clear() {
+	entries.clear();
+	names.clear();
+	stream_size = 0;
+	file_count = 0;
+}
+
+std::string twrpTarIndex::Index_Name(const std::string &Archive) {
+	return Archive + ".idx";
+}
+
+// Folders are stored with a trailing slash, look them up without it
+std::string twrpTarIndex::Normalize(const std::string &Name) const {
+	size_t end = Name.find_last_not_of('/');
+
+	if (end == std::string::npos)
+		return Name;
+	return Name.substr(0, end + 1);
+}
@@ -0,0 +1,66 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRPTARINDEX_HPP
+#define __TWRPTARINDEX_HPP
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Index of a backup archive, kept next to it as <archive>.idx. It holds the
+// size of the tar stream in the archive and its members sorted by name with
+// the offset of their first header in that stream, so the restore size and
+// single members can be looked up without decompressing or decrypting the
+// whole archive. An index is only used while the archive still has the size
+// it had when the index was written. Encrypted archives get no index, since
+// it would give away the names and sizes of their members.
+class twrpTarIndex
+{
+public:
+	twrpTarIndex();
+
+	void Add(const std::string &Name, uint64_t Offset, uint64_t Size, bool Is_File); // Records a member, Offset is where its headers start in the tar stream
+	bool Write(const std::string &Archive, uint64_t Stream_Size); // Writes the index of Archive, which has just been closed
+	bool Load(const std::string &Archive);               // Reads the index of Archive, false if there is none or it does not match Archive
+	bool Find(const std::string &Name, uint64_t *Offset, uint64_t *Size) const; // Binary search for a member, either pointer may be NULL
+	uint64_t Stream_Size() const;                        // Size of the uncompressed tar stream, end of archive blocks included
+	uint64_t Entry_Count() const;
+	uint64_t File_Count() const;                         // Regular files among the entries
+	void Clear();
+	static std::string Index_Name(const std::string &Archive);
+
+private:
+	struct Entry {
+		uint64_t offset;
+		uint64_t size;
+		uint32_t name;                               // Offset of the name in names
+		uint32_t flags;
+	};
+
+	struct Name_Less;
+
+	std::string Normalize(const std::string &Name) const;
+
+	std::vector<Entry> entries;
+	std::vector<char> names;                             // Arena of nul terminated member names
+	uint64_t stream_size;
+	uint64_t file_count;
+};
+
+#endif // __TWRPTARINDEX_HPP
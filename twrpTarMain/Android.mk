@@ -7,8 +7,17 @@ LOCAL_SRC_FILES:= \
 	twrpTarMain.cpp \
 	../twrp-functions.cpp \
 	../twrpTar.cpp \
+	../twrpGzip.cpp \
+	../twrpAes.cpp \
+	../twrpReadAhead.cpp \
 	../tarWrite.c \
 	../exclude.cpp \
+	../twrpScanCache.cpp \
+	../twrpTarIndex.cpp \
+	../twrpDigestDriver.cpp \
+	../twrpDigest/twrpDigest.cpp \
+	../twrpDigest/twrpMD5.cpp \
+	../twrpDigest/digest/md5/md5.c \
 	../progresstracking.cpp \
 	../gui/twmsg.cpp
 LOCAL_CFLAGS:= -g -c -W -DBUILD_TWRPTAR_MAIN
@@ -33,6 +42,12 @@ ifeq ($(TW_EXCLUDE_ENCRYPTED_BACKUPS), true)
 else
 	LOCAL_STATIC_LIBRARIES += libopenaes_static
 endif
+ifeq ($(shell test $(PLATFORM_SDK_VERSION) -lt 24; echo $$?),0)
+    LOCAL_CFLAGS += -DTW_NO_AES_LIBRARY -DTW_NO_SHA2_LIBRARY
+else
+    LOCAL_SRC_FILES += ../twrpDigest/twrpSHA.cpp
+    LOCAL_STATIC_LIBRARIES += libcrypto_static
+endif
 
 LOCAL_MODULE:= twrpTar_static
 LOCAL_FORCE_STATIC_EXECUTABLE := true
@@ -49,8 +64,17 @@ LOCAL_SRC_FILES:= \
 	twrpTarMain.cpp \
 	../twrp-functions.cpp \
 	../twrpTar.cpp \
+	../twrpGzip.cpp \
+	../twrpAes.cpp \
+	../twrpReadAhead.cpp \
 	../tarWrite.c \
 	../exclude.cpp \
+	../twrpScanCache.cpp \
+	../twrpTarIndex.cpp \
+	../twrpDigestDriver.cpp \
+	../twrpDigest/twrpDigest.cpp \
+	../twrpDigest/twrpMD5.cpp \
+	../twrpDigest/digest/md5/md5.c \
 	../progresstracking.cpp \
 	../gui/twmsg.cpp
 LOCAL_CFLAGS:= -g -c -W -DBUILD_TWRPTAR_MAIN
@@ -74,6 +98,12 @@ ifeq ($(TW_EXCLUDE_ENCRYPTED_BACKUPS), true)
 else
 	LOCAL_SHARED_LIBRARIES += libopenaes
 endif
+ifeq ($(shell test $(PLATFORM_SDK_VERSION) -lt 24; echo $$?),0)
+    LOCAL_CFLAGS += -DTW_NO_AES_LIBRARY -DTW_NO_SHA2_LIBRARY
+else
+    LOCAL_SRC_FILES += ../twrpDigest/twrpSHA.cpp
+    LOCAL_SHARED_LIBRARIES += libcrypto
+endif
 
 LOCAL_MODULE:= twrpTar
 LOCAL_MODULE_TAGS:= optional
@@ -23,7 +23,20 @@
 #include "../progresstracking.hpp"
 #include "../gui/gui.hpp"
 #include "../gui/twmsg.h"
+#include "../twrpReadAhead.hpp"
+#include "../twrpAes.hpp"
+#include "../twrpDigestDriver.hpp"
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+	#include "../openaes/inc/oaes_lib.h"
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 void gui_msg(const char* text)
 {
@@ -64,31 +77,309 @@ void gui_msg(Message msg)
 	fputs(output.c_str(), stdout);
 }
 
+static double elapsed_seconds(const timespec& start) {
+	timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1000000000.0;
+}
+
+static void print_throughput(const char* action, unsigned long long bytes, double seconds) {
+	double mbps = 0;
+
+	if (seconds > 0)
+		mbps = (double)bytes / (1024.0 * 1024.0) / seconds;
+	printf("%s %llu bytes in %.2f seconds (%.2f MB/s)\n", action, bytes, seconds, mbps);
+}
+
+// Same copy loop as TWPartition::Raw_Read_Write for benchmarking image
+// backup and restore between two files
+static bool copy_image(const string& src, const string& dest, bool synchronous, unsigned long long *copied) {
+	int src_fd, dest_fd;
+	struct stat st;
+	const void *data;
+	size_t len;
+	bool ret = false;
+
+	src_fd = open(src.c_str(), O_RDONLY | O_LARGEFILE);
+	if (src_fd < 0 || fstat(src_fd, &st) != 0) {
+		printf("Unable to open '%s': %s\n", src.c_str(), strerror(errno));
+		return false;
+	}
+	dest_fd = open(dest.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, S_IRUSR | S_IWUSR);
+	if (dest_fd < 0) {
+		printf("Unable to open '%s': %s\n", dest.c_str(), strerror(errno));
+		close(src_fd);
+		return false;
+	}
+
+	*copied = 0;
+	twrpReadAhead reader(src_fd, 1048576, synchronous ? 1 : READ_AHEAD_BLOCKS, !synchronous);
+	if (reader.Start(st.st_size)) {
+		while ((data = reader.Get_Block(&len)) != NULL) {
+			if (write(dest_fd, data, len) != (ssize_t)len) {
+				printf("Error writing '%s': %s\n", dest.c_str(), strerror(errno));
+				break;
+			}
+			reader.Put_Block();
+			*copied += len;
+		}
+		ret = data == NULL && !reader.Failed() && fsync(dest_fd) == 0;
+	}
+	close(dest_fd);
+	close(src_fd);
+	return ret;
+}
+
+static void benchmark_aes_engine(twrpAes *aes, const char *name, unsigned threads, const unsigned char *in, unsigned char *out, size_t len) {
+	char action[64];
+	timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	aes->Crypt(0, in, out, len);
+	snprintf(action, sizeof(action), "%s CTR, %u thread%s:", name, threads, threads == 1 ? "" : "s");
+	print_throughput(action, len, elapsed_seconds(start));
+}
+
+// Encrypts the same buffer the way openaes enc does it, CBC in 4064 byte
+// chunks, and with each twrpAes engine in counter mode
+static int benchmark_aes(unsigned threads) {
+	const size_t len = 64 * 1024 * 1024;
+	std::vector<unsigned char> in(len), out(len);
+	twrpAes::Engine engines[2] = { twrpAes::ENGINE_TABLE, twrpAes::ENGINE_LIBRARY };
+	timespec start;
+
+	if (!twrpAes::Self_Test()) {
+		printf("AES self test failed\n");
+		return -1;
+	}
+	for (size_t i = 0; i < len; i++)
+		in[i] = (unsigned char)(i * 131 + (i >> 12));
+
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+	{
+		OAES_CTX *ctx = oaes_alloc();
+		uint8_t key_data[16];
+		size_t pos, chunk, out_len;
+		bool ok = ctx != NULL;
+
+		for (int i = 0; i < 16; i++)
+			key_data[i] = i + 1;
+		if (ok)
+			ok = oaes_key_import_data(ctx, key_data, sizeof(key_data)) == OAES_RET_SUCCESS;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (pos = 0; ok && pos < len; pos += chunk) {
+			chunk = len - pos < 4064 ? len - pos : 4064;
+			out_len = 4096;
+			ok = oaes_encrypt(ctx, &in[pos], chunk, &out[0], &out_len) == OAES_RET_SUCCESS;
+		}
+		if (ok)
+			print_throughput("openaes CBC, 1 thread:", len, elapsed_seconds(start));
+		else
+			printf("openaes CBC failed\n");
+		if (ctx != NULL)
+			oaes_free(&ctx);
+	}
+#endif
+	twrpAes aes("", 1);
+	for (int i = 0; i < 2; i++) {
+		if (aes.Set_Engine(engines[i]))
+			benchmark_aes_engine(&aes, twrpAes::Engine_Name(engines[i]), 1, &in[0], &out[0], len);
+	}
+	if (threads == 0) {
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cores > 0 ? cores : 1;
+	}
+	if (threads > 1) {
+		twrpAes threaded("", threads);
+		for (int i = 0; i < 2; i++) {
+			if (threaded.Set_Engine(engines[i]))
+				benchmark_aes_engine(&threaded, twrpAes::Engine_Name(engines[i]), threads, &in[0], &out[0], len);
+		}
+	}
+	return 0;
+}
+
+static void init_part_settings(PartitionSettings *part_settings, ProgressTracking *progress) {
+	part_settings->Part = NULL;
+	part_settings->adbbackup = false;
+	part_settings->adb_compression = false;
+	part_settings->generate_digest = false;
+	part_settings->generate_md5 = false;
+	part_settings->digest_written = false;
+	part_settings->digest_verifier = NULL;
+	part_settings->progress = progress;
+}
+
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+// Backs up a small tree in folder encrypted on several archive threads, digests
+// every archive and restores it with the digests checked alongside, the way
+// a restore from the GUI does it. One folder holds enough entries to be split
+// across the threads.
+static int test_encrypted_restore(const string& folder) {
+	const unsigned threads = 3, folders = 8, many_files = 3000;
+	const string password = "twrp";
+	string src = folder + "/src", backup = folder + "/data.ext4.win", many = src + "/folder0/many", contents;
+	struct stat st;
+	char name[PATH_MAX];
+	PartitionSettings part_settings;
+	ProgressTracking progress(1);
+	pid_t tar_fork_pid = 0;
+	unsigned i;
+
+	init_part_settings(&part_settings, &progress);
+	if (mkdir(folder.c_str(), 0755) != 0 && errno != EEXIST) {
+		printf("Unable to create '%s': %s\n", folder.c_str(), strerror(errno));
+		return -1;
+	}
+	mkdir(src.c_str(), 0755);
+	for (i = 0; i < folders; i++) {
+		snprintf(name, sizeof(name), "%s/folder%u", src.c_str(), i);
+		mkdir(name, 0755);
+		snprintf(name, sizeof(name), "%s/folder%u/file", src.c_str(), i);
+		if (TWFunc::write_to_file(name, string(4096 * (i + 1), 'a' + i)) != 0) {
+			printf("Unable to write '%s'\n", name);
+			return -1;
+		}
+	}
+	mkdir(many.c_str(), 0750);
+	for (i = 0; i < many_files; i++) {
+		snprintf(name, sizeof(name), "%s/%u", many.c_str(), i);
+		if (TWFunc::write_to_file(name, to_string(i)) != 0) {
+			printf("Unable to write '%s'\n", name);
+			return -1;
+		}
+	}
+
+	{
+		TWExclude exclude;
+		twrpTar tar;
+
+		exclude.Keep_Scan_Cache();
+		tar.part_settings = &part_settings;
+		tar.setdir(src);
+		tar.setfn(backup);
+		tar.setsize(exclude.Get_Folder_Size(src));
+		tar.use_encryption = 1;
+		tar.setpassword(password);
+		tar.archive_threads = threads;
+		tar.backup_exclusions = &exclude;
+		if (tar.createTarFork(&tar_fork_pid) != 0) {
+			printf("Encrypted backup failed\n");
+			return -1;
+		}
+	}
+	if (!twrpDigestDriver::Make_Digest(backup)) {
+		printf("Unable to digest the backup\n");
+		return -1;
+	}
+	for (i = 0; i < threads; i++) {
+		bool use_sha2;
+
+		snprintf(name, sizeof(name), "%s%u00", backup.c_str(), i);
+		if (twrpDigestDriver::Find_Digest_File(name, &use_sha2).empty()) {
+			printf("No digest for '%s'\n", name);
+			return -1;
+		}
+	}
+	for (i = 0; i < folders; i++) {
+		snprintf(name, sizeof(name), "%s/folder%u/file", src.c_str(), i);
+		unlink(name);
+	}
+	for (i = 0; i < many_files; i++) {
+		snprintf(name, sizeof(name), "%s/%u", many.c_str(), i);
+		unlink(name);
+	}
+	rmdir(many.c_str());
+
+	{
+		twrpDigestVerifier verifier;
+		twrpTar tar;
+
+		verifier.Add(backup);
+		if (!verifier.Start()) {
+			printf("Unable to start checking digests\n");
+			return -1;
+		}
+		part_settings.digest_verifier = &verifier;
+		tar.part_settings = &part_settings;
+		tar.setdir(src);
+		tar.setfn(backup);
+		tar.setpassword(password);
+		if (tar.extractTarFork() != 0 || !verifier.Wait_All()) {
+			printf("Encrypted restore with digests failed\n");
+			return -1;
+		}
+		part_settings.digest_verifier = NULL;
+	}
+	for (i = 0; i < folders; i++) {
+		snprintf(name, sizeof(name), "%s/folder%u/file", src.c_str(), i);
+		if (TWFunc::read_file(name, contents) != 0 || contents != string(4096 * (i + 1), 'a' + i)) {
+			printf("'%s' was not restored\n", name);
+			return -1;
+		}
+	}
+	for (i = 0; i < many_files; i++) {
+		snprintf(name, sizeof(name), "%s/%u", many.c_str(), i);
+		if (TWFunc::read_file(name, contents) != 0 || contents != to_string(i)) {
+			printf("'%s' was not restored\n", name);
+			return -1;
+		}
+	}
+	if (stat(many.c_str(), &st) != 0 || (st.st_mode & 07777) != 0750) {
+		printf("'%s' was not restored with its mode\n", many.c_str());
+		return -1;
+	}
+	printf("Encrypted restore on %u archive threads with digests passed\n", threads);
+	return 0;
+}
+#endif
+
 void usage() {
 	printf("twrpTar <action> [options]\n\n");
 	printf("actions: -c create\n");
-	printf("         -x extract\n\n");
-	printf(" -d    target directory\n");
+	printf("         -x extract\n");
+	printf("         -r raw image copy from -d to -t (benchmark)\n");
+	printf("         -b AES encryption speed (benchmark)\n");
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+	printf("         -v encrypted backup and restore with digests in -d (test)\n");
+#endif
+	printf("\n");
+	printf(" -d    target directory (source image with -r)\n");
 	printf(" -t    output file\n");
+	printf(" -s    read synchronously without read-ahead (with -r)\n");
 	printf(" -m    skip media subfolder (has data media)\n");
-	printf(" -z    compress backup (/sbin/pigz must be present)\n");
+	printf(" -z    compress backup (extracting requires /sbin/pigz)\n");
+	printf(" -l    compression level followed by 1-9 (default 6)\n");
+	printf(" -j    compression or encryption threads followed by count (default one per core)\n");
+	printf(" -i    write an index next to each archive\n");
+	printf(" -g    digest the archives after creating, check the digests while extracting\n");
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
-	printf(" -e    encrypt/decrypt backup followed by password (/sbin/openaes must be present)\n");
+	printf(" -e    encrypt/decrypt backup followed by password (/sbin/openaes is needed for older backups)\n");
 	printf(" -u    encrypt using userdata encryption (must be used with -e)\n");
 #endif
 	printf("\n\n");
 	printf("Example: twrpTar -c -d /cache -t /sdcard/test.tar\n");
 	printf("         twrpTar -x -d /cache -t /sdcard/test.tar\n");
+	printf("         twrpTar -r -d /sdcard/boot.img -t /sdcard/copy.img\n");
+	printf("         twrpTar -b -j 4\n");
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+	printf("         twrpTar -v -d /tmp/twrptar\n");
+#endif
 }
 
 int main(int argc, char **argv) {
 	twrpTar tar;
 	int use_encryption = 0, userdata_encryption = 0, has_data_media = 0, use_compression = 0, include_root = 0;
-	int i, action = 0;
+	int compression_level = 6, compression_threads = 0, write_index = 0, use_digest = 0;
+	int i, action = 0, synchronous = 0;
 	unsigned j;
 	string Directory, Tar_Filename;
 	ProgressTracking progress(1);
+	PartitionSettings part_settings;
 	pid_t tar_fork_pid = 0;
+	unsigned long long dir_size = 0;
+	timespec start;
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
 	string Password;
 #endif
@@ -102,6 +393,14 @@ int main(int argc, char **argv) {
 		action = 1; // create tar
 	else if (strcmp(argv[1], "-x") == 0)
 		action = 2; // extract tar
+	else if (strcmp(argv[1], "-r") == 0)
+		action = 3; // raw image copy
+	else if (strcmp(argv[1], "-b") == 0)
+		action = 4; // AES benchmark
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+	else if (strcmp(argv[1], "-v") == 0)
+		action = 5; // encrypted restore test
+#endif
 	else {
 		printf("Invalid action '%s' specified.\n", argv[1]);
 		usage();
@@ -151,6 +450,25 @@ int main(int argc, char **argv) {
 			if (action == 2)
 				printf("NOTE: %s option not needed when extracting.\n", argv[i]);
 			use_compression = 1;
+		} else if (strcmp(argv[i], "-l") == 0 || strcmp(argv[i], "-j") == 0) {
+			i++;
+			if (argc <= i) {
+				printf("No argument specified for %s\n", argv[i - 1]);
+				usage();
+				return -1;
+			} else if (strcmp(argv[i - 1], "-l") == 0) {
+				compression_level = atoi(argv[i]);
+			} else {
+				compression_threads = atoi(argv[i]);
+			}
+		} else if (strcmp(argv[i], "-i") == 0) {
+			if (action == 2)
+				printf("NOTE: %s option not needed when extracting.\n", argv[i]);
+			write_index = 1;
+		} else if (strcmp(argv[i], "-g") == 0) {
+			use_digest = 1;
+		} else if (strcmp(argv[i], "-s") == 0) {
+			synchronous = 1;
 		} else if (strcmp(argv[i], "-u") == 0) {
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
 			if (action == 2)
@@ -164,13 +482,37 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	if (action == 3) {
+		unsigned long long copied = 0;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (!copy_image(Directory, Tar_Filename, synchronous, &copied))
+			return -1;
+		print_throughput("Copied", copied, elapsed_seconds(start));
+		return 0;
+	}
+	if (action == 4)
+		return benchmark_aes(compression_threads);
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+	if (action == 5)
+		return test_encrypted_restore(Directory.empty() ? "/tmp/twrptar" : Directory);
+#endif
+
 	TWExclude exclude;
-	exclude.add_absolute_dir("/data/media");
-	tar.has_data_media = has_data_media;
+	if (has_data_media)
+		exclude.add_absolute_dir("/data/media");
+	init_part_settings(&part_settings, &progress);
+	tar.part_settings = &part_settings;
 	tar.setdir(Directory);
 	tar.setfn(Tar_Filename);
-	tar.setsize(exclude.Get_Folder_Size(Directory));
+	if (action == 1)
+		exclude.Keep_Scan_Cache();
+	dir_size = exclude.Get_Folder_Size(Directory);
+	tar.setsize(dir_size);
 	tar.use_compression = use_compression;
+	tar.compression_level = compression_level;
+	tar.compression_threads = compression_threads;
+	tar.write_index = write_index;
 	tar.backup_exclusions = &exclude;
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
 	if (userdata_encryption && !use_encryption) {
@@ -186,20 +528,33 @@ int main(int argc, char **argv) {
 		use_encryption = false;
 	}
 #endif
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	if (action == 1) {
 		if (tar.createTarFork(&tar_fork_pid) != 0) {
 			sync();
 			return -1;
 		}
 		sync();
+		if (use_digest && !twrpDigestDriver::Make_Digest(Tar_Filename))
+			return -1;
 		printf("\n\ntar created successfully.\n");
+		print_throughput("Archived", dir_size, elapsed_seconds(start));
 	} else if (action == 2) {
-		if (tar.extractTarFork() != 0) {
+		twrpDigestVerifier verifier;
+
+		if (use_digest) {
+			verifier.Add(Tar_Filename);
+			if (!verifier.Start())
+				return -1;
+			part_settings.digest_verifier = &verifier;
+		}
+		if (tar.extractTarFork() != 0 || (use_digest && !verifier.Wait_All())) {
 			sync();
 			return -1;
 		}
 		sync();
 		printf("\n\ntar extracted successfully.\n");
+		print_throughput("Extracted", exclude.Get_Folder_Size(Directory), elapsed_seconds(start));
 	}
 	return 0;
 }
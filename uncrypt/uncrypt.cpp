@@ -90,6 +90,7 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <libgen.h>
+#include <linux/fiemap.h>
 #include <linux/fs.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -102,6 +103,7 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <limits>
 #include <memory>
 #include <vector>
 
@@ -120,6 +122,10 @@
 
 static constexpr int WINDOW_SIZE = 5;
 static constexpr int FIBMAP_RETRY_LIMIT = 3;
+// Number of extents to fetch per FIEMAP ioctl.
+static constexpr size_t FIEMAP_EXTENT_COUNT = 256;
+// Largest write when rewriting the contents of an extent on an encrypted device.
+static constexpr size_t EXTENT_WRITE_SIZE = 1024 * 1024;
 
 // uncrypt provides three services: SETUP_BCB, CLEAR_BCB and UNCRYPT.
 //
@@ -150,18 +156,22 @@ static int write_at_offset(unsigned char* buffer, size_t size, int wfd, off64_t
     return 0;
 }
 
-static void add_block_to_ranges(std::vector<int>& ranges, int new_block) {
+static void add_blocks_to_ranges(std::vector<int>& ranges, int new_block, int count) {
     if (!ranges.empty() && new_block == ranges.back()) {
-        // If the new block comes immediately after the current range,
+        // If the new blocks come immediately after the current range,
         // all we have to do is extend the current range.
-        ++ranges.back();
+        ranges.back() += count;
     } else {
         // We need to start a new range.
         ranges.push_back(new_block);
-        ranges.push_back(new_block + 1);
+        ranges.push_back(new_block + count);
     }
 }
 
+static void add_block_to_ranges(std::vector<int>& ranges, int new_block) {
+    add_blocks_to_ranges(ranges, new_block, 1);
+}
+
 static struct fstab* read_fstab() {
     fstab = fs_mgr_read_fstab_default();
     if (!fstab) {
@@ -249,48 +259,10 @@ static int retry_fibmap(const int fd, const char* name, int* block, const int he
     return kUncryptIoctlError;
 }
 
-static int produce_block_map(const char* path, const char* map_file, const char* blk_dev,
-                             bool encrypted, bool f2fs_fs, int socket) {
-    std::string err;
-    if (!android::base::RemoveFileIfExists(map_file, &err)) {
-        LOG(ERROR) << "failed to remove the existing map file " << map_file << ": " << err;
-        return kUncryptFileRemoveError;
-    }
-    std::string tmp_map_file = std::string(map_file) + ".tmp";
-    android::base::unique_fd mapfd(open(tmp_map_file.c_str(),
-                                        O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR));
-    if (mapfd == -1) {
-        PLOG(ERROR) << "failed to open " << tmp_map_file;
-        return kUncryptFileOpenError;
-    }
-
-    // Make sure we can write to the socket.
-    if (!write_status_to_socket(0, socket)) {
-        LOG(ERROR) << "failed to write to socket " << socket;
-        return kUncryptSocketWriteError;
-    }
-
-    struct stat sb;
-    if (stat(path, &sb) != 0) {
-        LOG(ERROR) << "failed to stat " << path;
-        return kUncryptFileStatError;
-    }
-
-    LOG(INFO) << " block size: " << sb.st_blksize << " bytes";
-
-    int blocks = ((sb.st_size-1) / sb.st_blksize) + 1;
-    LOG(INFO) << "  file size: " << sb.st_size << " bytes, " << blocks << " blocks";
-
-    std::vector<int> ranges;
-
-    std::string s = android::base::StringPrintf("%s\n%" PRId64 " %" PRId64 "\n",
-                       blk_dev, static_cast<int64_t>(sb.st_size),
-                       static_cast<int64_t>(sb.st_blksize));
-    if (!android::base::WriteStringToFd(s, mapfd)) {
-        PLOG(ERROR) << "failed to write " << tmp_map_file;
-        return kUncryptWriteError;
-    }
-
+// Finds the blocks of the file one FIBMAP ioctl at a time. On encrypted devices, the contents are
+// read through a WINDOW_SIZE ring of blocks and written back to the raw block device.
+static int map_file_blocks(int fd, const char* path, int wfd, bool encrypted,
+                           const struct stat& sb, int socket, std::vector<int>& ranges) {
     std::vector<std::vector<unsigned char>> buffers;
     if (encrypted) {
         buffers.resize(WINDOW_SIZE, std::vector<unsigned char>(sb.st_blksize));
@@ -298,32 +270,6 @@ static int produce_block_map(const char* path, const char* map_file, const char*
     int head_block = 0;
     int head = 0, tail = 0;
 
-    android::base::unique_fd fd(open(path, O_RDONLY));
-    if (fd == -1) {
-        PLOG(ERROR) << "failed to open " << path << " for reading";
-        return kUncryptFileOpenError;
-    }
-
-    android::base::unique_fd wfd;
-    if (encrypted) {
-        wfd.reset(open(blk_dev, O_WRONLY));
-        if (wfd == -1) {
-            PLOG(ERROR) << "failed to open " << blk_dev << " for writing";
-            return kUncryptBlockOpenError;
-        }
-    }
-
-#ifndef F2FS_IOC_SET_DONTMOVE
-#ifndef F2FS_IOCTL_MAGIC
-#define F2FS_IOCTL_MAGIC		0xf5
-#endif
-#define F2FS_IOC_SET_DONTMOVE		_IO(F2FS_IOCTL_MAGIC, 13)
-#endif
-    if (f2fs_fs && ioctl(fd, F2FS_IOC_SET_DONTMOVE) < 0) {
-        PLOG(ERROR) << "Failed to set non-movable file for f2fs: " << path << " on " << blk_dev;
-        return kUncryptIoctlError;
-    }
-
     off64_t pos = 0;
     int last_progress = 0;
     while (pos < sb.st_size) {
@@ -406,6 +352,219 @@ static int produce_block_map(const char* path, const char* map_file, const char*
         ++head_block;
     }
 
+    return kUncryptNoError;
+}
+
+// A run of file blocks that are contiguous on the block device.
+struct FileExtent {
+    int logical;   // first file block
+    int physical;  // first block on the block device
+    int count;
+};
+
+// Finds the extents of the file with FIEMAP, FIEMAP_EXTENT_COUNT of them per ioctl, so a large
+// package takes a handful of ioctls instead of one FIBMAP per block. Returns false if the
+// filesystem doesn't support FIEMAP, or if the extents don't describe plain, block-aligned data
+// covering the whole file (inline data, delayed allocation, holes...); the caller then falls back
+// to FIBMAP.
+static bool get_file_extents(int fd, const struct stat& sb, std::vector<FileExtent>* extents) {
+    const uint64_t block_size = sb.st_blksize;
+    const uint64_t blocks = (sb.st_size + block_size - 1) / block_size;
+    if (blocks > static_cast<uint64_t>(std::numeric_limits<int>::max())) {
+        return false;
+    }
+
+    std::vector<uint8_t> buffer(sizeof(struct fiemap) +
+                                FIEMAP_EXTENT_COUNT * sizeof(struct fiemap_extent));
+    struct fiemap* fm = reinterpret_cast<struct fiemap*>(buffer.data());
+    uint64_t next_block = 0;
+    bool last = false;
+    while (!last && next_block < blocks) {
+        memset(buffer.data(), 0, buffer.size());
+        fm->fm_start = next_block * block_size;
+        fm->fm_length = FIEMAP_MAX_OFFSET - fm->fm_start;
+        // Same as the fsync() before FIBMAP: flush delayed allocations so every block is mapped.
+        fm->fm_flags = FIEMAP_FLAG_SYNC;
+        fm->fm_extent_count = FIEMAP_EXTENT_COUNT;
+        if (ioctl(fd, FS_IOC_FIEMAP, fm) != 0) {
+            PLOG(INFO) << "FIEMAP failed";
+            return false;
+        }
+        if (fm->fm_mapped_extents == 0) {
+            break;
+        }
+
+        for (uint32_t i = 0; i < fm->fm_mapped_extents; i++) {
+            const struct fiemap_extent& fe = fm->fm_extents[i];
+            last = (fe.fe_flags & FIEMAP_EXTENT_LAST) != 0;
+            if ((fe.fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC |
+                                FIEMAP_EXTENT_ENCODED | FIEMAP_EXTENT_NOT_ALIGNED |
+                                FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_DATA_TAIL)) != 0 ||
+                fe.fe_logical % block_size != 0 || fe.fe_physical % block_size != 0 ||
+                fe.fe_length % block_size != 0) {
+                LOG(INFO) << "unsupported extent at " << fe.fe_logical << ", flags 0x" << std::hex
+                          << fe.fe_flags;
+                return false;
+            }
+            if (fe.fe_logical / block_size != next_block) {
+                LOG(INFO) << "file has a hole at block " << next_block;
+                return false;
+            }
+
+            uint64_t physical = fe.fe_physical / block_size;
+            uint64_t count = std::min<uint64_t>(fe.fe_length / block_size, blocks - next_block);
+            if (physical + count > static_cast<uint64_t>(std::numeric_limits<int>::max())) {
+                return false;
+            }
+            extents->push_back({ static_cast<int>(next_block), static_cast<int>(physical),
+                                 static_cast<int>(count) });
+            next_block += count;
+            if (next_block == blocks) {
+                break;
+            }
+        }
+    }
+
+    if (next_block != blocks) {
+        LOG(INFO) << "FIEMAP mapped " << next_block << " of " << blocks << " blocks";
+        return false;
+    }
+    return true;
+}
+
+// Produces the block ranges from the extents of the file. On encrypted devices, the contents of
+// each extent are read sequentially and written back to the raw block device in writes of up to
+// EXTENT_WRITE_SIZE bytes. Each piece is read before it's overwritten, as with the FIBMAP window.
+static int map_file_extents(const std::vector<FileExtent>& extents, int fd, const char* path,
+                            int wfd, bool encrypted, const struct stat& sb, int socket,
+                            std::vector<int>& ranges) {
+    const size_t block_size = sb.st_blksize;
+    const int max_chunk_blocks = std::max<size_t>(1, EXTENT_WRITE_SIZE / block_size);
+    std::vector<unsigned char> buffer;
+    if (encrypted) {
+        buffer.resize(max_chunk_blocks * block_size);
+    }
+
+    off64_t pos = 0;
+    int last_progress = 0;
+    for (const auto& extent : extents) {
+        add_blocks_to_ranges(ranges, extent.physical, extent.count);
+        if (!encrypted) {
+            continue;
+        }
+
+        for (int done = 0; done < extent.count;) {
+            // Update the status file, progress must be between [0, 99].
+            int progress = static_cast<int>(100 * (double(pos) / double(sb.st_size)));
+            if (progress > last_progress) {
+                last_progress = progress;
+                write_status_to_socket(progress, socket);
+            }
+
+            int chunk_blocks = std::min(extent.count - done, max_chunk_blocks);
+            size_t chunk_size = chunk_blocks * block_size;
+            size_t to_read = static_cast<size_t>(
+                    std::min(static_cast<off64_t>(chunk_size), sb.st_size - pos));
+            if (!android::base::ReadFully(fd, buffer.data(), to_read)) {
+                PLOG(ERROR) << "failed to read " << path;
+                return kUncryptReadError;
+            }
+            // Pad the last block of the file.
+            memset(buffer.data() + to_read, 0, chunk_size - to_read);
+            pos += to_read;
+
+            if (write_at_offset(buffer.data(), chunk_size, wfd,
+                                static_cast<off64_t>(block_size) *
+                                        (extent.physical + done)) != 0) {
+                return kUncryptWriteError;
+            }
+            done += chunk_blocks;
+        }
+    }
+    return kUncryptNoError;
+}
+
+static int produce_block_map(const char* path, const char* map_file, const char* blk_dev,
+                             bool encrypted, bool f2fs_fs, int socket) {
+    std::string err;
+    if (!android::base::RemoveFileIfExists(map_file, &err)) {
+        LOG(ERROR) << "failed to remove the existing map file " << map_file << ": " << err;
+        return kUncryptFileRemoveError;
+    }
+    std::string tmp_map_file = std::string(map_file) + ".tmp";
+    android::base::unique_fd mapfd(open(tmp_map_file.c_str(),
+                                        O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR));
+    if (mapfd == -1) {
+        PLOG(ERROR) << "failed to open " << tmp_map_file;
+        return kUncryptFileOpenError;
+    }
+
+    // Make sure we can write to the socket.
+    if (!write_status_to_socket(0, socket)) {
+        LOG(ERROR) << "failed to write to socket " << socket;
+        return kUncryptSocketWriteError;
+    }
+
+    struct stat sb;
+    if (stat(path, &sb) != 0) {
+        LOG(ERROR) << "failed to stat " << path;
+        return kUncryptFileStatError;
+    }
+
+    LOG(INFO) << " block size: " << sb.st_blksize << " bytes";
+
+    int blocks = ((sb.st_size-1) / sb.st_blksize) + 1;
+    LOG(INFO) << "  file size: " << sb.st_size << " bytes, " << blocks << " blocks";
+
+    std::vector<int> ranges;
+
+    std::string s = android::base::StringPrintf("%s\n%" PRId64 " %" PRId64 "\n",
+                       blk_dev, static_cast<int64_t>(sb.st_size),
+                       static_cast<int64_t>(sb.st_blksize));
+    if (!android::base::WriteStringToFd(s, mapfd)) {
+        PLOG(ERROR) << "failed to write " << tmp_map_file;
+        return kUncryptWriteError;
+    }
+
+    android::base::unique_fd fd(open(path, O_RDONLY));
+    if (fd == -1) {
+        PLOG(ERROR) << "failed to open " << path << " for reading";
+        return kUncryptFileOpenError;
+    }
+
+    android::base::unique_fd wfd;
+    if (encrypted) {
+        wfd.reset(open(blk_dev, O_WRONLY));
+        if (wfd == -1) {
+            PLOG(ERROR) << "failed to open " << blk_dev << " for writing";
+            return kUncryptBlockOpenError;
+        }
+    }
+
+#ifndef F2FS_IOC_SET_DONTMOVE
+#ifndef F2FS_IOCTL_MAGIC
+#define F2FS_IOCTL_MAGIC		0xf5
+#endif
+#define F2FS_IOC_SET_DONTMOVE		_IO(F2FS_IOCTL_MAGIC, 13)
+#endif
+    if (f2fs_fs && ioctl(fd, F2FS_IOC_SET_DONTMOVE) < 0) {
+        PLOG(ERROR) << "Failed to set non-movable file for f2fs: " << path << " on " << blk_dev;
+        return kUncryptIoctlError;
+    }
+
+    std::vector<FileExtent> extents;
+    int error;
+    if (get_file_extents(fd, sb, &extents)) {
+        LOG(INFO) << "  " << extents.size() << " extents";
+        error = map_file_extents(extents, fd, path, wfd, encrypted, sb, socket, ranges);
+    } else {
+        LOG(INFO) << "FIEMAP unavailable, mapping the file block by block";
+        error = map_file_blocks(fd, path, wfd, encrypted, sb, socket, ranges);
+    }
+    if (error != kUncryptNoError) {
+        return error;
+    }
+
     if (!android::base::WriteStringToFd(
             android::base::StringPrintf("%zu\n", ranges.size() / 2), mapfd)) {
         PLOG(ERROR) << "failed to write " << tmp_map_file;
@@ -33,8 +33,10 @@
 #include <unistd.h>
 #include <fec/io.h>
 
+#include <algorithm>
 #include <functional>
 #include <limits>
+#include <list>
 #include <memory>
 #include <string>
 #include <unordered_map>
@@ -68,6 +70,8 @@
 static constexpr size_t BLOCKSIZE = 4096;
 static constexpr mode_t STASH_DIRECTORY_MODE = 0700;
 static constexpr mode_t STASH_FILE_MODE = 0600;
+// Upper bound of the source data read ahead of the command being executed.
+static constexpr size_t PREFETCH_BUFFER_SIZE = 32 * 1024 * 1024;
 
 static CauseCode failure_type = kNoCause;
 static bool is_retry = false;
@@ -524,6 +528,296 @@ static int WriteBlocks(const RangeSet& tgt, const std::vector<uint8_t>& buffer,
   return 0;
 }
 
+/**
+ * BlockPrefetcher reads the source (and target) ranges of upcoming transfer commands on a
+ * background thread, so the disk reads of command N+1 overlap with the patching and writing of
+ * command N.
+ *
+ * A range is only read once every earlier command that writes to an overlapping range has
+ * finished, so the prefetched data is exactly what the main thread would have read itself when it
+ * gets to that command. Prefetched ranges are tagged with the index of the command that needs
+ * them and are dropped once the main thread moves past it, e.g. when a command finds its target
+ * already written and never reads the source. The data held at any time is bounded by
+ * PREFETCH_BUFFER_SIZE. The prefetcher only ever reads the block device, so resuming an
+ * interrupted update works the same way with or without it.
+ */
+class BlockPrefetcher {
+ public:
+  BlockPrefetcher(const std::vector<std::string>& lines, size_t start, int first_command,
+                  bool canwrite)
+      : lines_(lines),
+        start_(start),
+        first_command_(first_command),
+        canwrite_(canwrite),
+        started_(false),
+        stopping_(false),
+        current_command_(-1),
+        inflight_command_(-1),
+        buffered_(0) {
+    pthread_mutex_init(&mu_, nullptr);
+    pthread_cond_init(&cv_, nullptr);
+  }
+
+  ~BlockPrefetcher() {
+    Stop();
+    pthread_cond_destroy(&cv_);
+    pthread_mutex_destroy(&mu_);
+  }
+
+  // Opens a separate read-only descriptor for |blockdev| and starts the background thread.
+  bool Start(const std::string& blockdev) {
+    fd_.reset(TEMP_FAILURE_RETRY(ota_open(blockdev.c_str(), O_RDONLY)));
+    if (fd_ == -1) {
+      PLOG(WARNING) << "Failed to open " << blockdev << " for prefetching";
+      return false;
+    }
+    int error = pthread_create(&thread_, nullptr, PrefetchThread, this);
+    if (error != 0) {
+      LOG(WARNING) << "Failed to start the prefetch thread: " << strerror(error);
+      return false;
+    }
+    started_ = true;
+    return true;
+  }
+
+  void Stop() {
+    if (!started_) {
+      return;
+    }
+    pthread_mutex_lock(&mu_);
+    stopping_ = true;
+    pthread_cond_broadcast(&cv_);
+    pthread_mutex_unlock(&mu_);
+    pthread_join(thread_, nullptr);
+    started_ = false;
+  }
+
+  // Called by the main thread before it executes |cmdindex|; all the commands before it have
+  // finished by then.
+  void Advance(int cmdindex) {
+    pthread_mutex_lock(&mu_);
+    current_command_ = cmdindex;
+    for (auto it = ready_.begin(); it != ready_.end();) {
+      if (it->cmdindex < cmdindex) {
+        buffered_ -= it->data.size();
+        it = ready_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    pthread_cond_broadcast(&cv_);
+    pthread_mutex_unlock(&mu_);
+  }
+
+  // Copies the prefetched contents of |ranges| for |cmdindex| into |buffer|. If the range is being
+  // read right now, waits for it. Returns false if the caller has to read the blocks itself.
+  bool Take(int cmdindex, const RangeSet& ranges, std::vector<uint8_t>& buffer) {
+    if (cmdindex == -1) {
+      return false;
+    }
+
+    pthread_mutex_lock(&mu_);
+    while (inflight_command_ == cmdindex && inflight_ranges_ == ranges) {
+      pthread_cond_wait(&cv_, &mu_);
+    }
+    for (auto it = ready_.begin(); it != ready_.end(); ++it) {
+      if (it->cmdindex == cmdindex && it->ranges == ranges) {
+        memcpy(buffer.data(), it->data.data(), it->data.size());
+        buffered_ -= it->data.size();
+        ready_.erase(it);
+        pthread_cond_broadcast(&cv_);
+        pthread_mutex_unlock(&mu_);
+        return true;
+      }
+    }
+    pthread_mutex_unlock(&mu_);
+    return false;
+  }
+
+ private:
+  struct PrefetchedRanges {
+    int cmdindex;
+    RangeSet ranges;
+    std::vector<uint8_t> data;
+  };
+
+  static void* PrefetchThread(void* cookie) {
+    static_cast<BlockPrefetcher*>(cookie)->Run();
+    return nullptr;
+  }
+
+  // Gets the ranges that the given command reads from and writes to the block device. Returns
+  // false for the commands we don't know, which stop the lookahead.
+  static bool ParseCommand(const std::string& line, std::vector<RangeSet>* reads,
+                           RangeSet* writes) {
+    std::vector<std::string> tokens = android::base::Split(line, " ");
+    const std::string& cmdname = tokens[0];
+
+    // move <hash> <tgt_range> <src_block_count> <src_range> ...
+    // bsdiff/imgdiff <offset> <length> <srchash> <tgthash> <tgt_range> <src_block_count> ...
+    size_t tgt_pos;
+    if (cmdname == "move") {
+      tgt_pos = 2;
+    } else if (cmdname == "bsdiff" || cmdname == "imgdiff") {
+      tgt_pos = 5;
+    } else if (cmdname == "stash") {
+      // stash <stash_id> <src_range>
+      if (tokens.size() < 3) {
+        return false;
+      }
+      reads->push_back(RangeSet::Parse(tokens[2]));
+      return static_cast<bool>(reads->back());
+    } else if (cmdname == "new" || cmdname == "zero" || cmdname == "erase") {
+      if (tokens.size() < 2) {
+        return false;
+      }
+      *writes = RangeSet::Parse(tokens[1]);
+      return static_cast<bool>(*writes);
+    } else {
+      return cmdname == "free";
+    }
+
+    if (tokens.size() < tgt_pos + 3) {
+      return false;
+    }
+    // The target blocks are read first to check if the command has been done already.
+    *writes = RangeSet::Parse(tokens[tgt_pos]);
+    if (!*writes) {
+      return false;
+    }
+    reads->push_back(*writes);
+    if (tokens[tgt_pos + 2] != "-") {
+      reads->push_back(RangeSet::Parse(tokens[tgt_pos + 2]));
+      if (!reads->back()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool ReadRanges(const RangeSet& ranges, std::vector<uint8_t>* data) {
+    data->resize(ranges.blocks() * BLOCKSIZE);
+    uint8_t* p = data->data();
+    for (const auto& range : ranges) {
+      if (TEMP_FAILURE_RETRY(lseek64(fd_, static_cast<off64_t>(range.first) * BLOCKSIZE,
+                                     SEEK_SET)) == -1) {
+        return false;
+      }
+      size_t size = (range.second - range.first) * BLOCKSIZE;
+      while (size > 0) {
+        ssize_t r = TEMP_FAILURE_RETRY(ota_read(fd_, p, size));
+        if (r <= 0) {
+          return false;
+        }
+        p += r;
+        size -= r;
+      }
+    }
+    return true;
+  }
+
+  void Run() {
+    // Target ranges of the commands that haven't finished yet, by command index.
+    std::vector<std::pair<int, RangeSet>> writers;
+
+    for (size_t i = start_; i < lines_.size(); i++) {
+      if (lines_[i].empty()) continue;
+      if (i - start_ > static_cast<size_t>(std::numeric_limits<int>::max())) {
+        break;
+      }
+      int cmdindex = i - start_;
+
+      std::vector<RangeSet> reads;
+      RangeSet writes;
+      if (!ParseCommand(lines_[i], &reads, &writes)) {
+        break;
+      }
+
+      // Commands before the saved index are skipped when resuming an update, don't read for them.
+      if (cmdindex >= first_command_) {
+        for (const auto& ranges : reads) {
+          size_t size = ranges.blocks() * BLOCKSIZE;
+          if (size > PREFETCH_BUFFER_SIZE) {
+            continue;
+          }
+          // The last earlier command that changes these blocks must finish first.
+          int dependency = -1;
+          for (const auto& writer : writers) {
+            if (writer.first > dependency && ranges.Overlaps(writer.second)) {
+              dependency = writer.first;
+            }
+          }
+
+          pthread_mutex_lock(&mu_);
+          while (!stopping_ && current_command_ <= cmdindex &&
+                 (current_command_ <= dependency || buffered_ + size > PREFETCH_BUFFER_SIZE)) {
+            pthread_cond_wait(&cv_, &mu_);
+          }
+          if (stopping_) {
+            pthread_mutex_unlock(&mu_);
+            return;
+          }
+          if (current_command_ > cmdindex) {
+            // The main thread got there first.
+            pthread_mutex_unlock(&mu_);
+            break;
+          }
+          inflight_command_ = cmdindex;
+          inflight_ranges_ = ranges;
+          buffered_ += size;
+          pthread_mutex_unlock(&mu_);
+
+          std::vector<uint8_t> data;
+          bool success = ReadRanges(ranges, &data);
+
+          pthread_mutex_lock(&mu_);
+          inflight_command_ = -1;
+          if (success && current_command_ <= cmdindex) {
+            ready_.push_back({ cmdindex, ranges, std::move(data) });
+          } else {
+            buffered_ -= size;
+          }
+          pthread_cond_broadcast(&cv_);
+          pthread_mutex_unlock(&mu_);
+        }
+      }
+
+      // Nothing writes to the block device in verify mode.
+      if (canwrite_ && writes) {
+        pthread_mutex_lock(&mu_);
+        int current = current_command_;
+        pthread_mutex_unlock(&mu_);
+        writers.erase(std::remove_if(writers.begin(), writers.end(),
+                                     [current](const std::pair<int, RangeSet>& writer) {
+                                       return writer.first < current;
+                                     }),
+                      writers.end());
+        writers.emplace_back(cmdindex, std::move(writes));
+      }
+    }
+  }
+
+  const std::vector<std::string>& lines_;
+  size_t start_;
+  int first_command_;
+  bool canwrite_;
+  android::base::unique_fd fd_;
+  pthread_t thread_;
+  bool started_;
+
+  pthread_mutex_t mu_;
+  pthread_cond_t cv_;
+  bool stopping_;
+  // The command being executed by the main thread.
+  int current_command_;
+  // The ranges being read by the prefetch thread.
+  int inflight_command_;
+  RangeSet inflight_ranges_;
+  std::list<PrefetchedRanges> ready_;
+  // Bytes held in |ready_| plus the range being read.
+  size_t buffered_;
+};
+
 // Parameters for transfer list command functions
 struct CommandParameters {
     std::vector<std::string> tokens;
@@ -546,8 +840,18 @@ struct CommandParameters {
     std::vector<uint8_t> buffer;
     uint8_t* patch_start;
     bool target_verified;  // The target blocks have expected contents already.
+    std::unique_ptr<BlockPrefetcher> prefetcher;
 };
 
+// Read |src| for the current command, taking the prefetched copy if there is one.
+static int ReadCommandBlocks(CommandParameters& params, const RangeSet& src,
+                             std::vector<uint8_t>& buffer) {
+  if (params.prefetcher && params.prefetcher->Take(params.cmdindex, src, buffer)) {
+    return 0;
+  }
+  return ReadBlocks(src, buffer, params.fd);
+}
+
 // Print the hash in hex for corrupted source blocks (excluding the stashed blocks which is
 // handled separately).
 static void PrintHashForCorruptedSourceBlocks(const CommandParameters& params,
@@ -1034,7 +1338,7 @@ static int LoadSourceBlocks(CommandParameters& params, const RangeSet& tgt, size
     CHECK(static_cast<bool>(src));
     *overlap = src.Overlaps(tgt);
 
-    if (ReadBlocks(src, params.buffer, params.fd) == -1) {
+    if (ReadCommandBlocks(params, src, params.buffer) == -1) {
       return -1;
     }
 
@@ -1135,7 +1439,7 @@ static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet& tgt, size_t*
   CHECK(static_cast<bool>(tgt));
 
   std::vector<uint8_t> tgtbuffer(tgt.blocks() * BLOCKSIZE);
-  if (ReadBlocks(tgt, tgtbuffer, params.fd) == -1) {
+  if (ReadCommandBlocks(params, tgt, tgtbuffer) == -1) {
     return -1;
   }
 
@@ -1255,7 +1559,7 @@ static int PerformCommandStash(CommandParameters& params) {
   CHECK(static_cast<bool>(src));
 
   allocate(src.blocks() * BLOCKSIZE, params.buffer);
-  if (ReadBlocks(src, params.buffer, params.fd) == -1) {
+  if (ReadCommandBlocks(params, src, params.buffer) == -1) {
     return -1;
   }
   blocks = src.blocks();
@@ -1421,8 +1725,8 @@ static int PerformCommandDiff(CommandParameters& params) {
   if (params.canwrite) {
     if (status == 0) {
       LOG(INFO) << "patching " << blocks << " blocks to " << tgt.blocks();
-      Value patch_value(
-          VAL_BLOB, std::string(reinterpret_cast<const char*>(params.patch_start + offset), len));
+      // Read the patch straight from the mapped package instead of copying it out.
+      BlobView patch_value(params.patch_start + offset, len);
 
       RangeSinkWriter writer(params.fd, tgt);
       if (params.cmdname[0] == 'i') {  // imgdiff
@@ -1707,6 +2011,14 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
 
   int rc = -1;
 
+  // Read the source blocks of the upcoming commands while the current one is being patched. An
+  // update works the same way without it, only slower.
+  params.prefetcher = std::make_unique<BlockPrefetcher>(
+      lines, start, params.canwrite ? saved_last_command_index + 1 : 0, params.canwrite);
+  if (!params.prefetcher->Start(blockdev_filename->data)) {
+    params.prefetcher.reset();
+  }
+
   // Subsequent lines are all individual transfer commands
   for (size_t i = start; i < lines.size(); i++) {
     const std::string& line = lines[i];
@@ -1719,6 +2031,9 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
     } else {
       params.cmdindex = i - start;
     }
+    if (params.prefetcher && params.cmdindex != -1) {
+      params.prefetcher->Advance(params.cmdindex);
+    }
     params.cmdname = params.tokens[params.cpos++].c_str();
     params.cmdline = line.c_str();
     params.target_verified = false;
@@ -1778,6 +2093,8 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
   rc = 0;
 
 pbiudone:
+  params.prefetcher.reset();
+
   if (params.canwrite) {
     pthread_mutex_lock(&params.nti.mu);
     if (params.nti.receiver_available) {
@@ -21,6 +21,11 @@
 #define TW_VERSION_STR TW_MAIN_VERSION_STR TW_DEVICE_VERSION
 
 #define TW_USE_COMPRESSION_VAR      "tw_use_compression"
+#define TW_COMPRESSION_LEVEL_VAR    "tw_compression_level"
+#define TW_COMPRESSION_THREADS_VAR  "tw_compression_threads"
+#define TW_SPARSE_IMAGE_BACKUP_VAR  "tw_sparse_image_backup"
+#define TW_BACKUP_IO_JOBS_VAR       "tw_backup_io_jobs"
+#define TW_BACKUP_INDEX_VAR         "tw_backup_index"
 #define TW_FILENAME                 "tw_filename"
 #define TW_ZIP_INDEX                "tw_zip_index"
 #define TW_ZIP_QUEUE_COUNT       "tw_zip_queue_count"
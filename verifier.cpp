@@ -115,13 +115,14 @@ static bool read_pkcs7(const uint8_t* pkcs7_der, size_t pkcs7_der_len,
 /*
  * Looks for an RSA signature embedded in the .ZIP file comment given the path to the zip. Verifies
  * that it matches one of the given public keys. A callback function can be optionally provided for
- * posting the progress.
+ * posting the progress, and another one to receive the signed data as it is hashed.
  *
  * Returns VERIFY_SUCCESS or VERIFY_FAILURE (if any error is encountered or no key matches the
  * signature).
  */
 int verify_file(const unsigned char* addr, size_t length, const std::vector<Certificate>& keys,
-                const std::function<void(float)>& set_progress) {
+                const std::function<void(float)>& set_progress,
+                const std::function<void(const unsigned char*, size_t)>& hash_data) {
   if (set_progress) {
     set_progress(0.0);
   }
@@ -221,6 +222,7 @@ int verify_file(const unsigned char* addr, size_t length, const std::vector<Cert
 
     if (need_sha1) SHA1_Update(&sha1_ctx, addr + so_far, size);
     if (need_sha256) SHA256_Update(&sha256_ctx, addr + so_far, size);
+    if (hash_data) hash_data(addr + so_far, size);
     so_far += size;
 
     if (set_progress) {
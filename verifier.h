@@ -68,11 +68,14 @@ struct Certificate {
 /*
  * 'addr' and 'length' define an update package file that has been loaded (or mmap'ed, or
  * whatever) into memory. Verifies that the file is signed and the signature matches one of the
- * given keys. It optionally accepts a callback function for posting the progress to. Returns one
- * of the constants of VERIFY_SUCCESS and VERIFY_FAILURE.
+ * given keys. It optionally accepts a callback function for posting the progress to, and one that
+ * is handed each chunk of the signed region in order as it is hashed so the caller can compute
+ * other digests in the same pass. Returns one of the constants of VERIFY_SUCCESS and
+ * VERIFY_FAILURE.
  */
 int verify_file(const unsigned char* addr, size_t length, const std::vector<Certificate>& keys,
-                const std::function<void(float)>& set_progress = nullptr);
+                const std::function<void(float)>& set_progress = nullptr,
+                const std::function<void(const unsigned char*, size_t)>& hash_data = nullptr);
 
 bool load_keys(const char* filename, std::vector<Certificate>& certs);
 